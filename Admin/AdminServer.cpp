@@ -0,0 +1,243 @@
+#include "AdminServer.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdio>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+AdminServer::AdminServer() :
+	_listenFd(-1),
+	_timers(NULL),
+	_idleTimerKind(0),
+	_requests(0)
+{
+}
+
+AdminServer::~AdminServer() {
+	stop();
+}
+
+// Closes everything; open() may be called again afterwards
+void AdminServer::stop() {
+	while (!_conns.empty())
+		closeConnection(_conns.begin()->first);
+	if (_listenFd != -1)
+		close(_listenFd);
+	_listenFd = -1;
+	if (!_unixPath.empty())
+		unlink(_unixPath.c_str());
+	_unixPath.clear();
+}
+
+static void setNonBlocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		throw std::runtime_error("Failed to make admin socket non-blocking");
+}
+
+void AdminServer::open(const std::string& listen, const std::string& unixPath, TimerWheel& timers, int idleTimerKind) {
+	_timers = &timers;
+	_idleTimerKind = idleTimerKind;
+	if (!unixPath.empty()) {
+		sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (unixPath.length() >= sizeof(addr.sun_path))
+			throw std::runtime_error("Admin socket path is too long");
+		std::strcpy(addr.sun_path, unixPath.c_str());
+		_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (_listenFd == -1)
+			throw std::runtime_error("Failed to create admin socket");
+		unlink(unixPath.c_str()); // stale socket from a previous run
+		if (bind(_listenFd, (sockaddr *)&addr, sizeof(addr)) < 0)
+			throw std::runtime_error("Failed to bind admin socket " + unixPath);
+		_unixPath = unixPath;
+	} else if (!listen.empty()) {
+		size_t colon = listen.rfind(':');
+		if (colon == std::string::npos)
+			throw std::runtime_error("admin_listen must look like 127.0.0.1:9100");
+		sockaddr_in addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(std::atoi(listen.substr(colon + 1).c_str()));
+		if (inet_pton(AF_INET, listen.substr(0, colon).c_str(), &addr.sin_addr) != 1)
+			throw std::runtime_error("Bad admin_listen address " + listen);
+		// Metrics are not authenticated: never expose them beyond this host
+		if ((ntohl(addr.sin_addr.s_addr) >> 24) != 127)
+			throw std::runtime_error("admin_listen must be a loopback address");
+		_listenFd = socket(AF_INET, SOCK_STREAM, 0);
+		if (_listenFd == -1)
+			throw std::runtime_error("Failed to create admin socket");
+		int opt = 1;
+		setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+		if (bind(_listenFd, (sockaddr *)&addr, sizeof(addr)) < 0)
+			throw std::runtime_error("Failed to bind admin socket " + listen);
+	} else
+		return;
+	setNonBlocking(_listenFd);
+	if (::listen(_listenFd, 8) < 0)
+		throw std::runtime_error("Failed to listen on admin socket");
+}
+
+bool AdminServer::enabled() const {
+	return _listenFd != -1;
+}
+
+bool AdminServer::owns(int fd) const {
+	return fd == _listenFd || _conns.find(fd) != _conns.end();
+}
+
+void AdminServer::addPollFds(std::vector<pollfd>& fds) const {
+	if (_listenFd == -1)
+		return;
+	pollfd pfd;
+	pfd.fd = _listenFd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	fds.push_back(pfd);
+	for (std::map<int, Connection>::const_iterator it = _conns.begin(); it != _conns.end(); ++it) {
+		pfd.fd = it->first;
+		pfd.events = it->second.out.empty() ? POLLIN : POLLOUT;
+		fds.push_back(pfd);
+	}
+}
+
+void AdminServer::process(const std::vector<pollfd>& fds, MetricsProvider& provider) {
+	if (_listenFd == -1)
+		return;
+	// Collect first: handlers may close connections while we walk the map
+	std::vector<int> readable;
+	std::vector<int> writable;
+	bool acceptable = false;
+	for (size_t i = 0; i < fds.size(); ++i) {
+		if (fds[i].revents == 0)
+			continue;
+		if (fds[i].fd == _listenFd) {
+			acceptable = true;
+			continue;
+		}
+		std::map<int, Connection>::const_iterator it = _conns.find(fds[i].fd);
+		if (it == _conns.end())
+			continue;
+		if (it->second.out.empty())
+			readable.push_back(it->first);
+		else
+			writable.push_back(it->first);
+	}
+	for (size_t i = 0; i < readable.size(); ++i)
+		readRequest(readable[i], provider);
+	for (size_t i = 0; i < writable.size(); ++i)
+		writeResponse(writable[i]);
+	if (acceptable)
+		acceptConnection();
+}
+
+void AdminServer::acceptConnection() {
+	int fd = accept(_listenFd, NULL, NULL);
+	if (fd < 0)
+		return;
+	if (_conns.size() >= MAX_CONNECTIONS) {
+		close(fd);
+		return;
+	}
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		close(fd);
+		return;
+	}
+	Connection& conn = _conns[fd];
+	conn.sent = 0;
+	conn.timerId = _timers->schedule(TimerWheel::nowMs(), IDLE_TIMEOUT_MS, _idleTimerKind, fd);
+}
+
+void AdminServer::readRequest(int fd, MetricsProvider& provider) {
+	Connection& conn = _conns[fd];
+	char buffer[1024];
+	ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+	if (n <= 0) {
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		closeConnection(fd);
+		return;
+	}
+	conn.in.append(buffer, n);
+	size_t end = conn.in.find("\r\n\r\n");
+	if (end == std::string::npos) {
+		if (conn.in.size() > MAX_REQUEST)
+			closeConnection(fd);
+		return;
+	}
+
+	// "GET /metrics HTTP/1.1"
+	std::istringstream requestLine(conn.in.substr(0, conn.in.find("\r\n")));
+	std::string method, path;
+	requestLine >> method >> path;
+	std::string status = "200 OK";
+	std::string body;
+	if (method != "GET") {
+		status = "405 Method Not Allowed";
+		body = "only GET is supported\n";
+	} else if (path == "/metrics" || path == "/") {
+		body = provider.renderMetrics();
+		_requests++;
+	} else {
+		status = "404 Not Found";
+		body = "try /metrics\n";
+	}
+	std::ostringstream response;
+	response << "HTTP/1.0 " << status << "\r\n"
+			 << "Content-Type: text/plain; version=0.0.4\r\n"
+			 << "Content-Length: " << body.size() << "\r\n"
+			 << "Connection: close\r\n\r\n"
+			 << body;
+	conn.out = response.str();
+	conn.in.clear();
+	writeResponse(fd);
+}
+
+void AdminServer::writeResponse(int fd) {
+	Connection& conn = _conns[fd];
+	ssize_t n = send(fd, conn.out.c_str() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			closeConnection(fd);
+		return;
+	}
+	conn.sent += n;
+	if (conn.sent == conn.out.size())
+		closeConnection(fd);
+}
+
+void AdminServer::closeConnection(int fd) {
+	std::map<int, Connection>::iterator it = _conns.find(fd);
+	if (it == _conns.end())
+		return;
+	if (_timers)
+		_timers->cancel(it->second.timerId);
+	close(fd);
+	_conns.erase(it);
+}
+
+void AdminServer::onIdleTimeout(int fd) {
+	std::map<int, Connection>::iterator it = _conns.find(fd);
+	if (it == _conns.end())
+		return;
+	it->second.timerId = 0; // already fired
+	closeConnection(fd);
+}
+
+unsigned long AdminServer::requests() const {
+	return _requests;
+}
+
+size_t AdminServer::connections() const {
+	return _conns.size();
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <map>
+#include <vector>
+#include <poll.h>
+#include "../Timer/TimerWheel.hpp"
+
+// Whoever answers the scrape (the Server) implements this.
+class MetricsProvider {
+	public:
+	virtual ~MetricsProvider() {}
+	virtual std::string renderMetrics() = 0;
+};
+
+// Tiny HTTP/1.0 listener for monitoring, on a Unix socket or a loopback
+// TCP port. It shares the server's poll() loop: every socket is
+// non-blocking, requests and responses are size-capped and idle
+// connections are closed by a timer, so a stuck scraper can't slow IRC down.
+class AdminServer {
+	private:
+	struct Connection {
+		std::string		in;
+		std::string		out;
+		size_t			sent;
+		unsigned long	timerId;
+	};
+
+	int								_listenFd;
+	std::string						_unixPath;
+	std::map<int, Connection>		_conns;
+	TimerWheel*						_timers;
+	int								_idleTimerKind;
+	unsigned long					_requests;
+
+	AdminServer(const AdminServer& other);
+	AdminServer& operator=(const AdminServer& other);
+
+	void acceptConnection();
+	void readRequest(int fd, MetricsProvider& provider);
+	void writeResponse(int fd);
+	void closeConnection(int fd);
+
+	public:
+	static const size_t MAX_CONNECTIONS = 16;
+	static const size_t MAX_REQUEST = 4096;
+	static const unsigned long IDLE_TIMEOUT_MS = 5000;
+
+	AdminServer();
+	~AdminServer();
+
+	// `listen` is "127.0.0.1:9100" (loopback only), `unixPath` a socket path.
+	// Only one of them is used, the Unix socket wins. Throws on failure.
+	void open(const std::string& listen, const std::string& unixPath, TimerWheel& timers, int idleTimerKind);
+	void stop();
+	bool enabled() const;
+	bool owns(int fd) const;
+	void addPollFds(std::vector<pollfd>& fds) const;
+	void process(const std::vector<pollfd>& fds, MetricsProvider& provider);
+	void onIdleTimeout(int fd);
+
+	unsigned long requests() const;
+	size_t connections() const;
+};
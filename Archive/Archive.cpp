@@ -0,0 +1,425 @@
+#include "Archive.hpp"
+#include "../Logger/Logger.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+namespace {
+
+const char SEGMENT_MAGIC[] = "IRCSEG01";
+const char INDEX_MAGIC[] = "IRCIDX01";
+const size_t MAGIC_SIZE = 8;
+const size_t RECORD_HEADER = 12;	// u64 time | u32 length
+const unsigned long HOUR_MS = 3600000UL;
+const size_t EARLY_FLUSH = 256 * 1024;	// a segment's buffer is written as soon as it gets this big
+
+unsigned long monotonicMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000UL + (unsigned long)ts.tv_nsec / 1000000UL;
+}
+
+template <typename T>
+void put(std::string& out, T value) {
+	out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T get(const char* in) {
+	T value;
+	std::memcpy(&value, in, sizeof(value));
+	return value;
+}
+
+bool writeAll(int fd, const std::string& data) {
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+// Opens for appending and writes the magic if the file is new. Returns the fd, -1 on error.
+int openAppend(const std::string& path, const char* magic, unsigned long& size) {
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		::close(fd);
+		return -1;
+	}
+	size = st.st_size;
+	if (size == 0) {
+		if (!writeAll(fd, std::string(magic, MAGIC_SIZE))) {
+			::close(fd);
+			return -1;
+		}
+		size = MAGIC_SIZE;
+	}
+	return fd;
+}
+
+} // namespace
+
+ChannelArchive::ChannelArchive() :
+	_fsyncMs(-1),
+	_maxQueued(0),
+	_running(false),
+	_dropped(0),
+	_written(0)
+{
+	pthread_mutex_init(&_lock, NULL);
+	pthread_cond_init(&_wake, NULL);
+}
+
+ChannelArchive::~ChannelArchive() {
+	close();
+	pthread_cond_destroy(&_wake);
+	pthread_mutex_destroy(&_lock);
+}
+
+void ChannelArchive::open(const std::string& dir, long fsyncMs, size_t maxQueuedBytes) {
+	if (_running)
+		return;
+	if (mkdir(dir.c_str(), 0750) < 0 && errno != EEXIST)
+		throw std::runtime_error("Failed to create archive directory " + dir);
+	_dir = dir;
+	_fsyncMs = fsyncMs;
+	_maxQueued = maxQueuedBytes;
+	_running = true;
+	if (pthread_create(&_thread, NULL, &ChannelArchive::writerMain, this) != 0) {
+		_running = false;
+		throw std::runtime_error("Failed to start the archive thread");
+	}
+}
+
+void ChannelArchive::close() {
+	pthread_mutex_lock(&_lock);
+	bool running = _running;
+	_running = false;
+	pthread_cond_signal(&_wake);
+	pthread_mutex_unlock(&_lock);
+	if (running)
+		pthread_join(_thread, NULL);
+}
+
+bool ChannelArchive::enabled() const {
+	return !_dir.empty();
+}
+
+void ChannelArchive::append(const std::string& channel, unsigned long timeMs, const std::string& line) {
+	size_t need = 2 + channel.size() + RECORD_HEADER + line.size();
+	pthread_mutex_lock(&_lock);
+	if (!_running || _queue.size() + need > _maxQueued) {
+		if (_running)
+			_dropped++;
+		pthread_mutex_unlock(&_lock);
+		return;
+	}
+	// u16 channel length | channel | u64 time | u32 length | line
+	put<unsigned short>(_queue, (unsigned short)channel.size());
+	_queue.append(channel);
+	put<unsigned long>(_queue, timeMs);
+	put<unsigned int>(_queue, (unsigned int)line.size());
+	_queue.append(line);
+	// Bursts don't wait for the next tick, so batches stay reasonably small
+	if (_queue.size() >= EARLY_FLUSH)
+		pthread_cond_signal(&_wake);
+	pthread_mutex_unlock(&_lock);
+}
+
+unsigned long ChannelArchive::written() const {
+	return __atomic_load_n(&_written, __ATOMIC_RELAXED);
+}
+
+unsigned long ChannelArchive::dropped() {
+	pthread_mutex_lock(&_lock);
+	unsigned long n = _dropped;
+	pthread_mutex_unlock(&_lock);
+	return n;
+}
+
+size_t ChannelArchive::queuedBytes() {
+	pthread_mutex_lock(&_lock);
+	size_t n = _queue.capacity();
+	pthread_mutex_unlock(&_lock);
+	return n;
+}
+
+void* ChannelArchive::writerMain(void* arg) {
+	static_cast<ChannelArchive*>(arg)->writerLoop();
+	return NULL;
+}
+
+void ChannelArchive::writerLoop() {
+	std::string batch;
+	unsigned long lastSync = monotonicMs();
+	for (;;) {
+		pthread_mutex_lock(&_lock);
+		if (_running && _queue.empty()) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += BATCH_INTERVAL_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&_wake, &_lock, &deadline);
+		}
+		// Take the whole batch; the loop gets our (empty) buffer back
+		batch.swap(_queue);
+		bool running = _running;
+		pthread_mutex_unlock(&_lock);
+
+		if (!batch.empty()) {
+			writeBatch(batch);
+			batch.clear();
+		}
+		unsigned long now = monotonicMs();
+		bool sync = _fsyncMs >= 0 && (!running || now - lastSync >= (unsigned long)_fsyncMs);
+		flushSegments(sync);
+		if (sync)
+			lastSync = now;
+		if (!running)
+			break;
+	}
+	for (std::map<std::string, Segment>::iterator it = _segments.begin(); it != _segments.end(); ++it)
+		closeSegment(it->second);
+	_segments.clear();
+}
+
+void ChannelArchive::writeBatch(const std::string& batch) {
+	const char* p = batch.data();
+	const char* end = p + batch.size();
+	unsigned long count = 0;
+	while (p < end) {
+		unsigned short nameLen = get<unsigned short>(p);
+		std::string channel(p + 2, nameLen);
+		p += 2 + nameLen;
+		unsigned long timeMs = get<unsigned long>(p);
+		unsigned int len = get<unsigned int>(p + 8);
+		const char* record = p;
+		p += RECORD_HEADER + len;
+
+		Segment* seg = segmentFor(channel, timeMs / HOUR_MS);
+		if (seg == NULL)
+			continue;
+		if (seg->records % INDEX_EVERY == 0) {
+			put<unsigned long>(seg->idxBuf, timeMs);
+			put<unsigned long>(seg->idxBuf, seg->size + seg->buf.size());
+		}
+		// The record is already in its on-disk layout
+		seg->buf.append(record, RECORD_HEADER + len);
+		seg->records++;
+		seg->dirty = true;
+		count++;
+		if (seg->buf.size() >= EARLY_FLUSH) {
+			if (!writeAll(seg->fd, seg->buf))
+				LOG_ERROR("Archive write failed for " << channel << ": " << std::strerror(errno));
+			seg->size += seg->buf.size();
+			seg->buf.clear();
+		}
+	}
+	__atomic_add_fetch(&_written, count, __ATOMIC_RELAXED);
+}
+
+ChannelArchive::Segment* ChannelArchive::segmentFor(const std::string& channel, unsigned long hour) {
+	std::map<std::string, Segment>::iterator it = _segments.find(channel);
+	if (it != _segments.end()) {
+		if (it->second.hour == hour)
+			return &it->second;
+		// A new hour starts a new segment
+		closeSegment(it->second);
+		_segments.erase(it);
+	}
+	if (_segments.size() >= MAX_OPEN_SEGMENTS) {
+		for (it = _segments.begin(); it != _segments.end(); ++it)
+			closeSegment(it->second);
+		_segments.clear();
+	}
+
+	std::string dir = _dir + "/" + encodeName(channel);
+	if (mkdir(dir.c_str(), 0750) < 0 && errno != EEXIST) {
+		LOG_ERROR("Archive: can't create " << dir << ": " << std::strerror(errno));
+		return NULL;
+	}
+	std::string base = dir + "/" + hourName(hour);
+	Segment seg;
+	unsigned long idxSize;
+	seg.fd = openAppend(base + ".seg", SEGMENT_MAGIC, seg.size);
+	seg.idxFd = seg.fd < 0 ? -1 : openAppend(base + ".idx", INDEX_MAGIC, idxSize);
+	if (seg.fd < 0 || seg.idxFd < 0) {
+		LOG_ERROR("Archive: can't open " << base << ": " << std::strerror(errno));
+		if (seg.fd >= 0)
+			::close(seg.fd);
+		return NULL;
+	}
+	seg.hour = hour;
+	seg.records = 0;
+	seg.dirty = false;
+	return &(_segments[channel] = seg);
+}
+
+void ChannelArchive::flushSegments(bool sync) {
+	for (std::map<std::string, Segment>::iterator it = _segments.begin(); it != _segments.end(); ++it) {
+		Segment& seg = it->second;
+		if (!seg.buf.empty()) {
+			if (!writeAll(seg.fd, seg.buf))
+				LOG_ERROR("Archive write failed for " << it->first << ": " << std::strerror(errno));
+			seg.size += seg.buf.size();
+			seg.buf.clear();
+		}
+		if (!seg.idxBuf.empty()) {
+			writeAll(seg.idxFd, seg.idxBuf);
+			seg.idxBuf.clear();
+		}
+		if (sync && seg.dirty) {
+			fdatasync(seg.fd);
+			fdatasync(seg.idxFd);
+			seg.dirty = false;
+		}
+	}
+}
+
+void ChannelArchive::closeSegment(Segment& seg) {
+	if (!seg.buf.empty() && !writeAll(seg.fd, seg.buf))
+		LOG_ERROR("Archive write failed: " << std::strerror(errno));
+	if (!seg.idxBuf.empty())
+		writeAll(seg.idxFd, seg.idxBuf);
+	if (seg.dirty && _fsyncMs >= 0) {
+		fdatasync(seg.fd);
+		fdatasync(seg.idxFd);
+	}
+	::close(seg.fd);
+	::close(seg.idxFd);
+}
+
+// Letters, digits, '-' and '_' stay, everything else becomes %XX
+std::string ChannelArchive::encodeName(const std::string& channel) {
+	static const char hex[] = "0123456789ABCDEF";
+	std::string out;
+	for (size_t i = 0; i < channel.size(); ++i) {
+		unsigned char c = channel[i];
+		if (std::isalnum(c) || c == '-' || c == '_')
+			out += c;
+		else {
+			out += '%';
+			out += hex[c >> 4];
+			out += hex[c & 15];
+		}
+	}
+	return out;
+}
+
+std::string ChannelArchive::hourName(unsigned long hour) {
+	time_t seconds = (time_t)(hour * 3600UL);
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	char name[16];
+	std::snprintf(name, sizeof(name), "%04d%02d%02d%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour);
+	return name;
+}
+
+size_t ArchiveReader::read(const std::string& dir, const std::string& channel, unsigned long fromMs,
+	unsigned long toMs, size_t limit, std::vector<ArchiveRecord>& out) {
+	if (fromMs > LAST_MS || fromMs > toMs)
+		return 0;
+	std::string channelDir = dir + "/" + ChannelArchive::encodeName(channel);
+	DIR* d = opendir(channelDir.c_str());
+	if (d == NULL)
+		return 0;
+	// Names sort in time order, so string bounds are enough to pick the segments
+	std::string first = ChannelArchive::hourName(fromMs / HOUR_MS);
+	// Past year 9999 gmtime() has no 4-digit year to give: don't ask it
+	bool bounded = toMs <= LAST_MS;
+	std::string last = bounded ? ChannelArchive::hourName(toMs / HOUR_MS) : std::string();
+	std::vector<std::string> names;
+	struct dirent* entry;
+	while ((entry = readdir(d)) != NULL) {
+		std::string name = entry->d_name;
+		if (name.size() != 14 || name.compare(10, 4, ".seg") != 0)
+			continue;
+		std::string hour = name.substr(0, 10);
+		if (hour >= first && (!bounded || hour <= last))
+			names.push_back(name);
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	size_t added = 0;
+	for (size_t i = 0; i < names.size() && added < limit; ++i)
+		added += readSegment(channelDir + "/" + names[i], fromMs, toMs, limit - added, out);
+	return added;
+}
+
+size_t ArchiveReader::readSegment(const std::string& path, unsigned long fromMs, unsigned long toMs,
+	size_t limit, std::vector<ArchiveRecord>& out) {
+	// The index is small: read it whole and find the last entry at or before fromMs
+	size_t start = MAGIC_SIZE;
+	std::string idxPath = path.substr(0, path.size() - 4) + ".idx";
+	FILE* idx = std::fopen(idxPath.c_str(), "rb");
+	if (idx) {
+		char magic[MAGIC_SIZE];
+		unsigned long entry[2];
+		if (std::fread(magic, 1, MAGIC_SIZE, idx) == MAGIC_SIZE && std::memcmp(magic, INDEX_MAGIC, MAGIC_SIZE) == 0) {
+			while (std::fread(entry, sizeof(entry), 1, idx) == 1) {
+				if (entry[0] > fromMs)
+					break;
+				start = entry[1];
+			}
+		}
+		std::fclose(idx);
+	}
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < MAGIC_SIZE) {
+		::close(fd);
+		return 0;
+	}
+	size_t size = st.st_size;
+	void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	const char* data = static_cast<const char*>(map);
+	size_t added = 0;
+	if (std::memcmp(data, SEGMENT_MAGIC, MAGIC_SIZE) == 0) {
+		size_t pos = start < size ? start : size;
+		// A torn record at the end (crash mid-write) just ends the scan
+		while (pos + RECORD_HEADER <= size && added < limit) {
+			unsigned long timeMs = get<unsigned long>(data + pos);
+			unsigned int len = get<unsigned int>(data + pos + 8);
+			if (pos + RECORD_HEADER + len > size || timeMs > toMs)
+				break;
+			if (timeMs >= fromMs) {
+				ArchiveRecord rec;
+				rec.timeMs = timeMs;
+				rec.line.assign(data + pos + RECORD_HEADER, len);
+				out.push_back(rec);
+				added++;
+			}
+			pos += RECORD_HEADER + len;
+		}
+	}
+	munmap(map, size);
+	return added;
+}
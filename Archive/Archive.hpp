@@ -0,0 +1,106 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <cstddef>
+#include <pthread.h>
+
+// Append-only store of channel traffic, for compliance.
+//
+//   <dir>/<channel>/<YYYYMMDDHH>.seg   one segment per channel and UTC hour
+//     header:  "IRCSEG01"
+//     record:  u64 time (ms since the epoch) | u32 length | line bytes
+//   <dir>/<channel>/<YYYYMMDDHH>.idx   sparse time index of that segment
+//     header:  "IRCIDX01"
+//     entry:   u64 time | u64 offset of the record in the .seg
+//
+// Integers are in host byte order. The channel name is percent-encoded
+// into a directory name. Every INDEX_EVERY-th record of a segment gets an
+// index entry, so a range read only scans a few records before its start.
+//
+// The event loop only appends the record to an in-memory batch under a
+// mutex. A writer thread takes the whole batch, groups it by segment and
+// does one write() per file, plus fdatasync() every fsyncMs.
+class ChannelArchive {
+	private:
+	struct Segment {
+		int				fd;
+		int				idxFd;
+		unsigned long	hour;		// ms / 3600000
+		unsigned long	size;		// bytes in the .seg file
+		unsigned long	records;	// written to this segment since it was opened
+		bool			dirty;		// written since the last fdatasync
+		std::string		buf;
+		std::string		idxBuf;
+	};
+
+	std::string			_dir;
+	long				_fsyncMs;		// -1: leave it to the OS
+	size_t				_maxQueued;
+	pthread_t			_thread;
+	pthread_mutex_t		_lock;
+	pthread_cond_t		_wake;
+	bool				_running;
+	std::string			_queue;			// encoded records, guarded by _lock
+	unsigned long		_dropped;		// guarded by _lock
+	unsigned long		_written;		// writer thread only, read atomically
+	std::map<std::string, Segment>	_segments;	// writer thread only
+
+	ChannelArchive(const ChannelArchive& other);
+	ChannelArchive& operator=(const ChannelArchive& other);
+
+	static void* writerMain(void* arg);
+	void writerLoop();
+	void writeBatch(const std::string& batch);
+	Segment* segmentFor(const std::string& channel, unsigned long hour);
+	void flushSegments(bool sync);
+	void closeSegment(Segment& seg);
+
+	public:
+	static const unsigned long INDEX_EVERY = 64;
+	static const unsigned long BATCH_INTERVAL_MS = 20;
+	static const size_t MAX_OPEN_SEGMENTS = 256;
+
+	ChannelArchive();
+	~ChannelArchive();
+
+	// Creates dir if needed and starts the writer. Throws on failure.
+	void open(const std::string& dir, long fsyncMs, size_t maxQueuedBytes);
+	// Writes out everything queued, syncs and stops the writer
+	void close();
+	bool enabled() const;
+
+	// Never blocks on I/O. When the queue is over its cap the record is dropped and counted.
+	void append(const std::string& channel, unsigned long timeMs, const std::string& line);
+
+	unsigned long written() const;
+	unsigned long dropped();
+	size_t queuedBytes();	// records the writer has not taken yet
+
+	static std::string encodeName(const std::string& channel);
+	static std::string hourName(unsigned long hour);
+};
+
+struct ArchiveRecord {
+	unsigned long	timeMs;
+	std::string		line;
+};
+
+// Range reads over the files written by ChannelArchive. Segments are
+// mmap'd and the index tells where to start scanning.
+class ArchiveReader {
+	public:
+	// 9999-12-31T23:59:59.999Z, the last hour a segment name can spell.
+	// A toMs past it (ircarchive's default) means no upper bound.
+	static const unsigned long LAST_MS = 253402300799999UL;
+
+	// Records with fromMs <= time <= toMs, oldest first, at most `limit`.
+	// Returns how many were added to `out`.
+	static size_t read(const std::string& dir, const std::string& channel, unsigned long fromMs,
+		unsigned long toMs, size_t limit, std::vector<ArchiveRecord>& out);
+
+	private:
+	ArchiveReader();
+	static size_t readSegment(const std::string& path, unsigned long fromMs, unsigned long toMs,
+		size_t limit, std::vector<ArchiveRecord>& out);
+};
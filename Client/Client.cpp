@@ -1,11 +1,104 @@
 #include "Client.hpp"
+#include "../Memory/Footprint.hpp"
+#include <cstring>
 
-Client::Client(int socketFd):_socket(socketFd),_nickName(""),_userName(""),_realName(""),\
-_isAuthenticated(false),_isRegistered(false), _isVisible(true),_buffer(""){
+Client::Client(int socketFd):_socket(socketFd),_isAuthenticated(false),_isRegistered(false),\
+_isVisible(true),_flushScheduled(false),_recentlyActive(false),_isOper(false),_slowConsumer(false),\
+_evicting(false),_signon(0),_plainFrom(std::string::npos),_drained(0),_drainedAtSample(0),_drainRate(0),_identity(nextIdentity()),_io(NULL){
 };
 
+Client::Client(const Client& other):_socket(other._socket),_isAuthenticated(other._isAuthenticated),\
+_isRegistered(other._isRegistered),_isVisible(other._isVisible),_flushScheduled(other._flushScheduled),\
+_recentlyActive(other._recentlyActive),_isOper(other._isOper),_slowConsumer(other._slowConsumer),\
+_evicting(other._evicting),_signon(other._signon),_plainFrom(other._plainFrom),_drained(other._drained),\
+_drainedAtSample(other._drainedAtSample),_drainRate(other._drainRate),_identity(other._identity),\
+_nickName(other._nickName),_userName(other._userName),_realName(other._realName),\
+_io(other._io ? new ClientIo(*other._io) : NULL){
+};
+
+Client& Client::operator=(const Client& other) {
+    if (this == &other)
+        return *this;
+    ClientIo* io = other._io ? new ClientIo(*other._io) : NULL;
+    releaseIo(this->_io);
+    this->_io = io;
+    this->_socket = other._socket;
+    this->_isAuthenticated = other._isAuthenticated;
+    this->_isRegistered = other._isRegistered;
+    this->_isVisible = other._isVisible;
+    this->_flushScheduled = other._flushScheduled;
+    this->_recentlyActive = other._recentlyActive;
+    this->_isOper = other._isOper;
+    this->_slowConsumer = other._slowConsumer;
+    this->_evicting = other._evicting;
+    this->_signon = other._signon;
+    this->_plainFrom = other._plainFrom;
+    this->_drained = other._drained;
+    this->_drainedAtSample = other._drainedAtSample;
+    this->_drainRate = other._drainRate;
+    this->_identity = other._identity;
+    this->_nickName = other._nickName;
+    this->_userName = other._userName;
+    this->_realName = other._realName;
+    return *this;
+}
+
 Client::~Client(){
+    releaseIo(this->_io);
 };
+
+namespace {
+struct SpareList {
+    std::vector<ClientIo*> list;
+    ~SpareList() {
+        for (size_t i = 0; i < list.size(); ++i)
+            delete list[i];
+    }
+};
+}
+
+std::vector<ClientIo*>& Client::spares() {
+    static SpareList spares;
+    return spares.list;
+}
+
+// Spares keep their capacity (up to SPARE_CAPACITY), so a client that
+// wakes up doesn't grow its buffers from nothing again
+void Client::releaseIo(ClientIo* io) {
+    if (io == NULL)
+        return;
+    std::vector<ClientIo*>& list = spares();
+    if (list.size() >= MAX_SPARES) {
+        delete io;
+        return;
+    }
+    if (io->input.capacity() > SPARE_CAPACITY)
+        std::string().swap(io->input);
+    if (io->sendQueue.capacity() > SPARE_CAPACITY)
+        std::string().swap(io->sendQueue);
+    if (io->urgent.capacity() > SPARE_CAPACITY)
+        std::string().swap(io->urgent);
+    io->input.clear();
+    io->sendQueue.clear();
+    io->sendOffset = 0;
+    io->urgent.clear();
+    io->urgentOffset = 0;
+    list.push_back(io);
+}
+
+ClientIo& Client::io() {
+    this->_recentlyActive = true;
+    if (this->_io == NULL) {
+        std::vector<ClientIo*>& list = spares();
+        if (list.empty())
+            this->_io = new ClientIo();
+        else {
+            this->_io = list.back();
+            list.pop_back();
+        }
+    }
+    return *this->_io;
+}
 int Client::getSocket() const {
     return this->_socket;
 }
@@ -18,7 +111,7 @@ const std::string& Client::getUsername() const {
     return this->_userName;
 }
 const std::string& Client::getRealname() const {
-    return this->_realName;
+    return this->_realName.str();
 }
 
 bool Client::isAuthenticated() const {
@@ -29,20 +122,31 @@ bool Client::isRegistered() const {
     return this->_isRegistered;
 }
 void Client::appendBuffer(const std::string& data) {
-    this->_buffer.append(data);
+    io().input.append(data);
+}
+
+void Client::appendBuffer(const char* data, size_t len) {
+    io().input.append(data, len);
 }
 
 std::string& Client::getBuffer() {
-    return this->_buffer;
+    return io().input;
 }
 void Client::setAuthenticated(bool auth) {
     this->_isAuthenticated = auth;
 }
 void Client::setNickname(const std::string& nick) {
     this->_nickName = nick;
+    this->_identity = nextIdentity();
 }
 void Client::setUsername(const std::string& user) {
     this->_userName = user;
+    this->_identity = nextIdentity();
+}
+
+unsigned long Client::nextIdentity() {
+    static unsigned long counter = 0;
+    return ++counter;
 }
 
 void Client::setRealname(const std::string& real) {
@@ -51,4 +155,168 @@ void Client::setRealname(const std::string& real) {
 
 void Client::setRegistered(bool reg) {
     this->_isRegistered = reg;
-}
\ No newline at end of file
+}
+
+void Client::queueOutput(const std::string& data) {
+    io().sendQueue.append(data);
+}
+
+// Compressed links have a single byte stream: no lanes there
+void Client::queueUrgent(const std::string& data) {
+    if (this->_plainFrom != std::string::npos)
+        io().sendQueue.append(data);
+    else
+        io().urgent.append(data);
+}
+
+// The urgent lane goes first unless a normal line is half written: bytes of
+// two lines must never mix on the wire
+bool Client::urgentTurn() const {
+    const ClientIo* q = this->_io;
+    if (q == NULL || q->urgent.size() == q->urgentOffset)
+        return false;
+    return q->urgentOffset > 0 || q->sendOffset == 0 || q->sendQueue[q->sendOffset - 1] == '\n';
+}
+
+const char* Client::pendingOutput() const {
+    if (this->_io == NULL)
+        return NULL;
+    if (urgentTurn())
+        return this->_io->urgent.data() + this->_io->urgentOffset;
+    return this->_io->sendQueue.data() + this->_io->sendOffset;
+}
+
+size_t Client::pendingOutputSize() const {
+    if (this->_io == NULL)
+        return 0;
+    return this->_io->sendQueue.size() - this->_io->sendOffset + this->_io->urgent.size() - this->_io->urgentOffset;
+}
+
+// With urgent lines waiting, the normal lane only finishes its current line
+size_t Client::nextOutputSize() const {
+    const ClientIo* q = this->_io;
+    if (q == NULL)
+        return 0;
+    if (urgentTurn())
+        return q->urgent.size() - q->urgentOffset;
+    size_t left = q->sendQueue.size() - q->sendOffset;
+    if (q->urgent.size() == q->urgentOffset || left == 0)
+        return left;
+    const char* start = q->sendQueue.data() + q->sendOffset;
+    const void* eol = std::memchr(start, '\n', left);
+    return eol ? static_cast<const char*>(eol) - start + 1 : left;
+}
+
+// Moving an offset is cheaper than erasing the front of the string on every
+// partial write; the string is reset once everything has gone out.
+void Client::consumeOutput(size_t bytes) {
+    if (this->_io == NULL)
+        return;
+    this->_drained += bytes;
+    if (urgentTurn()) {
+        this->_io->urgentOffset += bytes;
+        if (this->_io->urgentOffset >= this->_io->urgent.size()) {
+            this->_io->urgent.clear();
+            this->_io->urgentOffset = 0;
+        }
+        return;
+    }
+    this->_io->sendOffset += bytes;
+    if (this->_io->sendOffset >= this->_io->sendQueue.size()) {
+        this->_io->sendQueue.clear();
+        this->_io->sendOffset = 0;
+        if (this->_plainFrom != std::string::npos)
+            this->_plainFrom = 0;
+    }
+}
+
+void Client::copyPendingOutput(std::string& out) const {
+    out.clear();
+    if (this->_io == NULL)
+        return;
+    const ClientIo& q = *this->_io;
+    size_t first = urgentTurn() ? 0 : nextOutputSize();
+    out.append(q.sendQueue, q.sendOffset, first);
+    out.append(q.urgent, q.urgentOffset, std::string::npos);
+    out.append(q.sendQueue, q.sendOffset + first, std::string::npos);
+}
+
+void Client::startCompression() {
+    this->_plainFrom = this->_io ? this->_io->sendQueue.size() : 0;
+}
+
+std::string Client::takePlainOutput() {
+    std::string& queue = io().sendQueue;
+    std::string plain = queue.substr(this->_plainFrom);
+    queue.resize(this->_plainFrom);
+    return plain;
+}
+
+void Client::queueCompressed(const std::string& data) {
+    std::string& queue = io().sendQueue;
+    queue.append(data);
+    this->_plainFrom = queue.size();
+}
+
+bool Client::trimIdle(bool force) {
+    if (this->_recentlyActive && !force) {
+        this->_recentlyActive = false;
+        return false;
+    }
+    if (this->_io == NULL)
+        return true;
+    if (!this->_io->input.empty() || pendingOutputSize() > 0)
+        return false;
+    releaseIo(this->_io);
+    this->_io = NULL;
+    return true;
+}
+
+// The realname is shared, it is counted once in InternedString::tableBytes()
+size_t Client::memoryBytes() const {
+    size_t bytes = sizeof(Client) + stringHeapBytes(_nickName) + stringHeapBytes(_userName);
+    if (this->_io != NULL)
+        bytes += sizeof(ClientIo) + stringHeapBytes(_io->input) + stringHeapBytes(_io->sendQueue)
+            + stringHeapBytes(_io->urgent);
+    return bytes;
+}
+
+size_t Client::recvqBytes() const {
+    return this->_io ? stringHeapBytes(this->_io->input) : 0;
+}
+
+size_t Client::sendqBytes() const {
+    return this->_io ? stringHeapBytes(this->_io->sendQueue) + stringHeapBytes(this->_io->urgent) : 0;
+}
+
+void Client::dropSpares() {
+    std::vector<ClientIo*>& list = spares();
+    for (size_t i = 0; i < list.size(); ++i)
+        delete list[i];
+    std::vector<ClientIo*>().swap(list);
+}
+
+size_t Client::spareBytes() {
+    size_t bytes = 0;
+    const std::vector<ClientIo*>& list = spares();
+    for (size_t i = 0; i < list.size(); ++i)
+        bytes += sizeof(ClientIo) + stringHeapBytes(list[i]->input) + stringHeapBytes(list[i]->sendQueue)
+            + stringHeapBytes(list[i]->urgent);
+    return bytes;
+}
+
+// Called once a second: a quarter of the new second, three quarters of the past
+unsigned long Client::sampleDrainRate() {
+    unsigned long last = this->_drained - this->_drainedAtSample;
+    this->_drainedAtSample = this->_drained;
+    this->_drainRate = (this->_drainRate * 3 + last) / 4;
+    return this->_drainRate;
+}
+
+bool Client::isFlushScheduled() const {
+    return this->_flushScheduled;
+}
+
+void Client::setFlushScheduled(bool scheduled) {
+    this->_flushScheduled = scheduled;
+}
@@ -1,24 +1,70 @@
 #pragma once
 #include <string> 
 #include <iostream>
+#include <vector>
+#include "../Memory/Intern.hpp"
+
+// Receive and send buffers of a connection. A client only holds one while it
+// has traffic: trimIdle() hands it back to a pool of spares, and the next
+// byte in or out takes one from there again.
+//
+// The send queue has two lanes. Control lines (PONG, ERROR) go in the
+// urgent one and are written as soon as the line being written from the
+// normal lane is complete, ahead of a WHO or history burst. Channel traffic
+// only ever uses the normal lane, so its order never changes.
+struct ClientIo {
+	std::string	input;		// received, not yet a complete line
+	std::string	sendQueue;	// replies not written to the socket yet
+	size_t		sendOffset;	// bytes of sendQueue already written
+	std::string	urgent;		// control lines, written before sendQueue
+	size_t		urgentOffset;
+
+	ClientIo() : sendOffset(0), urgentOffset(0) {}
+};
 
 class Client{
 
 	private:
+	// Small fields first, so the flags share a word with the socket
 	int 		_socket;
-	std::string _nickName;
-	std::string _userName;
-	std::string _realName;
-
 	bool 		_isAuthenticated;
 	bool		_isRegistered;
 	bool		_isVisible;
-	std::string _buffer;
+	bool		_flushScheduled;	// already in the server's list of clients to flush
+	bool		_recentlyActive;	// traffic since the last trimIdle()
+	bool		_isOper;		// OPER succeeded
+	bool		_slowConsumer;	// SendQ over its class's soft limit
+	bool		_evicting;		// over the hard limit: dropped at the end of the turn
+	unsigned long _signon;		// ms since the epoch at registration, settles nick collisions
+	size_t		_plainFrom;		// compressed links: where the text still to compress starts (npos if not compressed)
+	unsigned long _drained;			// bytes written to the socket, ever
+	unsigned long _drainedAtSample;
+	unsigned long _drainRate;		// bytes/s, averaged over the last few seconds
+	unsigned long _identity;		// changes with the nick or user: channels cache their verdicts on it
+
+	// Nick and user fit the string's inline buffer: no heap behind them
+	std::string _nickName;
+	std::string _userName;
+	InternedString _realName;
+	ClientIo*	_io;			// NULL while idle
+
+	ClientIo& io();
+	bool urgentTurn() const;
+	static std::vector<ClientIo*>& spares();
+	static void releaseIo(ClientIo* io);
+	static unsigned long nextIdentity();
 
 	public:
+	// Spare buffer sets kept for reuse, and the capacity a spare may keep
+	static const size_t MAX_SPARES = 256;
+	static const size_t SPARE_CAPACITY = 4096;
 
-	Client() : _socket(-1) {} 
+	Client() : _socket(-1), _isAuthenticated(false), _isRegistered(false), _isVisible(true),
+		_flushScheduled(false), _recentlyActive(false), _isOper(false), _slowConsumer(false), _evicting(false),
+		_signon(0), _plainFrom(std::string::npos), _drained(0), _drainedAtSample(0), _drainRate(0), _identity(nextIdentity()), _io(NULL) {}
 	Client(int socketFd);
+	Client(const Client& other);
+	Client& operator=(const Client& other);
 	~Client();
 	int getSocket() const;
     const std::string& getNickname() const;
@@ -27,6 +73,7 @@ class Client{
     bool isAuthenticated() const;
     bool isRegistered() const;
 	void appendBuffer(const std::string& data);
+	void appendBuffer(const char* data, size_t len);
 	void setAuthenticated(bool auth);
 	void setNickname(const std::string& nick);
 	void setUsername(const std::string& user);
@@ -34,4 +81,47 @@ class Client{
 	void setRegistered(bool reg);
     std::string& getBuffer();
 	void setModoInvisible(bool estado) { _isVisible = estado; }
-};
\ No newline at end of file
+	bool isVisible() const { return _isVisible; }
+	void setOper(bool oper) { _isOper = oper; }
+	bool isOper() const { return _isOper; }
+	unsigned long getSignon() const { return _signon; }
+	void setSignon(unsigned long ms) { _signon = ms; }
+	// Never the same for two clients, nor for one client before and after a NICK
+	unsigned long identity() const { return _identity; }
+
+	// SendQ
+	void queueOutput(const std::string& data);
+	void queueUrgent(const std::string& data);
+	size_t pendingOutputSize() const;	// both lanes
+	// What to write next, from one lane: pass it to send(), then consumeOutput()
+	const char* pendingOutput() const;
+	size_t nextOutputSize() const;
+	void consumeOutput(size_t bytes);
+	void copyPendingOutput(std::string& out) const;	// both lanes, in the order they'd go out
+	// Compressed links: what is queued from now on goes through zlib before
+	// it is sent, what is queued already goes as it is
+	void startCompression();
+	bool hasPlainOutput() const { return _io != NULL && _plainFrom < _io->sendQueue.size(); }
+	std::string takePlainOutput();
+	void queueCompressed(const std::string& data);
+	// Slow consumers: the server samples the drain rate once a second
+	unsigned long sampleDrainRate();
+	unsigned long drainRate() const { return _drainRate; }
+	bool isSlowConsumer() const { return _slowConsumer; }
+	void setSlowConsumer(bool slow) { _slowConsumer = slow; }
+	bool isEvicting() const { return _evicting; }
+	void setEvicting(bool evicting) { _evicting = evicting; }
+	bool isFlushScheduled() const;
+	void setFlushScheduled(bool scheduled);
+
+	// Gives the buffers back if nothing came in or went out since the last
+	// call (or `force`) and they are empty. Returns true if the client holds
+	// none now.
+	bool trimIdle(bool force = false);
+	bool hasBuffers() const { return _io != NULL; }
+	size_t memoryBytes() const;		// everything, buffers included
+	size_t recvqBytes() const;		// heap behind the receive buffer
+	size_t sendqBytes() const;		// heap behind the send queue
+	static size_t spareBytes();
+	static void dropSpares();
+};
@@ -3,45 +3,70 @@
 
 
 
+Command::Command() {
+}
+
 Command::Command(const std::string& rawCommand) {
-    std::string buffer = rawCommand;
+    parse(rawCommand);
+}
+
+// An empty slot at the end of _params, recycled from _spare when possible
+std::string& Command::nextParam() {
+    this->_params.push_back(std::string());
+    if (!this->_spare.empty()) {
+        this->_params.back().swap(this->_spare.back());
+        this->_spare.pop_back();
+    }
+    return this->_params.back();
+}
+
+void Command::parse(const std::string& rawCommand) {
+    size_t      count = 0;
+    size_t      pos;
     size_t      space_pos;
 
     // 1. Extract the command (the first word)
-    space_pos = buffer.find(' ');
+    space_pos = rawCommand.find(' ');
     if (space_pos != std::string::npos) {
         // If there's a space, the command is everything before it
-        this->_command = buffer.substr(0, space_pos);
-        // Erase the command and the space to prepare for parameter parsing
-        buffer.erase(0, space_pos + 1);
+        this->_command.assign(rawCommand, 0, space_pos);
+        pos = space_pos + 1;
     } else {
         // If there are no spaces, the whole string is the command
-        this->_command = buffer;
-        // No parameters, so we are done.
-        return;
+        // and there are no parameters
+        this->_command.assign(rawCommand);
+        pos = rawCommand.length();
     }
 
-    // 2. Parse the parameters
-    while (!buffer.empty()) {
+    // 2. Parse the parameters, overwriting the ones of the last parse
+    while (pos < rawCommand.length()) {
+        std::string& param = count < this->_params.size() ? this->_params[count] : nextParam();
+        count++;
         // If the first character is a ':', it's the last parameter
-        if (buffer[0] == ':') {
-            this->_params.push_back(buffer.substr(1)); // Push everything after ':'
+        if (rawCommand[pos] == ':') {
+            param.assign(rawCommand, pos + 1, std::string::npos); // Everything after ':'
             break; // Stop parsing
         }
 
         // Find the next space
-        space_pos = buffer.find(' ');
+        space_pos = rawCommand.find(' ', pos);
         if (space_pos != std::string::npos) {
             // If a space is found, the parameter is the word before it
-            this->_params.push_back(buffer.substr(0, space_pos));
-            // Erase the parameter and the space
-            buffer.erase(0, space_pos + 1);
+            param.assign(rawCommand, pos, space_pos - pos);
+            pos = space_pos + 1;
         } else {
-            // If no more spaces, the rest of the buffer is the last parameter
-            this->_params.push_back(buffer);
+            // If no more spaces, the rest of the line is the last parameter
+            param.assign(rawCommand, pos, std::string::npos);
             break;
         }
     }
+
+    // Leftovers of a longer command wait in _spare with their buffers
+    while (this->_params.size() > count) {
+        this->_spare.push_back(std::string());
+        this->_spare.back().swap(this->_params.back());
+        this->_params.pop_back();
+    }
 }
 
 const std::string& Command::getCommand() const {
@@ -50,4 +75,4 @@ const std::string& Command::getCommand() const {
 
 const std::vector<std::string>& Command::getParams() const {
     return this->_params;
-}
\ No newline at end of file
+}
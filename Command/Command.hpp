@@ -6,9 +6,15 @@ class Command{
 private:
 	std::string _command;
 	std::vector<std::string> _params;
+	std::vector<std::string> _spare; // strings of earlier, longer commands, kept for their buffers
+
+	std::string& nextParam();
 public:
 
+	Command();
 	Command(const std::string& rawCommand);
+	// Parses into the same object again: once warm, it doesn't allocate
+	void parse(const std::string& rawCommand);
 	const std::string& getCommand() const;
 	const std::vector<std::string>& getParams() const;
-};
\ No newline at end of file
+};
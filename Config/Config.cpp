@@ -0,0 +1,68 @@
+#include "Config.hpp"
+#include <fstream>
+#include <stdexcept>
+#include <cstdlib>
+
+Config::Config() {}
+
+Config::~Config() {}
+
+static std::string trim(const std::string& str) {
+	size_t start = str.find_first_not_of(" \t\r");
+	if (start == std::string::npos)
+		return "";
+	size_t end = str.find_last_not_of(" \t\r");
+	return str.substr(start, end - start + 1);
+}
+
+void Config::load(const std::string& path) {
+	std::ifstream in(path.c_str());
+	if (!in)
+		throw std::runtime_error("Failed to open config file " + path);
+	std::string line;
+	int lineNo = 0;
+	while (std::getline(in, line)) {
+		lineNo++;
+		line = trim(line);
+		if (line.empty() || line[0] == '#')
+			continue;
+		size_t eq = line.find('=');
+		if (eq == std::string::npos || trim(line.substr(0, eq)).empty())
+			throw std::runtime_error("Bad line in config file " + path + ": " + line);
+		set(trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+	}
+}
+
+void Config::set(const std::string& key, const std::string& value) {
+	_values[key] = value;
+}
+
+bool Config::has(const std::string& key) const {
+	return _values.find(key) != _values.end();
+}
+
+std::string Config::getString(const std::string& key, const std::string& def) const {
+	std::map<std::string, std::string>::const_iterator it = _values.find(key);
+	if (it == _values.end())
+		return def;
+	return it->second;
+}
+
+long Config::getInt(const std::string& key, long def) const {
+	std::map<std::string, std::string>::const_iterator it = _values.find(key);
+	if (it == _values.end() || it->second.empty())
+		return def;
+	char* end;
+	long value = std::strtol(it->second.c_str(), &end, 10);
+	if (*end != '\0')
+		throw std::runtime_error("Config value for " + key + " is not a number: " + it->second);
+	return value;
+}
+
+bool Config::getBool(const std::string& key, bool def) const {
+	std::map<std::string, std::string>::const_iterator it = _values.find(key);
+	if (it == _values.end())
+		return def;
+	const std::string& v = it->second;
+	return v == "1" || v == "yes" || v == "true" || v == "on";
+}
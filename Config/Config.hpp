@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <map>
+
+// Optional server settings, read from a "key = value" file given as the
+// third argument. Lines starting with '#' are comments. Every setting has a
+// default, so running without a file keeps the old behaviour.
+class Config {
+	private:
+	std::map<std::string, std::string> _values;
+
+	public:
+	Config();
+	~Config();
+
+	void load(const std::string& path);
+	void set(const std::string& key, const std::string& value);
+
+	bool has(const std::string& key) const;
+	std::string getString(const std::string& key, const std::string& def) const;
+	long getInt(const std::string& key, long def) const;
+	bool getBool(const std::string& key, bool def) const;
+};
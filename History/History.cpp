@@ -0,0 +1,282 @@
+#include "History.hpp"
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <sys/time.h>
+
+size_t HistoryRing::_totalBytes = 0;
+
+HistoryRing::HistoryRing() : _first(0), _count(0), _writePos(0) {}
+
+HistoryRing::HistoryRing(const HistoryRing& other) :
+	_arena(other._arena),
+	_entries(other._entries),
+	_first(other._first),
+	_count(other._count),
+	_writePos(other._writePos)
+{
+	_totalBytes += _arena.size();
+}
+
+HistoryRing& HistoryRing::operator=(const HistoryRing& other) {
+	if (this != &other) {
+		_totalBytes -= _arena.size();
+		_arena = other._arena;
+		_entries = other._entries;
+		_first = other._first;
+		_count = other._count;
+		_writePos = other._writePos;
+		_totalBytes += _arena.size();
+	}
+	return *this;
+}
+
+HistoryRing::~HistoryRing() {
+	_totalBytes -= _arena.size();
+}
+
+HistoryRing::Entry& HistoryRing::at(size_t i) {
+	return _entries[(_first + i) % _entries.size()];
+}
+
+const HistoryRing::Entry& HistoryRing::at(size_t i) const {
+	return _entries[(_first + i) % _entries.size()];
+}
+
+void HistoryRing::pushBack(const Entry& e) {
+	if (_count == _entries.size()) {
+		std::vector<Entry> entries;
+		entries.reserve(_entries.empty() ? 16 : _entries.size() * 2);
+		for (size_t i = 0; i < _count; ++i)
+			entries.push_back(at(i));
+		entries.resize(entries.capacity());
+		_entries.swap(entries);
+		_first = 0;
+	}
+	_entries[(_first + _count) % _entries.size()] = e;
+	_count++;
+}
+
+void HistoryRing::popFront() {
+	_first = (_first + 1) % _entries.size();
+	_count--;
+}
+
+// Doubles the arena (at least up to `needed`) and lays the events out again
+// from offset 0, oldest first. Returns false if the limits don't allow it.
+bool HistoryRing::grow(size_t needed, const HistoryLimits& limits) {
+	size_t used = 0;
+	for (size_t i = 0; i < _count; ++i)
+		used += at(i).length;
+	size_t size = _arena.empty() ? 4096 : _arena.size() * 2;
+	while (size < used + needed)
+		size *= 2;
+	if (size > limits.channelBytes)
+		size = limits.channelBytes;
+	if (size <= _arena.size() || size < used + needed)
+		return false;
+	if (_totalBytes - _arena.size() + size > limits.totalBytes)
+		return false;
+
+	std::vector<char> arena(size);
+	size_t pos = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		Entry& e = at(i);
+		std::memcpy(&arena[pos], &_arena[e.offset], e.length);
+		e.offset = pos;
+		pos += e.length;
+	}
+	_totalBytes = _totalBytes - _arena.size() + size;
+	_arena.swap(arena);
+	_writePos = pos;
+	return true;
+}
+
+// Drops the oldest events stored in [_writePos, end). Events are always laid
+// out oldest first starting right after the write position, so these are
+// exactly the front of the index.
+void HistoryRing::evictBefore(size_t end) {
+	while (_count > 0 && at(0).offset >= _writePos && at(0).offset < end)
+		popFront();
+}
+
+void HistoryRing::append(const std::string& line, unsigned long msgid, unsigned long timeMs, const HistoryLimits& limits) {
+	append(line.data(), line.size(), msgid, timeMs, limits);
+}
+
+void HistoryRing::append(const char* line, size_t len, unsigned long msgid, unsigned long timeMs, const HistoryLimits& limits) {
+	if (len == 0 || len > limits.channelBytes || limits.maxLines == 0)
+		return;
+	if (_writePos + len > _arena.size() && !grow(len, limits)) {
+		if (len > _arena.size())
+			return; // the budget is gone and this event doesn't fit what we have
+		// Wrap: whatever sits in the tail we skip is the oldest, it goes first
+		evictBefore(_arena.size());
+		_writePos = 0;
+	}
+	evictBefore(_writePos + len);
+	while (_count >= limits.maxLines)
+		popFront();
+
+	std::memcpy(&_arena[_writePos], line, len);
+	Entry e;
+	e.msgid = msgid;
+	e.timeMs = timeMs;
+	e.offset = _writePos;
+	e.length = len;
+	pushBack(e);
+	_writePos += len;
+}
+
+static unsigned long keyOf(unsigned long msgid, unsigned long timeMs, bool byMsgid) {
+	return byMsgid ? msgid : timeMs;
+}
+
+// Both keys only grow, so the index can be searched in log time
+size_t HistoryRing::lowerBound(const HistoryRef& ref) const {
+	size_t lo = 0, hi = _count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (keyOf(at(mid).msgid, at(mid).timeMs, ref.byMsgid) < ref.value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+size_t HistoryRing::upperBound(const HistoryRef& ref) const {
+	size_t lo = 0, hi = _count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (keyOf(at(mid).msgid, at(mid).timeMs, ref.byMsgid) <= ref.value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void HistoryRing::copyOut(size_t from, size_t to, std::vector<HistoryLine>& out) const {
+	for (size_t i = from; i < to; ++i) {
+		const Entry& e = at(i);
+		HistoryLine h;
+		h.msgid = e.msgid;
+		h.timeMs = e.timeMs;
+		h.line.assign(&_arena[e.offset], e.length);
+		out.push_back(h);
+	}
+}
+
+// The newest `limit` events, only those after `ref` if there is one
+void HistoryRing::latest(const HistoryRef* ref, size_t limit, std::vector<HistoryLine>& out) const {
+	size_t from = ref ? upperBound(*ref) : 0;
+	size_t to = _count;
+	if (to - from > limit)
+		from = to - limit;
+	copyOut(from, to, out);
+}
+
+void HistoryRing::before(const HistoryRef& ref, size_t limit, std::vector<HistoryLine>& out) const {
+	size_t to = lowerBound(ref);
+	size_t from = to > limit ? to - limit : 0;
+	copyOut(from, to, out);
+}
+
+void HistoryRing::after(const HistoryRef& ref, size_t limit, std::vector<HistoryLine>& out) const {
+	size_t from = upperBound(ref);
+	size_t to = _count;
+	if (to - from > limit)
+		to = from + limit;
+	copyOut(from, to, out);
+}
+
+size_t HistoryRing::size() const {
+	return _count;
+}
+
+size_t HistoryRing::arenaBytes() const {
+	return _arena.size();
+}
+
+size_t HistoryRing::memoryBytes() const {
+	return _arena.capacity() + _entries.capacity() * sizeof(Entry);
+}
+
+size_t HistoryRing::shrink() {
+	size_t before = memoryBytes();
+	size_t keep = _count / 2;
+	while (_count > keep)
+		popFront();
+
+	// Same layout as grow(): oldest first from offset 0
+	size_t used = 0;
+	for (size_t i = 0; i < _count; ++i)
+		used += at(i).length;
+	std::vector<char> arena(used);
+	std::vector<Entry> entries(_count);
+	size_t pos = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		entries[i] = at(i);
+		if (entries[i].length > 0)
+			std::memcpy(&arena[pos], &_arena[entries[i].offset], entries[i].length);
+		entries[i].offset = pos;
+		pos += entries[i].length;
+	}
+	_totalBytes = _totalBytes - _arena.size() + arena.size();
+	_arena.swap(arena);
+	_entries.swap(entries);
+	_first = 0;
+	_writePos = pos;
+	return before - memoryBytes();
+}
+
+size_t HistoryRing::totalBytes() {
+	return _totalBytes;
+}
+
+bool HistoryRing::parseRef(const std::string& text, HistoryRef& ref) {
+	if (text.compare(0, 6, "msgid=") == 0) {
+		std::string id = text.substr(6);
+		if (id.empty() || id.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+		ref.byMsgid = true;
+		ref.value = std::strtoul(id.c_str(), NULL, 10);
+		return true;
+	}
+	if (text.compare(0, 10, "timestamp=") == 0) {
+		struct tm tm;
+		int ms = 0;
+		std::memset(&tm, 0, sizeof(tm));
+		// 2024-01-31T12:00:00.000Z, the milliseconds are optional
+		if (std::sscanf(text.c_str() + 10, "%4d-%2d-%2dT%2d:%2d:%2d.%3dZ", &tm.tm_year, &tm.tm_mon,
+				&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &ms) < 6)
+			return false;
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		time_t seconds = timegm(&tm);
+		if (seconds == (time_t)-1)
+			return false;
+		ref.byMsgid = false;
+		ref.value = (unsigned long)seconds * 1000UL + (unsigned long)ms;
+		return true;
+	}
+	return false;
+}
+
+std::string HistoryRing::formatTime(unsigned long timeMs) {
+	time_t seconds = (time_t)(timeMs / 1000);
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	char buffer[32];
+	std::snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d.%03luZ", tm.tm_year + 1900,
+		tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, timeMs % 1000);
+	return buffer;
+}
+
+unsigned long HistoryRing::nowMs() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000UL + (unsigned long)tv.tv_usec / 1000UL;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Limits shared by every channel's ring, read from the config once.
+struct HistoryLimits {
+	size_t	channelBytes;	// arena size of one channel
+	size_t	totalBytes;		// all arenas together
+	size_t	maxLines;		// entries kept per channel
+
+	HistoryLimits() : channelBytes(64 * 1024), totalBytes(64 * 1024 * 1024), maxLines(1000) {}
+};
+
+struct HistoryLine {
+	unsigned long	msgid;
+	unsigned long	timeMs;	// wall clock, for timestamp= references
+	std::string		line;	// full IRC line, without CRLF
+};
+
+// Where a CHATHISTORY query starts: msgid=<n> or timestamp=<iso 8601>
+struct HistoryRef {
+	bool			byMsgid;
+	unsigned long	value;	// msgid, or ms since the epoch
+
+	HistoryRef() : byMsgid(true), value(0) {}
+};
+
+// Recent channel events in fixed memory. The text of every event lives in
+// one byte arena used as a ring; the index only keeps offsets, so an event
+// costs its bytes plus 32 bytes of bookkeeping, not a std::string.
+// The arena grows (doubling) up to channelBytes while the global budget
+// allows, then the oldest events are overwritten.
+class HistoryRing {
+	private:
+	struct Entry {
+		unsigned long	msgid;
+		unsigned long	timeMs;
+		size_t			offset;
+		size_t			length;
+	};
+
+	std::vector<char>	_arena;
+	std::vector<Entry>	_entries;	// circular: _count entries from _first, oldest first
+	size_t				_first;
+	size_t				_count;
+	size_t				_writePos;
+
+	static size_t		_totalBytes;	// sum of every arena
+
+	// No std::deque: it allocates even when empty, and most channels never
+	// get a message
+	Entry& at(size_t i);
+	const Entry& at(size_t i) const;
+	void pushBack(const Entry& e);
+	void popFront();
+	bool grow(size_t needed, const HistoryLimits& limits);
+	void evictBefore(size_t end);
+	size_t lowerBound(const HistoryRef& ref) const;	// first entry >= ref
+	size_t upperBound(const HistoryRef& ref) const;	// first entry > ref
+	void copyOut(size_t from, size_t to, std::vector<HistoryLine>& out) const;
+
+	public:
+	HistoryRing();
+	HistoryRing(const HistoryRing& other);
+	HistoryRing& operator=(const HistoryRing& other);
+	~HistoryRing();
+
+	// Events bigger than the whole arena are not kept
+	void append(const std::string& line, unsigned long msgid, unsigned long timeMs, const HistoryLimits& limits);
+	void append(const char* line, size_t len, unsigned long msgid, unsigned long timeMs, const HistoryLimits& limits);
+
+	// Oldest first in every case. `ref` NULL means "no reference" (LATEST *).
+	void latest(const HistoryRef* ref, size_t limit, std::vector<HistoryLine>& out) const;
+	void before(const HistoryRef& ref, size_t limit, std::vector<HistoryLine>& out) const;
+	void after(const HistoryRef& ref, size_t limit, std::vector<HistoryLine>& out) const;
+
+	// Memory pressure: forgets the older half of the events and shrinks the
+	// arena to what the rest takes. Returns the bytes given back.
+	size_t shrink();
+
+	size_t size() const;
+	size_t arenaBytes() const;
+	size_t memoryBytes() const;	// arena and index
+	static size_t totalBytes();
+
+	// "timestamp=2024-01-31T12:00:00.000Z" or "msgid=42". Returns false if it's neither.
+	static bool parseRef(const std::string& text, HistoryRef& ref);
+	static std::string formatTime(unsigned long timeMs);
+	static unsigned long nowMs();
+};
@@ -0,0 +1,96 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "../Memory/Intern.hpp"
+
+class ZipStream;
+
+// Server-to-server linking. Servers form a spanning tree: every server is
+// reached through exactly one of our links, and a SERVER that introduces a
+// name we already know is a loop, so that link is dropped.
+//
+// Lines on a link are IRC lines with a prefix naming their origin (a server
+// or a nick). Handshake, from the side that connects:
+//   [CAPAB :ZIP]                                (if link_compress is on)
+//   SERVER <name> <password> :<description>     (answered with the same)
+// If both sides sent CAPAB ZIP, each direction is a zlib stream (see
+// Link/ZipStream.hpp) from the byte after the sender's SERVER line on.
+// then both sides burst what they know:
+//   :<uplink> SERVER <name> <hops> :<description>
+//   NICK <nick> <signon ms> <user> <server> :<realname>
+//   SJOIN <channel> <+modes> [key] [limit] :<[@]nick ...>
+//   :<server> TOPIC <channel> :<topic>
+// and from then on relay what happens:
+//   :<nick> NICK <newnick>          :<nick> QUIT :<reason>
+//   :<nick> JOIN <channel>          :<nick> PART <channel> :<reason>
+//   :<nick> MODE <channel> <mode> [arg]
+//   :<nick> KICK <channel> <nick> :<reason>
+//   :<nick> TOPIC <channel> :<topic>
+//   :<nick> INVITE <nick> <channel>
+//   :<nick> PRIVMSG|NOTICE <target> :<text>
+//   :<server> KILL <nick> <signon ms> :<reason>
+//   :<server> SQUIT <name> :<reason>
+//
+// Channel state changes go to every link so that each server can check
+// keys, limits and operators on its own; PRIVMSG/NOTICE only go where a
+// member is, once per link (the server keeps, for every channel, how many
+// members sit behind each link). A nick collision is settled by the signon time: the newer user
+// is killed (both if they tie), and every server reaches the same verdict.
+
+// A user connected to some other server. Remote users get negative ids, so
+// channels can keep holding plain ints for their members.
+struct RemoteUser {
+	std::string		nick;
+	std::string		user;
+	InternedString	realname;
+	InternedString	server;	// where the user is connected (shared by all its users)
+	int				link;	// our link towards that server
+	unsigned long	signon;
+};
+
+struct RemoteServer {
+	std::string	name;
+	std::string	uplink;	// the server that introduced it: its parent in the tree
+	std::string	info;
+	int			link;	// our link towards it
+	int			hops;
+};
+
+// A connection to a neighbour server, outgoing or accepted.
+// The streams belong to the link: dropLink() deletes them.
+struct Link {
+	std::string	name;			// the server at the other end, once it has said so
+	bool		established;	// SERVER exchanged, burst sent
+	int			target;			// index in the link_connect list, -1 if they called us
+	bool		zipOffered;		// they sent CAPAB ZIP
+	ZipStream*	deflater;		// our output, once compression is on
+	ZipStream*	inflater;		// their input
+
+	Link() : established(false), target(-1), zipOffered(false), deflater(NULL), inflater(NULL) {}
+};
+
+// What interest routing did for one neighbour (kept by name, so it
+// survives reconnections). Flooding would send every channel message to
+// every link; we only send it where a member is.
+struct LinkTraffic {
+	unsigned long	messages;		// channel messages sent on the link
+	unsigned long	bytes;
+	unsigned long	savedMessages;	// ... and the ones flooding would have sent too
+	unsigned long	savedBytes;
+	// Compressed links: bytes before and after zlib, and the time it took
+	unsigned long	plainOut;
+	unsigned long	wireOut;
+	unsigned long	plainIn;
+	unsigned long	wireIn;
+	unsigned long	zipNs;
+
+	LinkTraffic() : messages(0), bytes(0), savedMessages(0), savedBytes(0),
+		plainOut(0), wireOut(0), plainIn(0), wireIn(0), zipNs(0) {}
+};
+
+// One entry of link_connect
+struct LinkTarget {
+	std::string	host;
+	int			port;
+	int			fd;	// -1 while not connected
+};
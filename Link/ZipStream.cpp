@@ -0,0 +1,63 @@
+#include "ZipStream.hpp"
+#include <stdexcept>
+#include <cstring>
+
+namespace {
+
+// Most frequent strings last: zlib prefers the closest match
+const char DICTIONARY[] =
+	"SQUIT ERROR KILL SJOIN SERVER INVITE TOPIC KICK MODE +o -o +k +l +i +t "
+	"PART :Quit: QUIT NICK JOIN #NOTICE #PRIVMSG #";
+
+} // namespace
+
+ZipStream::ZipStream(bool deflate, int level) : _deflate(deflate) {
+	std::memset(&_z, 0, sizeof(_z));
+	int err = deflate ? deflateInit(&_z, level) : inflateInit(&_z);
+	if (err != Z_OK)
+		throw std::runtime_error("zlib: could not set up a link stream");
+	if (deflate)
+		deflateSetDictionary(&_z, reinterpret_cast<const Bytef*>(DICTIONARY), sizeof(DICTIONARY) - 1);
+}
+
+ZipStream::~ZipStream() {
+	if (_deflate)
+		deflateEnd(&_z);
+	else
+		inflateEnd(&_z);
+}
+
+bool ZipStream::compress(const char* data, size_t len, std::string& out) {
+	char chunk[16384];
+	_z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	_z.avail_in = len;
+	// Z_SYNC_FLUSH is done once deflate() leaves room in the output
+	do {
+		_z.next_out = reinterpret_cast<Bytef*>(chunk);
+		_z.avail_out = sizeof(chunk);
+		if (deflate(&_z, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+			return false;
+		out.append(chunk, sizeof(chunk) - _z.avail_out);
+	} while (_z.avail_out == 0);
+	return true;
+}
+
+bool ZipStream::decompress(const char* data, size_t len, std::string& out) {
+	char chunk[16384];
+	_z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	_z.avail_in = len;
+	// A full chunk may mean there is more waiting inside zlib
+	do {
+		_z.next_out = reinterpret_cast<Bytef*>(chunk);
+		_z.avail_out = sizeof(chunk);
+		int err = inflate(&_z, Z_SYNC_FLUSH);
+		if (err == Z_NEED_DICT)
+			err = inflateSetDictionary(&_z, reinterpret_cast<const Bytef*>(DICTIONARY), sizeof(DICTIONARY) - 1);
+		if (err != Z_OK && err != Z_BUF_ERROR)
+			return false; // corrupt, or Z_STREAM_END: we never end a link stream
+		out.append(chunk, sizeof(chunk) - _z.avail_out);
+		if (err == Z_BUF_ERROR && _z.avail_out != 0)
+			break; // nothing left to do until more input comes
+	} while (_z.avail_in > 0 || _z.avail_out == 0);
+	return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <cstddef>
+#include <zlib.h>
+
+// One direction of a compressed link: a zlib stream that lives as long as
+// the connection, so later lines are compressed against everything sent
+// before them (the 32K window is what makes IRC text shrink). Both ends
+// start from the same preset dictionary of common IRC tokens, which helps
+// the first lines, before the window has anything in it.
+//
+// Every compress() ends with Z_SYNC_FLUSH: what it returns can be inflated
+// completely by the other side, so a line never waits for more data.
+class ZipStream {
+	private:
+	z_stream	_z;
+	bool		_deflate;
+
+	ZipStream(const ZipStream& other);
+	ZipStream& operator=(const ZipStream& other);
+
+	public:
+	// Throws std::runtime_error if zlib can't set the stream up
+	ZipStream(bool deflate, int level);
+	~ZipStream();
+
+	// Appends to `out`. Return false on corrupt input (the link is unusable).
+	bool compress(const char* data, size_t len, std::string& out);
+	bool decompress(const char* data, size_t len, std::string& out);
+};
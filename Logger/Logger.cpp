@@ -0,0 +1,225 @@
+#include "Logger.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+namespace {
+
+struct Record {
+	unsigned long	seq;	// ring protocol: tells producers and the writer who owns the slot
+	unsigned long	tsNs;	// wall clock, formatted by the writer thread
+	unsigned short	len;
+	unsigned char	level;
+	char			text[Logger::RECORD_SIZE - 2 * sizeof(unsigned long) - 4];
+};
+
+// Bounded MPMC queue (Vyukov): producers claim a slot with one CAS on
+// `head`, the writer thread is the only consumer. Head and tail live on
+// their own cache lines so the two sides don't fight over them.
+struct Ring {
+	char			pad0[64];
+	unsigned long	head;
+	char			pad1[64];
+	unsigned long	tail;
+	char			pad2[64];
+	Record			slots[Logger::CAPACITY];
+};
+
+Ring			g_ring;
+unsigned long	g_dropped = 0;
+unsigned long	g_written = 0;
+int				g_fd = 2;
+bool			g_ownsFd = false;
+int				g_minLevel = LOG_LEVEL_INFO;
+int				g_running = 0;
+pthread_t		g_thread;
+
+const char* levelName(int level) {
+	switch (level) {
+		case LOG_LEVEL_DEBUG: return "DEBUG";
+		case LOG_LEVEL_INFO: return "INFO";
+		case LOG_LEVEL_WARN: return "WARN";
+		default: return "ERROR";
+	}
+}
+
+unsigned long wallClockNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+// "2026-10-19 13:37:00.123 [INFO] message\n", returns the bytes used
+size_t formatRecord(char* out, size_t room, unsigned long tsNs, int level, const char* text, size_t len) {
+	time_t sec = (time_t)(tsNs / 1000000000UL);
+	struct tm tm;
+	localtime_r(&sec, &tm);
+	char stamp[32];
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	int n = snprintf(out, room, "%s.%03lu [%s] %.*s\n", stamp, (tsNs / 1000000UL) % 1000,
+		levelName(level), (int)len, text);
+	if (n < 0)
+		return 0;
+	return (size_t)n < room ? (size_t)n : room - 1;
+}
+
+void writeAll(const char* data, size_t len) {
+	while (len > 0) {
+		ssize_t n = ::write(g_fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return; // nowhere to report it
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+} // namespace
+
+void Logger::start(const std::string& path, LogLevel minLevel) {
+	if (__atomic_load_n(&g_running, __ATOMIC_ACQUIRE))
+		return;
+	g_minLevel = minLevel;
+	if (!path.empty()) {
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0)
+			throw std::runtime_error("Failed to open log file " + path);
+		g_fd = fd;
+		g_ownsFd = true;
+	}
+	for (size_t i = 0; i < CAPACITY; ++i)
+		g_ring.slots[i].seq = i;
+	g_ring.head = 0;
+	g_ring.tail = 0;
+	__atomic_store_n(&g_running, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&g_thread, NULL, &Logger::writerMain, NULL) != 0) {
+		__atomic_store_n(&g_running, 0, __ATOMIC_RELEASE);
+		throw std::runtime_error("Failed to start the logger thread");
+	}
+}
+
+void Logger::stop() {
+	if (!__atomic_load_n(&g_running, __ATOMIC_ACQUIRE))
+		return;
+	// The writer drains whatever is left before it exits
+	__atomic_store_n(&g_running, 0, __ATOMIC_RELEASE);
+	pthread_join(g_thread, NULL);
+	if (g_ownsFd) {
+		close(g_fd);
+		g_fd = 2;
+		g_ownsFd = false;
+	}
+}
+
+bool Logger::enabled(LogLevel level) {
+	return level >= g_minLevel;
+}
+
+void Logger::write(LogLevel level, const std::string& msg) {
+	size_t len = msg.size();
+	if (len > sizeof(((Record*)0)->text))
+		len = sizeof(((Record*)0)->text);
+
+	if (!__atomic_load_n(&g_running, __ATOMIC_ACQUIRE)) {
+		char line[RECORD_SIZE + 64];
+		writeAll(line, formatRecord(line, sizeof(line), wallClockNs(), level, msg.c_str(), len));
+		return;
+	}
+
+	unsigned long pos = __atomic_load_n(&g_ring.head, __ATOMIC_RELAXED);
+	Record* rec;
+	for (;;) {
+		rec = &g_ring.slots[pos & (CAPACITY - 1)];
+		unsigned long seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		long diff = (long)seq - (long)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&g_ring.head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			// Full: the writer is behind. Drop rather than block the caller.
+			__atomic_fetch_add(&g_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else
+			pos = __atomic_load_n(&g_ring.head, __ATOMIC_RELAXED);
+	}
+	rec->tsNs = wallClockNs();
+	rec->level = (unsigned char)level;
+	rec->len = (unsigned short)len;
+	std::memcpy(rec->text, msg.data(), len);
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+LogLevel Logger::parseLevel(const std::string& name) {
+	if (name == "debug")
+		return LOG_LEVEL_DEBUG;
+	if (name == "warn")
+		return LOG_LEVEL_WARN;
+	if (name == "error")
+		return LOG_LEVEL_ERROR;
+	return LOG_LEVEL_INFO;
+}
+
+size_t Logger::memoryBytes() {
+	return sizeof(g_ring);
+}
+
+unsigned long Logger::dropped() {
+	return __atomic_load_n(&g_dropped, __ATOMIC_RELAXED);
+}
+
+unsigned long Logger::written() {
+	return __atomic_load_n(&g_written, __ATOMIC_RELAXED);
+}
+
+// Drains the ring into a local buffer and writes it out in one go.
+// Sleeps a few milliseconds when there is nothing to do.
+void* Logger::writerMain(void* arg) {
+	(void)arg;
+	static char batch[64 * 1024];
+	unsigned long reportedDrops = 0;
+
+	for (;;) {
+		bool running = __atomic_load_n(&g_running, __ATOMIC_ACQUIRE);
+		size_t used = 0;
+		unsigned long count = 0;
+		for (;;) {
+			Record* rec = &g_ring.slots[g_ring.tail & (CAPACITY - 1)];
+			if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != g_ring.tail + 1)
+				break; // empty (or a producer is still filling this slot)
+			if (sizeof(batch) - used < RECORD_SIZE + 64) {
+				writeAll(batch, used);
+				used = 0;
+			}
+			used += formatRecord(batch + used, sizeof(batch) - used, rec->tsNs, rec->level, rec->text, rec->len);
+			__atomic_store_n(&rec->seq, g_ring.tail + CAPACITY, __ATOMIC_RELEASE);
+			g_ring.tail++;
+			count++;
+		}
+		unsigned long drops = __atomic_load_n(&g_dropped, __ATOMIC_RELAXED);
+		if (drops != reportedDrops) {
+			char note[RECORD_SIZE];
+			int n = snprintf(note, sizeof(note), "%lu log records dropped (ring full)", drops - reportedDrops);
+			used += formatRecord(batch + used, sizeof(batch) - used, wallClockNs(), LOG_LEVEL_WARN, note, n);
+			reportedDrops = drops;
+		}
+		if (used > 0)
+			writeAll(batch, used);
+		__atomic_fetch_add(&g_written, count, __ATOMIC_RELAXED);
+		if (count == 0) {
+			if (!running)
+				break;
+			struct timespec nap;
+			nap.tv_sec = 0;
+			nap.tv_nsec = 5 * 1000000;
+			nanosleep(&nap, NULL);
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <string>
+#include <sstream>
+#include <cstddef>
+
+enum LogLevel {
+	LOG_LEVEL_DEBUG = 0,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_ERROR,
+};
+
+// Asynchronous logger. A caller only copies the record into a fixed-size
+// ring buffer; a background thread drains it in batches, formats the
+// timestamps and does the write(). Any thread may log (the event loop, the
+// archive and snapshot threads): producers claim a slot with a CAS on the
+// head and publish it through the slot's sequence number, so the ring is
+// multi-producer and lock-free, with the writer thread as its only consumer.
+// When the ring is full the record is dropped and counted, nobody waits.
+// Before start() (or after stop()) records are written synchronously to stderr.
+class Logger {
+	public:
+	static const size_t RECORD_SIZE = 256;	// bytes per slot, longer messages are cut
+	static const size_t CAPACITY = 4096;	// slots, must be a power of two
+
+	// path "" means stderr. Throws if the file can't be opened or the thread can't start.
+	static void start(const std::string& path, LogLevel minLevel);
+	static void stop();
+
+	static bool enabled(LogLevel level);
+	static void write(LogLevel level, const std::string& msg);
+	static LogLevel parseLevel(const std::string& name);
+
+	static unsigned long dropped();
+	static unsigned long written();
+	static size_t memoryBytes();	// the ring: fixed, allocated once
+
+	private:
+	Logger();
+	static void* writerMain(void* arg);
+};
+
+#define IRC_LOG(level, expr) \
+	do { \
+		if (Logger::enabled(level)) { \
+			std::ostringstream irc_log_oss_; \
+			irc_log_oss_ << expr; \
+			Logger::write(level, irc_log_oss_.str()); \
+		} \
+	} while (0)
+
+#define LOG_INFO(expr)	IRC_LOG(LOG_LEVEL_INFO, expr)
+#define LOG_WARN(expr)	IRC_LOG(LOG_LEVEL_WARN, expr)
+#define LOG_ERROR(expr)	IRC_LOG(LOG_LEVEL_ERROR, expr)
+
+// Debug logs cost nothing unless built with `make DEBUG_LOGS=1`
+#ifdef IRC_DEBUG_LOGS
+# define LOG_DEBUG(expr) IRC_LOG(LOG_LEVEL_DEBUG, expr)
+#else
+# define LOG_DEBUG(expr) do {} while (0)
+#endif
@@ -0,0 +1,223 @@
+#include "Mask.hpp"
+#include "../Memory/Footprint.hpp"
+#include <cstring>
+
+WildMask::WildMask() : _prefixLen(0), _suffixLen(0), _minLength(0), _literal(true) {}
+
+WildMask::WildMask(const std::string& mask) : _pattern(mask), _prefixLen(0), _suffixLen(0), _minLength(0), _literal(true) {
+	fold(_pattern);
+	size_t first = _pattern.find_first_of("*?");
+	if (first == std::string::npos) {
+		_prefixLen = _suffixLen = _minLength = _pattern.size();
+		return;
+	}
+	_literal = false;
+	_prefixLen = first;
+	_suffixLen = _pattern.size() - 1 - _pattern.find_last_of("*?");
+	for (size_t i = 0; i < _pattern.size(); ++i) {
+		if (_pattern[i] != '*')
+			_minLength++;
+	}
+}
+
+bool WildMask::matches(const std::string& identity) const {
+	if (_literal)
+		return identity == _pattern;
+	size_t len = identity.size();
+	if (len < _minLength)
+		return false;
+	const char* id = identity.data();
+	const char* pat = _pattern.data();
+	if (std::memcmp(id, pat, _prefixLen) != 0
+		|| std::memcmp(id + len - _suffixLen, pat + _pattern.size() - _suffixLen, _suffixLen) != 0)
+		return false;
+	// _minLength >= prefix + suffix, so the two never overlap
+	return glob(pat + _prefixLen, _pattern.size() - _prefixLen - _suffixLen,
+		id + _prefixLen, len - _prefixLen - _suffixLen);
+}
+
+bool WildMask::glob(const char* pattern, size_t patternLen, const char* text, size_t textLen) {
+	size_t p = 0;
+	size_t t = 0;
+	size_t star = std::string::npos;
+	size_t resume = 0;
+	while (t < textLen) {
+		if (p < patternLen && pattern[p] == '*') {
+			star = p++;
+			resume = t;
+		} else if (p < patternLen && (pattern[p] == '?' || pattern[p] == text[t])) {
+			p++;
+			t++;
+		} else if (star != std::string::npos) {
+			// Let the last '*' take one more character and try again
+			p = star + 1;
+			t = ++resume;
+		} else
+			return false;
+	}
+	while (p < patternLen && pattern[p] == '*')
+		p++;
+	return p == patternLen;
+}
+
+std::string WildMask::normalize(const std::string& mask) {
+	size_t bang = mask.find('!');
+	size_t at = mask.find('@', bang == std::string::npos ? 0 : bang);
+	std::string nick, user, host;
+	if (bang == std::string::npos && at == std::string::npos)
+		nick = mask;
+	else if (bang == std::string::npos) {
+		user = mask.substr(0, at);
+		host = mask.substr(at + 1);
+	} else {
+		nick = mask.substr(0, bang);
+		user = at == std::string::npos ? mask.substr(bang + 1) : mask.substr(bang + 1, at - bang - 1);
+		if (at != std::string::npos)
+			host = mask.substr(at + 1);
+	}
+	return (nick.empty() ? "*" : nick) + "!" + (user.empty() ? "*" : user) + "@" + (host.empty() ? "*" : host);
+}
+
+void WildMask::fold(std::string& s) {
+	for (size_t i = 0; i < s.size(); ++i) {
+		if (s[i] >= 'A' && s[i] <= 'Z')
+			s[i] = s[i] - 'A' + 'a';
+	}
+}
+
+// Up to KEY_CHARS bytes, their count and the field in one word
+unsigned long MaskList::key(int field, const char* s, size_t len) {
+	unsigned long k = len | (unsigned long)field << 4;
+	for (size_t i = 0; i < len; ++i)
+		k |= (unsigned long)(unsigned char)s[i] << (8 * (i + 1));
+	return k;
+}
+
+// One '!' and one '@' after it. Nicks can't hold either; a user name that
+// does makes the identity fall back to trying every mask.
+bool MaskList::fields(const std::string& s, size_t start[3], size_t end[3]) {
+	size_t bang = s.find('!');
+	if (bang == std::string::npos)
+		return false;
+	size_t at = s.find('@', bang + 1);
+	if (at == std::string::npos || s.find('!', bang + 1) != std::string::npos
+		|| s.find('@', at + 1) != std::string::npos || s.find('@') < bang)
+		return false;
+	start[0] = 0;
+	end[0] = bang;
+	start[1] = bang + 1;
+	end[1] = at;
+	start[2] = at + 1;
+	end[2] = s.size();
+	return true;
+}
+
+void MaskList::index(size_t i) {
+	const std::string& pattern = _entries[i].mask.pattern();
+	size_t start[3], end[3];
+	if (!fields(pattern, start, end)) {
+		_unindexed.push_back(i);
+		return;
+	}
+	for (int f = 0; f < 3; ++f) {
+		size_t literal = 0;
+		while (start[f] + literal < end[f] && pattern[start[f] + literal] != '*' && pattern[start[f] + literal] != '?')
+			literal++;
+		if (literal > 0) {
+			_byPrefix[key(f, pattern.data() + start[f], literal < KEY_CHARS ? literal : KEY_CHARS)].push_back(i);
+			return;
+		}
+	}
+	size_t literal = 0;
+	while (literal < end[2] - start[2] && pattern[end[2] - literal - 1] != '*' && pattern[end[2] - literal - 1] != '?')
+		literal++;
+	if (literal > 0) {
+		size_t n = literal < KEY_CHARS ? literal : KEY_CHARS;
+		_bySuffix[key(2, pattern.data() + end[2] - n, n)].push_back(i);
+	} else
+		_unindexed.push_back(i);
+}
+
+bool MaskList::add(const std::string& mask, const std::string& setBy, unsigned long setAt) {
+	MaskEntry entry;
+	entry.mask = WildMask(mask);
+	if (!_patterns.insert(entry.mask.pattern()).second)
+		return false;
+	entry.setBy = setBy;
+	entry.setAt = setAt;
+	_entries.push_back(entry);
+	index(_entries.size() - 1);
+	return true;
+}
+
+// Rare next to lookups: the indexes are simply built again
+bool MaskList::remove(const std::string& mask) {
+	std::string pattern = mask;
+	WildMask::fold(pattern);
+	if (_patterns.erase(pattern) == 0)
+		return false;
+	for (size_t i = 0; i < _entries.size(); ++i) {
+		if (_entries[i].mask.pattern() == pattern) {
+			_entries.erase(_entries.begin() + i);
+			break;
+		}
+	}
+	_byPrefix.clear();
+	_bySuffix.clear();
+	_unindexed.clear();
+	for (size_t i = 0; i < _entries.size(); ++i)
+		index(i);
+	return true;
+}
+
+bool MaskList::scan(const Buckets& buckets, unsigned long k, const std::string& identity) const {
+	Buckets::const_iterator it = buckets.find(k);
+	if (it == buckets.end())
+		return false;
+	for (size_t i = 0; i < it->second.size(); ++i) {
+		if (_entries[it->second[i]].mask.matches(identity))
+			return true;
+	}
+	return false;
+}
+
+bool MaskList::matches(const std::string& identity) const {
+	if (_entries.empty())
+		return false;
+	size_t start[3], end[3];
+	if (!fields(identity, start, end)) {
+		for (size_t i = 0; i < _entries.size(); ++i) {
+			if (_entries[i].mask.matches(identity))
+				return true;
+		}
+		return false;
+	}
+	const char* id = identity.data();
+	for (int f = 0; f < 3 && !_byPrefix.empty(); ++f) {
+		for (size_t n = 1; n <= KEY_CHARS && start[f] + n <= end[f]; ++n) {
+			if (scan(_byPrefix, key(f, id + start[f], n), identity))
+				return true;
+		}
+	}
+	for (size_t n = 1; n <= KEY_CHARS && start[2] + n <= end[2] && !_bySuffix.empty(); ++n) {
+		if (scan(_bySuffix, key(2, id + end[2] - n, n), identity))
+			return true;
+	}
+	for (size_t i = 0; i < _unindexed.size(); ++i) {
+		if (_entries[_unindexed[i]].mask.matches(identity))
+			return true;
+	}
+	return false;
+}
+
+size_t MaskList::memoryBytes() const {
+	size_t bytes = _entries.capacity() * sizeof(MaskEntry) + _unindexed.capacity() * sizeof(size_t);
+	for (size_t i = 0; i < _entries.size(); ++i)
+		bytes += 2 * stringHeapBytes(_entries[i].mask.pattern()) + stringHeapBytes(_entries[i].setBy)
+			+ mapNodeBytes(sizeof(std::string));
+	for (Buckets::const_iterator it = _byPrefix.begin(); it != _byPrefix.end(); ++it)
+		bytes += mapNodeBytes(sizeof(*it)) + it->second.capacity() * sizeof(size_t);
+	for (Buckets::const_iterator it = _bySuffix.begin(); it != _bySuffix.end(); ++it)
+		bytes += mapNodeBytes(sizeof(*it)) + it->second.capacity() * sizeof(size_t);
+	return bytes;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstddef>
+
+// A nick!user@host mask compiled once, when it is set: lowercased, with
+// the literal text before the first wildcard and after the last one
+// measured, so most identities are turned down by two memcmp before the
+// glob runs on what is left in between.
+class WildMask {
+	private:
+	std::string	_pattern;	// lowercased
+	size_t		_prefixLen;	// literal characters before the first * or ?
+	size_t		_suffixLen;	// literal characters after the last one
+	size_t		_minLength;	// characters other than '*'
+	bool		_literal;	// no wildcard at all: a plain compare
+
+	public:
+	WildMask();
+	explicit WildMask(const std::string& mask);
+
+	// `identity` must be lowercased already (see fold())
+	bool matches(const std::string& identity) const;
+	const std::string& pattern() const { return _pattern; }
+	size_t prefixLength() const { return _prefixLen; }
+	size_t suffixLength() const { return _suffixLen; }
+
+	// "nick" -> "nick!*@*", "user@host" -> "*!user@host", "nick!user" -> "nick!user@*"
+	static std::string normalize(const std::string& mask);
+	// ASCII lowercase in place: nicks and hosts compare without case
+	static void fold(std::string& s);
+	// '*' is any run of characters, '?' any one. Linear apart from the
+	// backtracking to the last '*'.
+	static bool glob(const char* pattern, size_t patternLen, const char* text, size_t textLen);
+};
+
+struct MaskEntry {
+	WildMask		mask;
+	std::string		setBy;
+	unsigned long	setAt;	// seconds since the epoch
+};
+
+// A channel's +b or +e list. A mask is filed under the first literal
+// characters (up to KEY_CHARS) of its nick, user or host field, whichever
+// comes first, or else under the last ones of its host: nick bans, user
+// bans and host bans alike. A lookup only runs the masks filed under what
+// the identity's fields start or end with, plus the few that have
+// wildcards at both ends of every field. Thousands of bans cost a handful
+// of map lookups.
+class MaskList {
+	private:
+	typedef std::map<unsigned long, std::vector<size_t> > Buckets;
+
+	std::vector<MaskEntry>	_entries;	// in the order they were set, for listing
+	std::set<std::string>	_patterns;	// duplicates are refused
+	Buckets					_byPrefix;	// keyed by field and leading characters
+	Buckets					_bySuffix;	// keyed by trailing characters of the host
+	std::vector<size_t>		_unindexed;
+
+	static unsigned long key(int field, const char* s, size_t len);
+	// Splits nick!user@host, false if `s` has any other shape
+	static bool fields(const std::string& s, size_t start[3], size_t end[3]);
+	void index(size_t i);
+	bool scan(const Buckets& buckets, unsigned long k, const std::string& identity) const;
+
+	public:
+	static const size_t KEY_CHARS = 4;
+
+	// `mask` normalized already. Returns false if it is on the list.
+	bool add(const std::string& mask, const std::string& setBy, unsigned long setAt);
+	bool remove(const std::string& mask);
+	// `identity` lowercased, nick!user@host
+	bool matches(const std::string& identity) const;
+	const std::vector<MaskEntry>& entries() const { return _entries; }
+	size_t size() const { return _entries.size(); }
+	bool empty() const { return _entries.empty(); }
+	size_t memoryBytes() const;
+};
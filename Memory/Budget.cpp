@@ -0,0 +1,20 @@
+#include "Budget.hpp"
+
+MemoryReport::MemoryReport() {
+	for (int i = 0; i < MEM_AREAS; ++i)
+		bytes[i] = 0;
+}
+
+size_t MemoryReport::total() const {
+	size_t sum = 0;
+	for (int i = 0; i < MEM_AREAS; ++i)
+		sum += bytes[i];
+	return sum;
+}
+
+const char* MemoryReport::name(int area) {
+	static const char* const names[MEM_AREAS] = {
+		"clients", "recvq", "sendq", "channels", "history", "archive", "log", "pools", "stats"
+	};
+	return area >= 0 && area < MEM_AREAS ? names[area] : "?";
+}
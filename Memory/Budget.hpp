@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+
+// Where the server's memory goes. Filled in by Server::collectMemory() from
+// the subsystems' own counters and a walk of the client and channel tables.
+enum MemoryArea {
+	MEM_CLIENTS = 0,	// client entries, nick/user, interned realnames, MONITOR lists
+	MEM_RECVQ,			// receive buffers, spares included
+	MEM_SENDQ,			// send queues (what they hold, not just what is pending)
+	MEM_CHANNELS,		// channels and their member/operator/invite lists
+	MEM_HISTORY,		// CHATHISTORY arenas and their indexes
+	MEM_ARCHIVE,		// records waiting for the archive thread
+	MEM_LOG,			// the logger's ring
+	MEM_POOLS,			// slabs of the fixed-size pools (client map nodes)
+	MEM_STATS,			// talker sketches and the spam filter (fixed at startup)
+	MEM_AREAS
+};
+
+struct MemoryReport {
+	size_t	bytes[MEM_AREAS];
+
+	MemoryReport();
+	size_t total() const;
+	static const char* name(int area);
+};
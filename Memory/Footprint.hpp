@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+// Heap behind a string: nothing while the text fits the inline buffer
+// (libstdc++ keeps up to 15 chars inside the object itself).
+inline size_t stringHeapBytes(const std::string& s) {
+	const char* p = s.data();
+	if (p >= reinterpret_cast<const char*>(&s) && p < reinterpret_cast<const char*>(&s + 1))
+		return 0;
+	return s.capacity() ? s.capacity() + 1 : 0;
+}
+
+// A std::map / std::set node: the value plus the tree links (parent, left,
+// right) and the colour, padded to a word.
+inline size_t mapNodeBytes(size_t valueBytes) {
+	return 4 * sizeof(void*) + valueBytes;
+}
@@ -0,0 +1,69 @@
+#include "Intern.hpp"
+#include "Footprint.hpp"
+
+InternedString::Table& InternedString::table() {
+	static Table instance;
+	return instance;
+}
+
+void InternedString::acquire(const std::string& s) {
+	if (s.empty()) {
+		_set = false;
+		return;
+	}
+	_entry = table().insert(std::make_pair(s, 0UL)).first;
+	_entry->second++;
+	_set = true;
+}
+
+void InternedString::release() {
+	if (_set && --_entry->second == 0)
+		table().erase(_entry);
+	_set = false;
+}
+
+InternedString::InternedString() : _set(false) {}
+
+InternedString::InternedString(const std::string& s) : _set(false) {
+	acquire(s);
+}
+
+InternedString::InternedString(const InternedString& other) : _entry(other._entry), _set(other._set) {
+	if (_set)
+		_entry->second++;
+}
+
+InternedString& InternedString::operator=(const InternedString& other) {
+	if (other._set)
+		other._entry->second++; // first, in case both share the entry
+	release();
+	_entry = other._entry;
+	_set = other._set;
+	return *this;
+}
+
+InternedString& InternedString::operator=(const std::string& s) {
+	InternedString copy(s);
+	return *this = copy;
+}
+
+InternedString::~InternedString() {
+	release();
+}
+
+const std::string& InternedString::str() const {
+	static const std::string empty;
+	return _set ? _entry->first : empty;
+}
+
+size_t InternedString::distinct() {
+	return table().size();
+}
+
+size_t InternedString::tableBytes() {
+	// Node: the key and the count, plus the text itself
+	size_t bytes = 0;
+	for (Table::const_iterator it = table().begin(); it != table().end(); ++it)
+		bytes += mapNodeBytes(sizeof(Table::value_type)) + stringHeapBytes(it->first);
+	return bytes;
+}
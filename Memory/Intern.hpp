@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <map>
+#include <cstddef>
+
+// A string stored once, however many holders it has. Realnames and server
+// names repeat a lot (a bouncer or a bot farm uses the same one for every
+// connection), so each holder only keeps a pointer to the shared copy.
+// The copy is dropped with its last holder. Event loop thread only.
+class InternedString {
+	private:
+	typedef std::map<std::string, unsigned long> Table;	// text -> holders
+	Table::iterator	_entry;
+	bool			_set;
+
+	static Table& table();
+	void acquire(const std::string& s);
+	void release();
+
+	public:
+	InternedString();
+	InternedString(const std::string& s);
+	InternedString(const InternedString& other);
+	InternedString& operator=(const InternedString& other);
+	InternedString& operator=(const std::string& s);
+	~InternedString();
+
+	const std::string& str() const;
+	operator const std::string&() const { return str(); }
+
+	// For the memory report: distinct strings and the bytes they take
+	static size_t distinct();
+	static size_t tableBytes();
+};
@@ -0,0 +1,52 @@
+#include "Pool.hpp"
+
+unsigned long FixedPool::slabBytes = 0;
+unsigned long FixedPool::blocksInUse = 0;
+
+FixedPool::FixedPool(size_t blockSize) : _free(NULL), _slabs(NULL) {
+	// Every block must hold the freelist link and keep its contents aligned
+	const size_t align = sizeof(void*) * 2;
+	if (blockSize < sizeof(Block))
+		blockSize = sizeof(Block);
+	_blockSize = (blockSize + align - 1) / align * align;
+}
+
+FixedPool::~FixedPool() {
+	while (_slabs != NULL) {
+		void* previous = *static_cast<void**>(_slabs);
+		::operator delete(_slabs);
+		_slabs = previous;
+	}
+}
+
+void FixedPool::addSlab() {
+	// The first aligned slot holds the slab chain, the rest are blocks
+	const size_t header = sizeof(void*) * 2;
+	char* slab = static_cast<char*>(::operator new(header + _blockSize * SLAB_BLOCKS));
+	*reinterpret_cast<void**>(slab) = _slabs;
+	_slabs = slab;
+	slabBytes += header + _blockSize * SLAB_BLOCKS;
+	for (size_t i = SLAB_BLOCKS; i > 0; --i) {
+		Block* b = reinterpret_cast<Block*>(slab + header + (i - 1) * _blockSize);
+		b->next = _free;
+		_free = b;
+	}
+}
+
+void* FixedPool::allocate() {
+	if (_free == NULL)
+		addSlab();
+	Block* b = _free;
+	_free = b->next;
+	blocksInUse++;
+	return b;
+}
+
+void FixedPool::release(void* p) {
+	if (p == NULL)
+		return;
+	Block* b = static_cast<Block*>(p);
+	b->next = _free;
+	_free = b;
+	blocksInUse--;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <cstddef>
+#include <new>
+
+// Freelist of same-sized blocks. Blocks come from slabs of SLAB_BLOCKS and
+// go back to the list when released; slabs are only returned at exit, so a
+// server that once held N clients keeps the memory for N.
+class FixedPool {
+	private:
+	struct Block { Block* next; };
+
+	size_t	_blockSize;
+	Block*	_free;
+	void*	_slabs;		// each slab starts with a pointer to the previous one
+
+	FixedPool(const FixedPool& other);
+	FixedPool& operator=(const FixedPool& other);
+
+	void addSlab();
+
+	public:
+	static const size_t SLAB_BLOCKS = 64;
+
+	// Totals over every pool, for STATS and the metrics
+	static unsigned long slabBytes;
+	static unsigned long blocksInUse;
+
+	explicit FixedPool(size_t blockSize);
+	~FixedPool();
+
+	void* allocate();
+	void release(void* p);
+};
+
+// STL allocator on top of FixedPool: single objects (the nodes of a
+// std::map or std::list) come from the pool of their size, arrays go to
+// operator new as usual. Stateless, so any two instances are equal.
+template <typename T>
+class PoolAllocator {
+	public:
+	typedef T				value_type;
+	typedef T*				pointer;
+	typedef const T*		const_pointer;
+	typedef T&				reference;
+	typedef const T&		const_reference;
+	typedef std::size_t		size_type;
+	typedef std::ptrdiff_t	difference_type;
+
+	template <typename U>
+	struct rebind { typedef PoolAllocator<U> other; };
+
+	PoolAllocator() {}
+	PoolAllocator(const PoolAllocator&) {}
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U>&) {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+	size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+	pointer allocate(size_type n, const void* = 0) {
+		if (n == 1)
+			return static_cast<pointer>(pool().allocate());
+		return static_cast<pointer>(::operator new(n * sizeof(T)));
+	}
+	void deallocate(pointer p, size_type n) {
+		if (n == 1)
+			pool().release(p);
+		else
+			::operator delete(p);
+	}
+	void construct(pointer p, const T& value) { new (p) T(value); }
+	void destroy(pointer p) { p->~T(); }
+
+	// One pool per type, created on first use. Only the event loop thread
+	// touches pooled containers.
+	static FixedPool& pool() {
+		static FixedPool instance(sizeof(T));
+		return instance;
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
@@ -0,0 +1,75 @@
+#include "Monitor.hpp"
+#include "../Memory/Footprint.hpp"
+#include <algorithm>
+
+const std::vector<int> MonitorIndex::_noWatchers;
+const std::vector<std::string> MonitorIndex::_noTargets;
+
+MonitorIndex::MonitorIndex() : _entries(0) {}
+
+bool MonitorIndex::add(int fd, const std::string& nick) {
+	std::vector<std::string>& targets = _targets[fd];
+	if (std::find(targets.begin(), targets.end(), nick) != targets.end())
+		return false;
+	targets.push_back(nick);
+	_watchers[nick].push_back(fd);
+	_entries++;
+	return true;
+}
+
+bool MonitorIndex::remove(int fd, const std::string& nick) {
+	std::map<int, std::vector<std::string> >::iterator t = _targets.find(fd);
+	if (t == _targets.end())
+		return false;
+	std::vector<std::string>::iterator it = std::find(t->second.begin(), t->second.end(), nick);
+	if (it == t->second.end())
+		return false;
+	t->second.erase(it);
+	if (t->second.empty())
+		_targets.erase(t);
+	// Both sides always hold the pair, so the nick is there
+	std::map<std::string, std::vector<int> >::iterator w = _watchers.find(nick);
+	w->second.erase(std::find(w->second.begin(), w->second.end(), fd));
+	if (w->second.empty())
+		_watchers.erase(w);
+	_entries--;
+	return true;
+}
+
+void MonitorIndex::clear(int fd) {
+	std::map<int, std::vector<std::string> >::iterator t = _targets.find(fd);
+	if (t == _targets.end())
+		return;
+	std::vector<std::string> targets;
+	targets.swap(t->second);
+	_targets.erase(t);
+	for (size_t i = 0; i < targets.size(); ++i) {
+		std::map<std::string, std::vector<int> >::iterator w = _watchers.find(targets[i]);
+		w->second.erase(std::find(w->second.begin(), w->second.end(), fd));
+		if (w->second.empty())
+			_watchers.erase(w);
+	}
+	_entries -= targets.size();
+}
+
+const std::vector<int>& MonitorIndex::watchers(const std::string& nick) const {
+	std::map<std::string, std::vector<int> >::const_iterator it = _watchers.find(nick);
+	return it == _watchers.end() ? _noWatchers : it->second;
+}
+
+const std::vector<std::string>& MonitorIndex::targets(int fd) const {
+	std::map<int, std::vector<std::string> >::const_iterator it = _targets.find(fd);
+	return it == _targets.end() ? _noTargets : it->second;
+}
+
+size_t MonitorIndex::memoryBytes() const {
+	size_t bytes = 0;
+	for (std::map<std::string, std::vector<int> >::const_iterator it = _watchers.begin(); it != _watchers.end(); ++it)
+		bytes += mapNodeBytes(sizeof(*it)) + stringHeapBytes(it->first) + it->second.capacity() * sizeof(int);
+	for (std::map<int, std::vector<std::string> >::const_iterator it = _targets.begin(); it != _targets.end(); ++it) {
+		bytes += mapNodeBytes(sizeof(*it)) + it->second.capacity() * sizeof(std::string);
+		for (size_t i = 0; i < it->second.size(); ++i)
+			bytes += stringHeapBytes(it->second[i]);
+	}
+	return bytes;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <cstddef>
+
+// MONITOR lists, kept both ways: the nicks each client watches, and the
+// clients watching each nick. A nick coming or going looks up its own
+// watchers and nobody else is looked at. Nicks compare the way NICK
+// compares them, exactly.
+class MonitorIndex {
+	private:
+	std::map<std::string, std::vector<int> >	_watchers;	// nick -> fds
+	std::map<int, std::vector<std::string> >	_targets;	// fd -> nicks, in the order they were added
+	size_t	_entries;
+
+	static const std::vector<int>			_noWatchers;
+	static const std::vector<std::string>	_noTargets;
+
+	public:
+	MonitorIndex();
+
+	// Returns false if fd watches nick already
+	bool add(int fd, const std::string& nick);
+	bool remove(int fd, const std::string& nick);
+	// Everything fd watches, e.g. when it disconnects
+	void clear(int fd);
+
+	const std::vector<int>& watchers(const std::string& nick) const;
+	const std::vector<std::string>& targets(int fd) const;
+	size_t entries() const { return _entries; }
+	size_t memoryBytes() const;
+};
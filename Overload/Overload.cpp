@@ -0,0 +1,125 @@
+#include "Overload.hpp"
+
+OverloadControl::OverloadControl() :
+	_mode(LOAD_NORMAL),
+	_lagLimitNs(0),
+	_sendqLimit(0),
+	_joinsPerSec(20),
+	_queryMaxCost(50),
+	_calmChecks(0),
+	_joinTokens(0),
+	_joinRefillMs(0),
+	_modeChanges(0)
+{
+	for (int i = 0; i < WORK_CLASSES; ++i)
+		_shed[i] = 0;
+}
+
+void OverloadControl::configure(unsigned long lagLimitMs, size_t sendqLimit, unsigned int joinsPerSec, size_t queryMaxCost) {
+	_lagLimitNs = lagLimitMs * 1000000UL;
+	_sendqLimit = sendqLimit;
+	_joinsPerSec = joinsPerSec > 0 ? joinsPerSec : 1;
+	_queryMaxCost = queryMaxCost;
+	_joinTokens = _joinsPerSec * 1000UL;
+}
+
+LoadMode OverloadControl::target(unsigned long lagNs, size_t sendqBytes) const {
+	if ((_lagLimitNs && lagNs >= _lagLimitNs * 4) || (_sendqLimit && sendqBytes >= _sendqLimit * 4))
+		return LOAD_CRITICAL;
+	if ((_lagLimitNs && lagNs >= _lagLimitNs) || (_sendqLimit && sendqBytes >= _sendqLimit))
+		return LOAD_DEGRADED;
+	return LOAD_NORMAL;
+}
+
+bool OverloadControl::update(unsigned long lagNs, size_t sendqBytes) {
+	LoadMode wanted = target(lagNs, sendqBytes);
+	if (wanted > _mode) {
+		_mode = wanted;
+		_calmChecks = 0;
+		_modeChanges++;
+		return true;
+	}
+	if (wanted == _mode) {
+		_calmChecks = 0;
+		return false;
+	}
+	if (++_calmChecks < CALM_CHECKS)
+		return false;
+	_mode = static_cast<LoadMode>(_mode - 1);
+	_calmChecks = 0;
+	_modeChanges++;
+	return true;
+}
+
+LoadMode OverloadControl::mode() const {
+	return _mode;
+}
+
+WorkClass OverloadControl::classify(const std::string& verb) {
+	if (verb == "PRIVMSG")
+		return WORK_MESSAGE;
+	if (verb == "NOTICE")
+		return WORK_NOTICE;
+	if (verb == "JOIN")
+		return WORK_JOIN;
+	if (verb == "WHO" || verb == "CHATHISTORY" || verb == "NAMES" || verb == "LIST")
+		return WORK_QUERY;
+	if (verb == "PING" || verb == "PONG" || verb == "PASS" || verb == "NICK" || verb == "USER"
+		|| verb == "QUIT" || verb == "CAP" || verb == "OPER")
+		return WORK_ESSENTIAL;
+	return WORK_MESSAGE;
+}
+
+// Refilled by elapsed time, so nothing needs to run while nobody joins
+bool OverloadControl::takeJoin(unsigned long nowMs) {
+	unsigned long rate = _joinsPerSec;
+	if (_mode == LOAD_CRITICAL)
+		rate = rate / 4 > 0 ? rate / 4 : 1;
+	if (nowMs > _joinRefillMs) {
+		_joinTokens += (nowMs - _joinRefillMs) * rate;
+		if (_joinTokens > _joinsPerSec * 1000UL)
+			_joinTokens = _joinsPerSec * 1000UL;
+	}
+	_joinRefillMs = nowMs;
+	if (_joinTokens < 1000)
+		return false;
+	_joinTokens -= 1000;
+	return true;
+}
+
+Admission OverloadControl::admit(WorkClass work, size_t cost, unsigned long nowMs) {
+	if (_mode == LOAD_NORMAL || work == WORK_ESSENTIAL || work == WORK_MESSAGE)
+		return ADMIT;
+	Admission verdict = ADMIT;
+	if (work == WORK_NOTICE) {
+		if (_mode == LOAD_CRITICAL || cost > 1)
+			verdict = ADMIT_DROP;
+	} else if (work == WORK_QUERY) {
+		if (_mode == LOAD_CRITICAL || cost > _queryMaxCost)
+			verdict = ADMIT_LATER;
+	} else if (work == WORK_JOIN) {
+		if (!takeJoin(nowMs))
+			verdict = ADMIT_LATER;
+	}
+	if (verdict != ADMIT)
+		_shed[work]++;
+	return verdict;
+}
+
+unsigned long OverloadControl::shed(int work) const {
+	return _shed[work];
+}
+
+unsigned long OverloadControl::modeChanges() const {
+	return _modeChanges;
+}
+
+const char* OverloadControl::modeName(int mode) {
+	static const char* names[LOAD_MODES] = { "normal", "degraded", "critical" };
+	return names[mode];
+}
+
+const char* OverloadControl::className(int work) {
+	static const char* names[WORK_CLASSES] = { "essential", "message", "join", "notice", "query" };
+	return names[work];
+}
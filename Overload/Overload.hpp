@@ -0,0 +1,69 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+// How hard the server is pushed, from the loop lag and the total SendQ.
+// Checked once a second by the housekeeping timer.
+enum LoadMode {
+	LOAD_NORMAL = 0,
+	LOAD_DEGRADED,		// a limit crossed: shed what is expensive or optional
+	LOAD_CRITICAL,		// four times a limit: keep only what users can't do without
+	LOAD_MODES
+};
+
+// What a command costs and how much it matters, for shedding
+enum WorkClass {
+	WORK_ESSENTIAL = 0,	// registration, PING/PONG, QUIT: never shed
+	WORK_MESSAGE,		// PRIVMSG and the channel commands
+	WORK_JOIN,			// a NAMES list and a broadcast each: throttled
+	WORK_NOTICE,		// no reply expected, so the first to go
+	WORK_QUERY,			// WHO, CHATHISTORY: replies that grow with the channel
+	WORK_CLASSES
+};
+
+enum Admission {
+	ADMIT = 0,
+	ADMIT_LATER,		// refused with RPL_TRYAGAIN (263)
+	ADMIT_DROP			// dropped without a word
+};
+
+// Degraded: NOTICE to a channel is dropped, WHO on a channel bigger than
+// the configured size is refused, JOINs go through a token bucket.
+// Critical: every NOTICE is dropped, every query refused, and the bucket
+// refills four times slower. A mode is left one step at a time, after a
+// few calm checks in a row, so one good second doesn't undo it.
+class OverloadControl {
+	private:
+	LoadMode		_mode;
+	unsigned long	_lagLimitNs;		// 0: lag is not watched
+	size_t			_sendqLimit;		// 0: SendQ is not watched
+	unsigned int	_joinsPerSec;
+	size_t			_queryMaxCost;		// biggest channel a WHO may list while degraded
+	int				_calmChecks;
+	unsigned long	_joinTokens;		// thousandths of a JOIN
+	unsigned long	_joinRefillMs;
+	unsigned long	_shed[WORK_CLASSES];
+	unsigned long	_modeChanges;
+
+	LoadMode target(unsigned long lagNs, size_t sendqBytes) const;
+	bool takeJoin(unsigned long nowMs);
+
+	public:
+	static const int CALM_CHECKS = 5;
+
+	OverloadControl();
+	void configure(unsigned long lagLimitMs, size_t sendqLimit, unsigned int joinsPerSec, size_t queryMaxCost);
+
+	// Returns true when the mode changed
+	bool update(unsigned long lagNs, size_t sendqBytes);
+	LoadMode mode() const;
+
+	static WorkClass classify(const std::string& verb);
+	// `cost`: channel size for WHO and NOTICE, 1 otherwise
+	Admission admit(WorkClass work, size_t cost, unsigned long nowMs);
+
+	unsigned long shed(int work) const;
+	unsigned long modeChanges() const;
+	static const char* modeName(int mode);
+	static const char* className(int work);
+};
@@ -0,0 +1,23 @@
+#include "SendqClass.hpp"
+#include <cstdlib>
+#include <stdexcept>
+
+SendqClass SendqClass::parse(const std::string& value) {
+	const char* p = value.c_str();
+	char* end;
+	unsigned long soft = std::strtoul(p, &end, 10);
+	if (end == p || *end != ',')
+		throw std::runtime_error("sendq classes look like <soft bytes>,<hard bytes>: " + value);
+	p = end + 1;
+	unsigned long hard = std::strtoul(p, &end, 10);
+	if (end == p || *end != '\0')
+		throw std::runtime_error("sendq classes look like <soft bytes>,<hard bytes>: " + value);
+	if (hard != 0 && soft > hard)
+		throw std::runtime_error("sendq class with a soft limit over the hard one: " + value);
+	return SendqClass(soft, hard);
+}
+
+const char* SendqClass::name(int cls) {
+	static const char* const names[SENDQ_CLASSES] = { "user", "oper", "link" };
+	return cls >= 0 && cls < SENDQ_CLASSES ? names[cls] : "?";
+}
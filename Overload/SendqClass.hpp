@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Per-client SendQ limits, by kind of connection (sendq_user, sendq_oper,
+// sendq_link in the config). Over `soft` a client is a slow consumer: it
+// is logged and its WHO/CHATHISTORY are refused until it catches up. Over
+// `hard` it is disconnected with "Max SendQ exceeded". 0 means no limit.
+enum SendqClassId {
+	SENDQ_USER = 0,
+	SENDQ_OPER,
+	SENDQ_LINK,
+	SENDQ_CLASSES
+};
+
+struct SendqClass {
+	size_t	soft;
+	size_t	hard;
+
+	SendqClass() : soft(0), hard(0) {}
+	SendqClass(size_t s, size_t h) : soft(s), hard(h) {}
+
+	// "soft,hard" in bytes. Throws std::runtime_error on anything else.
+	static SendqClass parse(const std::string& value);
+	static const char* name(int cls);
+};
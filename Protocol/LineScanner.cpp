@@ -0,0 +1,155 @@
+#include "LineScanner.hpp"
+#include "ScanKernels.hpp"
+
+namespace {
+
+typedef const char* (*FindSpecial)(const char* p, const char* end);
+
+const FindSpecial KERNELS[SCAN_IMPLS] = {
+	findSpecialScalar,
+#if defined(__x86_64__) || defined(__i386__)
+	findSpecialSse2,
+	findSpecialAvx2
+#else
+	0,
+	0
+#endif
+};
+
+ScanImpl detect() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SCAN_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return SCAN_SSE2;
+#endif
+	return SCAN_SCALAR;
+}
+
+const ScanImpl g_best = detect();
+ScanImpl g_current = g_best;
+FindSpecial g_find = KERNELS[g_best];
+
+const size_t INCOMPLETE = static_cast<size_t>(-1);
+
+// Length of the UTF-8 sequence at p (*p >= 0x80), 0 if it is not valid
+// UTF-8, INCOMPLETE if the buffer ends inside it
+size_t utf8Sequence(const unsigned char* p, const unsigned char* end) {
+	unsigned char c = *p;
+	size_t n;
+	unsigned char lo = 0x80, hi = 0xBF;	// allowed range of the second byte
+	if (c >= 0xC2 && c <= 0xDF)
+		n = 2;
+	else if (c >= 0xE0 && c <= 0xEF) {
+		n = 3;
+		if (c == 0xE0)
+			lo = 0xA0;		// overlong
+		else if (c == 0xED)
+			hi = 0x9F;		// surrogates
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		n = 4;
+		if (c == 0xF0)
+			lo = 0x90;		// overlong
+		else if (c == 0xF4)
+			hi = 0x8F;		// past U+10FFFF
+	} else
+		return 0;
+	for (size_t i = 1; i < n; ++i) {
+		if (p + i == end)
+			return INCOMPLETE;
+		if (p[i] < (i == 1 ? lo : 0x80) || p[i] > (i == 1 ? hi : 0xBF))
+			return 0;
+	}
+	return n;
+}
+
+} // namespace
+
+bool LineScanner::next(const char* data, size_t len, bool bareLf, ScannedLine& line) {
+	const char* p = data;
+	const char* end = data + len;
+	unsigned flags = 0;
+	for (;;) {
+		p = g_find(p, end);
+		if (p == end)
+			return false;
+		unsigned char c = static_cast<unsigned char>(*p);
+		if (c == '\r') {
+			if (p + 1 == end)
+				return false; // the LF is probably in the next read
+			if (p[1] == '\n') {
+				line.length = p - data;
+				line.consumed = p - data + 2;
+				line.flags = flags;
+				return true;
+			}
+			flags |= LINE_STRAY_EOL;
+			++p;
+		} else if (c == '\n') {
+			if (!bareLf)
+				flags |= LINE_STRAY_EOL;
+			line.length = p - data;
+			line.consumed = p - data + 1;
+			line.flags = flags;
+			return true;
+		} else if (c == '\0') {
+			flags |= LINE_NUL;
+			++p;
+		} else {
+			// Non-ASCII text comes in runs: stay here until the run ends
+			do {
+				size_t n = utf8Sequence(reinterpret_cast<const unsigned char*>(p), reinterpret_cast<const unsigned char*>(end));
+				if (n == INCOMPLETE)
+					return false;
+				if (n == 0) {
+					flags |= LINE_BAD_UTF8;
+					n = 1;
+				}
+				p += n;
+			} while (p < end && static_cast<unsigned char>(*p) >= 0x80);
+		}
+	}
+}
+
+bool LineScanner::validUtf8(const char* data, size_t len) {
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+	const unsigned char* end = p + len;
+	while (p < end) {
+		if (*p < 0x80) {
+			++p;
+			continue;
+		}
+		size_t n = utf8Sequence(p, end);
+		if (n == 0 || n == INCOMPLETE)
+			return false;
+		p += n;
+	}
+	return true;
+}
+
+ScanImpl LineScanner::best() {
+	return g_best;
+}
+
+ScanImpl LineScanner::current() {
+	return g_current;
+}
+
+bool LineScanner::select(ScanImpl impl) {
+	if (impl > g_best)
+		return false;
+	g_current = impl;
+	g_find = KERNELS[impl];
+	return true;
+}
+
+const char* LineScanner::name(int impl) {
+	static const char* const names[SCAN_IMPLS] = { "scalar", "sse2", "avx2" };
+	return impl >= 0 && impl < SCAN_IMPLS ? names[impl] : "?";
+}
+
+const char* LineScanner::flagName(int bit) {
+	static const char* const names[LINE_FLAG_BITS] = { "nul", "utf8", "eol" };
+	return bit >= 0 && bit < LINE_FLAG_BITS ? names[bit] : "?";
+}
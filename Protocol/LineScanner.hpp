@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+
+// What is wrong with a line, found while looking for its end
+enum LineFlags {
+	LINE_NUL = 1,			// a NUL byte
+	LINE_BAD_UTF8 = 2,		// bytes >= 0x80 that are not UTF-8
+	LINE_STRAY_EOL = 4,		// a CR not followed by LF, or a bare LF where only CRLF ends a line
+	LINE_FLAG_BITS = 3
+};
+
+struct ScannedLine {
+	size_t		length;		// without the terminator
+	size_t		consumed;	// with it: where the next line starts
+	unsigned	flags;		// LineFlags
+};
+
+enum ScanImpl {
+	SCAN_SCALAR = 0,
+	SCAN_SSE2,
+	SCAN_AVX2,
+	SCAN_IMPLS
+};
+
+// Splits the receive buffer into lines in a single pass: the bytes that
+// need a look (CR, LF, NUL, >= 0x80) are found 16 or 32 at a time with
+// SSE2/AVX2, whichever the CPU has (checked once, at startup), and plain
+// ASCII in between is never touched one byte at a time. Bytes >= 0x80 are
+// checked as UTF-8 on the way (RFC 3629: no overlongs, no surrogates).
+class LineScanner {
+	private:
+	LineScanner();
+
+	public:
+	// True if [data, data + len) starts with a complete line. With `bareLf`
+	// a lone LF ends a line too; without it such a line is flagged.
+	static bool next(const char* data, size_t len, bool bareLf, ScannedLine& line);
+	// The same UTF-8 rules on a piece of a line already split, for when
+	// only part of a flagged line matters
+	static bool validUtf8(const char* data, size_t len);
+
+	static ScanImpl best();				// what this CPU can run
+	static ScanImpl current();
+	static bool select(ScanImpl impl);	// false if the CPU can't (benchmarks)
+	static const char* name(int impl);
+	static const char* flagName(int bit);	// "nul", "utf8", "eol"
+};
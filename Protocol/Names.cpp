@@ -0,0 +1,46 @@
+#include "Names.hpp"
+
+namespace {
+
+enum {
+	BAD_IN_NICK = 1,
+	BAD_IN_CHANNEL = 2
+};
+
+struct NameTable {
+	unsigned char bad[256];
+
+	NameTable() {
+		for (int i = 0; i < 256; ++i)
+			bad[i] = 0;
+		const char* nick = " ,*?!@.";
+		for (const char* c = nick; *c; ++c)
+			bad[static_cast<unsigned char>(*c)] |= BAD_IN_NICK;
+		bad[static_cast<unsigned char>(' ')] |= BAD_IN_CHANNEL;
+		bad[static_cast<unsigned char>(',')] |= BAD_IN_CHANNEL;
+		bad[0x07] |= BAD_IN_CHANNEL;
+	}
+};
+
+const NameTable& table() {
+	static const NameTable t;
+	return t;
+}
+
+bool clean(const std::string& s, size_t from, unsigned char bit) {
+	const unsigned char* bad = table().bad;
+	for (size_t i = from; i < s.size(); ++i)
+		if (bad[static_cast<unsigned char>(s[i])] & bit)
+			return false;
+	return true;
+}
+
+} // namespace
+
+bool Names::validNick(const std::string& nick) {
+	return !nick.empty() && nick.size() <= NICK_MAX && clean(nick, 0, BAD_IN_NICK);
+}
+
+bool Names::validChannel(const std::string& name) {
+	return !name.empty() && name.size() <= CHANNEL_MAX && name[0] == '#' && clean(name, 1, BAD_IN_CHANNEL);
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+
+// Nick and channel name checks: one table lookup per character
+class Names {
+	private:
+	Names();
+
+	public:
+	static const size_t NICK_MAX = 9;
+	static const size_t CHANNEL_MAX = 50;
+
+	// 1 to 9 characters, none of " ,*?!@."
+	static bool validNick(const std::string& nick);
+	// '#' then up to 49 characters, no space, comma or ^G
+	static bool validChannel(const std::string& name);
+};
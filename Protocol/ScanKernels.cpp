@@ -0,0 +1,52 @@
+#include "ScanKernels.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+const char* findSpecialScalar(const char* p, const char* end) {
+	for (; p < end; ++p) {
+		unsigned char c = static_cast<unsigned char>(*p);
+		if (c >= 0x80 || c == '\r' || c == '\n' || c == '\0')
+			break;
+	}
+	return p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The sign bit of each byte (movemask) already says >= 0x80, so only CR,
+// LF and NUL need a compare
+__attribute__((target("sse2")))
+const char* findSpecialSse2(const char* p, const char* end) {
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i nul = _mm_setzero_si128();
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)), _mm_cmpeq_epi8(v, nul));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(hit, v));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+	return findSpecialScalar(p, end);
+}
+
+__attribute__((target("avx2")))
+const char* findSpecialAvx2(const char* p, const char* end) {
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i nul = _mm256_setzero_si256();
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+		__m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)),
+			_mm256_cmpeq_epi8(v, nul));
+		unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(hit, v));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+	return findSpecialSse2(p, end);
+}
+
+#endif
@@ -0,0 +1,9 @@
+#pragma once
+
+// The first byte in [p, end) that is CR, LF, NUL or >= 0x80, or end.
+// Internal to LineScanner; the SIMD ones finish the tail with the scalar one.
+const char* findSpecialScalar(const char* p, const char* end);
+#if defined(__x86_64__) || defined(__i386__)
+const char* findSpecialSse2(const char* p, const char* end);
+const char* findSpecialAvx2(const char* p, const char* end);
+#endif
@@ -1,112 +1,350 @@
 #include "Server.hpp"
-Server::Server(int port, const std::string& password) :
+#include "../Memory/Footprint.hpp"
+#include <fstream>
+#include <cerrno>
+#include <sys/wait.h>
+
+volatile sig_atomic_t Server::_statsDumpRequested = 0;
+volatile sig_atomic_t Server::_stopRequested = 0;
+volatile sig_atomic_t Server::_upgradeRequested = 0;
+
+Server::Server(int port, const std::string& password, const Config& config, Transport& transport) :
     _port(port),
     _password(password),
-    _listeningSocketFd(-1)
+    _listeningSocketFd(-1),
+    _transport(transport),
+    _inputHandled(0),
+    _sendqBytes(0),
+    _config(config),
+    _timers(100, 512),
+    _historyPlaybackMax(100),
+    _nextMsgid(1),
+    _nextBatchId(1),
+    _snapshotIntervalMs(0),
+    _bufferTrimMs(0),
+    _upgradeTimeoutMs(10000),
+    _handedOff(false),
+    _linkRetryMs(5000),
+    _linkCompress(false),
+    _linkCompressLevel(6),
+    _nextRemoteId(-2),
+    _memoryBudget(0),
+    _refusingClients(false),
+    _shedRefused(0),
+    _shedHistoryBytes(0),
+    _shedKills(0),
+    _slowConsumers(0),
+    _slowWarnings(0),
+    _bulkRefused(0),
+    _sendqEvictions(0),
+    _allowBareLf(true),
+    _utf8Only(false),
+    _maxListEntries(5000),
+    _peerWalk(0),
+    _monitorMax(100),
+    _spamDrop(false),
+    _spamFlagged(0),
+    _spamDropped(0)
 {
+    for (int i = 0; i < LINE_FLAG_BITS; ++i)
+        this->_rejectedLines[i] = 0;
+    // Started by a hot upgrade: the listener comes with the old process's state
+    int upgradeSock = Upgrade::inheritedSocket();
+    if (upgradeSock < 0)
+        this->_listeningSocketFd = this->_transport.listen(port);
+
+    signal(SIGUSR1, Server::onStatsSignal);
+    // Ctrl+C / kill: leave the loop so the destructor can save state
+    signal(SIGINT, Server::onStopSignal);
+    signal(SIGTERM, Server::onStopSignal);
+    // A client that hangs up while we write to it must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    // Hand everything over to a new binary
+    signal(SIGUSR2, Server::onUpgradeSignal);
+    this->_upgradeTimeoutMs = _config.getInt("upgrade_timeout_ms", 10000);
+
+    openServices();
+    this->_timers.schedule(TimerWheel::nowMs(), 1000, TIMER_HOUSEKEEPING, -1);
+
+    // Over this the server sheds load instead of waiting for the OOM killer
+    long budget = _config.getInt("memory_budget_bytes", 0);
+    if (budget > 0)
+        this->_memoryBudget = budget;
+    this->_operName = _config.getString("oper_name", "admin");
+    this->_operPassword = _config.getString("oper_password", "");
+
+    // Past these the server sheds expensive and optional work (Overload.hpp)
+    this->_overload.configure(_config.getInt("overload_lag_ms", 500), _config.getInt("overload_sendq_bytes", 64 * 1024 * 1024),
+        _config.getInt("overload_joins_per_sec", 20), _config.getInt("overload_who_max", 50));
+    // What a line may look like (Protocol/LineScanner.hpp)
+    this->_allowBareLf = _config.getInt("allow_bare_lf", 1) != 0;
+    this->_utf8Only = _config.getInt("utf8_only", 0) != 0;
+    LOG_INFO("Line scanning with " << LineScanner::name(LineScanner::current()));
+    // Entries a channel's +b or +e list may hold (Mask/Mask.hpp)
+    this->_maxListEntries = _config.getInt("max_list_entries", 5000);
+    this->_monitorMax = _config.getInt("monitor_max", 100);
+    // Heaviest channels and senders for STATS f, in fixed memory (Stats/Sketch.hpp)
+    this->_stats.configureTalkers(_config.getInt("talkers_width", 2048), _config.getInt("talkers_top", 10),
+        _config.getInt("talkers_halflife", 60));
+    // Copies of one text per window before the rest are flagged (or dropped)
+    this->_spam.configure(_config.getInt("spam_cells", 65536), _config.getInt("spam_threshold", 20),
+        _config.getInt("spam_min_length", 12), _config.getInt("spam_window", 10));
+    this->_spamDrop = _config.getString("spam_action", "flag") == "drop";
+
+    // Per-client SendQ limits, "soft,hard" in bytes for each kind of connection
+    this->_sendqClasses[SENDQ_USER] = SendqClass::parse(_config.getString("sendq_user", "262144,4194304"));
+    this->_sendqClasses[SENDQ_OPER] = SendqClass::parse(_config.getString("sendq_oper", "1048576,16777216"));
+    this->_sendqClasses[SENDQ_LINK] = SendqClass::parse(_config.getString("sendq_link", "0,0"));
+
+    // A client idle for one to two intervals holds no buffers
+    long trim = _config.getInt("buffer_trim_ms", 30000);
+    if (trim > 0) {
+        this->_bufferTrimMs = trim;
+        this->_timers.schedule(TimerWheel::nowMs(), trim, TIMER_BUFFER_TRIM, -1);
+    }
+
+    // Channel history kept for CHATHISTORY
+    this->_historyLimits.channelBytes = _config.getInt("history_channel_bytes", 64 * 1024);
+    this->_historyLimits.totalBytes = _config.getInt("history_total_bytes", 64 * 1024 * 1024);
+    this->_historyLimits.maxLines = _config.getInt("history_lines", 1000);
+    this->_historyPlaybackMax = _config.getInt("history_playback_max", 100);
+
+    // Channels (topic, modes, key, limit) survive restarts through a snapshot
+    this->_snapshotFile = _config.getString("snapshot_file", "");
+    if (!this->_snapshotFile.empty()) {
+        if (upgradeSock < 0)
+            loadSnapshot();
+        long interval = _config.getInt("snapshot_interval_ms", 60000);
+        if (interval > 0) {
+            this->_snapshotIntervalMs = interval;
+            this->_timers.schedule(TimerWheel::nowMs(), interval, TIMER_SNAPSHOT, -1);
+        }
+    }
 
-    this->setupSocket();
-    this->bindSocket();
-    this->startListening();
+    if (upgradeSock >= 0)
+        resumeFrom(upgradeSock);
+
+    // Other servers: we call the ones in link_connect, the rest call us
+    this->_serverName = _config.getString("server_name", "ircserv");
+    this->_serverInfo = _config.getString("server_info", "ft_IRC");
+    this->_linkPassword = _config.getString("link_password", "");
+    this->_linkCompress = _config.getInt("link_compress", 0) != 0;
+    this->_linkCompressLevel = _config.getInt("link_compress_level", 6);
+    std::istringstream targets(_config.getString("link_connect", ""));
+    std::string target;
+    while (std::getline(targets, target, ',')) {
+        size_t colon = target.rfind(':');
+        if (colon == std::string::npos)
+            throw std::runtime_error("link_connect entries must look like 127.0.0.1:6668");
+        LinkTarget t;
+        t.host = target.substr(0, colon);
+        t.port = std::atoi(target.substr(colon + 1).c_str());
+        t.fd = -1;
+        this->_linkTargets.push_back(t);
+    }
+    if (!this->_linkTargets.empty()) {
+        this->_linkRetryMs = _config.getInt("link_retry_ms", 5000);
+        connectLinks();
+        this->_timers.schedule(TimerWheel::nowMs(), this->_linkRetryMs, TIMER_LINK_RETRY, -1);
+    }
 
-    FD_ZERO(&this->_master_set);
-    FD_SET(this->_listeningSocketFd, &this->_master_set);
-    this->_max_fd = this->_listeningSocketFd;
+    // Optional capture of all inbound traffic, for tools/replay
+    if (!_config.getString("trace_file", "").empty()) {
+        this->_trace.open(_config.getString("trace_file", ""));
+        LOG_INFO("Recording client traffic to " << _config.getString("trace_file", ""));
+    }
 
-    std::cout << "The server is running on port: " << _port << std::endl;
+    LOG_INFO("The server is running on port: " << _port);
+    if (upgradeSock >= 0) {
+        // From here on the old process lets go
+        Upgrade::signalReady(upgradeSock);
+        ::close(upgradeSock);
+    }
+}
+
+// Admin endpoint and archive: they own files and ports, so a hot upgrade
+// closes them before the new process opens its own
+void Server::openServices() {
+    // Optional monitoring endpoint, off unless configured
+    this->_admin.open(_config.getString("admin_listen", ""), _config.getString("admin_socket", ""),
+        this->_timers, TIMER_ADMIN_IDLE);
+    if (this->_admin.enabled())
+        LOG_INFO("Serving metrics on " << _config.getString("admin_socket", _config.getString("admin_listen", "")));
+
+    // Optional persistent copy of channel traffic, written by its own thread
+    if (!_config.getString("archive_dir", "").empty()) {
+        this->_archive.open(_config.getString("archive_dir", ""), _config.getInt("archive_fsync_ms", 1000),
+            _config.getInt("archive_queue_bytes", 64 * 1024 * 1024));
+        LOG_INFO("Archiving channel traffic to " << _config.getString("archive_dir", ""));
+    }
 }
 
 
 Server::~Server(){
+    // After a hot upgrade the snapshot is the new process's job
+    if (!this->_snapshotFile.empty() && !this->_handedOff)
+        saveSnapshot(false);
+    this->_archive.close();
 	if (this->_listeningSocketFd != -1) {
-        std::cout << "Closing listening socket fd: " << this->_listeningSocketFd << std::endl;
-        close(this->_listeningSocketFd);
+        LOG_INFO("Closing listening socket fd: " << this->_listeningSocketFd);
+        this->_transport.close(this->_listeningSocketFd);
 	}
 };
 
+void Server::handleNewConnection() {
+    // The listener is non-blocking: take everyone who is waiting, up to a
+    // limit so a connection storm can't starve the clients already here
+    for (int accepted = 0; accepted < 64; ++accepted) {
+        std::string host;
+        int new_socket_fd = this->_transport.accept(this->_listeningSocketFd, host);
+
+        if (new_socket_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_WARN("accept() failed: " << std::strerror(errno));
+            return;
+        }
 
+        if (this->_refusingClients) {
+            // Over the memory budget: say why and close, before any state exists
+            static const std::string full = "ERROR :Closing Link: Server out of memory, try again later\r\n";
+            this->_transport.send(new_socket_fd, full.data(), full.size());
+            this->_transport.close(new_socket_fd);
+            this->_shedRefused++;
+            continue;
+        }
+        LOG_INFO("New connection from " << host << " on socket " << new_socket_fd);
 
-//AF_INET: We're telling it we want to use the IPv4 protocol (e.g., 127.0.0.1).
-//SOCK_STREAM: We're telling it we want a reliable TCP connection (the "phone call").
-//0: We're letting the OS pick the specific protocol, which will be TCP.
-void Server::setupSocket(){
-	this->_listeningSocketFd = socket(AF_INET, SOCK_STREAM, 0);
-	if(this->_listeningSocketFd == -1)
-		throw std::runtime_error("Failed to create socket");
-	int opt = 1; // This value means "enable the option"
-    if (setsockopt(this->_listeningSocketFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) { // we use this funcion to disable the waiting time after the ctrl+c to use the same port and not wait 30 -60 sec
-        throw std::runtime_error("Failed to set socket options");
+        // Create a new Client object and add it to the map
+        this->_clients.insert(std::make_pair(new_socket_fd, Client(new_socket_fd)));
+        this->_stats.recordConnection();
+        this->_trace.onConnect(new_socket_fd);
     }
-};
-
-
+}
 
 
-void Server::bindSocket(){
-	sockaddr_in serverAddress;
-	std::memset(&serverAddress,  0, sizeof(serverAddress) );
-	serverAddress.sin_family = AF_INET;   //we store the address family
-	serverAddress.sin_port = htons(_port);   //we store the port
-	serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-	if (bind(_listeningSocketFd,(sockaddr *)&serverAddress,sizeof(serverAddress)) < 0)
-		throw std::runtime_error("Failed to bind socket"); 
-};
-
-void Server::startListening(){
-	if (listen(_listeningSocketFd,SOMAXCONN)<0)
-	{
-		throw std::runtime_error("Failed to Listen"); 
-	}
-};
-void Server::handleNewConnection() {
-    sockaddr_in client_addr; // A structure to hold the new client's address
-    socklen_t client_len = sizeof(client_addr);
-    int new_socket_fd;
 
-    // 1. Accept the new connection
-    new_socket_fd = accept(this->_listeningSocketFd, (sockaddr *)&client_addr, &client_len);
+void Server::handleClientDisconnect(int clientFd, const std::string& reason, bool toLinks) {
+    ClientMap::iterator it = this->_clients.find(clientFd);
+    if (it == this->_clients.end())
+        return;
+    // The other servers forget the user, or everything behind a lost link
+    if (it->second.hasPlainOutput())
+        compressOutput(clientFd, it->second);
+    if (isLink(clientFd))
+        dropLink(clientFd);
+    else if (it->second.isRegistered()) {
+        std::string quitMsg = ":" + maskOf(clientFd) + " QUIT :" + reason + "\r\n";
+        const std::vector<int>& peers = channelPeers(clientFd);
+        for (size_t i = 0; i < peers.size(); ++i)
+            sendReply(peers[i], quitMsg);
+        if (toLinks)
+            propagate(":" + it->second.getNickname() + " QUIT :" + reason, -1);
+        notifyPresence(it->second.getNickname(), clientFd, false);
+    }
+    this->_monitor.clear(clientFd);
 
-    if (new_socket_fd < 0) {
-        perror("accept() failed");
-        return; 
+    // Last chance for whatever is still queued (e.g. an ERROR or KICK line)
+    while (it->second.pendingOutputSize() > 0) {
+        ssize_t n = this->_transport.send(clientFd, it->second.pendingOutput(), it->second.nextOutputSize());
+        if (n <= 0)
+            break;
+        Stats::sentBytes += n;
+        it->second.consumeOutput(n);
+        this->_sendqBytes -= n;
+    }
+    this->_sendqBytes -= it->second.pendingOutputSize();
+    if (it->second.isSlowConsumer())
+        this->_slowConsumers--;
+    this->_transport.close(clientFd);
+
+    // The fd will be reused by the next client: it must not stay in any channel
+    std::map<int, std::vector<Channel*> >::iterator joined = this->_joined.find(clientFd);
+    if (joined != this->_joined.end()) {
+        for (size_t i = 0; i < joined->second.size(); ++i)
+            joined->second[i]->part(clientFd, "");
+        this->_joined.erase(joined);
     }
 
-    // Optional: Print the new client's IP address maybe later we will delete it
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
-    std::cout << "New connection from " << client_ip << " on socket " << new_socket_fd << std::endl;
+    this->_clients.erase(it);
+    this->_trace.onDisconnect(clientFd);
 
-    // 2. Add the new socket to our master_set
-    FD_SET(new_socket_fd, &this->_master_set);
+    LOG_INFO("Client " << clientFd << " has been disconnected and cleaned up.");
+}
 
-    // 3. Update the maximum file descriptor
-    if (new_socket_fd > this->_max_fd) {
-        this->_max_fd = new_socket_fd;
+void Server::processCommand(int clientFd, const std::string& rawCommand, size_t wireBytes) {
+    LOG_DEBUG("fd " << clientFd << " -> " << rawCommand);
+    if (isLink(clientFd)) {
+        // Server traffic is accounted as a whole, not per verb
+        unsigned long queuedBefore = Stats::queuedBytes;
+        unsigned long start = Stats::nowNs();
+        handleLinkLine(clientFd, rawCommand);
+        static const std::string link("LINK");
+        this->_stats.recordCommand(link, rawCommand.length() + 2, Stats::queuedBytes - queuedBefore, Stats::nowNs() - start);
+        return;
+    }
+    // Parsed into the same Command every time, to keep its buffers
+    Command& cmd = this->_parsed;
+    cmd.parse(rawCommand);
+    if (this->_overload.mode() != LOAD_NORMAL && !admitCommand(clientFd, cmd))
+        return;
+    // A slow consumer gets no bulk replies until it has caught up
+    if (this->_slowConsumers > 0 && OverloadControl::classify(cmd.getCommand()) == WORK_QUERY
+        && this->_clients.find(clientFd)->second.isSlowConsumer()) {
+        this->_bulkRefused++;
+        tryAgain(clientFd, cmd);
+        return;
     }
 
-    // 4. Create a new Client object and add it to the map
-    this->_clients.insert(std::make_pair(new_socket_fd, Client(new_socket_fd)));
+    // Instrumentation: two clock reads and one map lookup per command.
+    // Unknown verbs are folded together so clients cannot grow the table.
+    unsigned long queuedBefore = Stats::queuedBytes;
+    unsigned long start = Stats::nowNs();
+    bool known = executeCommand(clientFd, cmd);
+    unsigned long elapsed = Stats::nowNs() - start;
+    static const std::string unknown("UNKNOWN");
+    this->_stats.recordCommand(known ? cmd.getCommand() : unknown, wireBytes,
+        Stats::queuedBytes - queuedBefore, elapsed);
 }
 
-
-
-void Server::handleClientDisconnect(int clientFd) {
-    close(clientFd);
-
-    FD_CLR(clientFd, &this->_master_set);
-
-    this->_clients.erase(clientFd);
-
-    std::cout << "Client " << clientFd << " has been disconnected and cleaned up." << std::endl;
+// Under overload: false when the command is shed, after telling the client
+// to come back later if its class gets a reply.
+bool Server::admitCommand(int clientFd, const Command& cmd) {
+    WorkClass work = OverloadControl::classify(cmd.getCommand());
+    size_t cost = 1;
+    if ((work == WORK_QUERY || work == WORK_NOTICE) && !cmd.getParams().empty()) {
+        Channel* channel = findChannelByName(_Channels, cmd.getParams()[0]);
+        if (channel != NULL)
+            cost = channel->get_members().size();
+    }
+    Admission verdict = this->_overload.admit(work, cost, TimerWheel::nowMs());
+    if (verdict == ADMIT)
+        return true;
+    if (verdict == ADMIT_LATER)
+        tryAgain(clientFd, cmd);
+    return false;
 }
 
-void Server::processCommand(int clientFd, const std::string& rawCommand) {
-    Command cmd(rawCommand);
+// RPL_TRYAGAIN
+void Server::tryAgain(int clientFd, const Command& cmd) {
+    const std::string& nick = this->_clients.find(clientFd)->second.getNickname();
+    reply(clientFd, ":ircserv 263 " + (nick.empty() ? std::string("*") : nick) + " " + cmd.getCommand()
+        + " :Server load is temporarily too heavy. Please wait a while and try again.\r\n");
+}
 
-    executeCommand(clientFd, cmd);
+void Server::checkOverload() {
+    unsigned long lag = this->_stats.loopLagNs();
+    if (!this->_overload.update(lag, this->_sendqBytes))
+        return;
+    LoadMode mode = this->_overload.mode();
+    if (mode == LOAD_NORMAL)
+        LOG_INFO("Load back to normal");
+    else
+        LOG_WARN("Load " << OverloadControl::modeName(mode) << ": loop lag " << lag / 1000000 << " ms, SendQ "
+            << this->_sendqBytes << " bytes");
 }
 
-void Server::executeCommand(int clientFd, const Command& cmd) {
+// Returns false when the verb is not one we know about.
+bool Server::executeCommand(int clientFd, const Command& cmd) {
     const std::string& command = cmd.getCommand();
 
     if (command == "PASS") {
@@ -133,15 +371,33 @@ void Server::executeCommand(int clientFd, const Command& cmd) {
 	 else if (command == "WHO") {
 		handleWho(clientFd, cmd);
 	}
+     else if (command == "MONITOR") {
+        handleMonitor(clientFd, cmd);
+    }
      else if (command == "QUIT") {
         handleQuit(clientFd, cmd);
     }
      else if (command == "PING") {
         handlePing(clientFd, cmd);
+    }
+     else if (command == "STATS") {
+        handleStats(clientFd, cmd);
+    }
+     else if (command == "CHATHISTORY") {
+        handleChathistory(clientFd, cmd);
+    }
+     else if (command == "SERVER") {
+        handleServer(clientFd, cmd);
+    }
+     else if (command == "CAPAB") {
+        handleCapab(clientFd, cmd);
+    }
+     else if (command == "OPER") {
+        handleOper(clientFd, cmd);
     }
     else {
         // Find the client who sent the command
-        std::map<int, Client>::iterator it = this->_clients.find(clientFd);
+        ClientMap::iterator it = this->_clients.find(clientFd);
         if (it != this->_clients.end()) {
             // Get the client's nickname (or a default if not set)
             std::string nick = it->second.getNickname().empty() ? "*" : it->second.getNickname();
@@ -150,21 +406,35 @@ void Server::executeCommand(int clientFd, const Command& cmd) {
             std::string errorMsg = ":ircserv 421 " + nick + " " + command + " :Unknown command\r\n";
             
             // Send the message back to the client
-            send(clientFd, errorMsg.c_str(), errorMsg.length(), 0);
+            reply(clientFd, errorMsg);
         }
+        return false;
     }
+    return true;
+}
+
+// The trailing parameter is the text people write (messages, topics,
+// reasons); commands, nicks and channel names are up to their handlers
+static bool trailingIsUtf8(const std::string& line)
+{
+    size_t colon = line.find(" :");
+    if (colon == std::string::npos)
+        return true;
+    return LineScanner::validUtf8(line.data() + colon + 2, line.size() - colon - 2);
 }
 
 void Server::handleClientData(int clientFd) {
-    // Safety check, although the loop in run() should prevent this
+    // Safety check, although the loop in pollOnce() should prevent this
     if (this->_clients.find(clientFd) == this->_clients.end()) return;
     
     Client& client = this->_clients.find(clientFd)->second;
     char    buffer[512];
 
 
-    ssize_t bytes_received = recv(clientFd, buffer, sizeof(buffer) - 1, 0);
+    ssize_t bytes_received = this->_transport.recv(clientFd, buffer, sizeof(buffer) - 1);
 
+    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
     if (bytes_received <= 0) {
         handleClientDisconnect(clientFd);
         return;
@@ -172,50 +442,161 @@ void Server::handleClientData(int clientFd) {
     
     buffer[bytes_received] = '\0';
     
-    client.appendBuffer(std::string(buffer));
+    if (!this->_links.empty() && isLink(clientFd)) {
+        // Server links may be compressed, and then carry any byte
+        std::string data;
+        if (!inflateInput(clientFd, buffer, bytes_received, data)) {
+            LOG_WARN("Corrupt compressed data on server link " << clientFd);
+            handleClientDisconnect(clientFd, "Corrupt compressed data");
+            return;
+        }
+        client.appendBuffer(data);
+    } else
+        client.appendBuffer(buffer, bytes_received);
+    this->_stats.noteRecvQueue(client.getBuffer().size());
 
 
     // --- The processing loop ---
+    // The lines are only cut off the front of the buffer once all of them
+    // are done, not one erase per line
     std::string& clientBuffer = client.getBuffer();
-    size_t pos;
-    while ((pos = clientBuffer.find("\r\n")) != std::string::npos) {
-        std::string command_line = clientBuffer.substr(0, pos);
-        clientBuffer.erase(0, pos + 2);
-
+    std::string& command_line = this->_lineScratch;
+    size_t start = 0;
+    ScannedLine line;
+    while (LineScanner::next(clientBuffer.data() + start, clientBuffer.size() - start, this->_allowBareLf, line)) {
+        command_line.assign(clientBuffer, start, line.length);
+        start += line.consumed;
+        // A SERVER line may turn the rest of the buffer into a zlib stream:
+        // startZip() only inflates what is past this
+        this->_inputHandled = start;
+
+        if (line.flags) {
+            unsigned bad = line.flags;
+            // Only the trailing parameter has to be UTF-8, and other
+            // servers check their own users' text
+            if ((bad & LINE_BAD_UTF8) && (!this->_utf8Only || (!this->_links.empty() && isLink(clientFd))
+                    || trailingIsUtf8(command_line)))
+                bad &= ~LINE_BAD_UTF8;
+            if (bad) {
+                rejectLine(clientFd, command_line, bad);
+                continue;
+            }
+        }
         if (!command_line.empty()) {
-            processCommand(clientFd, command_line);
+            this->_trace.onLine(clientFd, command_line);
+            processCommand(clientFd, command_line, line.consumed);
+            // QUIT (or an error) may have destroyed the client and its buffer
+            if (this->_clients.find(clientFd) == this->_clients.end())
+                return;
         }
     }
+    clientBuffer.erase(0, start);
+}
+
+// A line with a NUL, a stray CR/LF or (with utf8_only) a trailing parameter
+// that is not UTF-8 never reaches a handler: passed on, it could split into two lines
+// at the next client or server
+void Server::rejectLine(int clientFd, const std::string& line, unsigned flags)
+{
+    for (int i = 0; i < LINE_FLAG_BITS; ++i)
+        if (flags & (1U << i))
+            this->_rejectedLines[i]++;
+    LOG_DEBUG("fd " << clientFd << " sent a malformed line (flags " << flags << ")");
+    if (flags == LINE_BAD_UTF8) {
+        // IRCv3 standard reply, the way UTF8ONLY networks refuse it
+        this->_parsed.parse(line);
+        reply(clientFd, "FAIL " + (this->_parsed.getCommand().empty() ? std::string("*") : this->_parsed.getCommand())
+            + " INVALID_UTF8 :Message rejected, your message contained invalid UTF-8\r\n");
+    }
 }
 
 
 void Server::run() {
-    while (true) {
-        fd_set working_set = this->_master_set;
+    while (this->pollOnce(-1))
+        ;
+}
 
-        int activity = select(this->_max_fd + 1, &working_set, NULL, NULL, NULL);
+bool Server::pollOnce(int maxWaitMs) {
+    if (_stopRequested)
+        return false;
+    // Reused from turn to turn: its capacity follows the peak client count
+    std::vector<pollfd>& fds = this->_pollFds;
+    fds.clear();
+    fds.reserve(this->_clients.size() + 1 + AdminServer::MAX_CONNECTIONS + 1);
+
+    pollfd pfd;
+    pfd.fd = this->_listeningSocketFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    fds.push_back(pfd);
+    for (ClientMap::const_iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
+        pfd.fd = it->first;
+        // Only ask for POLLOUT while something is waiting, or poll() never sleeps
+        pfd.events = POLLIN | (it->second.pendingOutputSize() > 0 ? POLLOUT : 0);
+        fds.push_back(pfd);
+    }
+    size_t clientEnd = fds.size();
+    this->_admin.addPollFds(fds);
 
-        if (activity < 0) {
-            perror("select() failed");
-            break;
-        }
+    // Sleep until the next timer at most (and never more than a second)
+    int waitMs = (int)this->_timers.nextTimeoutMs(TimerWheel::nowMs(), 1000);
+    if (maxWaitMs >= 0 && maxWaitMs < waitMs)
+        waitMs = maxWaitMs;
 
+    int activity = this->_transport.poll(fds, waitMs);
 
-        for (int i = 0; i <= this->_max_fd; ++i) {
-            if (FD_ISSET(i, &working_set)) {
-                if (i == this->_listeningSocketFd) {
-                    handleNewConnection();
-                }
-                else {
-                    handleClientData(i);
-                }
-            }
+    if (activity < 0) {
+        if (errno != EINTR) {
+            LOG_ERROR("poll() failed: " << std::strerror(errno));
+            return false;
+        }
+        // A signal (SIGUSR1) woke us up: not an error
+        for (size_t i = 0; i < fds.size(); ++i)
+            fds[i].revents = 0;
+    }
+    if (_stopRequested) {
+        LOG_INFO("Shutting down");
+        return false;
+    }
+    this->_stats.loopIteration();
+    if (_statsDumpRequested) {
+        _statsDumpRequested = 0;
+        dumpStats(_config.getString("stats_dump_file", "ircserv.stats"));
+    }
+    if (_upgradeRequested) {
+        _upgradeRequested = 0;
+        // Checked before reading anything: the new process picks up
+        // whatever is waiting in the sockets
+        if (handOff())
+            return false;
+    }
+
+    std::vector<TimerEvent> expired;
+    this->_timers.advance(TimerWheel::nowMs(), expired);
+    for (size_t i = 0; i < expired.size(); ++i)
+        onTimer(expired[i]);
+    this->_admin.process(fds, *this);
+
+    for (size_t i = 0; i < clientEnd; ++i) {
+        if (fds[i].revents == 0)
+            continue;
+        if (fds[i].fd == this->_listeningSocketFd) {
+            handleNewConnection();
+            continue;
         }
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            handleClientData(fds[i].fd);
+        if ((fds[i].revents & POLLOUT) && this->_clients.find(fds[i].fd) != this->_clients.end())
+            flushClient(fds[i].fd);
     }
+
+    // Everything the handlers queued goes out now, one send() per client
+    flushPending();
+    return true;
 }
 void Server::handlePass(int clientFd, const Command& cmd) {
     // Find the client in the map
-    std::map<int, Client>::iterator it = this->_clients.find(clientFd);
+    ClientMap::iterator it = this->_clients.find(clientFd);
     if (it == this->_clients.end()) {
         return; // Safety check
     }
@@ -243,7 +624,7 @@ void Server::handlePass(int clientFd, const Command& cmd) {
     if (cmd.getParams()[0] == this->_password) {
         // Correct password.
         client.setAuthenticated(true);
-        std::cout << "Client " << clientFd << " authenticated successfully." << std::endl;
+        LOG_INFO("Client " << clientFd << " authenticated successfully.");
     } else {
         // Incorrect password
         reply(clientFd, ":ircserv 464 " + (client.getNickname().empty() ? "*" : client.getNickname()) + " :Password incorrect\r\n");
@@ -268,13 +649,17 @@ void Server::handleNick(int clientFd, const Command& cmd) {
     const std::string& newNick = cmd.getParams()[0];
 
     // Check 3: Basic nickname validation 
-    if (newNick.empty() || newNick.length() > 9 || newNick.find_first_of(" ,*?!@.") != std::string::npos) {
+    if (!Names::validNick(newNick)) {
         reply(clientFd, ":ircserv 432 " + (client.getNickname().empty() ? "*" : client.getNickname()) + " " + newNick + " :Erroneous nickname\r\n");
         return;
     }
 
-    // Check 4: Check if nickname is already in use
-    for (std::map<int, Client>::iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
+    // Check 4: Check if nickname is already in use (here or on another server)
+    if (this->_remoteNicks.count(newNick)) {
+        reply(clientFd, ":ircserv 433 " + (client.getNickname().empty() ? "*" : client.getNickname()) + " " + newNick + " :Nickname is already in use\r\n");
+        return;
+    }
+    for (ClientMap::iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
         if (it->second.getNickname() == newNick) {
             reply(clientFd, ":ircserv 433 " + (client.getNickname().empty() ? "*" : client.getNickname()) + " " + newNick + " :Nickname is already in use\r\n");
             return;
@@ -282,8 +667,22 @@ void Server::handleNick(int clientFd, const Command& cmd) {
     }
 
     // If all checks pass, set the nickname
-    std::cout << "Client " << clientFd << " changed nickname to " << newNick << std::endl;
+    LOG_INFO("Client " << clientFd << " changed nickname to " << newNick);
+    std::string oldNick = client.getNickname();
+    if (client.isRegistered()) {
+        // The user and everyone sharing a channel with them, once each
+        std::string nickMsg = ":" + maskOf(clientFd) + " NICK :" + newNick + "\r\n";
+        sendReply(clientFd, nickMsg);
+        const std::vector<int>& peers = channelPeers(clientFd);
+        for (size_t i = 0; i < peers.size(); ++i)
+            sendReply(peers[i], nickMsg);
+        propagate(":" + oldNick + " NICK " + newNick, -1);
+    }
     client.setNickname(newNick);
+    if (client.isRegistered()) {
+        notifyPresence(oldNick, clientFd, false);
+        notifyPresence(newNick, clientFd, true);
+    }
     // Note: We will add the logic to check for full registration and send welcome messages after USER is also implemented.
 }
 
@@ -324,15 +723,113 @@ void Server::handleUser(int clientFd, const Command& cmd) {
     reply(clientFd, ":ircserv 002 " + client.getNickname() + " :Your host is ircserv, running version 1.0\r\n");
     reply(clientFd, ":ircserv 003 " + client.getNickname() + " :This server was created some time ago\r\n");
     reply(clientFd, ":ircserv 004 " + client.getNickname() + " :ircserv 1.0 - -\r\n");
+    std::ostringstream isupport;
+    isupport << ":ircserv 005 " << client.getNickname() << " CHATHISTORY=" << this->_historyPlaybackMax
+             << " MONITOR=" << this->_monitorMax << " :are supported by this server\r\n";
+    reply(clientFd, isupport.str());
     reply(clientFd, ":ircserv 004 " + client.getUsername() + " this is username");
     reply(clientFd, ":ircserv 004 " + client.getRealname() + " this is realname\n");
 
 
-    std::cout << "Client " << clientFd << " (" << client.getNickname() << ") is now fully registered." << std::endl;
+    LOG_INFO("Client " << clientFd << " (" << client.getNickname() << ") is now fully registered.");
+    introduceLocal(clientFd);
+    notifyPresence(client.getNickname(), clientFd, true);
 }
 
 void Server::reply(int clientFd, const std::string& message) {
-    send(clientFd, message.c_str(), message.length(), 0);
+    sendReply(clientFd, message);
+}
+
+// Keeps a copy of a channel event for CHATHISTORY and the archive. msg ends with CRLF.
+void Server::recordHistory(Channel& ch, const std::string& msg)
+{
+    size_t len = msg.size();
+    while (len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == '\r'))
+        len--;
+    unsigned long now = HistoryRing::nowMs();
+    ch.get_history().append(msg.data(), len, this->_nextMsgid++, now, this->_historyLimits);
+    if (this->_archive.enabled())
+        this->_archive.append(ch.get_name(), now, msg.substr(0, len));
+}
+
+void Server::sendReply(int clientFd, const std::string &msg)
+{
+    queueReply(clientFd, msg, false);
+}
+
+// Control lines (PONG, ERROR): written before the bulk already queued
+void Server::sendUrgent(int clientFd, const std::string &msg)
+{
+    queueReply(clientFd, msg, true);
+}
+
+void Server::queueReply(int clientFd, const std::string &msg, bool urgent)
+{
+    ClientMap::iterator it = this->_clients.find(clientFd);
+    if (it == this->_clients.end())
+        return; // nobody there (search_fd_name() returns 0 for an unknown nick)
+    Client& client = it->second;
+    if (client.isEvicting())
+        return;
+    size_t hard = sendqLimits(clientFd, client).hard;
+    if (hard > 0 && client.pendingOutputSize() + msg.length() > hard) {
+        // Dropped once this turn is over (evictSlowConsumers)
+        client.setEvicting(true);
+        this->_evictList.push_back(clientFd);
+        return;
+    }
+
+    if (urgent)
+        client.queueUrgent(msg);
+    else
+        client.queueOutput(msg);
+    this->_sendqBytes += msg.length();
+    Stats::queuedBytes += msg.length();
+    if (!client.isFlushScheduled()) {
+        client.setFlushScheduled(true);
+        this->_flushList.push_back(clientFd);
+    }
+}
+
+// Writes as much of the client's SendQ as the socket takes. Returns false if
+// the client had to be dropped.
+bool Server::flushClient(int clientFd)
+{
+    Client& client = this->_clients.find(clientFd)->second;
+    // Compressed link: one zlib flush for everything queued since the last one
+    if (client.hasPlainOutput())
+        compressOutput(clientFd, client);
+    while (client.pendingOutputSize() > 0) {
+        ssize_t n = this->_transport.send(clientFd, client.pendingOutput(), client.nextOutputSize());
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true; // socket full: POLLOUT will tell us when to go on
+            LOG_WARN("Error enviando mensaje al cliente FD: " << clientFd << ": " << std::strerror(errno));
+            handleClientDisconnect(clientFd);
+            return false;
+        }
+        client.consumeOutput(n);
+        this->_sendqBytes -= n;
+        Stats::sentBytes += n;
+    }
+    return true;
+}
+
+void Server::flushPending()
+{
+    if (!this->_evictList.empty())
+        evictSlowConsumers();
+    std::vector<int> pending;
+    pending.swap(this->_flushList);
+    for (size_t i = 0; i < pending.size(); ++i) {
+        ClientMap::iterator it = this->_clients.find(pending[i]);
+        if (it == this->_clients.end())
+            continue;
+        it->second.setFlushScheduled(false);
+        flushClient(pending[i]);
+    }
 }
 
 void Server::handleJoin(int clientFd, const Command& cmd)
@@ -350,99 +847,31 @@ void Server::handleJoin(int clientFd, const Command& cmd)
 		new_join(cmd.getParams()[0], clientFd);
 		return ;
 	}
+	Channel* ch = findChannelByName(_Channels, cmd.getParams()[0]);
+	const std::string& nick = _clients[clientFd].getNickname();
+	std::string key = cmd.getParams().size() > 1 ? cmd.getParams()[1] : "";
+	err = ch->can_join(clientFd, _clients[clientFd], key);
+	if (err == ERR_USER_ON_CHANNEL)
+		sendReply(clientFd, ":ircserv 443 " + nick + " " + nick + " " + ch->get_name() + " :is already on channel\r\n");
+	else if (err == ERR_BANNED_FROM_CHAN)
+		sendReply(clientFd, ":ircserv 474 " + nick + " " + ch->get_name() + " :Cannot join channel (+b)\r\n");
+	else if (err == ERR_BAD_CHANNEL_KEY)
+		sendReply(clientFd, ":ircserv 475 " + nick + " " + ch->get_name() + " :Cannot join channel (+k)\r\n");
+	else if (err == ERR_CHANNEL_IS_FULL)
+		sendReply(clientFd, ":ircserv 471 " + nick + " " + ch->get_name() + " :Cannot join channel (+l)\r\n");
+	else if (err == ERR_INVITE_ONLY_CHAN)
+		sendReply(clientFd, ":ircserv 473 " + nick + " " + ch->get_name() + " :Cannot join channel (+i)\r\n");
 	else
 	{
-		Channel* ch = findChannelByName(_Channels, cmd.getParams()[0]);
-		const std::vector<int>& members = ch->get_members();
-		std::vector<int>::const_iterator it = std::find(members.begin(), members.end(), clientFd);
-		if (it != members.end())
-		{
-			sendReply(clientFd, ":ircserv 443 " + _clients[clientFd].getNickname() + " " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :is already on channel\r\n");
-			return ;
-		}
-		if (ch->get_modes()[1] == 0)
-		{
-			if (ch->get_modes()[2] < (int)ch->get_members().size())
-			{
-				// CHECK INVITATION MODE
-				if (ch->get_modes()[0] == 0)
-				{
-					ch->add_member(clientFd, 1);
-					sendJoinMessages(*ch, clientFd);
-				}
-				else
-				{
-					std::vector<int>::iterator it = std::find(ch->get_invite_list().begin(), ch->get_invite_list().end(), clientFd);
-					if (it != ch->get_invite_list().end())
-					{
-						ch->add_member(clientFd, 1);
-						sendJoinMessages(*ch, clientFd);
-					}
-					else
-					{
-						sendReply(clientFd, ":ircserv 473 " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :Cannot join channel (+i)\r\n");
-						return ;
-					}
-				}
-			}
-			else
-			{
-				sendReply(clientFd, ":ircserv 471 " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :Cannot join channel (+l)\r\n");
-				return ;
-			}
-		}
-		else
-		{
-			if (ch->get_modes()[1] == 1 && cmd.getParams().size() < 2)
-			{
-				sendReply(clientFd, ":ircserv 475 " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :Cannot join channel (+k)\r\n");
-				return ;
-			}
-			// YOU need a password
-			if (cmd.getParams()[1] == ch->get_password() && ch->get_modes()[1] == 1)
-			{
-				// check limit 
-				if (ch->get_modes()[2] < (int)ch->get_members().size())
-				{
-					// CHECK INVITATION MODE
-					if (ch->get_modes()[0] == 0)
-					{
-						ch->add_member(clientFd, 1);
-						sendJoinMessages(*ch, clientFd);
-					}
-					else
-					{
-						std::vector<int>::iterator it = std::find(ch->get_invite_list().begin(), ch->get_invite_list().end(), clientFd);
-						if (it != ch->get_invite_list().end())
-						{
-							ch->add_member(clientFd, 1);
-							sendJoinMessages(*ch, clientFd);
-						}
-						else
-						{
-							sendReply(clientFd, ":ircserv 473 " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :Cannot join channel (+i)\r\n");
-							return ;
-						}
-					}
-				}
-				else
-				{
-					sendReply(clientFd, ":ircserv 471 " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :Cannot join channel (+l)\r\n");
-					return ;
-				}
-			}
-			else	
-			{
-				sendReply(clientFd, ":ircserv 475 " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :Cannot join channel (+k)\r\n");
-				return ;
-			}
-		}
+		ch->add_member(clientFd, 1);
+		trackJoin(*ch, clientFd);
+		sendJoinMessages(*ch, clientFd);
 	}
 }
 
-Channel* Server::findChannelByName(std::vector<Channel>& channels,const std::string& name)
+Channel* Server::findChannelByName(ChannelList& channels,const std::string& name)
 {
-    for (std::vector<Channel>::iterator it = channels.begin(); it != channels.end(); ++it)
+    for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
 	{
         if (it->get_name() == name)
 			return &(*it);
@@ -450,9 +879,9 @@ Channel* Server::findChannelByName(std::vector<Channel>& channels,const std::str
 	return NULL;
 }
 
-bool Server::findChannelByName_b(std::vector<Channel>& channels,const std::string& name)
+bool Server::findChannelByName_b(ChannelList& channels,const std::string& name)
 {
-    for (std::vector<Channel>::iterator it = channels.begin(); it != channels.end(); ++it)
+    for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
 	{
         if (it->get_name() == name)
 			return 1;
@@ -464,7 +893,7 @@ void Server::sendJoinMessages(Channel& ch, int clientFd)
 {
     std::string nick;
     std::string user;
-    std::map<int, Client>::iterator it = _clients.find(clientFd);
+    ClientMap::iterator it = _clients.find(clientFd);
     if (it != _clients.end())
 	{
         nick = it->second.getNickname();
@@ -472,11 +901,9 @@ void Server::sendJoinMessages(Channel& ch, int clientFd)
     }
     // Mensaje JOIN a todos los miembros (incluido el nuevo)
     std::string joinMsg = ":" + nick + "!" + user + "@localhost JOIN :" + ch.get_name() + "\r\n";
+    broadcastToChannel(ch, joinMsg, -1);
+    propagate(":" + nick + " JOIN " + ch.get_name(), -1);
     const std::vector<int>& members = ch.get_members();
-    for (size_t i = 0; i < members.size(); ++i)
-	{
-        sendReply(members[i], joinMsg);
-    }
     // Enviar topic actual o "No topic set" al cliente que entra
     if (ch.get_topic().empty()) {
         sendReply(clientFd, ":ircserv 331 " + nick + " " + ch.get_name() + " :No topic is set\r\n");
@@ -491,7 +918,7 @@ void Server::sendJoinMessages(Channel& ch, int clientFd)
         std::string prefix = "";
         if (ch.isOperator(memberFd))
             prefix = "@";
-        nameList += prefix + _clients[memberFd].getNickname() + " ";
+        nameList += prefix + nickOf(memberFd) + " ";
     }
     if (!nameList.empty())
         nameList.erase(nameList.size() - 1);
@@ -503,6 +930,7 @@ void Server::new_join(std::string channel, int cl)
 {
 		Channel ch(channel, cl);
 		_Channels.push_back(ch);
+		trackJoin(_Channels.back(), cl);
 		sendJoinMessages(ch, cl);
 }
 
@@ -550,9 +978,9 @@ void Server::handleTopic(int clientFd, const Command& cmd)
 	}
     std::string topicMsg = ":" + nick + "!" + user + "@" + host + " TOPIC " + ch->get_name() + " " + new_topic + "\r\n";
 	// envio a todos los del canal
-    const std::vector<int>& members = ch->get_members();
-	for (size_t i = 0; i < members.size(); ++i)
-		sendReply(members[i], topicMsg);
+	broadcastToChannel(*ch, topicMsg, -1);
+	recordHistory(*ch, topicMsg);
+	propagate(":" + nick + " TOPIC " + ch->get_name() + " :" + new_topic, -1);
 	return ;
 }
 
@@ -578,12 +1006,15 @@ void Server::handlePart(int clientFd, const Command& cmd)
     std::string host = "localhost";
     std::string partMsg = ":" + nick + "!" + user + "@" + host + " PART " + ch->get_name() + " " + reason + "\r\n";
 	// Envio a todos los del canal
-    const std::vector<int>& members = ch->get_members();
-    for (size_t i = 0; i < members.size(); ++i)
-		sendReply(members[i], partMsg);
+	broadcastToChannel(*ch, partMsg, -1);
 	ChannelError err = ch->part(clientFd, reason);
 	if (err == ERR_USER_NOT_IN_CHANNEL)
 		sendReply(clientFd, ":ircserv 442 " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :You're not on that channel\r\n");
+	else
+	{
+		trackPart(*ch, clientFd);
+		propagate(":" + nick + " PART " + ch->get_name() + " :" + reason, -1);
+	}
 }
 
 void Server::handleKick(int clientFd, const Command& cmd)
@@ -611,7 +1042,7 @@ void Server::handleKick(int clientFd, const Command& cmd)
 	if (cmd.getParams().size() == 3)
 		reason = cmd.getParams()[2];
     std::string nick, user, host = "localhost";
-    std::map<int, Client>::iterator it = _clients.find(clientFd);
+    ClientMap::iterator it = _clients.find(clientFd);
     if (it != _clients.end())
     {
         nick = it->second.getNickname();
@@ -622,7 +1053,7 @@ void Server::handleKick(int clientFd, const Command& cmd)
         nick = "*";
         user = "*";
     }
-    std::string kickMsg = ":" + nick + "!" + user + "@" + host + " KICK " + ch->get_name() + " " + _clients[search_fd_name(cmd.getParams()[1])].getNickname();
+    std::string kickMsg = ":" + nick + "!" + user + "@" + host + " KICK " + ch->get_name() + " " + nickOf(search_fd_name(cmd.getParams()[1]));
     if (!reason.empty())
 	{
 		kickMsg += " :";
@@ -636,10 +1067,12 @@ void Server::handleKick(int clientFd, const Command& cmd)
 		sendReply(clientFd, ":ircserv 482 " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :You're not channel operator\r\n");
 		return ;
 	}
-    const std::vector<int>& members = ch->get_members();
-	for (size_t i = 0; i < members.size(); ++i)
-		sendReply(members[i], kickMsg);
+	trackPart(*ch, search_fd_name(cmd.getParams()[1]));
+	broadcastToChannel(*ch, kickMsg, -1);
 	sendReply(search_fd_name(cmd.getParams()[1]), kickMsg);
+	if (search_fd_name(cmd.getParams()[1]) < 0)
+		noteRemotePart(ch->get_name(), search_fd_name(cmd.getParams()[1]));
+	propagate(":" + nick + " KICK " + ch->get_name() + " " + cmd.getParams()[1] + " :" + reason, -1);
 }
 
 void Server::handleInvite(int clientFd, const Command& cmd)
@@ -670,20 +1103,19 @@ void Server::handleInvite(int clientFd, const Command& cmd)
 		return ;
 	}
     std::string inviterNick = _clients[clientFd].getNickname();
-    std::string targetNick = _clients[search_fd_name(cmd.getParams()[0])].getNickname();
+    std::string targetNick = nickOf(search_fd_name(cmd.getParams()[0]));
     std::string channelName = ch->get_name();
     // Enviar mensaje al nick invitado
     std::string inviteMsg = ":" + inviterNick + "!" + _clients[clientFd].getUsername() + "@localhost INVITE " + targetNick + " :" + channelName + "\r\n";
-    sendReply(search_fd_name(cmd.getParams()[0]), inviteMsg);
+    routeToUser(search_fd_name(cmd.getParams()[0]), inviteMsg, ":" + inviterNick + " INVITE " + targetNick + " " + channelName);
     // Enviar mensaje de confirmacion al que manda el mensaje
     std::string confirmMsg = ":ircserv 341 " + inviterNick + " " + targetNick + " " + channelName + "\r\n";
     sendReply(clientFd, confirmMsg);
 }
 void Server::handleQuit(int clientFd, const Command& cmd) {
-    (void)cmd;
-    std::cout << "Client " << clientFd << " sent QUIT command. Disconnecting." << std::endl;
+    LOG_INFO("Client " << clientFd << " sent QUIT command. Disconnecting.");
     
-    handleClientDisconnect(clientFd);
+    handleClientDisconnect(clientFd, cmd.getParams().empty() ? "Quit" : "Quit: " + cmd.getParams()[0]);
 }
 
 void Server::handleModeQuery(int clientFd, const Command& cmd)
@@ -743,7 +1175,7 @@ void Server::handleMode(int clientFd, const Command& cmd)
             int cc = search_fd_name(cmd.getParams()[0]);
             if (cc != 0)
             {
-                std::map<int, Client>::iterator ite = _clients.find(clientFd);
+                ClientMap::iterator ite = _clients.find(clientFd);
                 if (ite != _clients.end())
                 {
                     // Aquí asumo que +i significa modo invisible para usuario
@@ -765,6 +1197,10 @@ void Server::handleMode(int clientFd, const Command& cmd)
         sendReply(clientFd, ":ircserv 403 " + _clients[clientFd].getNickname() + " " + cmd.getParams()[0] + " :No such channel\r\n");
         return ;
     }
+    // Listas de mascaras: +b/-b/+e/-e <mask>, o b/e solas para verlas
+    const std::string& listMode = cmd.getParams()[1];
+    if (listMode == "b" || listMode == "+b" || listMode == "-b" || listMode == "e" || listMode == "+e" || listMode == "-e")
+        return handleListMode(clientFd, cmd, *ch);
     ChannelError err;
 	std::string target;
     // Dependiendo del modo, parametros distintos
@@ -815,9 +1251,8 @@ void Server::handleMode(int clientFd, const Command& cmd)
 	if (!target.empty())
 		modeMsg += " " + target;
 	modeMsg += "\r\n";
-    const std::vector<int>& members = ch->get_members();
-    for (size_t i = 0; i < members.size(); ++i)
-        sendReply(members[i], modeMsg);
+	broadcastToChannel(*ch, modeMsg, -1);
+	propagate(":" + senderNick + " MODE " + channelName + " " + cmd.getParams()[1] + (target.empty() ? "" : " " + target), -1);
 }
 
 void Server::handlePing(int clientFd, const Command& cmd) {
@@ -828,8 +1263,9 @@ void Server::handlePing(int clientFd, const Command& cmd) {
     }
 
     std::string pong_reply = ":ircserv PONG ircserv :" + token + "\r\n";
-    
-    reply(clientFd, pong_reply);
+
+    // Ahead of whatever bulk is queued: a late PONG makes clients reconnect
+    sendUrgent(clientFd, pong_reply);
 }
 
 
@@ -855,7 +1291,7 @@ void Server::handlePrivmsg(int clientFd, const Command& cmd)
  	Channel* ch = findChannelByName(_Channels, cmd.getParams()[0]);
  	if (ch == NULL)
  	{
- 		if (cmd.getParams()[0].empty() || cmd.getParams()[0].length() > 9 || cmd.getParams()[0].find_first_of(" ,*?!@.") != std::string::npos)
+ 		if (!Names::validNick(cmd.getParams()[0]))
  		{
 			sendReply(clientFd, ":ircserv 432 " + _clients[clientFd].getNickname() + " " + cmd.getParams()[0] + " :Erroneous nickname\r\n");
  			return ;
@@ -874,81 +1310,158 @@ void Server::handlePrivmsg(int clientFd, const Command& cmd)
 		}
  	}
 
- 	std::string senderNick = _clients[clientFd].getNickname();
- 	std::string senderUser = _clients[clientFd].getUsername();
- 	std::string senderHost = "localhost";
- 	std::string target = cmd.getParams()[0];
- 	std::string message = cmd.getParams()[1];
-	 std::string fullMsg;
-	if (cmd.getCommand() == "PRIVMSG")
- 		fullMsg = ":" + senderNick + "!" + senderUser + "@" + senderHost + " PRIVMSG " + target + " :" + message + "\r\n";
-	else
-		fullMsg = ":" + senderNick + "!" + senderUser + "@" + senderHost + " NOTICE " + target + " :" + message + "\r\n";
+ 	Client& sender = _clients[clientFd];
+ 	const std::string& target = cmd.getParams()[0];
+ 	const std::string& message = cmd.getParams()[1];
+	// Built in place, in buffers that outlive the call: the hot path
+	// doesn't allocate once they have grown to the usual line size
+	std::string& fullMsg = this->_msgScratch;
+	fullMsg.assign(1, ':');
+	fullMsg.append(sender.getNickname()).append(1, '!').append(sender.getUsername()).append("@localhost ");
+	fullMsg.append(cmd.getCommand()).append(1, ' ').append(target).append(" :").append(message).append("\r\n");
+	// The other servers' version, only needed if there are any
+	std::string& linkMsg = this->_linkScratch;
+	linkMsg.clear();
+	if (!this->_links.empty()) {
+		linkMsg.assign(1, ':');
+		linkMsg.append(sender.getNickname()).append(1, ' ').append(cmd.getCommand()).append(1, ' ');
+		linkMsg.append(target).append(" :").append(message);
+	}
  	if (flag == 0)
  	{
-		const std::vector<int>& members = ch->get_members();
-		std::vector<int>::const_iterator it = std::find(members.begin(), members.end(), clientFd);
-		if (it == members.end())
+		// Cached per member until the channel or the nick changes
+		ChannelError err = ch->can_send(clientFd, sender);
+		if (err == ERR_NOT_ON_CHANNEL)
 		{
-			sendReply(clientFd, ":ircserv 442 " + _clients[clientFd].getNickname() + " " + ch->get_name() + " :You're not on that channel\r\n");
+			sendReply(clientFd, ":ircserv 442 " + sender.getNickname() + " " + ch->get_name() + " :You're not on that channel\r\n");
 			return ;
 		}
- 		for (std::vector<int>::const_iterator it = members.begin(); it != members.end(); ++it)
- 		{
- 			int memberFd = *it;
- 			if (memberFd != clientFd)
- 				sendReply(memberFd, fullMsg);
- 		}
+		if (err != CHANNEL_OK)
+		{
+			if (cmd.getCommand() == "PRIVMSG")
+				sendReply(clientFd, ":ircserv 404 " + sender.getNickname() + " " + ch->get_name() + " :Cannot send to channel\r\n");
+			return ;
+		}
+		if (dropAsSpam(sender, target, message))
+			return ;
+		recordHistory(*ch, fullMsg);
+		// Local members get it directly, other servers once per link
+		routeToChannel(*ch, fullMsg, linkMsg, clientFd, -1);
  				return ;
  	}
 	// Si es user
- 	sendReply(search_fd_name(cmd.getParams()[0]), fullMsg);
+	if (dropAsSpam(sender, target, message))
+		return ;
+ 	routeToUser(search_fd_name(cmd.getParams()[0]), fullMsg, linkMsg);
+}
+
+// Right before the fan-out, once the target exists and the sender may
+// reach it: the same text from anyone to anywhere, past the threshold, is a
+// spam wave. Messages refused anyway (401, 442, 404) are never counted, and
+// operators aren't either. True if this copy must not be sent.
+bool Server::dropAsSpam(const Client& sender, const std::string& target, const std::string& message)
+{
+	if (!this->_spam.enabled() || sender.isOper())
+		return false;
+	unsigned int copies = this->_spam.check(message);
+	if (copies <= this->_spam.threshold())
+		return false;
+	if (copies == this->_spam.threshold() + 1)
+		LOG_WARN("Spam wave: " << copies << " copies of a line, the last from " << sender.getNickname()
+			<< " to " << target << (this->_spamDrop ? ", dropping the rest" : ", flagging the rest"));
+	if (!this->_spamDrop)
+	{
+		this->_spamFlagged++;
+		return false;
+	}
+	this->_spamDropped++;
+	return true;
 }
 
 
-int	Server::search_fd_name(std::string name)
+int	Server::search_fd_name(const std::string& name)
 {
-	for (std::map<int, Client>::const_iterator it = _clients.begin(); it != _clients.end(); ++it) {
+	for (ClientMap::const_iterator it = _clients.begin(); it != _clients.end(); ++it) {
 		if (it->second.getNickname() == name)
 			return it->first;
 	}
+	// Users of other servers have negative ids
+	std::map<std::string, int>::const_iterator remote = _remoteNicks.find(name);
+	if (remote != _remoteNicks.end())
+		return remote->second;
 	return 0;
 }
 
-void sendReply(int clientFd, const std::string &msg)
+// Sends msg to every member of the channel except exceptFd (-1 for nobody).
+// Returns how many got it.
+size_t Server::broadcastToChannel(Channel& ch, const std::string& msg, int exceptFd)
 {
-    // Enviar el mensaje al cliente
-    ssize_t bytesSent = send(clientFd, msg.c_str(), msg.length(), 0);
+	const std::vector<int>& members = ch.get_members();
+	size_t recipients = 0;
+	for (size_t i = 0; i < members.size(); ++i)
+	{
+		if (members[i] == exceptFd || members[i] < 0) // remote users are reached through their link
+			continue;
+		sendReply(members[i], msg);
+		recipients++;
+	}
+	this->_stats.recordFanout(ch.get_name(), recipients, msg.size());
+	return recipients;
+}
 
-    if (bytesSent == -1) {
-        perror("send");
-        std::cerr << "Error enviando mensaje al cliente FD: " << clientFd << std::endl;
-    }
-    else if ((size_t)bytesSent < msg.length()) {
-        std::cerr << "Advertencia: no se enviaron todos los bytes al cliente FD: " << clientFd << std::endl;
-    }
+void Server::trackJoin(Channel& ch, int id)
+{
+	std::vector<Channel*>& channels = this->_joined[id];
+	if (std::find(channels.begin(), channels.end(), &ch) == channels.end())
+		channels.push_back(&ch);
 }
 
-ChannelError Server::check_name(std::string name, int cl)
+void Server::trackPart(Channel& ch, int id)
 {
-	if (name.length() > 50)
+	std::map<int, std::vector<Channel*> >::iterator it = this->_joined.find(id);
+	if (it == this->_joined.end())
+		return;
+	it->second.erase(std::remove(it->second.begin(), it->second.end(), &ch), it->second.end());
+	if (it->second.empty())
+		this->_joined.erase(it);
+}
+
+// One pass over the user's own channels, with a stamp per fd instead of a
+// set: someone sharing 200 channels with the user is still taken once, and
+// taking them is an array read and a write.
+const std::vector<int>& Server::channelPeers(int id)
+{
+	unsigned long walk = ++this->_peerWalk;
+	this->_peers.clear();
+	std::map<int, std::vector<Channel*> >::const_iterator joined = this->_joined.find(id);
+	if (joined == this->_joined.end())
+		return this->_peers;
+	for (size_t i = 0; i < joined->second.size(); ++i)
 	{
-		sendReply(cl, ":ircserv 403 " + _clients[cl].getNickname() + " " + name + " :No such channel\r\n");
-        return ERR_NO_SUCH_CHANNEL;
+		const std::vector<int>& members = joined->second[i]->get_members();
+		for (size_t j = 0; j < members.size(); ++j)
+		{
+			int fd = members[j];
+			if (fd < 0 || fd == id) // remote users are told by their own server
+				continue;
+			if ((size_t)fd >= this->_peerStamps.size())
+				this->_peerStamps.resize(fd + 1, 0);
+			if (this->_peerStamps[fd] == walk)
+				continue;
+			this->_peerStamps[fd] = walk;
+			this->_peers.push_back(fd);
+		}
 	}
-	else if (name[0] != '#')
+	return this->_peers;
+}
+
+ChannelError Server::check_name(const std::string& name, int cl)
+{
+	if (!Names::validChannel(name))
 	{
 		sendReply(cl, ":ircserv 403 " + _clients[cl].getNickname() + " " + name + " :No such channel\r\n");
         return ERR_NO_SUCH_CHANNEL;
 	}
-	for(unsigned int i = 0; i < name.length(); i++)
-	{
-		if (name[i] == ' ' || name[i] == ',' || name[i] == '\x07')
-		{
-			sendReply(cl, ":ircserv 403 " + _clients[cl].getNickname() + " " + name + " :No such channel\r\n");
-        	return ERR_NO_SUCH_CHANNEL;
-		}
-	}
 	return CHANNEL_OK;
 }
 
@@ -967,17 +1480,775 @@ void Server::handleWho(int clientFd, const Command& cmd) {
 
     for (size_t i = 0; i < members.size(); ++i) {
         int memberFd = members[i];
-        Client& member = this->_clients.find(memberFd)->second;
-        
         std::string status = "";
         if (channel->isOperator(memberFd)) {
             status = "@";
         }
+        std::string user, host = "localhost", server = "ircserv", real;
+        int hops = 0;
+        if (memberFd >= 0) {
+            Client& member = this->_clients.find(memberFd)->second;
+            user = member.getUsername();
+            real = member.getRealname();
+        } else {
+            const RemoteUser& member = this->_remoteUsers.find(memberFd)->second;
+            user = member.user;
+            host = server = member.server.str();
+            real = member.realname.str();
+            hops = this->_servers[member.server.str()].hops;
+        }
+        std::ostringstream hopCount;
+        hopCount << hops;
         std::string replyMsg = ":ircserv 352 " + client.getNickname() + " " + channel->get_name()
-                             + " " + member.getUsername() + " localhost ircserv " + member.getNickname()
-                             + " H" + status + " :0 " + member.getRealname() + "\r\n";
+                             + " " + user + " " + host + " " + server + " " + nickOf(memberFd)
+                             + " H" + status + " :" + hopCount.str() + " " + real + "\r\n";
         
         reply(clientFd, replyMsg);
     }
     reply(clientFd, ":ircserv 315 " + client.getNickname() + " " + target + " :End of /WHO list.\r\n");
 }
+
+// STATS <letter>
+//   m: calls and bytes per command     h: latency percentiles per command
+//   g: global gauges                   u: uptime
+void Server::handleStats(int clientFd, const Command& cmd) {
+    Client& client = this->_clients.find(clientFd)->second;
+    if (!client.isRegistered()) {
+        reply(clientFd, ":ircserv 451 * :You have not registered\r\n");
+        return;
+    }
+    if (cmd.getParams().empty() || cmd.getParams()[0].empty()) {
+        reply(clientFd, ":ircserv 461 " + client.getNickname() + " STATS :Not enough parameters\r\n");
+        return;
+    }
+    char which = cmd.getParams()[0][0];
+    std::vector<std::string> lines;
+    if ((which == 'z' || which == 'q' || which == 'f') && !client.isOper()) {
+        reply(clientFd, ":ircserv 481 " + client.getNickname() + " :Permission Denied- You're not an IRC operator\r\n");
+        return;
+    }
+    if (which == 'l')
+        reportLinks(lines);
+    else if (which == 'z')
+        reportMemory(lines);
+    else if (which == 'q')
+        reportSendq(lines);
+    else
+        this->_stats.report(which, collectGauges(), lines);
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (which == 'l')
+            reply(clientFd, ":ircserv 211 " + client.getNickname() + " " + lines[i] + "\r\n");
+        else if (which == 'm')
+            reply(clientFd, ":ircserv 212 " + client.getNickname() + " " + lines[i] + "\r\n");
+        else if (which == 'u')
+            reply(clientFd, ":ircserv 242 " + client.getNickname() + " :" + lines[i] + "\r\n");
+        else
+            reply(clientFd, ":ircserv 249 " + client.getNickname() + " " + which + " :" + lines[i] + "\r\n");
+    }
+    reply(clientFd, ":ircserv 219 " + client.getNickname() + " " + which + " :End of STATS report\r\n");
+}
+
+// OPER <name> <password>: unlocks STATS z
+void Server::handleOper(int clientFd, const Command& cmd) {
+    Client& client = this->_clients.find(clientFd)->second;
+    if (!client.isRegistered()) {
+        reply(clientFd, ":ircserv 451 * :You have not registered\r\n");
+        return;
+    }
+    if (cmd.getParams().size() < 2) {
+        reply(clientFd, ":ircserv 461 " + client.getNickname() + " OPER :Not enough parameters\r\n");
+        return;
+    }
+    if (this->_operPassword.empty()) {
+        reply(clientFd, ":ircserv 491 " + client.getNickname() + " :No O-lines for your host\r\n");
+        return;
+    }
+    if (cmd.getParams()[0] != this->_operName || cmd.getParams()[1] != this->_operPassword) {
+        LOG_WARN("Failed OPER attempt by " << client.getNickname() << " on fd " << clientFd);
+        reply(clientFd, ":ircserv 464 " + client.getNickname() + " :Password incorrect\r\n");
+        return;
+    }
+    client.setOper(true);
+    LOG_INFO(client.getNickname() << " is now an IRC operator");
+    reply(clientFd, ":ircserv 381 " + client.getNickname() + " :You are now an IRC operator\r\n");
+}
+
+// CHATHISTORY LATEST <channel> <* | msgid=.. | timestamp=..> <limit>
+// CHATHISTORY BEFORE|AFTER <channel> <msgid=.. | timestamp=..> <limit>
+// The events come back oldest first, inside a chathistory BATCH. They are
+// queued like any other reply, so a big playback is written out as the
+// client reads it instead of blocking the loop.
+void Server::handleChathistory(int clientFd, const Command& cmd) {
+    Client& client = this->_clients.find(clientFd)->second;
+    if (!client.isRegistered()) {
+        reply(clientFd, ":ircserv 451 * :You have not registered\r\n");
+        return;
+    }
+    const std::vector<std::string>& params = cmd.getParams();
+    if (params.size() < 4) {
+        reply(clientFd, ":ircserv FAIL CHATHISTORY NEED_MORE_PARAMS :Missing parameters\r\n");
+        return;
+    }
+    const std::string& sub = params[0];
+    const std::string& target = params[1];
+    if (sub != "LATEST" && sub != "BEFORE" && sub != "AFTER") {
+        reply(clientFd, ":ircserv FAIL CHATHISTORY INVALID_PARAMS " + sub + " :Unknown subcommand\r\n");
+        return;
+    }
+
+    Channel* ch = findChannelByName(_Channels, target);
+    if (ch == NULL || !ch->isMember(clientFd)) {
+        reply(clientFd, ":ircserv FAIL CHATHISTORY INVALID_TARGET " + sub + " " + target + " :Messages could not be retrieved\r\n");
+        return;
+    }
+
+    HistoryRef ref;
+    bool hasRef = !(sub == "LATEST" && params[2] == "*");
+    if (hasRef && !HistoryRing::parseRef(params[2], ref)) {
+        reply(clientFd, ":ircserv FAIL CHATHISTORY INVALID_PARAMS " + sub + " " + params[2] + " :Invalid message reference\r\n");
+        return;
+    }
+    if (params[3].empty() || params[3].find_first_not_of("0123456789") != std::string::npos) {
+        reply(clientFd, ":ircserv FAIL CHATHISTORY INVALID_PARAMS " + sub + " " + params[3] + " :Invalid limit\r\n");
+        return;
+    }
+    size_t limit = std::strtoul(params[3].c_str(), NULL, 10);
+    if (limit == 0 || limit > this->_historyPlaybackMax)
+        limit = this->_historyPlaybackMax;
+
+    std::vector<HistoryLine> lines;
+    const HistoryRing& history = ch->get_history();
+    if (sub == "LATEST")
+        history.latest(hasRef ? &ref : NULL, limit, lines);
+    else if (sub == "BEFORE")
+        history.before(ref, limit, lines);
+    else
+        history.after(ref, limit, lines);
+
+    std::ostringstream batch;
+    batch << "hist" << this->_nextBatchId++;
+    reply(clientFd, ":ircserv BATCH +" + batch.str() + " chathistory " + ch->get_name() + "\r\n");
+    for (size_t i = 0; i < lines.size(); ++i) {
+        std::ostringstream line;
+        line << "@batch=" << batch.str() << ";time=" << HistoryRing::formatTime(lines[i].timeMs)
+             << ";msgid=" << lines[i].msgid << " " << lines[i].line << "\r\n";
+        reply(clientFd, line.str());
+    }
+    reply(clientFd, ":ircserv BATCH -" + batch.str() + "\r\n");
+}
+
+StatsGauges Server::collectGauges() const {
+    StatsGauges gauges;
+    gauges.clients = this->_clients.size() - this->_links.size();
+    gauges.channels = this->_Channels.size();
+    gauges.sendqBytes = this->_sendqBytes;
+    gauges.clientBytes = clientMemory();
+    gauges.loadMode = OverloadControl::modeName(this->_overload.mode());
+    gauges.spamFlagged = this->_spamFlagged;
+    gauges.spamDropped = this->_spamDropped;
+    return gauges;
+}
+
+size_t Server::clientMemory() const {
+    // The Client itself is in memoryBytes(), the node adds its key and links
+    size_t bytes = 0;
+    for (ClientMap::const_iterator it = this->_clients.begin(); it != this->_clients.end(); ++it)
+        bytes += mapNodeBytes(sizeof(int)) + it->second.memoryBytes();
+    // Shared by everybody: interned realnames and server names, spare buffers
+    return bytes + InternedString::tableBytes() + Client::spareBytes();
+}
+
+size_t Server::trimIdleBuffers() {
+    size_t idle = 0;
+    for (ClientMap::iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
+        if (it->second.trimIdle())
+            idle++;
+    }
+    return idle;
+}
+
+void Server::dumpStats(const std::string& path) const {
+    std::ofstream out(path.c_str(), std::ios::out | std::ios::trunc);
+    if (!out) {
+        LOG_ERROR("Could not open " << path << " to dump stats");
+        return;
+    }
+    const char sections[] = { 'u', 'g', 'm', 'h', 'f' };
+    StatsGauges gauges = collectGauges();
+    for (size_t i = 0; i < sizeof(sections); ++i) {
+        std::vector<std::string> lines;
+        this->_stats.report(sections[i], gauges, lines);
+        out << "[" << sections[i] << "]\n";
+        for (size_t j = 0; j < lines.size(); ++j)
+            out << lines[j] << "\n";
+    }
+    LOG_INFO("Stats dumped to " << path);
+}
+
+void Server::onStatsSignal(int signum) {
+    (void)signum;
+    _statsDumpRequested = 1;
+}
+
+void Server::onStopSignal(int signum) {
+    (void)signum;
+    _stopRequested = 1;
+}
+
+// Encoding runs on the loop, it's only copies. With `async` the file is
+// written by the snapshot thread, otherwise right here (at shutdown).
+void Server::saveSnapshot(bool async) {
+    unsigned long start = Stats::nowNs();
+    SnapshotEncoder encoder;
+    for (size_t i = 0; i < this->_Channels.size(); ++i) {
+        Channel& ch = this->_Channels[i];
+        ChannelSnapshot snap;
+        int* modes = ch.get_modes();
+        snap.name = ch.get_name();
+        snap.topic = ch.get_topic();
+        snap.key = ch.get_password();
+        snap.inviteOnly = modes[0] != 0;
+        snap.hasKey = modes[1] != 0;
+        snap.limit = modes[2];
+        snap.topicLocked = modes[3] != 0;
+        for (int l = 0; l < 2; ++l) {
+            char list = l == 0 ? 'b' : 'e';
+            const std::vector<MaskEntry>& entries = ch.get_masks(list).entries();
+            for (size_t j = 0; j < entries.size(); ++j) {
+                MaskSnapshot mask;
+                mask.list = list;
+                mask.mask = entries[j].mask.pattern();
+                mask.setBy = entries[j].setBy;
+                mask.setAt = entries[j].setAt;
+                snap.masks.push_back(mask);
+            }
+        }
+        encoder.add(snap);
+    }
+    std::string& image = encoder.finish();
+    unsigned long encodeNs = Stats::nowNs() - start;
+
+    if (async) {
+        if (this->_snapshotWriter.writeAsync(this->_snapshotFile, image))
+            LOG_INFO("Snapshot of " << this->_Channels.size() << " channels encoded in " << encodeNs / 1000 << "us");
+        else
+            LOG_WARN("Previous snapshot still being written, skipping this one");
+    } else if (this->_snapshotWriter.writeNow(this->_snapshotFile, image)) {
+        LOG_INFO("Saved " << this->_Channels.size() << " channels to " << this->_snapshotFile);
+    } else {
+        LOG_ERROR("Could not write snapshot " << this->_snapshotFile << ": " << std::strerror(errno));
+    }
+}
+
+void Server::loadSnapshot() {
+    unsigned long start = Stats::nowNs();
+    SnapshotReader reader;
+    if (!reader.open(this->_snapshotFile)) {
+        LOG_INFO("No usable snapshot in " << this->_snapshotFile << ", starting with no channels");
+        return;
+    }
+    ChannelSnapshot snap;
+    while (reader.next(snap)) {
+        int modes[4];
+        modes[0] = snap.inviteOnly ? 1 : 0;
+        modes[1] = snap.hasKey ? 1 : 0;
+        modes[2] = snap.limit;
+        modes[3] = snap.topicLocked ? 1 : 0;
+        this->_Channels.push_back(Channel(snap.name));
+        this->_Channels.back().restore_settings(snap.topic, modes, snap.key);
+        for (size_t j = 0; j < snap.masks.size(); ++j)
+            this->_Channels.back().add_mask(snap.masks[j].list, snap.masks[j].mask, snap.masks[j].setBy, snap.masks[j].setAt);
+    }
+    LOG_INFO("Restored " << this->_Channels.size() << " channels from " << this->_snapshotFile
+        << " in " << (Stats::nowNs() - start) / 1000 << "us");
+}
+
+void Server::onUpgradeSignal(int signum) {
+    (void)signum;
+    _upgradeRequested = 1;
+}
+
+void Server::setUpgradeCommand(int argc, char** argv) {
+    this->_upgradeArgv.assign(argv, argv + argc);
+    this->_upgradePath = argc > 0 ? Upgrade::programPath(argv[0]) : "";
+}
+
+// Client flags in the handoff state
+enum {
+    STATE_AUTHENTICATED = 1,
+    STATE_REGISTERED = 2,
+    STATE_VISIBLE = 4,
+    STATE_OPER = 8,
+};
+
+// Sockets travel as indexes into `fds` (the new process gets other numbers).
+//   u64 next msgid | u64 next batch id | u64 next trace id (0: no trace) | u64 trace clock
+//   u32 clients, each: u32 fd index | nick | user | realname | u64 signon | u8 flags | input buffer | unsent output
+//       | u32 monitored nicks, each: nick | u64 trace id
+//   u32 channels, each: name | topic | key | i32 modes[4]
+//       | u32 members, each: u32 fd index | u8 operator
+//       | u32 invites, each: u32 fd index
+//       | u32 history lines, each: u64 msgid | u64 time | line
+//       | u32 masks, each: u8 list ('b' or 'e') | mask | set by | u64 set at
+void Server::encodeState(StateEncoder& out, std::vector<int>& fds) {
+    std::map<int, unsigned int> index;
+    fds.push_back(this->_listeningSocketFd);
+    out.putU64(this->_nextMsgid);
+    out.putU64(this->_nextBatchId);
+    out.putU64(this->_trace.enabled() ? this->_trace.nextConnId() : 0);
+    out.putU64(this->_trace.lastNs());
+
+    out.putU32(this->_clients.size());
+    for (ClientMap::iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
+        const Client& client = it->second;
+        index[it->first] = fds.size();
+        out.putU32(fds.size());
+        fds.push_back(it->first);
+        out.putString(client.getNickname());
+        out.putString(client.getUsername());
+        out.putString(client.getRealname());
+        out.putU64(client.getSignon());
+        out.putU8((client.isAuthenticated() ? STATE_AUTHENTICATED : 0) | (client.isRegistered() ? STATE_REGISTERED : 0)
+            | (client.isVisible() ? STATE_VISIBLE : 0) | (client.isOper() ? STATE_OPER : 0));
+        out.putString(it->second.getBuffer());
+        std::string pending;
+        client.copyPendingOutput(pending);
+        out.putString(pending);
+        const std::vector<std::string>& monitored = this->_monitor.targets(it->first);
+        out.putU32(monitored.size());
+        for (size_t j = 0; j < monitored.size(); ++j)
+            out.putString(monitored[j]);
+        out.putU64(this->_trace.connId(it->first));
+    }
+
+    out.putU32(this->_Channels.size());
+    for (size_t i = 0; i < this->_Channels.size(); ++i) {
+        Channel& ch = this->_Channels[i];
+        out.putString(ch.get_name());
+        out.putString(ch.get_topic());
+        out.putString(ch.get_password());
+        for (int m = 0; m < 4; ++m)
+            out.putI32(ch.get_modes()[m]);
+
+        std::vector<int> members = ch.get_members();
+        std::vector<int> kept;
+        for (size_t j = 0; j < members.size(); ++j) {
+            if (index.count(members[j]))
+                kept.push_back(members[j]);
+        }
+        out.putU32(kept.size());
+        for (size_t j = 0; j < kept.size(); ++j) {
+            out.putU32(index[kept[j]]);
+            out.putU8(ch.isOperator(kept[j]) ? 1 : 0);
+        }
+
+        // Invites for clients that left long ago are dropped on the way
+        std::vector<int> invites = ch.get_invite_list();
+        kept.clear();
+        for (size_t j = 0; j < invites.size(); ++j) {
+            if (index.count(invites[j]))
+                kept.push_back(invites[j]);
+        }
+        out.putU32(kept.size());
+        for (size_t j = 0; j < kept.size(); ++j)
+            out.putU32(index[kept[j]]);
+
+        std::vector<HistoryLine> lines;
+        ch.get_history().latest(NULL, ch.get_history().size(), lines);
+        out.putU32(lines.size());
+        for (size_t j = 0; j < lines.size(); ++j) {
+            out.putU64(lines[j].msgid);
+            out.putU64(lines[j].timeMs);
+            out.putString(lines[j].line);
+        }
+
+        for (int l = 0; l < 2; ++l) {
+            char list = l == 0 ? 'b' : 'e';
+            const std::vector<MaskEntry>& entries = ch.get_masks(list).entries();
+            if (l == 0)
+                out.putU32(entries.size() + ch.get_masks('e').size());
+            for (size_t j = 0; j < entries.size(); ++j) {
+                out.putU8(list);
+                out.putString(entries[j].mask.pattern());
+                out.putString(entries[j].setBy);
+                out.putU64(entries[j].setAt);
+            }
+        }
+    }
+}
+
+// SIGUSR2: start the new binary and give it everything. Returns true once
+// it has taken over; on any failure we keep serving as if nothing happened.
+bool Server::handOff() {
+    if (this->_upgradeArgv.empty()) {
+        LOG_WARN("Hot upgrade requested but no command to start, ignoring");
+        return false;
+    }
+    unsigned long start = Stats::nowNs();
+    // Server links are not handed over: the peers see a netsplit and link
+    // again with the new process
+    while (!this->_links.empty())
+        handleClientDisconnect(this->_links.begin()->first, "Upgrading");
+    // Ports and files the new process opens again
+    this->_admin.stop();
+    this->_archive.close();
+    this->_trace.sync();
+    this->_snapshotWriter.wait();
+
+    StateEncoder state;
+    std::vector<int> fds;
+    encodeState(state, fds);
+
+    pid_t pid = -1;
+    int sock = Upgrade::spawn(this->_upgradePath, this->_upgradeArgv, pid);
+    bool ok = sock >= 0
+        && Upgrade::sendState(sock, fds, state.data(), this->_upgradeTimeoutMs)
+        && Upgrade::waitReady(sock, this->_upgradeTimeoutMs);
+    int saved = errno;
+    if (sock >= 0)
+        ::close(sock);
+    if (ok) {
+        LOG_INFO("Handed " << this->_clients.size() << " clients and " << this->_Channels.size()
+            << " channels (" << state.data().size() << " bytes) over to pid " << pid
+            << " in " << (Stats::nowNs() - start) / 1000 << "us");
+        this->_handedOff = true;
+        return true;
+    }
+
+    LOG_ERROR("Hot upgrade failed (" << std::strerror(saved) << "), still serving");
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    try {
+        openServices();
+    } catch (const std::exception& e) {
+        LOG_ERROR("Could not reopen after the failed upgrade: " << e.what());
+    }
+    return false;
+}
+
+// The other end of handOff(), called from the constructor
+void Server::resumeFrom(int sock) {
+    unsigned long start = Stats::nowNs();
+    std::vector<int> fds;
+    std::string data;
+    Upgrade::receiveState(sock, fds, data);
+    if (fds.empty())
+        throw std::runtime_error("Upgrade: no listening socket in the handoff");
+    this->_listeningSocketFd = fds[0];
+
+    StateDecoder in(data);
+    this->_nextMsgid = in.getU64();
+    this->_nextBatchId = in.getU64();
+    unsigned long traceNext = in.getU64();
+    this->_trace.resume(traceNext, in.getU64());
+
+    unsigned int clients = in.getU32();
+    for (unsigned int i = 0; i < clients && in.ok(); ++i) {
+        unsigned int fdIndex = in.getU32();
+        std::string nick = in.getString();
+        std::string user = in.getString();
+        std::string real = in.getString();
+        unsigned long signon = in.getU64();
+        unsigned char flags = in.getU8();
+        std::string input = in.getString();
+        std::string output = in.getString();
+        if (fdIndex >= fds.size())
+            throw std::runtime_error("Upgrade: the state from the old process is corrupt");
+
+        int fd = fds[fdIndex];
+        unsigned int monitored = in.getU32();
+        for (unsigned int j = 0; j < monitored && in.ok(); ++j)
+            this->_monitor.add(fd, in.getString());
+        this->_trace.adopt(fd, in.getU64());
+        Client& client = this->_clients.insert(std::make_pair(fd, Client(fd))).first->second;
+        client.setNickname(nick);
+        client.setUsername(user);
+        client.setRealname(real);
+        client.setSignon(signon);
+        client.setAuthenticated((flags & STATE_AUTHENTICATED) != 0);
+        client.setRegistered((flags & STATE_REGISTERED) != 0);
+        client.setModoInvisible((flags & STATE_VISIBLE) != 0);
+        client.setOper((flags & STATE_OPER) != 0);
+        client.appendBuffer(input);
+        if (!output.empty()) {
+            client.queueOutput(output);
+            this->_sendqBytes += output.size();
+            client.setFlushScheduled(true);
+            this->_flushList.push_back(fd);
+        }
+    }
+
+    unsigned int channels = in.getU32();
+    for (unsigned int i = 0; i < channels && in.ok(); ++i) {
+        std::string name = in.getString();
+        std::string topic = in.getString();
+        std::string key = in.getString();
+        int modes[4];
+        for (int m = 0; m < 4; ++m)
+            modes[m] = in.getI32();
+
+        std::vector<int> members;
+        std::vector<int> operators;
+        std::vector<int> invites;
+        unsigned int count = in.getU32();
+        for (unsigned int j = 0; j < count && in.ok(); ++j) {
+            unsigned int fdIndex = in.getU32();
+            bool op = in.getU8() != 0;
+            if (fdIndex >= fds.size())
+                throw std::runtime_error("Upgrade: the state from the old process is corrupt");
+            members.push_back(fds[fdIndex]);
+            if (op)
+                operators.push_back(fds[fdIndex]);
+        }
+        count = in.getU32();
+        for (unsigned int j = 0; j < count && in.ok(); ++j) {
+            unsigned int fdIndex = in.getU32();
+            if (fdIndex >= fds.size())
+                throw std::runtime_error("Upgrade: the state from the old process is corrupt");
+            invites.push_back(fds[fdIndex]);
+        }
+
+        this->_Channels.push_back(Channel(name));
+        Channel& ch = this->_Channels.back();
+        ch.restore_settings(topic, modes, key);
+        ch.restore_members(members, operators, invites);
+        for (size_t j = 0; j < members.size(); ++j)
+            trackJoin(ch, members[j]);
+        count = in.getU32();
+        for (unsigned int j = 0; j < count && in.ok(); ++j) {
+            unsigned long msgid = in.getU64();
+            unsigned long timeMs = in.getU64();
+            ch.get_history().append(in.getString(), msgid, timeMs, this->_historyLimits);
+        }
+        count = in.getU32();
+        for (unsigned int j = 0; j < count && in.ok(); ++j) {
+            char list = in.getU8();
+            std::string mask = in.getString();
+            std::string setBy = in.getString();
+            ch.add_mask(list, mask, setBy, in.getU64());
+        }
+    }
+    if (!in.ok())
+        throw std::runtime_error("Upgrade: the state from the old process is corrupt");
+
+    LOG_INFO("Took over " << this->_clients.size() << " clients and " << this->_Channels.size()
+        << " channels from the previous process in " << (Stats::nowNs() - start) / 1000 << "us");
+}
+
+void Server::onTimer(const TimerEvent& ev) {
+    if (ev.kind == TIMER_HOUSEKEEPING) {
+        // How late we are compared to when the timer was due: that is the loop lag
+        unsigned long now = TimerWheel::nowMs();
+        this->_stats.recordLoopLag((now > ev.dueMs ? now - ev.dueMs : 0) * 1000000UL);
+        this->_stats.noteSendQueue(collectGauges().sendqBytes);
+        enforceMemoryBudget();
+        checkOverload();
+        checkSlowConsumers();
+        this->_stats.sampleTraffic();
+        this->_spam.tick();
+        this->_trace.flush();
+        this->_timers.schedule(now, 1000, TIMER_HOUSEKEEPING, -1);
+    } else if (ev.kind == TIMER_ADMIN_IDLE) {
+        this->_admin.onIdleTimeout(ev.fd);
+    } else if (ev.kind == TIMER_SNAPSHOT) {
+        saveSnapshot(true);
+        this->_timers.schedule(TimerWheel::nowMs(), this->_snapshotIntervalMs, TIMER_SNAPSHOT, -1);
+    } else if (ev.kind == TIMER_LINK_RETRY) {
+        connectLinks();
+        this->_timers.schedule(TimerWheel::nowMs(), this->_linkRetryMs, TIMER_LINK_RETRY, -1);
+    } else if (ev.kind == TIMER_BUFFER_TRIM) {
+        trimIdleBuffers();
+        this->_timers.schedule(TimerWheel::nowMs(), this->_bufferTrimMs, TIMER_BUFFER_TRIM, -1);
+    }
+}
+
+static void metric(std::ostringstream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+// Label values come from users (channel names, nicks): quote them
+static std::string labelValue(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '\\' || s[i] == '"')
+            out += '\\';
+        out += s[i];
+    }
+    return out;
+}
+
+// Prometheus text exposition format, version 0.0.4
+std::string Server::renderMetrics() {
+    std::ostringstream out;
+    StatsGauges gauges = collectGauges();
+    this->_stats.noteSendQueue(gauges.sendqBytes);
+
+    metric(out, "ircserv_uptime_seconds", "gauge", "Seconds since the server started.");
+    out << "ircserv_uptime_seconds " << this->_stats.uptime() << "\n";
+    metric(out, "ircserv_clients", "gauge", "Connected clients.");
+    out << "ircserv_clients " << gauges.clients << "\n";
+    metric(out, "ircserv_connections_accepted_total", "counter", "Connections accepted since start.");
+    out << "ircserv_connections_accepted_total " << this->_stats.connectionsAccepted() << "\n";
+    metric(out, "ircserv_channels", "gauge", "Existing channels.");
+    out << "ircserv_channels " << gauges.channels << "\n";
+
+    const std::map<std::string, CommandStats>& commands = this->_stats.commands();
+    std::map<std::string, CommandStats>::const_iterator it;
+    metric(out, "ircserv_command_calls_total", "counter", "Commands processed, by verb.");
+    for (it = commands.begin(); it != commands.end(); ++it)
+        out << "ircserv_command_calls_total{command=\"" << it->first << "\"} " << it->second.calls << "\n";
+    metric(out, "ircserv_command_bytes_in_total", "counter", "Bytes of command lines received, by verb.");
+    for (it = commands.begin(); it != commands.end(); ++it)
+        out << "ircserv_command_bytes_in_total{command=\"" << it->first << "\"} " << it->second.bytesIn << "\n";
+    metric(out, "ircserv_command_bytes_out_total", "counter", "Bytes sent while handling each verb.");
+    for (it = commands.begin(); it != commands.end(); ++it)
+        out << "ircserv_command_bytes_out_total{command=\"" << it->first << "\"} " << it->second.bytesOut << "\n";
+    metric(out, "ircserv_command_latency_seconds", "summary", "Time spent handling each verb.");
+    for (it = commands.begin(); it != commands.end(); ++it) {
+        const LatencyHistogram& h = it->second.latency;
+        const double quantiles[] = { 0.5, 0.9, 0.99 };
+        for (size_t q = 0; q < 3; ++q)
+            out << "ircserv_command_latency_seconds{command=\"" << it->first << "\",quantile=\"" << quantiles[q] << "\"} "
+                << (double)h.percentile(quantiles[q] * 100) / 1e9 << "\n";
+        out << "ircserv_command_latency_seconds_sum{command=\"" << it->first << "\"} " << (double)h.sum() / 1e9 << "\n";
+        out << "ircserv_command_latency_seconds_count{command=\"" << it->first << "\"} " << h.count() << "\n";
+    }
+
+    metric(out, "ircserv_fanout_messages_total", "counter", "Messages broadcast to a channel.");
+    out << "ircserv_fanout_messages_total " << this->_stats.fanoutMessages() << "\n";
+    metric(out, "ircserv_fanout_deliveries_total", "counter", "Copies of broadcast messages handed to members.");
+    out << "ircserv_fanout_deliveries_total " << this->_stats.fanoutDeliveries() << "\n";
+    metric(out, "ircserv_fanout_bytes_total", "counter", "Bytes of broadcast messages handed to members.");
+    out << "ircserv_fanout_bytes_total " << this->_stats.fanoutBytes() << "\n";
+    metric(out, "ircserv_fanout_bytes_in_total", "counter", "Bytes of broadcast messages, one copy each.");
+    out << "ircserv_fanout_bytes_in_total " << this->_stats.fanoutBytesIn() << "\n";
+    metric(out, "ircserv_fanout_messages_per_second", "gauge", "Channel broadcasts over the last second.");
+    out << "ircserv_fanout_messages_per_second " << this->_stats.fanoutMessageRate() << "\n";
+    metric(out, "ircserv_fanout_bytes_per_second", "gauge", "Bytes handed to members over the last second.");
+    out << "ircserv_fanout_bytes_per_second " << this->_stats.fanoutByteRate() << "\n";
+    metric(out, "ircserv_fanout_amplification", "gauge", "Fan-out bytes per byte broadcast, since start.");
+    out << "ircserv_fanout_amplification "
+        << (this->_stats.fanoutBytesIn() ? (double)this->_stats.fanoutBytes() / this->_stats.fanoutBytesIn() : 0.0) << "\n";
+    std::vector<Talker> top;
+    this->_stats.channelTalkers().sorted(top);
+    metric(out, "ircserv_top_channel_bytes", "gauge", "Fan-out bytes of the heaviest channels (estimated, decaying).");
+    for (size_t i = 0; i < top.size(); ++i)
+        out << "ircserv_top_channel_bytes{channel=\"" << labelValue(top[i].key) << "\"} " << top[i].bytes << "\n";
+    this->_stats.userTalkers().sorted(top);
+    metric(out, "ircserv_top_user_bytes", "gauge", "Fan-out bytes of the heaviest senders (estimated, decaying).");
+    for (size_t i = 0; i < top.size(); ++i)
+        out << "ircserv_top_user_bytes{user=\"" << labelValue(top[i].key) << "\"} " << top[i].bytes << "\n";
+    metric(out, "ircserv_sent_bytes_total", "counter", "Bytes written to client sockets.");
+    out << "ircserv_sent_bytes_total " << Stats::sentBytes << "\n";
+
+    metric(out, "ircserv_client_memory_bytes", "gauge", "Memory held by the client table, buffers included.");
+    out << "ircserv_client_memory_bytes " << gauges.clientBytes << "\n";
+    MemoryReport mem;
+    collectMemory(mem);
+    metric(out, "ircserv_memory_bytes", "gauge", "Memory held by each part of the server.");
+    for (int i = 0; i < MEM_AREAS; ++i)
+        out << "ircserv_memory_bytes{area=\"" << MemoryReport::name(i) << "\"} " << mem.bytes[i] << "\n";
+    metric(out, "ircserv_memory_budget_bytes", "gauge", "Configured memory budget (0: none).");
+    out << "ircserv_memory_budget_bytes " << this->_memoryBudget << "\n";
+    metric(out, "ircserv_memory_refused_connections_total", "counter", "Connections turned away while over the memory budget.");
+    out << "ircserv_memory_refused_connections_total " << this->_shedRefused << "\n";
+    metric(out, "ircserv_memory_history_freed_bytes_total", "counter", "Channel history dropped to get back under the memory budget.");
+    out << "ircserv_memory_history_freed_bytes_total " << this->_shedHistoryBytes << "\n";
+    metric(out, "ircserv_memory_sendq_kills_total", "counter", "Clients dropped for their SendQ to get back under the memory budget.");
+    out << "ircserv_memory_sendq_kills_total " << this->_shedKills << "\n";
+    metric(out, "ircserv_overload_mode", "gauge", "Load mode: 0 normal, 1 degraded, 2 critical.");
+    out << "ircserv_overload_mode " << this->_overload.mode() << "\n";
+    metric(out, "ircserv_overload_mode_changes_total", "counter", "Times the load mode went up or down.");
+    out << "ircserv_overload_mode_changes_total " << this->_overload.modeChanges() << "\n";
+    metric(out, "ircserv_overload_shed_total", "counter", "Commands refused or dropped under overload, by class.");
+    for (int i = WORK_JOIN; i < WORK_CLASSES; ++i)
+        out << "ircserv_overload_shed_total{class=\"" << OverloadControl::className(i) << "\"} " << this->_overload.shed(i) << "\n";
+    metric(out, "ircserv_sendq_slow_consumers", "gauge", "Clients over their soft SendQ limit.");
+    out << "ircserv_sendq_slow_consumers " << this->_slowConsumers << "\n";
+    metric(out, "ircserv_sendq_slow_warnings_total", "counter", "Times a client went over its soft SendQ limit.");
+    out << "ircserv_sendq_slow_warnings_total " << this->_slowWarnings << "\n";
+    metric(out, "ircserv_sendq_bulk_refused_total", "counter", "WHO/CHATHISTORY refused to slow consumers.");
+    out << "ircserv_sendq_bulk_refused_total " << this->_bulkRefused << "\n";
+    metric(out, "ircserv_sendq_evictions_total", "counter", "Clients disconnected at their hard SendQ limit.");
+    out << "ircserv_sendq_evictions_total " << this->_sendqEvictions << "\n";
+    metric(out, "ircserv_rejected_lines_total", "counter", "Lines dropped before parsing, by what was wrong with them.");
+    for (int i = 0; i < LINE_FLAG_BITS; ++i)
+        out << "ircserv_rejected_lines_total{reason=\"" << LineScanner::flagName(i) << "\"} " << this->_rejectedLines[i] << "\n";
+    metric(out, "ircserv_spam_messages_total", "counter", "Repeated PRIVMSG/NOTICE texts past spam_threshold, by what was done.");
+    out << "ircserv_spam_messages_total{action=\"flagged\"} " << this->_spamFlagged << "\n";
+    out << "ircserv_spam_messages_total{action=\"dropped\"} " << this->_spamDropped << "\n";
+    metric(out, "ircserv_heap_allocations_total", "counter", "Calls to operator new, from every thread.");
+    out << "ircserv_heap_allocations_total " << Stats::heapAllocations << "\n";
+    metric(out, "ircserv_pool_bytes", "gauge", "Memory held by the fixed-size pools (never returned).");
+    out << "ircserv_pool_bytes " << FixedPool::slabBytes << "\n";
+    metric(out, "ircserv_pool_blocks_in_use", "gauge", "Pool blocks currently handed out.");
+    out << "ircserv_pool_blocks_in_use " << FixedPool::blocksInUse << "\n";
+
+    metric(out, "ircserv_sendq_bytes", "gauge", "Bytes waiting to be sent to clients.");
+    out << "ircserv_sendq_bytes " << gauges.sendqBytes << "\n";
+    metric(out, "ircserv_sendq_high_water_bytes", "gauge", "Largest total SendQ seen.");
+    out << "ircserv_sendq_high_water_bytes " << this->_stats.sendqHighWater() << "\n";
+    metric(out, "ircserv_recvq_high_water_bytes", "gauge", "Largest input buffer of a single client.");
+    out << "ircserv_recvq_high_water_bytes " << this->_stats.recvqHighWater() << "\n";
+
+    metric(out, "ircserv_timer_wheel_timers", "gauge", "Timers scheduled in the timer wheel.");
+    out << "ircserv_timer_wheel_timers " << this->_timers.size() << "\n";
+    metric(out, "ircserv_event_loop_lag_seconds", "gauge", "Delay of the last housekeeping timer.");
+    out << "ircserv_event_loop_lag_seconds " << (double)this->_stats.loopLagNs() / 1e9 << "\n";
+    metric(out, "ircserv_event_loop_lag_max_seconds", "gauge", "Worst housekeeping timer delay seen.");
+    out << "ircserv_event_loop_lag_max_seconds " << (double)this->_stats.loopLagMaxNs() / 1e9 << "\n";
+    metric(out, "ircserv_event_loop_iterations_per_second", "gauge", "poll() wakeups per second.");
+    out << "ircserv_event_loop_iterations_per_second " << this->_stats.loopsPerSecond() << "\n";
+    metric(out, "ircserv_log_records_written_total", "counter", "Log records written by the logger thread.");
+    out << "ircserv_log_records_written_total " << Logger::written() << "\n";
+    metric(out, "ircserv_log_records_dropped_total", "counter", "Log records dropped because the ring was full.");
+    out << "ircserv_log_records_dropped_total " << Logger::dropped() << "\n";
+    if (this->_archive.enabled()) {
+        metric(out, "ircserv_archive_records_written_total", "counter", "Channel messages written to the archive.");
+        out << "ircserv_archive_records_written_total " << this->_archive.written() << "\n";
+        metric(out, "ircserv_archive_records_dropped_total", "counter", "Channel messages dropped because the archive queue was full.");
+        out << "ircserv_archive_records_dropped_total " << this->_archive.dropped() << "\n";
+    }
+    if (this->_trace.enabled()) {
+        metric(out, "ircserv_trace_dropped_bytes_total", "counter", "Trace bytes dropped because the trace writer fell behind.");
+        out << "ircserv_trace_dropped_bytes_total " << this->_trace.droppedBytes() << "\n";
+    }
+    metric(out, "ircserv_links", "gauge", "Servers linked directly to this one.");
+    out << "ircserv_links " << this->_links.size() << "\n";
+    metric(out, "ircserv_servers", "gauge", "Other servers in the network.");
+    out << "ircserv_servers " << this->_servers.size() << "\n";
+    metric(out, "ircserv_remote_users", "gauge", "Users connected to other servers.");
+    out << "ircserv_remote_users " << this->_remoteUsers.size() << "\n";
+    metric(out, "ircserv_link_messages_total", "counter", "Channel messages sent to each neighbour server.");
+    std::map<std::string, LinkTraffic>::const_iterator link;
+    for (link = this->_linkTraffic.begin(); link != this->_linkTraffic.end(); ++link)
+        out << "ircserv_link_messages_total{link=\"" << link->first << "\"} " << link->second.messages << "\n";
+    metric(out, "ircserv_link_bytes_total", "counter", "Bytes of channel messages sent to each neighbour server.");
+    for (link = this->_linkTraffic.begin(); link != this->_linkTraffic.end(); ++link)
+        out << "ircserv_link_bytes_total{link=\"" << link->first << "\"} " << link->second.bytes << "\n";
+    metric(out, "ircserv_link_messages_saved_total", "counter", "Channel messages not sent to a neighbour that had no member (flooding would have).");
+    for (link = this->_linkTraffic.begin(); link != this->_linkTraffic.end(); ++link)
+        out << "ircserv_link_messages_saved_total{link=\"" << link->first << "\"} " << link->second.savedMessages << "\n";
+    metric(out, "ircserv_link_bytes_saved_total", "counter", "Bytes of the channel messages not sent to each neighbour.");
+    for (link = this->_linkTraffic.begin(); link != this->_linkTraffic.end(); ++link)
+        out << "ircserv_link_bytes_saved_total{link=\"" << link->first << "\"} " << link->second.savedBytes << "\n";
+    metric(out, "ircserv_link_zip_plain_bytes_total", "counter", "Bytes of text through zlib on compressed links.");
+    for (link = this->_linkTraffic.begin(); link != this->_linkTraffic.end(); ++link) {
+        out << "ircserv_link_zip_plain_bytes_total{link=\"" << link->first << "\",direction=\"out\"} " << link->second.plainOut << "\n";
+        out << "ircserv_link_zip_plain_bytes_total{link=\"" << link->first << "\",direction=\"in\"} " << link->second.plainIn << "\n";
+    }
+    metric(out, "ircserv_link_zip_wire_bytes_total", "counter", "The same, compressed: what went over the socket.");
+    for (link = this->_linkTraffic.begin(); link != this->_linkTraffic.end(); ++link) {
+        out << "ircserv_link_zip_wire_bytes_total{link=\"" << link->first << "\",direction=\"out\"} " << link->second.wireOut << "\n";
+        out << "ircserv_link_zip_wire_bytes_total{link=\"" << link->first << "\",direction=\"in\"} " << link->second.wireIn << "\n";
+    }
+    metric(out, "ircserv_link_zip_seconds_total", "counter", "Time spent compressing and decompressing link traffic.");
+    for (link = this->_linkTraffic.begin(); link != this->_linkTraffic.end(); ++link)
+        out << "ircserv_link_zip_seconds_total{link=\"" << link->first << "\"} " << link->second.zipNs / 1e9 << "\n";
+    metric(out, "ircserv_admin_requests_total", "counter", "Metrics scrapes served.");
+    out << "ircserv_admin_requests_total " << this->_admin.requests() << "\n";
+    return out.str();
+}
@@ -8,18 +8,53 @@
 #include <unistd.h>
 #include <map>
 #include <cstdio>
-#include <sys/select.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <string>   
 #include <sstream>
-// #define FD_ZERO(fdsetp)
+#include <csignal>
 #include "../Client/Client.hpp"
 #include "../Command/Command.hpp"
 #include "../channel/channel.hpp"
+#include "../Stats/Stats.hpp"
+#include "../Config/Config.hpp"
+#include "../Timer/TimerWheel.hpp"
+#include "../Admin/AdminServer.hpp"
+#include "../Logger/Logger.hpp"
+#include "../Trace/Trace.hpp"
+#include "../Transport/Transport.hpp"
+#include "../Archive/Archive.hpp"
+#include "../Snapshot/Snapshot.hpp"
+#include "../Upgrade/Upgrade.hpp"
+#include "../Link/Link.hpp"
+#include "../Memory/Pool.hpp"
+#include "../Memory/Budget.hpp"
+#include "../Overload/Overload.hpp"
+#include "../Overload/SendqClass.hpp"
+#include "../Protocol/LineScanner.hpp"
+#include "../Protocol/Names.hpp"
+#include "../Monitor/Monitor.hpp"
+#include "../Spam/SpamFilter.hpp"
+#include <set>
+#include <deque>
 
 class Channel;
 
-class Server{
+enum TimerKind {
+	TIMER_HOUSEKEEPING = 0,	// once a second: loop lag, queue high-water marks
+	TIMER_ADMIN_IDLE,		// admin connection that never finished its request
+	TIMER_SNAPSHOT,			// every snapshot_interval_ms: save the channel registry
+	TIMER_LINK_RETRY,		// every link_retry_ms: reconnect the link_connect servers that are down
+	TIMER_BUFFER_TRIM,		// every buffer_trim_ms: idle clients give their I/O buffers back
+};
+
+// Client map nodes come from a pool: connect/disconnect churn reuses them
+typedef std::map<int, Client, std::less<int>, PoolAllocator<std::pair<const int, Client> > > ClientMap;
+// A deque never moves its channels: pointers stay valid across new_join(),
+// and growing the registry doesn't copy every channel (and its history)
+typedef std::deque<Channel> ChannelList;
+
+class Server : public MetricsProvider {
 	private:
 	int 		_port;
 	std::string _password;
@@ -28,44 +63,223 @@ class Server{
 	//separate socket for the private conversation with that specific client.
 	//it will never be used to send or receive actual chat msg .... only waiting new clients
 
-	std::map<int , Client> _clients;
-	std::vector<Channel> _Channels;
+	ClientMap	_clients;
+	ChannelList	_Channels;
 
-	fd_set _master_set;
-    int    _max_fd;
+	Transport&	_transport;	// sockets in production, in-memory pipes in tools/
+	std::vector<int>	_flushList;	// clients with replies queued since the last flush
+	// Buffers reused by the hot path so a message costs no allocations
+	std::vector<pollfd>	_pollFds;
+	std::string			_lineScratch;	// the line being processed
+	size_t				_inputHandled;	// how much of its input buffer is done
+	Command				_parsed;		// ...and its parse
+	std::string			_msgScratch;	// PRIVMSG/NOTICE as our clients see it
+	std::string			_linkScratch;	// ...and as other servers do
+	unsigned long		_sendqBytes;	// sum of every client's SendQ
+
+	Config		_config;
+	Stats		_stats;
+	TimerWheel	_timers;
+	AdminServer	_admin;
+	TraceWriter	_trace;
+	HistoryLimits	_historyLimits;
+	size_t			_historyPlaybackMax;	// most lines one CHATHISTORY may return
+	unsigned long	_nextMsgid;
+	unsigned long	_nextBatchId;
+	ChannelArchive	_archive;
+	std::string		_snapshotFile;
+	unsigned long	_snapshotIntervalMs;
+	unsigned long	_bufferTrimMs;
+	SnapshotWriter	_snapshotWriter;
+	std::vector<std::string> _upgradeArgv;	// how to start the new binary on SIGUSR2
+	std::string				_upgradePath;	// argv[0] made absolute at startup
+	int				_upgradeTimeoutMs;
+	bool			_handedOff;	// the clients belong to the new process now
+	std::string		_serverName;	// our name towards other servers
+	std::string		_serverInfo;
+	std::string		_linkPassword;
+	unsigned long	_linkRetryMs;
+	bool			_linkCompress;	// offer CAPAB ZIP to other servers
+	int				_linkCompressLevel;
+	std::map<int, Link>	_links;	// neighbour servers, by fd (they are in _clients too)
+	std::vector<LinkTarget> _linkTargets;
+	std::map<std::string, RemoteServer> _servers;	// every other server in the tree
+	std::map<int, RemoteUser> _remoteUsers;	// by id, always < 0
+	std::map<std::string, int> _remoteNicks;	// nick -> id
+	// Channel name -> link -> remote members behind it: where PRIVMSG goes
+	std::map<std::string, std::map<int, unsigned int> > _channelLinks;
+	std::map<std::string, LinkTraffic> _linkTraffic;	// by server name
+	int				_nextRemoteId;
+	// Memory budget (ServerMemory.cpp)
+	size_t			_memoryBudget;		// bytes, 0: no budget
+	bool			_refusingClients;	// over budget: new connections are turned away
+	unsigned long	_shedRefused;		// connections turned away
+	unsigned long	_shedHistoryBytes;	// history given back
+	unsigned long	_shedKills;			// clients dropped for their SendQ
+	std::string		_operName;
+	std::string		_operPassword;	// empty: OPER is disabled
+	OverloadControl	_overload;
+	// Slow consumers (ServerSendq.cpp)
+	SendqClass		_sendqClasses[SENDQ_CLASSES];
+	std::vector<int> _evictList;		// over the hard limit this turn
+	size_t			_slowConsumers;		// clients over their soft limit now
+	unsigned long	_slowWarnings;		// times a client went over its soft limit
+	unsigned long	_bulkRefused;		// WHO/CHATHISTORY refused to slow consumers
+	unsigned long	_sendqEvictions;	// clients dropped at their hard limit
+	// Line checks (Protocol/LineScanner.hpp)
+	bool			_allowBareLf;		// a lone LF ends a line
+	bool			_utf8Only;			// lines that are not UTF-8 are refused
+	unsigned long	_rejectedLines[LINE_FLAG_BITS];	// by LineFlags bit
+	size_t			_maxListEntries;	// per +b/+e list, set by users (links aren't held to it)
+	// The channels each user (fd, or negative id for remote users) is on,
+	// kept with the member lists. Channels never leave the deque, so the
+	// pointers stay good.
+	std::map<int, std::vector<Channel*> > _joined;
+	// channelPeers(): a client is taken when its stamp isn't this walk's yet
+	std::vector<unsigned long> _peerStamps;	// by fd
+	unsigned long	_peerWalk;
+	std::vector<int> _peers;
+	MonitorIndex	_monitor;			// MONITOR lists (ServerMonitor.cpp)
+	size_t			_monitorMax;		// nicks a client may watch
+	SpamFilter		_spam;				// repeated PRIVMSG/NOTICE texts
+	bool			_spamDrop;			// spam_action = drop; by default only counted and logged
+	unsigned long	_spamFlagged;
+	unsigned long	_spamDropped;
+	static volatile sig_atomic_t _statsDumpRequested; // set from the SIGUSR1 handler
+	static volatile sig_atomic_t _stopRequested; // set from the SIGINT/SIGTERM handler
+	static volatile sig_atomic_t _upgradeRequested; // set from the SIGUSR2 handler
 	// I puted those two to make the server non copyable
 	Server(const Server& other);
 	Server&	operator=(const Server &other);
 	
-	//Method to setup my socket
-	void setupSocket();
-	void bindSocket();
-	void startListening();
 	void handleNewConnection();
 	void handleClientData(int clientFd);
-	void handleClientDisconnect(int clientFd);
-    void processCommand(int clientFd, const std::string& command);
-	void executeCommand(int clientFd, const Command& cmd);
+	void rejectLine(int clientFd, const std::string& line, unsigned flags);
+	// toLinks = false when the other servers already know (a KILL)
+	void handleClientDisconnect(int clientFd, const std::string& reason = "Connection closed", bool toLinks = true);
+    void processCommand(int clientFd, const std::string& command, size_t wireBytes);
+	bool executeCommand(int clientFd, const Command& cmd);
+	bool admitCommand(int clientFd, const Command& cmd);
+	void tryAgain(int clientFd, const Command& cmd);
+	void checkOverload();
 	void handlePass(int clientFd, const Command& cmd);
     void handleNick(int clientFd, const Command& cmd);
     void handleUser(int clientFd, const Command& cmd);
 	void handleWho(int clientFd, const Command& cmd);
+	void handleStats(int clientFd, const Command& cmd);
+	void handleOper(int clientFd, const Command& cmd);
+	StatsGauges collectGauges() const;
+	void dumpStats(const std::string& path) const;
+	static void onStatsSignal(int signum);
+	static void onStopSignal(int signum);
+	void saveSnapshot(bool async);
+	void loadSnapshot();
+	static void onUpgradeSignal(int signum);
+	void openServices();
+	bool handOff();
+	void encodeState(StateEncoder& out, std::vector<int>& fds);
+	void resumeFrom(int sock);
+
+	// SERVER LINKS (ServerLink.cpp)
+	std::string nickOf(int id);
+	std::string maskOf(int id);
+	unsigned long signonOf(int id);
+	bool isLink(int fd) const;
+	void propagate(const std::string& line, int exceptLink);
+	void routeToChannel(Channel& ch, const std::string& localMsg, const std::string& linkMsg, int senderId, int fromLink);
+	void routeToUser(int id, const std::string& localMsg, const std::string& linkMsg);
+	void connectLinks();
+	void handleServer(int clientFd, const Command& cmd);
+	void handleCapab(int clientFd, const Command& cmd);
+	bool startZip(int linkFd);
+	void compressOutput(int clientFd, Client& client);
+	bool inflateInput(int linkFd, const char* data, size_t len, std::string& out);
+	bool acceptLink(int linkFd, const Command& cmd);
+	void sendBurst(int linkFd);
+	void dropLink(int linkFd);
+	void forgetServers(const std::set<std::string>& names, const std::string& reason);
+	void removeRemoteUser(int id, const std::string& reason);
+	void noteRemoteJoin(const std::string& channel, int id);
+	void noteRemotePart(const std::string& channel, int id);
+	void reportLinks(std::vector<std::string>& lines);
+	void killUser(int id, const std::string& reason, int fromLink);
+	bool settleCollision(int existing, unsigned long theirs, int fromLink);
+	void introduceLocal(int clientFd);
+	void handleLinkLine(int linkFd, const std::string& line);
+	void onLinkServer(int linkFd, const std::string& origin, const std::vector<std::string>& params);
+	void onLinkSquit(int linkFd, const std::vector<std::string>& params);
+	void onLinkIntroduce(int linkFd, const std::string& line, const std::vector<std::string>& params);
+	void onLinkNick(int linkFd, const std::string& line, int id, const std::vector<std::string>& params);
+	void onLinkKill(int linkFd, const std::vector<std::string>& params);
+	void onLinkSjoin(int linkFd, const std::string& line, const std::vector<std::string>& params);
+	void onLinkJoin(int linkFd, const std::string& line, int id, const std::vector<std::string>& params);
+	void onLinkLeave(int linkFd, const std::string& line, int id, const Command& cmd);
+	void onLinkMode(int linkFd, const std::string& line, int id, const std::vector<std::string>& params);
+	void onLinkTopic(int linkFd, const std::string& line, int id, const std::vector<std::string>& params);
+	void onLinkInvite(const std::string& line, int id, const std::vector<std::string>& params);
+	void onLinkPrivmsg(int linkFd, const std::string& line, int id, const Command& cmd);
+	void onTimer(const TimerEvent& ev);
+
+	// MEMORY (ServerMemory.cpp)
+	void collectMemory(MemoryReport& mem);
+	void enforceMemoryBudget();
+	void reportMemory(std::vector<std::string>& lines);
+
+	// SLOW CONSUMERS (ServerSendq.cpp)
+	const SendqClass& sendqLimits(int clientFd, const Client& client) const;
+	void checkSlowConsumers();
+	void evictSlowConsumers();
+	void reportSendq(std::vector<std::string>& lines);
+
+	// MONITOR (ServerMonitor.cpp)
+	void handleMonitor(int clientFd, const Command& cmd);
+	void sendMonitorList(int clientFd, const char* numeric, const std::vector<std::string>& items);
+	void notifyPresence(const std::string& nick, int id, bool online);
+
+	// BANS (ServerBans.cpp)
+	void handleListMode(int clientFd, const Command& cmd, Channel& ch);
+	void listMasks(int clientFd, Channel& ch, char list);
+
+	size_t broadcastToChannel(Channel& ch, const std::string& msg, int exceptFd);
+	// Every add_member()/part() goes with one of these
+	void trackJoin(Channel& ch, int id);
+	void trackPart(Channel& ch, int id);
+	// Local clients sharing a channel with `id`, each once, `id` left out
+	const std::vector<int>& channelPeers(int id);
+	void recordHistory(Channel& ch, const std::string& msg);
 	void reply(int clientFd, const std::string& message);
+	bool flushClient(int clientFd);
+	void flushPending();
 	public:
 	//password by reference to not copy it and go exactly whre i have it
-	Server(int port, const std::string &password);
+	Server(int port, const std::string &password, const Config& config, Transport& transport);
 	~Server();
 	void run();
+	// One turn of the event loop. maxWaitMs caps the sleep (-1: timers decide).
+	// Returns false on a fatal poll() error.
+	bool pollOnce(int maxWaitMs);
+	// Queues msg on the client's SendQ; it goes out at the end of the loop turn
+	void sendReply(int clientFd, const std::string &msg);
+	void sendUrgent(int clientFd, const std::string &msg);
+	void queueReply(int clientFd, const std::string &msg, bool urgent);
+	std::string renderMetrics();
+	// Command line of the binary to exec on SIGUSR2 (usually our own argv)
+	void setUpgradeCommand(int argc, char** argv);
+	// Bytes held by the client table: the entries and the heap behind them
+	size_t clientMemory() const;
+	// Idle clients (no traffic since the last call) give their buffers back.
+	// Returns how many clients hold no buffers now.
+	size_t trimIdleBuffers();
 
 	// JOIN
-	bool findChannelByName_b(std::vector<Channel>& channels, const std::string& name);
-	Channel* findChannelByName(std::vector<Channel>& channels, const std::string& name);
+	bool findChannelByName_b(ChannelList& channels, const std::string& name);
+	Channel* findChannelByName(ChannelList& channels, const std::string& name);
 	void handleJoin(int clientFd, const Command& cmd);
 	void sendJoinMessages(Channel& ch, int clientFd);
 	void new_join(std::string channel, int cl);
 
 	// HANDLE CHANNEL
-	int	search_fd_name(std::string name);
+	int	search_fd_name(const std::string& name);
 	void handleTopic(int clientFd, const Command& cmd);
 	void handlePart(int clientFd, const Command& cmd);
 	void handleKick(int clientFd, const Command& cmd);
@@ -73,9 +287,9 @@ class Server{
 	void handleMode(int clientFd, const Command& cmd);
 	void handleModeQuery(int clientFd, const Command& cmd);
 	void handlePrivmsg(int clientFd, const Command& cmd);
+	bool dropAsSpam(const Client& sender, const std::string& target, const std::string& message);
 	void handlePing(int clientFd, const Command& cmd);
 	void handleQuit(int clientFd, const Command& cmd);
-	ChannelError check_name(std::string name, int cl);
+	void handleChathistory(int clientFd, const Command& cmd);
+	ChannelError check_name(const std::string& name, int cl);
 };
-
-void sendReply(int clientFd, const std::string &msg);
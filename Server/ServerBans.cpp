@@ -0,0 +1,54 @@
+#include "Server.hpp"
+#include <sstream>
+#include <ctime>
+
+// Channel ban (+b) and exception (+e) lists. Setting takes a channel
+// operator, looking at them only a name: MODE #chan b, MODE #chan +e.
+
+void Server::handleListMode(int clientFd, const Command& cmd, Channel& ch)
+{
+    const std::vector<std::string>& params = cmd.getParams();
+    const std::string& mode = params[1];
+    char list = mode[mode.size() - 1];
+    const std::string& nick = this->_clients[clientFd].getNickname();
+    if (mode.size() == 1 || params.size() < 3)
+        return listMasks(clientFd, ch, list);
+    if (!ch.isMember(clientFd)) {
+        sendReply(clientFd, ":ircserv 442 " + nick + " " + ch.get_name() + " :You're not on that channel\r\n");
+        return;
+    }
+    if (!ch.isOperator(clientFd)) {
+        sendReply(clientFd, ":ircserv 482 " + nick + " " + ch.get_name() + " :You're not channel operator\r\n");
+        return;
+    }
+    std::string mask = WildMask::normalize(params[2]);
+    if (mode[0] == '+') {
+        if (ch.get_masks(list).size() >= this->_maxListEntries) {
+            sendReply(clientFd, ":ircserv 478 " + nick + " " + ch.get_name() + " " + list + " :Channel list is full\r\n");
+            return;
+        }
+        if (!ch.add_mask(list, mask, maskOf(clientFd), std::time(NULL)))
+            return;
+    } else if (!ch.remove_mask(list, mask))
+        return;
+    broadcastToChannel(ch, ":" + maskOf(clientFd) + " MODE " + ch.get_name() + " " + mode + " " + mask + "\r\n", -1);
+    propagate(":" + nick + " MODE " + ch.get_name() + " " + mode + " " + mask, -1);
+}
+
+// RPL_BANLIST (367) / RPL_EXCEPTLIST (348), then the end of the list
+void Server::listMasks(int clientFd, Channel& ch, char list)
+{
+    const std::string& nick = this->_clients[clientFd].getNickname();
+    const std::vector<MaskEntry>& entries = ch.get_masks(list).entries();
+    const char* item = list == 'e' ? " 348 " : " 367 ";
+    for (size_t i = 0; i < entries.size(); ++i) {
+        std::ostringstream oss;
+        oss << ":ircserv" << item << nick << " " << ch.get_name() << " " << entries[i].mask.pattern()
+            << " " << entries[i].setBy << " " << entries[i].setAt << "\r\n";
+        sendReply(clientFd, oss.str());
+    }
+    if (list == 'e')
+        sendReply(clientFd, ":ircserv 349 " + nick + " " + ch.get_name() + " :End of channel exception list\r\n");
+    else
+        sendReply(clientFd, ":ircserv 368 " + nick + " " + ch.get_name() + " :End of channel ban list\r\n");
+}
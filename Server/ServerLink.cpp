@@ -0,0 +1,837 @@
+#include "Server.hpp"
+#include "../Link/ZipStream.hpp"
+#include <cerrno>
+#include <ctime>
+#include <set>
+#include <algorithm>
+
+// Server-to-server links, see Link/Link.hpp for the protocol. Neighbour
+// servers are connections in _clients like everybody else (same buffers,
+// same SendQ); _links says which ones they are.
+
+// ":origin VERB params" -> "origin", and "VERB params" in rest
+static std::string splitPrefix(const std::string& line, std::string& rest)
+{
+    if (line.empty() || line[0] != ':') {
+        rest = line;
+        return "";
+    }
+    size_t space = line.find(' ');
+    if (space == std::string::npos) {
+        rest = "";
+        return line.substr(1);
+    }
+    rest = line.substr(space + 1);
+    return line.substr(1, space - 1);
+}
+
+static std::string toString(unsigned long value)
+{
+    std::ostringstream oss;
+    oss << value;
+    return oss.str();
+}
+
+static bool byHops(const RemoteServer* a, const RemoteServer* b)
+{
+    return a->hops < b->hops;
+}
+
+std::string Server::nickOf(int id)
+{
+    if (id >= 0) {
+        ClientMap::iterator it = this->_clients.find(id);
+        return it == this->_clients.end() ? "" : it->second.getNickname();
+    }
+    std::map<int, RemoteUser>::iterator it = this->_remoteUsers.find(id);
+    return it == this->_remoteUsers.end() ? "" : it->second.nick;
+}
+
+// nick!user@host as local clients see it
+std::string Server::maskOf(int id)
+{
+    if (id >= 0) {
+        ClientMap::iterator it = this->_clients.find(id);
+        if (it == this->_clients.end())
+            return "*";
+        return it->second.getNickname() + "!" + it->second.getUsername() + "@localhost";
+    }
+    std::map<int, RemoteUser>::iterator it = this->_remoteUsers.find(id);
+    if (it == this->_remoteUsers.end())
+        return "*";
+    return it->second.nick + "!" + it->second.user + "@" + it->second.server.str();
+}
+
+unsigned long Server::signonOf(int id)
+{
+    if (id >= 0) {
+        ClientMap::iterator it = this->_clients.find(id);
+        return it == this->_clients.end() ? 0 : it->second.getSignon();
+    }
+    std::map<int, RemoteUser>::iterator it = this->_remoteUsers.find(id);
+    return it == this->_remoteUsers.end() ? 0 : it->second.signon;
+}
+
+bool Server::isLink(int fd) const
+{
+    return this->_links.find(fd) != this->_links.end();
+}
+
+// Every established link but one
+void Server::propagate(const std::string& line, int exceptLink)
+{
+    for (std::map<int, Link>::iterator it = this->_links.begin(); it != this->_links.end(); ++it) {
+        if (it->first != exceptLink && it->second.established)
+            sendReply(it->first, line + "\r\n");
+    }
+}
+
+// Channel message: local members get localMsg, and every link with at least
+// one member behind it gets linkMsg once. fromLink (-1 if the sender is
+// ours) already has it.
+void Server::routeToChannel(Channel& ch, const std::string& localMsg, const std::string& linkMsg, int senderId, int fromLink)
+{
+    size_t recipients = broadcastToChannel(ch, localMsg, senderId);
+    // Who the fan-out is for, in the talker sketch (STATS f)
+    if (senderId > 0)
+        this->_stats.recordTalker(this->_clients.find(senderId)->second.getNickname(), recipients, localMsg.size());
+    else {
+        std::map<int, RemoteUser>::const_iterator remote = this->_remoteUsers.find(senderId);
+        if (remote != this->_remoteUsers.end())
+            this->_stats.recordTalker(remote->second.nick, recipients, localMsg.size());
+    }
+    if (this->_links.empty())
+        return;
+    std::string line = linkMsg + "\r\n";
+    std::map<std::string, std::map<int, unsigned int> >::const_iterator interest = this->_channelLinks.find(ch.get_name());
+    for (std::map<int, Link>::iterator it = this->_links.begin(); it != this->_links.end(); ++it) {
+        if (it->first == fromLink || !it->second.established)
+            continue;
+        LinkTraffic& traffic = this->_linkTraffic[it->second.name];
+        if (interest != this->_channelLinks.end() && interest->second.count(it->first)) {
+            sendReply(it->first, line);
+            traffic.messages++;
+            traffic.bytes += line.size();
+        } else {
+            traffic.savedMessages++;
+            traffic.savedBytes += line.size();
+        }
+    }
+}
+
+// Keep _channelLinks in step with the remote members of each channel
+void Server::noteRemoteJoin(const std::string& channel, int id)
+{
+    std::map<int, RemoteUser>::iterator it = this->_remoteUsers.find(id);
+    if (it != this->_remoteUsers.end())
+        this->_channelLinks[channel][it->second.link]++;
+}
+
+void Server::noteRemotePart(const std::string& channel, int id)
+{
+    std::map<int, RemoteUser>::iterator it = this->_remoteUsers.find(id);
+    std::map<std::string, std::map<int, unsigned int> >::iterator ch = this->_channelLinks.find(channel);
+    if (it == this->_remoteUsers.end() || ch == this->_channelLinks.end())
+        return;
+    std::map<int, unsigned int>::iterator link = ch->second.find(it->second.link);
+    if (link != ch->second.end() && --link->second == 0)
+        ch->second.erase(link);
+    if (ch->second.empty())
+        this->_channelLinks.erase(ch);
+}
+
+// STATS l: one line per neighbour
+void Server::reportLinks(std::vector<std::string>& lines)
+{
+    for (std::map<int, Link>::iterator it = this->_links.begin(); it != this->_links.end(); ++it) {
+        if (!it->second.established)
+            continue;
+        const LinkTraffic& traffic = this->_linkTraffic[it->second.name];
+        ClientMap::iterator client = this->_clients.find(it->first);
+        lines.push_back(it->second.name + " " + toString(client->second.pendingOutputSize()) + " "
+            + toString(traffic.messages) + " " + toString(traffic.bytes) + " "
+            + toString(traffic.savedMessages) + " " + toString(traffic.savedBytes) + " "
+            + toString(traffic.plainOut) + " " + toString(traffic.wireOut));
+    }
+}
+
+// Private message or INVITE for one user, wherever they are
+void Server::routeToUser(int id, const std::string& localMsg, const std::string& linkMsg)
+{
+    if (id >= 0) {
+        sendReply(id, localMsg);
+        return;
+    }
+    std::map<int, RemoteUser>::iterator it = this->_remoteUsers.find(id);
+    if (it != this->_remoteUsers.end())
+        sendReply(it->second.link, linkMsg + "\r\n");
+}
+
+// Opens the link_connect connections that are not up. The connect is
+// non-blocking: SERVER waits in the SendQ until the socket is writable.
+void Server::connectLinks()
+{
+    for (size_t i = 0; i < this->_linkTargets.size(); ++i) {
+        LinkTarget& target = this->_linkTargets[i];
+        if (target.fd != -1)
+            continue;
+        int fd = this->_transport.connectTo(target.host, target.port);
+        if (fd < 0) {
+            LOG_WARN("Could not link to " << target.host << ":" << target.port << ": " << std::strerror(errno));
+            continue;
+        }
+        this->_clients.insert(std::make_pair(fd, Client(fd)));
+        Link link;
+        link.target = i;
+        this->_links[fd] = link;
+        target.fd = fd;
+        if (this->_linkCompress)
+            sendReply(fd, "CAPAB :ZIP\r\n");
+        sendReply(fd, "SERVER " + this->_serverName + " " + this->_linkPassword + " :" + this->_serverInfo + "\r\n");
+        LOG_INFO("Linking to " << target.host << ":" << target.port << " on socket " << fd);
+    }
+}
+
+// SERVER from a connection that is not registered: a neighbour calling us
+void Server::handleServer(int clientFd, const Command& cmd)
+{
+    Client& client = this->_clients.find(clientFd)->second;
+    if (client.isRegistered() || client.isAuthenticated()) {
+        reply(clientFd, ":ircserv 462 " + (client.getNickname().empty() ? "*" : client.getNickname()) + " :You may not reregister\r\n");
+        return;
+    }
+    this->_links[clientFd] = Link();
+    acceptLink(clientFd, cmd);
+}
+
+// CAPAB before SERVER: a neighbour calling us says what it can do. From
+// here on the connection is handled as a link.
+void Server::handleCapab(int clientFd, const Command& cmd)
+{
+    Client& client = this->_clients.find(clientFd)->second;
+    if (client.isRegistered() || client.isAuthenticated()) {
+        reply(clientFd, ":ircserv 462 " + (client.getNickname().empty() ? "*" : client.getNickname()) + " :You may not reregister\r\n");
+        return;
+    }
+    Link& link = this->_links[clientFd];
+    const std::vector<std::string>& params = cmd.getParams();
+    for (size_t i = 0; i < params.size(); ++i) {
+        std::istringstream tokens(params[i]);
+        std::string token;
+        while (tokens >> token) {
+            if (token == "ZIP")
+                link.zipOffered = true;
+        }
+    }
+}
+
+// Both sides offered ZIP and our SERVER line is queued: from here on both
+// directions are zlib streams
+bool Server::startZip(int linkFd)
+{
+    Link& link = this->_links[linkFd];
+    link.deflater = new ZipStream(true, this->_linkCompressLevel);
+    link.inflater = new ZipStream(false, 0);
+    Client& client = this->_clients.find(linkFd)->second;
+    client.startCompression();
+    // What they sent after their SERVER line is compressed already. The
+    // lines before it are still in the buffer (handleClientData cuts them
+    // off at the end), plain, and stay as they are.
+    std::string& buffered = client.getBuffer();
+    size_t handled = std::min(this->_inputHandled, buffered.size());
+    std::string plain(buffered, 0, handled);
+    if (!inflateInput(linkFd, buffered.data() + handled, buffered.size() - handled, plain))
+        return false;
+    buffered.swap(plain);
+    LOG_INFO("Compressing the link to " << link.name);
+    return true;
+}
+
+void Server::compressOutput(int clientFd, Client& client)
+{
+    std::map<int, Link>::iterator it = this->_links.find(clientFd);
+    if (it == this->_links.end() || it->second.deflater == NULL)
+        return;
+    std::string plain = client.takePlainOutput();
+    std::string wire;
+    unsigned long start = Stats::nowNs();
+    it->second.deflater->compress(plain.data(), plain.size(), wire);
+    LinkTraffic& traffic = this->_linkTraffic[it->second.name];
+    traffic.zipNs += Stats::nowNs() - start;
+    traffic.plainOut += plain.size();
+    traffic.wireOut += wire.size();
+    client.queueCompressed(wire);
+    this->_sendqBytes = this->_sendqBytes - plain.size() + wire.size();
+}
+
+// Raw bytes read from a link -> text for the line parser
+bool Server::inflateInput(int linkFd, const char* data, size_t len, std::string& out)
+{
+    Link& link = this->_links[linkFd];
+    if (link.inflater == NULL) {
+        out.append(data, len);
+        return true;
+    }
+    size_t before = out.size();
+    unsigned long start = Stats::nowNs();
+    bool ok = link.inflater->decompress(data, len, out);
+    LinkTraffic& traffic = this->_linkTraffic[link.name];
+    traffic.zipNs += Stats::nowNs() - start;
+    traffic.wireIn += len;
+    traffic.plainIn += out.size() - before;
+    return ok;
+}
+
+// Both ends: checks the other side's SERVER, answers if they called us,
+// then bursts. Returns false if the link was dropped.
+bool Server::acceptLink(int linkFd, const Command& cmd)
+{
+    const std::vector<std::string>& params = cmd.getParams();
+    std::string error;
+    if (params.size() < 2)
+        error = "Not enough parameters";
+    else if (this->_linkPassword.empty() || params[1] != this->_linkPassword)
+        error = "Bad link password";
+    else if (params[0] == this->_serverName || this->_servers.count(params[0]))
+        error = "Server " + params[0] + " already exists";
+    if (!error.empty()) {
+        LOG_WARN("Refusing server link on socket " << linkFd << ": " << error);
+        sendReply(linkFd, "ERROR :" + error + "\r\n");
+        handleClientDisconnect(linkFd);
+        return false;
+    }
+
+    Link& link = this->_links[linkFd];
+    if (link.target == -1) { // they called: answer with who we are
+        if (this->_linkCompress)
+            sendReply(linkFd, "CAPAB :ZIP\r\n");
+        sendReply(linkFd, "SERVER " + this->_serverName + " " + this->_linkPassword + " :" + this->_serverInfo + "\r\n");
+    }
+    link.name = params[0];
+    link.established = true;
+    if (this->_linkCompress && link.zipOffered && !startZip(linkFd)) {
+        LOG_WARN("Corrupt compressed data from server " << link.name);
+        handleClientDisconnect(linkFd, "Corrupt compressed data");
+        return false;
+    }
+
+    RemoteServer server;
+    server.name = params[0];
+    server.uplink = this->_serverName;
+    server.info = params.size() > 2 ? params[2] : "";
+    server.link = linkFd;
+    server.hops = 1;
+    this->_servers[server.name] = server;
+    propagate(":" + this->_serverName + " SERVER " + server.name + " 2 :" + server.info, linkFd);
+    LOG_INFO("Linked with server " << server.name << " on socket " << linkFd);
+
+    sendBurst(linkFd);
+    return true;
+}
+
+// Everything we know, to a neighbour that just linked
+void Server::sendBurst(int linkFd)
+{
+    std::vector<const RemoteServer*> servers;
+    for (std::map<std::string, RemoteServer>::const_iterator it = this->_servers.begin(); it != this->_servers.end(); ++it) {
+        if (it->second.link != linkFd)
+            servers.push_back(&it->second);
+    }
+    // Parents before their children
+    std::sort(servers.begin(), servers.end(), byHops);
+    for (size_t i = 0; i < servers.size(); ++i)
+        sendReply(linkFd, ":" + servers[i]->uplink + " SERVER " + servers[i]->name + " "
+            + toString(servers[i]->hops + 1) + " :" + servers[i]->info + "\r\n");
+
+    for (ClientMap::iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
+        if (it->second.isRegistered() && !isLink(it->first))
+            sendReply(linkFd, "NICK " + it->second.getNickname() + " " + toString(it->second.getSignon()) + " "
+                + it->second.getUsername() + " " + this->_serverName + " :" + it->second.getRealname() + "\r\n");
+    }
+    for (std::map<int, RemoteUser>::iterator it = this->_remoteUsers.begin(); it != this->_remoteUsers.end(); ++it) {
+        if (it->second.link != linkFd)
+            sendReply(linkFd, "NICK " + it->second.nick + " " + toString(it->second.signon) + " "
+                + it->second.user + " " + it->second.server.str() + " :" + it->second.realname.str() + "\r\n");
+    }
+
+    for (size_t i = 0; i < this->_Channels.size(); ++i) {
+        Channel& ch = this->_Channels[i];
+        int* modes = ch.get_modes();
+        std::string flags = "+";
+        std::string args;
+        if (modes[0]) flags += "i";
+        if (modes[3]) flags += "t";
+        if (modes[1]) {
+            flags += "k";
+            args += " " + ch.get_password();
+        }
+        if (modes[2] != -1) {
+            flags += "l";
+            args += " " + toString(modes[2]);
+        }
+        std::string names;
+        const std::vector<int>& members = ch.get_members();
+        for (size_t j = 0; j < members.size(); ++j) {
+            std::string nick = nickOf(members[j]);
+            if (nick.empty())
+                continue;
+            names += (names.empty() ? "" : " ") + std::string(ch.isOperator(members[j]) ? "@" : "") + nick;
+        }
+        sendReply(linkFd, "SJOIN " + ch.get_name() + " " + flags + args + " :" + names + "\r\n");
+        if (!ch.get_topic().empty())
+            sendReply(linkFd, ":" + this->_serverName + " TOPIC " + ch.get_name() + " :" + ch.get_topic() + "\r\n");
+        // Ban and exception lists: the other side merges them into its own
+        for (int l = 0; l < 2; ++l) {
+            char list = l == 0 ? 'b' : 'e';
+            const std::vector<MaskEntry>& entries = ch.get_masks(list).entries();
+            for (size_t j = 0; j < entries.size(); ++j)
+                sendReply(linkFd, ":" + this->_serverName + " MODE " + ch.get_name() + " +" + list + " "
+                    + entries[j].mask.pattern() + "\r\n");
+        }
+    }
+}
+
+// A neighbour is gone: so is everything behind it (netsplit)
+void Server::dropLink(int linkFd)
+{
+    std::map<int, Link>::iterator it = this->_links.find(linkFd);
+    if (it == this->_links.end())
+        return;
+    Link link = it->second;
+    this->_links.erase(it);
+    delete link.deflater;
+    delete link.inflater;
+    if (link.target >= 0)
+        this->_linkTargets[link.target].fd = -1;
+    if (!link.established)
+        return;
+
+    std::set<std::string> gone;
+    for (std::map<std::string, RemoteServer>::iterator s = this->_servers.begin(); s != this->_servers.end(); ++s) {
+        if (s->second.link == linkFd)
+            gone.insert(s->first);
+    }
+    forgetServers(gone, this->_serverName + " " + link.name);
+    propagate(":" + this->_serverName + " SQUIT " + link.name + " :Link closed", -1);
+    LOG_WARN("Lost server link to " << link.name << " (" << gone.size() << " servers behind it)");
+}
+
+// Drops the servers and their users; local channel members see the users QUIT
+void Server::forgetServers(const std::set<std::string>& names, const std::string& reason)
+{
+    std::vector<int> users;
+    for (std::map<int, RemoteUser>::iterator it = this->_remoteUsers.begin(); it != this->_remoteUsers.end(); ++it) {
+        if (names.count(it->second.server.str()))
+            users.push_back(it->first);
+    }
+    for (size_t i = 0; i < users.size(); ++i)
+        removeRemoteUser(users[i], reason);
+    for (std::set<std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
+        this->_servers.erase(*it);
+}
+
+void Server::removeRemoteUser(int id, const std::string& reason)
+{
+    std::map<int, RemoteUser>::iterator it = this->_remoteUsers.find(id);
+    if (it == this->_remoteUsers.end())
+        return;
+    notifyPresence(it->second.nick, id, false);
+    std::string quitMsg = ":" + maskOf(id) + " QUIT :" + reason + "\r\n";
+    const std::vector<int>& peers = channelPeers(id);
+    for (size_t i = 0; i < peers.size(); ++i)
+        sendReply(peers[i], quitMsg);
+    std::map<int, std::vector<Channel*> >::iterator joined = this->_joined.find(id);
+    if (joined != this->_joined.end()) {
+        for (size_t i = 0; i < joined->second.size(); ++i) {
+            joined->second[i]->part(id, reason);
+            noteRemotePart(joined->second[i]->get_name(), id);
+        }
+        this->_joined.erase(joined);
+    }
+    this->_remoteNicks.erase(it->second.nick);
+    this->_remoteUsers.erase(it);
+}
+
+// Removes a user from the whole network. For one of ours that means closing
+// the connection; KILL carries the signon time so that a server which
+// already settled the collision the other way ignores it.
+void Server::killUser(int id, const std::string& reason, int fromLink)
+{
+    std::string nick = nickOf(id);
+    unsigned long signon = signonOf(id);
+    propagate(":" + this->_serverName + " KILL " + nick + " " + toString(signon) + " :" + reason, fromLink);
+    if (id < 0) {
+        removeRemoteUser(id, "Killed (" + reason + ")");
+        return;
+    }
+    ClientMap::iterator it = this->_clients.find(id);
+    if (it == this->_clients.end())
+        return;
+    sendUrgent(id, "ERROR :Closing Link: " + nick + " (Killed (" + reason + "))\r\n");
+    // No QUIT for the other servers, the KILL says it all; our own channels
+    // and MONITOR watchers still have to hear about it
+    handleClientDisconnect(id, "Killed (" + reason + ")", false);
+}
+
+// Settles a nick used by two users. Returns true if the newcomer (signon
+// `theirs`) keeps it; the existing holder may have been killed on the way.
+bool Server::settleCollision(int existing, unsigned long theirs, int fromLink)
+{
+    ClientMap::iterator local = this->_clients.find(existing);
+    if (local != this->_clients.end() && !local->second.isRegistered()) {
+        // Still registering: they just have to pick another nick
+        reply(existing, ":ircserv 433 * " + local->second.getNickname() + " :Nickname is already in use\r\n");
+        local->second.setNickname("");
+        return true;
+    }
+    unsigned long ours = signonOf(existing);
+    if (theirs < ours) {
+        killUser(existing, "Nick collision", fromLink);
+        return true;
+    }
+    if (theirs == ours)
+        killUser(existing, "Nick collision", fromLink);
+    return false;
+}
+
+// Registration (or nick change) of one of our users, for the other servers
+void Server::introduceLocal(int clientFd)
+{
+    Client& client = this->_clients.find(clientFd)->second;
+    client.setSignon(HistoryRing::nowMs());
+    propagate("NICK " + client.getNickname() + " " + toString(client.getSignon()) + " " + client.getUsername()
+        + " " + this->_serverName + " :" + client.getRealname(), -1);
+}
+
+// Every line a neighbour sends us
+void Server::handleLinkLine(int linkFd, const std::string& line)
+{
+    std::string rest;
+    std::string origin = splitPrefix(line, rest);
+    Command cmd(rest);
+    const std::string& verb = cmd.getCommand();
+    const std::vector<std::string>& params = cmd.getParams();
+
+    if (!this->_links[linkFd].established) {
+        if (verb == "CAPAB")
+            handleCapab(linkFd, cmd);
+        else if (verb == "SERVER")
+            acceptLink(linkFd, cmd);
+        else if (verb == "ERROR")
+            LOG_WARN("Server link refused: " << (params.empty() ? "" : params[0]));
+        return;
+    }
+
+    if (verb == "SERVER")
+        onLinkServer(linkFd, origin, params);
+    else if (verb == "SQUIT")
+        onLinkSquit(linkFd, params);
+    else if (verb == "NICK" && params.size() >= 5)
+        onLinkIntroduce(linkFd, line, params);
+    else if (verb == "SJOIN")
+        onLinkSjoin(linkFd, line, params);
+    else if (verb == "KILL")
+        onLinkKill(linkFd, params);
+    else if (verb == "ERROR")
+        LOG_WARN("Server link error: " << (params.empty() ? "" : params[0]));
+    else if (verb == "TOPIC" && this->_servers.count(origin))
+        onLinkTopic(linkFd, line, 0, params);
+    else if (verb == "MODE" && this->_servers.count(origin))
+        onLinkMode(linkFd, line, 0, params);
+    else {
+        // Everything else comes from a user, who must be behind this link
+        std::map<std::string, int>::iterator nick = this->_remoteNicks.find(origin);
+        if (nick == this->_remoteNicks.end() || this->_remoteUsers[nick->second].link != linkFd)
+            return;
+        int id = nick->second;
+        if (verb == "NICK")
+            onLinkNick(linkFd, line, id, params);
+        else if (verb == "QUIT") {
+            removeRemoteUser(id, params.empty() ? "" : params[0]);
+            propagate(line, linkFd);
+        }
+        else if (verb == "JOIN")
+            onLinkJoin(linkFd, line, id, params);
+        else if (verb == "PART" || verb == "KICK")
+            onLinkLeave(linkFd, line, id, cmd);
+        else if (verb == "MODE")
+            onLinkMode(linkFd, line, id, params);
+        else if (verb == "TOPIC")
+            onLinkTopic(linkFd, line, id, params);
+        else if (verb == "INVITE")
+            onLinkInvite(line, id, params);
+        else if (verb == "PRIVMSG" || verb == "NOTICE")
+            onLinkPrivmsg(linkFd, line, id, cmd);
+    }
+}
+
+// :<uplink> SERVER <name> <hops> :<info>
+void Server::onLinkServer(int linkFd, const std::string& origin, const std::vector<std::string>& params)
+{
+    if (params.size() < 2)
+        return;
+    if (params[0] == this->_serverName || this->_servers.count(params[0])) {
+        // Known already: the tree has a cycle, cut it here
+        LOG_WARN("Server " << params[0] << " is already linked, dropping the link that brought it again");
+        sendReply(linkFd, "ERROR :Server " + params[0] + " already exists\r\n");
+        handleClientDisconnect(linkFd);
+        return;
+    }
+    RemoteServer server;
+    server.name = params[0];
+    server.uplink = origin;
+    server.hops = std::atoi(params[1].c_str());
+    server.info = params.size() > 2 ? params[2] : "";
+    server.link = linkFd;
+    this->_servers[server.name] = server;
+    propagate(":" + origin + " SERVER " + server.name + " " + toString(server.hops + 1) + " :" + server.info, linkFd);
+}
+
+// :<server> SQUIT <name> :<reason>
+void Server::onLinkSquit(int linkFd, const std::vector<std::string>& params)
+{
+    if (params.empty())
+        return;
+    std::map<std::string, RemoteServer>::iterator it = this->_servers.find(params[0]);
+    if (it == this->_servers.end() || it->second.link != linkFd)
+        return;
+    // The server and its whole subtree
+    std::set<std::string> gone;
+    gone.insert(params[0]);
+    for (bool grew = true; grew; ) {
+        grew = false;
+        for (std::map<std::string, RemoteServer>::iterator s = this->_servers.begin(); s != this->_servers.end(); ++s) {
+            if (!gone.count(s->first) && gone.count(s->second.uplink)) {
+                gone.insert(s->first);
+                grew = true;
+            }
+        }
+    }
+    forgetServers(gone, it->second.uplink + " " + params[0]);
+    propagate(":" + this->_serverName + " SQUIT " + params[0] + " :" + (params.size() > 1 ? params[1] : ""), linkFd);
+}
+
+// NICK <nick> <signon> <user> <server> :<realname>
+void Server::onLinkIntroduce(int linkFd, const std::string& line, const std::vector<std::string>& params)
+{
+    const std::string& nick = params[0];
+    unsigned long signon = std::strtoul(params[1].c_str(), NULL, 10);
+    int existing = search_fd_name(nick);
+    if (existing != 0 && !settleCollision(existing, signon, linkFd)) {
+        // The newcomer loses: only the servers on its side know it
+        sendReply(linkFd, ":" + this->_serverName + " KILL " + nick + " " + params[1] + " :Nick collision\r\n");
+        return;
+    }
+    RemoteUser user;
+    user.nick = nick;
+    user.signon = signon;
+    user.user = params[2];
+    user.server = params[3];
+    user.realname = params[4];
+    user.link = linkFd;
+    int id = this->_nextRemoteId--;
+    this->_remoteUsers[id] = user;
+    this->_remoteNicks[nick] = id;
+    notifyPresence(nick, id, true);
+    propagate(line, linkFd);
+}
+
+// :<nick> NICK <newnick>
+void Server::onLinkNick(int linkFd, const std::string& line, int id, const std::vector<std::string>& params)
+{
+    if (params.empty())
+        return;
+    RemoteUser& user = this->_remoteUsers[id];
+    int existing = search_fd_name(params[0]);
+    if (existing != 0 && existing != id && !settleCollision(existing, user.signon, linkFd)) {
+        // Dead everywhere: under the new nick on its side, the old one on ours
+        sendReply(linkFd, ":" + this->_serverName + " KILL " + params[0] + " " + toString(user.signon) + " :Nick collision\r\n");
+        killUser(id, "Nick collision", linkFd);
+        return;
+    }
+    // Local users sharing a channel see the change
+    std::string nickMsg = ":" + maskOf(id) + " NICK :" + params[0] + "\r\n";
+    const std::vector<int>& peers = channelPeers(id);
+    for (size_t i = 0; i < peers.size(); ++i)
+        sendReply(peers[i], nickMsg);
+    notifyPresence(user.nick, id, false);
+    this->_remoteNicks.erase(user.nick);
+    user.nick = params[0];
+    this->_remoteNicks[user.nick] = id;
+    notifyPresence(user.nick, id, true);
+    propagate(line, linkFd);
+}
+
+// :<server> KILL <nick> <signon> :<reason>
+void Server::onLinkKill(int linkFd, const std::vector<std::string>& params)
+{
+    if (params.size() < 2)
+        return;
+    int id = search_fd_name(params[0]);
+    // Not the user this KILL was meant for (the collision went the other way here)
+    if (id == 0 || toString(signonOf(id)) != params[1])
+        return;
+    killUser(id, params.size() > 2 ? params[2] : "Killed", linkFd);
+}
+
+// SJOIN <channel> <+modes> [key] [limit] :<[@]nick ...>
+// A channel that has members here keeps its modes; otherwise it takes theirs.
+void Server::onLinkSjoin(int linkFd, const std::string& line, const std::vector<std::string>& params)
+{
+    if (params.size() < 3)
+        return;
+    Channel* ch = findChannelByName(this->_Channels, params[0]);
+    if (ch == NULL) {
+        this->_Channels.push_back(Channel(params[0]));
+        ch = &this->_Channels.back();
+    }
+    if (ch->get_members().empty()) {
+        size_t arg = 2;
+        const std::string& flags = params[1];
+        for (size_t i = 1; i < flags.size(); ++i) {
+            std::string mode = std::string("+") + flags[i];
+            if ((flags[i] == 'k' || flags[i] == 'l') && arg < params.size() - 1)
+                ch->force_mode(mode, 0, params[arg++]);
+            else if (flags[i] == 'i' || flags[i] == 't')
+                ch->force_mode(mode, 0, "");
+        }
+    }
+    std::istringstream names(params[params.size() - 1]);
+    std::string name;
+    while (names >> name) {
+        bool op = name[0] == '@';
+        if (op)
+            name.erase(0, 1);
+        std::map<std::string, int>::iterator it = this->_remoteNicks.find(name);
+        if (it == this->_remoteNicks.end() || ch->isMember(it->second))
+            continue;
+        ch->add_member(it->second, op ? 0 : 1);
+        trackJoin(*ch, it->second);
+        noteRemoteJoin(ch->get_name(), it->second);
+        if (!op && ch->isOperator(it->second))
+            ch->force_mode("-o", it->second, "");
+        broadcastToChannel(*ch, ":" + maskOf(it->second) + " JOIN :" + ch->get_name() + "\r\n", -1);
+    }
+    propagate(line, linkFd);
+}
+
+// :<nick> JOIN <channel>. Keys, limits and invites were checked by the user's server.
+void Server::onLinkJoin(int linkFd, const std::string& line, int id, const std::vector<std::string>& params)
+{
+    if (params.empty())
+        return;
+    Channel* ch = findChannelByName(this->_Channels, params[0]);
+    if (ch == NULL) {
+        this->_Channels.push_back(Channel(params[0]));
+        ch = &this->_Channels.back();
+    }
+    if (ch->isMember(id))
+        return;
+    ch->add_member(id, 1);
+    trackJoin(*ch, id);
+    noteRemoteJoin(ch->get_name(), id);
+    broadcastToChannel(*ch, ":" + maskOf(id) + " JOIN :" + ch->get_name() + "\r\n", -1);
+    propagate(line, linkFd);
+}
+
+// :<nick> PART <channel> :<reason>   or   :<nick> KICK <channel> <nick> :<reason>
+void Server::onLinkLeave(int linkFd, const std::string& line, int id, const Command& cmd)
+{
+    const std::vector<std::string>& params = cmd.getParams();
+    bool kick = cmd.getCommand() == "KICK";
+    if (params.empty() || (kick && params.size() < 2))
+        return;
+    Channel* ch = findChannelByName(this->_Channels, params[0]);
+    int who = kick ? search_fd_name(params[1]) : id;
+    if (ch == NULL || who == 0 || !ch->isMember(who))
+        return;
+    std::string msg = ":" + maskOf(id) + " " + cmd.getCommand() + " " + ch->get_name();
+    if (kick)
+        msg += " " + params[1];
+    if (params.size() > (kick ? 2u : 1u))
+        msg += " :" + params[kick ? 2 : 1];
+    broadcastToChannel(*ch, msg + "\r\n", -1);
+    ch->part(who, "");
+    trackPart(*ch, who);
+    if (who < 0)
+        noteRemotePart(ch->get_name(), who);
+    propagate(line, linkFd);
+}
+
+// :<nick or server> MODE <channel> <mode> [arg]. From a server it is a
+// ban or exception from the burst.
+void Server::onLinkMode(int linkFd, const std::string& line, int id, const std::vector<std::string>& params)
+{
+    if (params.size() < 2)
+        return;
+    Channel* ch = findChannelByName(this->_Channels, params[0]);
+    if (ch == NULL)
+        return;
+    std::string arg = params.size() > 2 ? params[2] : "";
+    std::string rest;
+    std::string source = id != 0 ? maskOf(id) : splitPrefix(line, rest);
+    const std::string& mode = params[1];
+    if (mode.size() == 2 && (mode[1] == 'b' || mode[1] == 'e')) {
+        // Already known (both sides had it before the burst): stops here
+        if (arg.empty() || !(mode[0] == '+' ? ch->add_mask(mode[1], arg, source, std::time(NULL))
+                : ch->remove_mask(mode[1], arg)))
+            return;
+    } else if (id == 0)
+        return;
+    else {
+        int target = (mode == "+o" || mode == "-o") ? search_fd_name(arg) : 0;
+        if (ch->force_mode(mode, target, arg) != CHANNEL_OK)
+            return;
+    }
+    broadcastToChannel(*ch, ":" + source + " MODE " + ch->get_name() + " " + mode
+        + (arg.empty() ? "" : " " + arg) + "\r\n", -1);
+    propagate(line, linkFd);
+}
+
+// :<nick or server> TOPIC <channel> :<topic>. From a server it is burst data.
+void Server::onLinkTopic(int linkFd, const std::string& line, int id, const std::vector<std::string>& params)
+{
+    if (params.size() < 2)
+        return;
+    Channel* ch = findChannelByName(this->_Channels, params[0]);
+    if (ch == NULL)
+        return;
+    ch->set_topic(params[1]);
+    if (id != 0) {
+        std::string msg = ":" + maskOf(id) + " TOPIC " + ch->get_name() + " :" + params[1] + "\r\n";
+        broadcastToChannel(*ch, msg, -1);
+        recordHistory(*ch, msg);
+    }
+    propagate(line, linkFd);
+}
+
+// :<nick> INVITE <nick> <channel>: only the invited user's server needs it
+void Server::onLinkInvite(const std::string& line, int id, const std::vector<std::string>& params)
+{
+    if (params.size() < 2)
+        return;
+    int target = search_fd_name(params[0]);
+    Channel* ch = findChannelByName(this->_Channels, params[1]);
+    if (target == 0 || ch == NULL)
+        return;
+    ch->invite(id, target);
+    routeToUser(target, ":" + maskOf(id) + " INVITE " + params[0] + " :" + params[1] + "\r\n", line);
+}
+
+// :<nick> PRIVMSG|NOTICE <channel or nick> :<text>
+void Server::onLinkPrivmsg(int linkFd, const std::string& line, int id, const Command& cmd)
+{
+    const std::vector<std::string>& params = cmd.getParams();
+    if (params.size() < 2)
+        return;
+    std::string msg = ":" + maskOf(id) + " " + cmd.getCommand() + " " + params[0] + " :" + params[1] + "\r\n";
+    Channel* ch = findChannelByName(this->_Channels, params[0]);
+    if (ch != NULL) {
+        recordHistory(*ch, msg);
+        routeToChannel(*ch, msg, line, id, linkFd);
+        return;
+    }
+    int target = search_fd_name(params[0]);
+    if (target != 0)
+        routeToUser(target, msg, line);
+}
@@ -0,0 +1,114 @@
+#include "Server.hpp"
+#include "../Memory/Intern.hpp"
+#include "../Memory/Footprint.hpp"
+#include <sstream>
+
+// Memory accounting and the budget. The numbers come from the subsystems'
+// own counters plus one walk of the client and channel tables, so this runs
+// from the housekeeping timer (once a second) and on demand, never per
+// message.
+
+void Server::collectMemory(MemoryReport& mem)
+{
+    mem = MemoryReport();
+    // A map node is the entry plus the tree links; those nodes live in the
+    // pool slabs, so only the heap behind each client is added here
+    for (ClientMap::const_iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
+        const Client& client = it->second;
+        size_t recvq = client.recvqBytes();
+        size_t sendq = client.sendqBytes();
+        mem.bytes[MEM_RECVQ] += recvq;
+        mem.bytes[MEM_SENDQ] += sendq;
+        mem.bytes[MEM_CLIENTS] += client.memoryBytes() - recvq - sendq - sizeof(Client);
+    }
+    mem.bytes[MEM_CLIENTS] += InternedString::tableBytes();
+    mem.bytes[MEM_CLIENTS] += this->_monitor.memoryBytes();
+    mem.bytes[MEM_RECVQ] += Client::spareBytes();
+    for (ChannelList::iterator it = this->_Channels.begin(); it != this->_Channels.end(); ++it) {
+        mem.bytes[MEM_CHANNELS] += it->memoryBytes();
+        mem.bytes[MEM_HISTORY] += it->get_history().memoryBytes();
+    }
+    for (std::map<int, std::vector<Channel*> >::const_iterator it = this->_joined.begin(); it != this->_joined.end(); ++it)
+        mem.bytes[MEM_CHANNELS] += mapNodeBytes(sizeof(*it)) + it->second.capacity() * sizeof(Channel*);
+    if (this->_archive.enabled())
+        mem.bytes[MEM_ARCHIVE] = this->_archive.queuedBytes();
+    mem.bytes[MEM_LOG] = Logger::memoryBytes();
+    mem.bytes[MEM_POOLS] = FixedPool::slabBytes;
+    mem.bytes[MEM_STATS] = this->_stats.talkerMemoryBytes() + this->_spam.memoryBytes();
+}
+
+// Over budget, in order of how little it hurts: stop taking clients, give
+// back idle buffers, forget half of every channel's history, and last drop
+// the clients holding the biggest SendQs (the slowest readers).
+void Server::enforceMemoryBudget()
+{
+    if (this->_memoryBudget == 0)
+        return;
+    MemoryReport mem;
+    collectMemory(mem);
+    size_t total = mem.total();
+    if (total <= this->_memoryBudget) {
+        // Some slack before taking clients again, or we'd flap at the limit
+        if (this->_refusingClients && total < this->_memoryBudget / 10 * 9) {
+            this->_refusingClients = false;
+            LOG_INFO("Memory down to " << total << " bytes, accepting connections again");
+        }
+        return;
+    }
+    if (!this->_refusingClients) {
+        this->_refusingClients = true;
+        LOG_WARN("Memory at " << total << " bytes, over the budget of " << this->_memoryBudget
+            << ": refusing new connections");
+    }
+
+    for (ClientMap::iterator it = this->_clients.begin(); it != this->_clients.end(); ++it)
+        it->second.trimIdle(true);
+    Client::dropSpares();
+    collectMemory(mem);
+    total = mem.total();
+
+    if (total > this->_memoryBudget) {
+        size_t freed = 0;
+        for (ChannelList::iterator it = this->_Channels.begin(); it != this->_Channels.end(); ++it)
+            freed += it->get_history().shrink();
+        this->_shedHistoryBytes += freed;
+        total -= freed < total ? freed : total;
+        LOG_WARN("Memory over budget: dropped " << freed << " bytes of channel history");
+    }
+
+    while (total > this->_memoryBudget) {
+        int victim = -1;
+        size_t biggest = 0;
+        for (ClientMap::const_iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
+            if (it->second.sendqBytes() > biggest && !isLink(it->first)) {
+                biggest = it->second.sendqBytes();
+                victim = it->first;
+            }
+        }
+        if (victim == -1)
+            break; // what is left is not ours to drop
+        size_t bytes = this->_clients.find(victim)->second.memoryBytes();
+        LOG_WARN("Memory over budget: dropping fd " << victim << " with a " << biggest << " byte SendQ");
+        sendUrgent(victim, "ERROR :Closing Link: " + this->_clients.find(victim)->second.getNickname() + " (SendQ exceeded)\r\n");
+        handleClientDisconnect(victim, "SendQ exceeded");
+        this->_shedKills++;
+        total -= bytes < total ? bytes : total;
+    }
+}
+
+// STATS z (operators only): one line per area, then the budget
+void Server::reportMemory(std::vector<std::string>& lines)
+{
+    MemoryReport mem;
+    collectMemory(mem);
+    for (int i = 0; i < MEM_AREAS; ++i) {
+        std::ostringstream oss;
+        oss << MemoryReport::name(i) << " " << mem.bytes[i];
+        lines.push_back(oss.str());
+    }
+    std::ostringstream oss;
+    oss << "total " << mem.total() << " budget " << this->_memoryBudget
+        << " refusing=" << (this->_refusingClients ? 1 : 0) << " refused=" << this->_shedRefused
+        << " history_freed=" << this->_shedHistoryBytes << " sendq_kills=" << this->_shedKills;
+    lines.push_back(oss.str());
+}
@@ -0,0 +1,113 @@
+#include "Server.hpp"
+#include <sstream>
+
+// IRCv3 MONITOR: clients register the nicks they care about and are told
+// when those come and go (730/731), instead of polling with WHO. Both
+// directions are indexed (Monitor/Monitor.hpp): a NICK, a registration or
+// a QUIT costs one map lookup when nobody watches that nick.
+
+// MONITOR + <nick>[,<nick>...] | - <nick>[,...] | C | L | S
+void Server::handleMonitor(int clientFd, const Command& cmd)
+{
+    Client& client = this->_clients.find(clientFd)->second;
+    const std::vector<std::string>& params = cmd.getParams();
+    if (!client.isRegistered()) {
+        reply(clientFd, ":ircserv 451 " + (client.getNickname().empty() ? std::string("*") : client.getNickname())
+            + " :You have not registered\r\n");
+        return;
+    }
+    const std::string& nick = client.getNickname();
+    if (params.empty() || ((params[0] == "+" || params[0] == "-") && params.size() < 2)) {
+        reply(clientFd, ":ircserv 461 " + nick + " MONITOR :Not enough parameters\r\n");
+        return;
+    }
+    const std::string& action = params[0];
+    if (action == "+" || action == "-") {
+        std::vector<std::string> targets;
+        std::stringstream ss(params[1]);
+        std::string target;
+        while (std::getline(ss, target, ','))
+            if (!target.empty())
+                targets.push_back(target);
+        if (action == "-") {
+            for (size_t i = 0; i < targets.size(); ++i)
+                this->_monitor.remove(clientFd, targets[i]);
+            return;
+        }
+        std::vector<std::string> online, offline;
+        for (size_t i = 0; i < targets.size(); ++i) {
+            if (!Names::validNick(targets[i]))
+                continue;
+            if (this->_monitor.targets(clientFd).size() >= this->_monitorMax) {
+                // ERR_MONLISTFULL names what was not added
+                std::string rest = targets[i];
+                for (size_t j = i + 1; j < targets.size(); ++j)
+                    rest += "," + targets[j];
+                std::ostringstream oss;
+                oss << ":ircserv 734 " << nick << " " << this->_monitorMax << " " << rest << " :Monitor list is full.\r\n";
+                reply(clientFd, oss.str());
+                break;
+            }
+            if (!this->_monitor.add(clientFd, targets[i]))
+                continue;
+            int id = search_fd_name(targets[i]);
+            if (id != 0 && (id < 0 || this->_clients.find(id)->second.isRegistered()))
+                online.push_back(maskOf(id));
+            else
+                offline.push_back(targets[i]);
+        }
+        sendMonitorList(clientFd, "730", online);
+        sendMonitorList(clientFd, "731", offline);
+    } else if (action == "C" || action == "c") {
+        this->_monitor.clear(clientFd);
+    } else if (action == "L" || action == "l") {
+        sendMonitorList(clientFd, "732", this->_monitor.targets(clientFd));
+        reply(clientFd, ":ircserv 733 " + nick + " :End of MONITOR list\r\n");
+    } else if (action == "S" || action == "s") {
+        std::vector<std::string> online, offline;
+        const std::vector<std::string>& targets = this->_monitor.targets(clientFd);
+        for (size_t i = 0; i < targets.size(); ++i) {
+            int id = search_fd_name(targets[i]);
+            if (id != 0 && (id < 0 || this->_clients.find(id)->second.isRegistered()))
+                online.push_back(maskOf(id));
+            else
+                offline.push_back(targets[i]);
+        }
+        sendMonitorList(clientFd, "730", online);
+        sendMonitorList(clientFd, "731", offline);
+    }
+}
+
+// As few lines as fit in 512 bytes, comma-separated
+void Server::sendMonitorList(int clientFd, const char* numeric, const std::vector<std::string>& items)
+{
+    if (items.empty())
+        return;
+    std::string head = std::string(":ircserv ") + numeric + " " + this->_clients.find(clientFd)->second.getNickname() + " :";
+    std::string line = head;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (line.size() > head.size() && line.size() + 1 + items[i].size() + 2 > 512) {
+            reply(clientFd, line + "\r\n");
+            line = head;
+        }
+        if (line.size() > head.size())
+            line += ",";
+        line += items[i];
+    }
+    reply(clientFd, line + "\r\n");
+}
+
+// `id` is the user who came or went, local or remote
+void Server::notifyPresence(const std::string& nick, int id, bool online)
+{
+    const std::vector<int>& watchers = this->_monitor.watchers(nick);
+    if (watchers.empty())
+        return;
+    std::string what = online ? " 730 " : " 731 ";
+    std::string who = online ? maskOf(id) : nick;
+    for (size_t i = 0; i < watchers.size(); ++i) {
+        ClientMap::iterator it = this->_clients.find(watchers[i]);
+        if (it != this->_clients.end() && watchers[i] != id)
+            sendReply(watchers[i], ":ircserv" + what + it->second.getNickname() + " :" + who + "\r\n");
+    }
+}
@@ -0,0 +1,82 @@
+#include "Server.hpp"
+#include <sstream>
+
+// Slow consumers: clients that read less than the server queues for them.
+// Every queued reply is checked against the client's hard limit (two
+// compares); the soft limit and the drain rate are looked at once a second
+// from the housekeeping timer.
+
+const SendqClass& Server::sendqLimits(int clientFd, const Client& client) const
+{
+    if (!this->_links.empty() && isLink(clientFd))
+        return this->_sendqClasses[SENDQ_LINK];
+    return this->_sendqClasses[client.isOper() ? SENDQ_OPER : SENDQ_USER];
+}
+
+// Over the soft limit a client is flagged (and its bulk replies refused)
+// until it is back under half of it, so a client hovering at the limit
+// isn't logged every second
+void Server::checkSlowConsumers()
+{
+    for (ClientMap::iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
+        Client& client = it->second;
+        unsigned long rate = client.sampleDrainRate();
+        size_t soft = sendqLimits(it->first, client).soft;
+        size_t depth = client.pendingOutputSize();
+        if (!client.isSlowConsumer() && soft > 0 && depth > soft) {
+            client.setSlowConsumer(true);
+            this->_slowConsumers++;
+            this->_slowWarnings++;
+            LOG_WARN("Slow consumer on fd " << it->first << " (" << client.getNickname() << "): " << depth
+                << " bytes queued, draining " << rate << " bytes/s");
+        } else if (client.isSlowConsumer() && (soft == 0 || depth <= soft / 2)) {
+            client.setSlowConsumer(false);
+            this->_slowConsumers--;
+            LOG_INFO("Fd " << it->first << " (" << client.getNickname() << ") caught up with its SendQ");
+        }
+    }
+}
+
+// Clients that hit their hard limit while a handler was queueing: dropped
+// here, between turns, so no fan-out loop sees a member disappear
+void Server::evictSlowConsumers()
+{
+    std::vector<int> victims;
+    victims.swap(this->_evictList);
+    for (size_t i = 0; i < victims.size(); ++i) {
+        ClientMap::iterator it = this->_clients.find(victims[i]);
+        if (it == this->_clients.end() || !it->second.isEvicting())
+            continue;
+        Client& client = it->second;
+        LOG_WARN("Dropping fd " << victims[i] << " (" << client.getNickname() << "): SendQ over "
+            << sendqLimits(victims[i], client).hard << " bytes, draining " << client.drainRate() << " bytes/s");
+        // Past the limit check on purpose: this is the last line it gets
+        std::string error = "ERROR :Closing Link: " + client.getNickname() + " (Max SendQ exceeded)\r\n";
+        client.queueUrgent(error);
+        this->_sendqBytes += error.size();
+        this->_sendqEvictions++;
+        handleClientDisconnect(victims[i], "Max SendQ exceeded");
+    }
+}
+
+// STATS q (operators only): every client with something queued
+void Server::reportSendq(std::vector<std::string>& lines)
+{
+    for (ClientMap::const_iterator it = this->_clients.begin(); it != this->_clients.end(); ++it) {
+        const Client& client = it->second;
+        if (client.pendingOutputSize() == 0 && !client.isSlowConsumer())
+            continue;
+        const SendqClass& limits = sendqLimits(it->first, client);
+        int cls = &limits - this->_sendqClasses;
+        std::ostringstream oss;
+        oss << (client.getNickname().empty() ? "*" : client.getNickname()) << " fd=" << it->first
+            << " class=" << SendqClass::name(cls) << " sendq=" << client.pendingOutputSize()
+            << " drain=" << client.drainRate() << "/s soft=" << limits.soft << " hard=" << limits.hard
+            << (client.isSlowConsumer() ? " slow" : "");
+        lines.push_back(oss.str());
+    }
+    std::ostringstream oss;
+    oss << "slow=" << this->_slowConsumers << " warnings=" << this->_slowWarnings
+        << " bulk_refused=" << this->_bulkRefused << " evictions=" << this->_sendqEvictions;
+    lines.push_back(oss.str());
+}
@@ -0,0 +1,251 @@
+#include "Snapshot.hpp"
+#include "../Logger/Logger.hpp"
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace {
+
+const char MAGIC[] = "IRCSNAP1";
+const size_t MAGIC_SIZE = 8;
+const size_t HEADER_SIZE = MAGIC_SIZE + 4 + 4 + 8;
+const size_t COUNT_OFFSET = MAGIC_SIZE + 4;
+
+enum {
+	FLAG_INVITE_ONLY = 1,
+	FLAG_KEY = 2,
+	FLAG_TOPIC_LOCKED = 4,
+};
+
+template <typename T>
+void put(std::string& out, T value) {
+	out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T get(const char* in) {
+	T value;
+	std::memcpy(&value, in, sizeof(value));
+	return value;
+}
+
+void putString(std::string& out, const std::string& s) {
+	size_t len = s.size() > 0xffff ? 0xffff : s.size();
+	put<unsigned short>(out, (unsigned short)len);
+	out.append(s, 0, len);
+}
+
+unsigned int fnv1a(const char* data, size_t len) {
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+} // namespace
+
+SnapshotEncoder::SnapshotEncoder() : _count(0) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	_data.append(MAGIC, MAGIC_SIZE);
+	put<unsigned int>(_data, VERSION);
+	put<unsigned int>(_data, 0); // count, patched by finish()
+	put<unsigned long>(_data, (unsigned long)tv.tv_sec * 1000UL + (unsigned long)tv.tv_usec / 1000UL);
+}
+
+void SnapshotEncoder::add(const ChannelSnapshot& ch) {
+	putString(_data, ch.name);
+	putString(_data, ch.topic);
+	putString(_data, ch.key);
+	unsigned char flags = 0;
+	if (ch.inviteOnly)
+		flags |= FLAG_INVITE_ONLY;
+	if (ch.hasKey)
+		flags |= FLAG_KEY;
+	if (ch.topicLocked)
+		flags |= FLAG_TOPIC_LOCKED;
+	put<unsigned char>(_data, flags);
+	put<int>(_data, ch.limit);
+	put<unsigned int>(_data, ch.masks.size());
+	for (size_t i = 0; i < ch.masks.size(); ++i) {
+		put<unsigned char>(_data, ch.masks[i].list);
+		putString(_data, ch.masks[i].mask);
+		putString(_data, ch.masks[i].setBy);
+		put<unsigned long>(_data, ch.masks[i].setAt);
+	}
+	_count++;
+}
+
+std::string& SnapshotEncoder::finish() {
+	std::memcpy(&_data[COUNT_OFFSET], &_count, sizeof(_count));
+	put<unsigned int>(_data, fnv1a(_data.data(), _data.size()));
+	return _data;
+}
+
+SnapshotWriter::SnapshotWriter() : _started(false), _busy(0) {}
+
+SnapshotWriter::~SnapshotWriter() {
+	wait();
+}
+
+bool SnapshotWriter::busy() const {
+	return __atomic_load_n(&_busy, __ATOMIC_ACQUIRE) != 0;
+}
+
+bool SnapshotWriter::writeAsync(const std::string& path, std::string& image) {
+	if (busy())
+		return false;
+	wait(); // reap the previous thread, it is done
+	_path = path;
+	_data.swap(image);
+	__atomic_store_n(&_busy, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&_thread, NULL, &SnapshotWriter::writerMain, this) != 0) {
+		__atomic_store_n(&_busy, 0, __ATOMIC_RELEASE);
+		return writeFile(_path, _data);
+	}
+	_started = true;
+	return true;
+}
+
+bool SnapshotWriter::writeNow(const std::string& path, std::string& image) {
+	wait();
+	return writeFile(path, image);
+}
+
+void SnapshotWriter::wait() {
+	if (_started) {
+		pthread_join(_thread, NULL);
+		_started = false;
+	}
+}
+
+void* SnapshotWriter::writerMain(void* arg) {
+	SnapshotWriter* self = static_cast<SnapshotWriter*>(arg);
+	if (!writeFile(self->_path, self->_data))
+		LOG_ERROR("Could not write snapshot " << self->_path << ": " << std::strerror(errno));
+	std::string().swap(self->_data);
+	__atomic_store_n(&self->_busy, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+bool SnapshotWriter::writeFile(const std::string& path, const std::string& data) {
+	std::string tmp = path + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	if (fd < 0)
+		return false;
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			::close(fd);
+			::unlink(tmp.c_str());
+			return false;
+		}
+		done += n;
+	}
+	if (fsync(fd) < 0 || ::close(fd) < 0) {
+		::unlink(tmp.c_str());
+		return false;
+	}
+	return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+SnapshotReader::SnapshotReader() : _map(NULL), _size(0), _pos(0), _end(0), _count(0), _read(0), _version(0) {}
+
+SnapshotReader::~SnapshotReader() {
+	close();
+}
+
+bool SnapshotReader::open(const std::string& path) {
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < HEADER_SIZE + 4) {
+		::close(fd);
+		return false;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	_map = static_cast<const char*>(map);
+	_size = st.st_size;
+	_end = _size - 4;
+	_version = get<unsigned int>(_map + MAGIC_SIZE);
+	if (std::memcmp(_map, MAGIC, MAGIC_SIZE) != 0
+		|| _version < 1 || _version > SnapshotEncoder::VERSION
+		|| get<unsigned int>(_map + _end) != fnv1a(_map, _end)) {
+		close();
+		return false;
+	}
+	_count = get<unsigned int>(_map + COUNT_OFFSET);
+	_pos = HEADER_SIZE;
+	_read = 0;
+	return true;
+}
+
+bool SnapshotReader::readString(std::string& out) {
+	if (_pos + 2 > _end)
+		return false;
+	unsigned short len = get<unsigned short>(_map + _pos);
+	if (_pos + 2 + len > _end)
+		return false;
+	out.assign(_map + _pos + 2, len);
+	_pos += 2 + len;
+	return true;
+}
+
+bool SnapshotReader::next(ChannelSnapshot& ch) {
+	if (_map == NULL || _read >= _count)
+		return false;
+	if (!readString(ch.name) || !readString(ch.topic) || !readString(ch.key) || _pos + 5 > _end)
+		return false;
+	unsigned char flags = (unsigned char)_map[_pos];
+	ch.inviteOnly = (flags & FLAG_INVITE_ONLY) != 0;
+	ch.hasKey = (flags & FLAG_KEY) != 0;
+	ch.topicLocked = (flags & FLAG_TOPIC_LOCKED) != 0;
+	ch.limit = get<int>(_map + _pos + 1);
+	_pos += 5;
+	ch.masks.clear();
+	if (_version >= 2) {
+		if (_pos + 4 > _end)
+			return false;
+		unsigned int masks = get<unsigned int>(_map + _pos);
+		_pos += 4;
+		for (unsigned int i = 0; i < masks; ++i) {
+			MaskSnapshot mask;
+			if (_pos + 1 > _end)
+				return false;
+			mask.list = _map[_pos++];
+			if (!readString(mask.mask) || !readString(mask.setBy) || _pos + 8 > _end)
+				return false;
+			mask.setAt = get<unsigned long>(_map + _pos);
+			_pos += 8;
+			ch.masks.push_back(mask);
+		}
+	}
+	_read++;
+	return true;
+}
+
+unsigned int SnapshotReader::count() const {
+	return _count;
+}
+
+void SnapshotReader::close() {
+	if (_map != NULL)
+		munmap(const_cast<char*>(_map), _size);
+	_map = NULL;
+	_size = 0;
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <pthread.h>
+
+// Channel registry snapshot, so a restart doesn't lose topics and modes.
+//
+//   header:  "IRCSNAP1" | u32 version | u32 channel count | u64 created (ms since the epoch)
+//   channel: u16 len | name | u16 len | topic | u16 len | key
+//            | u8 flags (1 = +i, 2 = +k, 4 = +t) | i32 limit (-1 = none)
+//            | u32 masks, each: u8 list ('b' or 'e') | u16 len | mask | u16 len | set by | u64 set at
+//              (version 2 on; a version 1 file is read as channels without any)
+//   trailer: u32 FNV-1a of everything before it
+//
+// Integers are in host byte order. A file with a bad magic, version or
+// checksum is ignored as a whole: better no channels than wrong ones.
+struct MaskSnapshot {
+	char			list;
+	std::string		mask;
+	std::string		setBy;
+	unsigned long	setAt;
+};
+
+struct ChannelSnapshot {
+	std::string	name;
+	std::string	topic;
+	std::string	key;
+	bool		inviteOnly;
+	bool		hasKey;
+	bool		topicLocked;
+	int			limit;
+	std::vector<MaskSnapshot> masks;
+
+	ChannelSnapshot() : inviteOnly(false), hasKey(false), topicLocked(false), limit(-1) {}
+};
+
+// Builds the file image in memory. Encoding is a handful of memcpy per
+// channel, cheap enough for the event loop; the I/O is SnapshotWriter's job.
+class SnapshotEncoder {
+	private:
+	std::string	_data;
+	unsigned int _count;
+
+	public:
+	static const unsigned int VERSION = 2;
+
+	SnapshotEncoder();
+	void add(const ChannelSnapshot& ch);
+	// Fills in the count and appends the checksum. Returns the file image.
+	std::string& finish();
+};
+
+// Writes snapshots on a background thread: tmp file, fsync, rename, so a
+// crash in the middle leaves the previous snapshot in place.
+class SnapshotWriter {
+	private:
+	pthread_t	_thread;
+	bool		_started;	// a thread was created and not joined yet
+	int			_busy;		// set while the thread works, read atomically
+	std::string	_path;
+	std::string	_data;
+
+	SnapshotWriter(const SnapshotWriter& other);
+	SnapshotWriter& operator=(const SnapshotWriter& other);
+
+	static void* writerMain(void* arg);
+
+	public:
+	SnapshotWriter();
+	~SnapshotWriter();
+
+	bool busy() const;
+	// Takes the image (swapped out of `image`). Returns false if the previous
+	// snapshot is still being written.
+	bool writeAsync(const std::string& path, std::string& image);
+	// Same thing on the caller's thread, for shutdown. Returns false on error.
+	bool writeNow(const std::string& path, std::string& image);
+	void wait();
+
+	static bool writeFile(const std::string& path, const std::string& data);
+};
+
+// Reads a snapshot straight from a private mmap of the file.
+class SnapshotReader {
+	private:
+	const char*	_map;
+	size_t		_size;
+	size_t		_pos;
+	size_t		_end;	// where the checksum starts
+	unsigned int _count;
+	unsigned int _read;
+	unsigned int _version;
+
+	SnapshotReader(const SnapshotReader& other);
+	SnapshotReader& operator=(const SnapshotReader& other);
+
+	bool readString(std::string& out);
+
+	public:
+	SnapshotReader();
+	~SnapshotReader();
+
+	// Returns false if there is no file or it isn't a valid snapshot
+	bool open(const std::string& path);
+	bool next(ChannelSnapshot& ch);
+	unsigned int count() const;
+	void close();
+};
@@ -0,0 +1,100 @@
+#include "SpamFilter.hpp"
+#include <cstring>
+
+SpamFilter::SpamFilter() : _mask(0), _threshold(0), _minLength(0), _window(1), _age(0) {}
+
+void SpamFilter::configure(size_t cells, unsigned int threshold, size_t minLength, unsigned long window) {
+	size_t size = 64;
+	while (size < cells)
+		size <<= 1;
+	_current.assign(size, 0);
+	_previous.assign(size, 0);
+	_mask = size - 1;
+	// Counters saturate at 255, so a bigger threshold would never trip
+	_threshold = threshold < 254 ? threshold : 254;
+	_minLength = minLength;
+	_window = window > 0 ? window : 1;
+	_age = 0;
+}
+
+// Bold, colour (with its "fg[,bg]" digits), reverse, italics, underline,
+// strikethrough, monospace and reset don't change what a line says, and
+// spammers vary them to dodge exact matches
+unsigned long SpamFilter::fingerprint(const std::string& text, size_t& length) {
+	unsigned long h = 0;
+	bool blank = false;
+	length = 0;
+	for (size_t i = 0; i < text.size(); ++i) {
+		unsigned char c = text[i];
+		if (c == 0x03) {
+			for (int n = 0; n < 2 && i + 1 < text.size() && text[i + 1] >= '0' && text[i + 1] <= '9'; ++n)
+				i++;
+			if (i + 2 < text.size() && text[i + 1] == ',' && text[i + 2] >= '0' && text[i + 2] <= '9') {
+				i++;
+				for (int n = 0; n < 2 && i + 1 < text.size() && text[i + 1] >= '0' && text[i + 1] <= '9'; ++n)
+					i++;
+			}
+			continue;
+		}
+		if (c == 0x02 || c == 0x0f || c == 0x11 || c == 0x16 || c == 0x1d || c == 0x1e || c == 0x1f)
+			continue;
+		if (c == ' ' || c == '\t') {
+			blank = length > 0;
+			continue;
+		}
+		if (blank) {
+			h = h * 1099511628211UL + ' ';
+			length++;
+			blank = false;
+		}
+		if (c >= 'A' && c <= 'Z')
+			c = c - 'A' + 'a';
+		h = h * 1099511628211UL + c;
+		length++;
+	}
+	// The multiply only carries upwards: fold the high bits back down
+	h ^= length;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	return h;
+}
+
+unsigned int SpamFilter::check(const std::string& text) {
+	if (_threshold == 0)
+		return 0;
+	size_t length;
+	unsigned long h = fingerprint(text, length);
+	if (length < _minLength)
+		return 0;
+	unsigned long h1 = h & 0xffffffffUL;
+	unsigned long h2 = (h >> 32) | 1;
+	size_t cells[HASHES];
+	unsigned int least = 512;
+	for (size_t i = 0; i < HASHES; ++i) {
+		cells[i] = (h1 + i * h2) & _mask;
+		unsigned int seen = _current[cells[i]] + _previous[cells[i]];
+		if (seen < least)
+			least = seen;
+	}
+	// Conservative update: counters already above this text's count were
+	// pushed there by others and are left alone
+	for (size_t i = 0; i < HASHES; ++i) {
+		unsigned char& c = _current[cells[i]];
+		if (c < 255 && (unsigned int)c + _previous[cells[i]] == least)
+			c++;
+	}
+	return least + 1;
+}
+
+void SpamFilter::tick() {
+	if (_threshold == 0 || ++_age < _window)
+		return;
+	_age = 0;
+	_current.swap(_previous);
+	std::memset(&_current[0], 0, _current.size());
+}
+
+size_t SpamFilter::memoryBytes() const {
+	return _current.capacity() + _previous.capacity();
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Spam waves: the same line pasted into many channels and PMs, often from
+// many connections at once. Every message text is reduced to a fingerprint
+// (case, IRC formatting and runs of blanks ignored) and counted in a
+// counting Bloom filter: HASHES byte counters out of `cells`, the smallest
+// of them is how many copies were seen. There are two filters, this
+// window's and the last one's; every `window` seconds the old one is wiped
+// and they swap, so a copy is remembered for one to two windows and the
+// memory never grows. A check is one pass over the text and HASHES counter
+// updates.
+class SpamFilter {
+	private:
+	std::vector<unsigned char>	_current;
+	std::vector<unsigned char>	_previous;
+	size_t			_mask;			// cells - 1
+	unsigned int	_threshold;		// copies let through per window (0: off)
+	size_t			_minLength;		// shorter texts ("hi", "lol") aren't counted
+	unsigned long	_window;		// seconds
+	unsigned long	_age;
+
+	public:
+	static const size_t HASHES = 4;
+
+	SpamFilter();
+	// `cells` is rounded up to a power of two
+	void configure(size_t cells, unsigned int threshold, size_t minLength, unsigned long window);
+	bool enabled() const { return _threshold > 0; }
+	unsigned int threshold() const { return _threshold; }
+
+	// Counts one more copy of `text` and returns how many were seen over
+	// the last one to two windows, this one included; 0 if it is too short
+	// to be counted
+	unsigned int check(const std::string& text);
+	// Once a second, from the housekeeping timer
+	void tick();
+	// Polynomial hash of the normalized text. `length` gets how many
+	// characters were hashed.
+	static unsigned long fingerprint(const std::string& text, size_t& length);
+	size_t memoryBytes() const;
+};
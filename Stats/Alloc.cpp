@@ -0,0 +1,51 @@
+#include "Stats.hpp"
+#include <new>
+#include <cstdlib>
+
+// Replaces the global operator new to count heap allocations, so STATS,
+// the metrics and ircbench can show allocations per command. One atomic
+// increment per call: the logger and archive threads allocate too.
+
+volatile unsigned long Stats::heapAllocations = 0;
+
+static void* countedAlloc(std::size_t size) {
+	__sync_fetch_and_add(&Stats::heapAllocations, 1UL);
+	void* p = std::malloc(size ? size : 1);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new(std::size_t size) throw(std::bad_alloc) {
+	return countedAlloc(size);
+}
+
+void* operator new[](std::size_t size) throw(std::bad_alloc) {
+	return countedAlloc(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) throw() {
+	__sync_fetch_and_add(&Stats::heapAllocations, 1UL);
+	return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) throw() {
+	__sync_fetch_and_add(&Stats::heapAllocations, 1UL);
+	return std::malloc(size ? size : 1);
+}
+
+void operator delete(void* p) throw() {
+	std::free(p);
+}
+
+void operator delete[](void* p) throw() {
+	std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) throw() {
+	std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) throw() {
+	std::free(p);
+}
@@ -0,0 +1,111 @@
+#include "Sketch.hpp"
+#include "../Memory/Footprint.hpp"
+#include <algorithm>
+
+HeavyHitters::HeavyHitters(size_t width, size_t top) : _width(64), _maxTop(top) {
+	while (_width < width)
+		_width <<= 1;
+	_counters.assign(DEPTH * _width, 0);
+	_top.reserve(_maxTop);
+}
+
+// FNV-1a, then a multiply-xorshift so the high half is usable as well
+unsigned long HeavyHitters::hash(const std::string& key) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < key.size(); ++i) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (unsigned long)h;
+}
+
+// Row i uses h1 + i * h2 (two hashes are as good as DEPTH for count-min)
+void HeavyHitters::add(const std::string& key, unsigned long weight, unsigned long bytesIn) {
+	unsigned long h = hash(key);
+	unsigned long h1 = h & 0xffffffffUL;
+	unsigned long h2 = (h >> 32) | 1;
+	size_t mask = _width - 1;
+	unsigned long* cells[DEPTH];
+	unsigned long least = (unsigned long)-1;
+	for (size_t i = 0; i < DEPTH; ++i) {
+		cells[i] = &_counters[i * _width + ((h1 + i * h2) & mask)];
+		if (*cells[i] < least)
+			least = *cells[i];
+	}
+	// Conservative update: only the counters at the minimum grow, the
+	// others already overcount this key
+	unsigned long estimate = least + weight;
+	for (size_t i = 0; i < DEPTH; ++i) {
+		if (*cells[i] < estimate)
+			*cells[i] = estimate;
+	}
+
+	size_t lightest = 0;
+	for (size_t i = 0; i < _top.size(); ++i) {
+		Talker& t = _top[i];
+		if (t.hash == h && t.key == key) {
+			t.bytes = estimate;
+			t.messages++;
+			t.bytesIn += bytesIn;
+			t.bytesOut += weight;
+			return;
+		}
+		if (t.bytes < _top[lightest].bytes)
+			lightest = i;
+	}
+	if (_top.size() < _maxTop) {
+		_top.push_back(Talker());
+		lightest = _top.size() - 1;
+	} else if (_maxTop == 0 || estimate <= _top[lightest].bytes)
+		return;
+	Talker& t = _top[lightest];
+	t.key = key;
+	t.hash = h;
+	t.bytes = estimate;
+	t.messages = 1;
+	t.bytesIn = bytesIn;
+	t.bytesOut = weight;
+}
+
+unsigned long HeavyHitters::estimate(const std::string& key) const {
+	unsigned long h = hash(key);
+	unsigned long h1 = h & 0xffffffffUL;
+	unsigned long h2 = (h >> 32) | 1;
+	unsigned long least = (unsigned long)-1;
+	for (size_t i = 0; i < DEPTH; ++i) {
+		unsigned long c = _counters[i * _width + ((h1 + i * h2) & (_width - 1))];
+		if (c < least)
+			least = c;
+	}
+	return least;
+}
+
+void HeavyHitters::decay() {
+	for (size_t i = 0; i < _counters.size(); ++i)
+		_counters[i] >>= 1;
+	for (size_t i = 0; i < _top.size(); ++i) {
+		_top[i].bytes >>= 1;
+		_top[i].messages >>= 1;
+		_top[i].bytesIn >>= 1;
+		_top[i].bytesOut >>= 1;
+	}
+}
+
+static bool heavier(const Talker& a, const Talker& b) {
+	return a.bytes > b.bytes;
+}
+
+void HeavyHitters::sorted(std::vector<Talker>& out) const {
+	out = _top;
+	std::sort(out.begin(), out.end(), heavier);
+}
+
+size_t HeavyHitters::memoryBytes() const {
+	size_t bytes = _counters.capacity() * sizeof(unsigned long) + _top.capacity() * sizeof(Talker);
+	for (size_t i = 0; i < _top.size(); ++i)
+		bytes += stringHeapBytes(_top[i].key);
+	return bytes;
+}
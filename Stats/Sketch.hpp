@@ -0,0 +1,43 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// One of the heaviest keys seen so far. `bytes` comes from the sketch (an
+// overestimate, never under); the other counts started when the key got on
+// the list, so they leave out what came before.
+struct Talker {
+	std::string		key;
+	unsigned long	hash;
+	unsigned long	bytes;		// fan-out bytes, estimated
+	unsigned long	messages;
+	unsigned long	bytesIn;
+	unsigned long	bytesOut;
+};
+
+// Heavy hitters in fixed memory: a count-min sketch (DEPTH rows of `width`
+// counters) estimates every key's weight, and the `top` keys with the
+// biggest estimates are kept by name. Adding is DEPTH counter updates and a
+// scan of the short list; no key outside the list is stored anywhere, so
+// any number of channels or users cost the same memory.
+class HeavyHitters {
+	private:
+	std::vector<unsigned long>	_counters;	// DEPTH rows of _width
+	size_t						_width;		// a power of two
+	std::vector<Talker>			_top;		// heaviest first only after sorted()
+	size_t						_maxTop;
+
+	static unsigned long hash(const std::string& key);
+
+	public:
+	static const size_t DEPTH = 4;
+
+	HeavyHitters(size_t width, size_t top);
+
+	void add(const std::string& key, unsigned long weight, unsigned long bytesIn);
+	unsigned long estimate(const std::string& key) const;
+	// Every counter halved: what was heavy a while ago fades out
+	void decay();
+	void sorted(std::vector<Talker>& out) const;
+	size_t memoryBytes() const;
+};
@@ -0,0 +1,319 @@
+#include "Stats.hpp"
+#include "../Logger/Logger.hpp"
+#include "../Memory/Pool.hpp"
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+unsigned long Stats::sentBytes = 0;
+unsigned long Stats::queuedBytes = 0;
+
+LatencyHistogram::LatencyHistogram() : _count(0), _max(0), _sum(0) {
+	std::memset(_buckets, 0, sizeof(_buckets));
+}
+
+int LatencyHistogram::bucketFor(unsigned long ns) {
+	if (ns < (unsigned long)SUB_COUNT)
+		return (int)ns;
+	int msb = (int)(sizeof(unsigned long) * 8) - 1 - __builtin_clzl(ns);
+	if (msb > MAX_BIT)
+		return BUCKETS - 1;
+	int sub = (int)((ns >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+	return (msb - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+unsigned long LatencyHistogram::bucketUpper(int index) {
+	if (index < SUB_COUNT)
+		return (unsigned long)index;
+	int msb = index / SUB_COUNT + SUB_BITS - 1;
+	int shift = msb - SUB_BITS;
+	unsigned long lower = (unsigned long)(SUB_COUNT + index % SUB_COUNT) << shift;
+	return lower + (1UL << shift) - 1;
+}
+
+void LatencyHistogram::record(unsigned long ns) {
+	_buckets[bucketFor(ns)]++;
+	_count++;
+	_sum += ns;
+	if (ns > _max)
+		_max = ns;
+}
+
+unsigned long LatencyHistogram::count() const {
+	return _count;
+}
+
+unsigned long LatencyHistogram::max() const {
+	return _max;
+}
+
+unsigned long LatencyHistogram::sum() const {
+	return _sum;
+}
+
+unsigned long LatencyHistogram::percentile(double p) const {
+	if (_count == 0)
+		return 0;
+	unsigned long target = (unsigned long)(p / 100.0 * (double)_count);
+	if (target == 0)
+		target = 1;
+	unsigned long seen = 0;
+	for (int i = 0; i < BUCKETS; ++i) {
+		seen += _buckets[i];
+		if (seen >= target) {
+			unsigned long upper = bucketUpper(i);
+			return upper < _max ? upper : _max;
+		}
+	}
+	return _max;
+}
+
+Stats::Stats() :
+	_startTime(std::time(NULL)),
+	_loops(0),
+	_loopsPerSec(0),
+	_connectionsAccepted(0),
+	_fanoutMessages(0),
+	_fanoutDeliveries(0),
+	_fanoutBytes(0),
+	_fanoutBytesIn(0),
+	_fanoutMessagesLast(0),
+	_fanoutBytesLast(0),
+	_fanoutBytesInLast(0),
+	_fanoutMessageRate(0),
+	_fanoutByteRate(0),
+	_fanoutByteInRate(0),
+	_channelTalkers(2048, 10),
+	_userTalkers(2048, 10),
+	_talkerHalfLife(60),
+	_talkerAge(0),
+	_recvqHighWater(0),
+	_sendqHighWater(0),
+	_loopLagNs(0),
+	_loopLagMaxNs(0)
+{
+	clock_gettime(CLOCK_MONOTONIC, &_windowStart);
+}
+
+Stats::~Stats() {}
+
+unsigned long Stats::nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+void Stats::recordCommand(const std::string& verb, size_t bytesIn, size_t bytesOut, unsigned long ns) {
+	CommandStats& entry = _commands[verb];
+	entry.calls++;
+	entry.bytesIn += bytesIn;
+	entry.bytesOut += bytesOut;
+	entry.latency.record(ns);
+}
+
+// Called once per poll() wakeup. The rate is recomputed when a full second
+// has gone by, so reading it never costs more than a field access.
+void Stats::loopIteration() {
+	_loops++;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsedMs = (now.tv_sec - _windowStart.tv_sec) * 1000 + (now.tv_nsec - _windowStart.tv_nsec) / 1000000;
+	if (elapsedMs >= 1000) {
+		_loopsPerSec = _loops * 1000 / (unsigned long)elapsedMs;
+		_loops = 0;
+		_windowStart = now;
+	}
+}
+
+void Stats::recordConnection() {
+	_connectionsAccepted++;
+}
+
+void Stats::configureTalkers(size_t width, size_t top, unsigned long halfLife) {
+	_channelTalkers = HeavyHitters(width, top);
+	_userTalkers = HeavyHitters(width, top);
+	_talkerHalfLife = halfLife;
+}
+
+void Stats::recordFanout(const std::string& channel, size_t recipients, size_t bytes) {
+	_fanoutMessages++;
+	_fanoutDeliveries += recipients;
+	_fanoutBytes += recipients * bytes;
+	_fanoutBytesIn += bytes;
+	_channelTalkers.add(channel, recipients * bytes, bytes);
+}
+
+void Stats::recordTalker(const std::string& nick, size_t recipients, size_t bytes) {
+	_userTalkers.add(nick, recipients * bytes, bytes);
+}
+
+void Stats::sampleTraffic() {
+	_fanoutMessageRate = _fanoutMessages - _fanoutMessagesLast;
+	_fanoutByteRate = _fanoutBytes - _fanoutBytesLast;
+	_fanoutByteInRate = _fanoutBytesIn - _fanoutBytesInLast;
+	_fanoutMessagesLast = _fanoutMessages;
+	_fanoutBytesLast = _fanoutBytes;
+	_fanoutBytesInLast = _fanoutBytesIn;
+	if (_talkerHalfLife > 0 && ++_talkerAge >= _talkerHalfLife) {
+		_channelTalkers.decay();
+		_userTalkers.decay();
+		_talkerAge = 0;
+	}
+}
+
+void Stats::noteRecvQueue(size_t bytes) {
+	if (bytes > _recvqHighWater)
+		_recvqHighWater = bytes;
+}
+
+void Stats::noteSendQueue(unsigned long bytes) {
+	if (bytes > _sendqHighWater)
+		_sendqHighWater = bytes;
+}
+
+void Stats::recordLoopLag(unsigned long ns) {
+	_loopLagNs = ns;
+	if (ns > _loopLagMaxNs)
+		_loopLagMaxNs = ns;
+}
+
+unsigned long Stats::loopsPerSecond() const {
+	return _loopsPerSec;
+}
+
+unsigned long Stats::connectionsAccepted() const {
+	return _connectionsAccepted;
+}
+
+unsigned long Stats::fanoutMessages() const {
+	return _fanoutMessages;
+}
+
+unsigned long Stats::fanoutDeliveries() const {
+	return _fanoutDeliveries;
+}
+
+unsigned long Stats::fanoutBytes() const {
+	return _fanoutBytes;
+}
+
+unsigned long Stats::fanoutBytesIn() const {
+	return _fanoutBytesIn;
+}
+
+unsigned long Stats::fanoutMessageRate() const {
+	return _fanoutMessageRate;
+}
+
+unsigned long Stats::fanoutByteRate() const {
+	return _fanoutByteRate;
+}
+
+unsigned long Stats::fanoutByteInRate() const {
+	return _fanoutByteInRate;
+}
+
+const HeavyHitters& Stats::channelTalkers() const {
+	return _channelTalkers;
+}
+
+const HeavyHitters& Stats::userTalkers() const {
+	return _userTalkers;
+}
+
+size_t Stats::talkerMemoryBytes() const {
+	return _channelTalkers.memoryBytes() + _userTalkers.memoryBytes();
+}
+
+size_t Stats::recvqHighWater() const {
+	return _recvqHighWater;
+}
+
+unsigned long Stats::sendqHighWater() const {
+	return _sendqHighWater;
+}
+
+unsigned long Stats::loopLagNs() const {
+	return _loopLagNs;
+}
+
+unsigned long Stats::loopLagMaxNs() const {
+	return _loopLagMaxNs;
+}
+
+time_t Stats::uptime() const {
+	return std::time(NULL) - _startTime;
+}
+
+const std::map<std::string, CommandStats>& Stats::commands() const {
+	return _commands;
+}
+
+static std::string formatUs(unsigned long ns) {
+	std::ostringstream oss;
+	oss << std::fixed << std::setprecision(1) << (double)ns / 1000.0 << "us";
+	return oss.str();
+}
+
+void Stats::report(char which, const StatsGauges& gauges, std::vector<std::string>& lines) const {
+	std::map<std::string, CommandStats>::const_iterator it;
+
+	if (which == 'm') {
+		// <command> <calls> <bytes in> <bytes out>
+		for (it = _commands.begin(); it != _commands.end(); ++it) {
+			std::ostringstream oss;
+			oss << it->first << " " << it->second.calls << " " << it->second.bytesIn << " " << it->second.bytesOut;
+			lines.push_back(oss.str());
+		}
+	} else if (which == 'h') {
+		for (it = _commands.begin(); it != _commands.end(); ++it) {
+			const LatencyHistogram& h = it->second.latency;
+			std::ostringstream oss;
+			oss << it->first << " n=" << h.count()
+				<< " p50=" << formatUs(h.percentile(50))
+				<< " p90=" << formatUs(h.percentile(90))
+				<< " p99=" << formatUs(h.percentile(99))
+				<< " max=" << formatUs(h.max());
+			lines.push_back(oss.str());
+		}
+	} else if (which == 'g') {
+		std::ostringstream oss;
+		oss << "clients=" << gauges.clients << " channels=" << gauges.channels
+			<< " sendq_bytes=" << gauges.sendqBytes << " loops_per_sec=" << _loopsPerSec
+			<< " bytes_sent=" << sentBytes << " fanout_msgs=" << _fanoutMessages
+			<< " fanout_bytes=" << _fanoutBytes << " loop_lag=" << formatUs(_loopLagNs)
+			<< " log_dropped=" << Logger::dropped() << " client_bytes=" << gauges.clientBytes
+			<< " heap_allocs=" << heapAllocations
+			<< " pool_bytes=" << FixedPool::slabBytes << " pool_blocks=" << FixedPool::blocksInUse
+			<< " load=" << gauges.loadMode << " spam_flagged=" << gauges.spamFlagged
+			<< " spam_dropped=" << gauges.spamDropped;
+		lines.push_back(oss.str());
+	} else if (which == 'f') {
+		// Rates over the last second, then the heaviest channels and senders:
+		// <kind> <name> <bytes out> <messages> <bytes in> <amplification>
+		std::ostringstream oss;
+		oss << "msgs_per_sec=" << _fanoutMessageRate << " bytes_in_per_sec=" << _fanoutByteInRate
+			<< " bytes_out_per_sec=" << _fanoutByteRate << " amplification="
+			<< std::fixed << std::setprecision(1) << (_fanoutBytesIn ? (double)_fanoutBytes / _fanoutBytesIn : 0.0);
+		lines.push_back(oss.str());
+		const HeavyHitters* sketches[2] = { &_channelTalkers, &_userTalkers };
+		const char* kinds[2] = { "channel", "user" };
+		std::vector<Talker> top;
+		for (int k = 0; k < 2; ++k) {
+			sketches[k]->sorted(top);
+			for (size_t i = 0; i < top.size(); ++i) {
+				std::ostringstream line;
+				line << kinds[k] << " " << top[i].key << " " << top[i].bytes << " " << top[i].messages << " " << top[i].bytesIn
+					<< " " << std::fixed << std::setprecision(1) << (top[i].bytesIn ? (double)top[i].bytesOut / top[i].bytesIn : 0.0);
+				lines.push_back(line.str());
+			}
+		}
+	} else if (which == 'u') {
+		time_t up = uptime();
+		std::ostringstream oss;
+		oss << "Server Up " << up / 86400 << " days " << (up % 86400) / 3600 << ":"
+			<< std::setw(2) << std::setfill('0') << (up % 3600) / 60 << ":"
+			<< std::setw(2) << std::setfill('0') << up % 60;
+		lines.push_back(oss.str());
+	}
+}
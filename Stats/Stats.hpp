@@ -0,0 +1,133 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include "Sketch.hpp"
+
+// Log-bucketed latency histogram (HDR style). Every power of two is split in
+// SUB_COUNT linear sub-buckets, so a value is never off by more than 1/8.
+// Values are nanoseconds; anything bigger than 2^MAX_BIT goes to the last bucket.
+class LatencyHistogram {
+	public:
+	static const int SUB_BITS = 3;
+	static const int SUB_COUNT = 1 << SUB_BITS;
+	static const int MAX_BIT = 40; // ~18 minutes, more than enough for one command
+	static const int BUCKETS = (MAX_BIT - SUB_BITS + 2) * SUB_COUNT;
+
+	LatencyHistogram();
+	void record(unsigned long ns);
+	unsigned long count() const;
+	unsigned long max() const;
+	unsigned long sum() const;	// every value recorded, added up
+	unsigned long percentile(double p) const; // p in [0, 100]
+
+	private:
+	unsigned long _buckets[BUCKETS];
+	unsigned long _count;
+	unsigned long _max;
+	unsigned long _sum;
+
+	static int bucketFor(unsigned long ns);
+	static unsigned long bucketUpper(int index);
+};
+
+struct CommandStats {
+	unsigned long calls;
+	unsigned long bytesIn;
+	unsigned long bytesOut;
+	LatencyHistogram latency;
+
+	CommandStats() : calls(0), bytesIn(0), bytesOut(0) {}
+};
+
+// Values the server owns and only knows at report time.
+struct StatsGauges {
+	size_t clients;
+	size_t channels;
+	unsigned long sendqBytes;
+	size_t clientBytes;		// Server::clientMemory()
+	const char* loadMode;	// OverloadControl::modeName()
+	unsigned long spamFlagged;	// repeats let through with spam_action = flag
+	unsigned long spamDropped;
+
+	StatsGauges() : clients(0), channels(0), sendqBytes(0), clientBytes(0), loadMode("normal"), spamFlagged(0), spamDropped(0) {}
+};
+
+class Stats {
+	private:
+	std::map<std::string, CommandStats> _commands;
+	time_t			_startTime;
+	unsigned long	_loops;			// event-loop iterations in the current window
+	unsigned long	_loopsPerSec;	// rate of the last complete window
+	struct timespec	_windowStart;
+
+	unsigned long	_connectionsAccepted;
+	unsigned long	_fanoutMessages;	// channel broadcasts
+	unsigned long	_fanoutDeliveries;	// copies handed to members
+	unsigned long	_fanoutBytes;
+	unsigned long	_fanoutBytesIn;		// one copy per broadcast: amplification is out / in
+	// Per-second rates of the three above, from the last housekeeping tick
+	unsigned long	_fanoutMessagesLast, _fanoutBytesLast, _fanoutBytesInLast;
+	unsigned long	_fanoutMessageRate, _fanoutByteRate, _fanoutByteInRate;
+	HeavyHitters	_channelTalkers;	// fan-out bytes by channel
+	HeavyHitters	_userTalkers;		// by sender nick, channel messages only
+	unsigned long	_talkerHalfLife;	// seconds between two halvings (0: never)
+	unsigned long	_talkerAge;
+	size_t			_recvqHighWater;
+	unsigned long	_sendqHighWater;
+	unsigned long	_loopLagNs;		// how late the last housekeeping timer fired
+	unsigned long	_loopLagMaxNs;
+
+	Stats(const Stats& other);
+	Stats& operator=(const Stats& other);
+
+	public:
+	// Every byte written to a client socket goes through here, no matter who sent it.
+	static unsigned long sentBytes;
+	// Bytes put on a SendQ. Attributed to the command that produced them.
+	static unsigned long queuedBytes;
+	// Calls to operator new, from any thread (Stats/Alloc.cpp)
+	static volatile unsigned long heapAllocations;
+
+	Stats();
+	~Stats();
+
+	static unsigned long nowNs();
+
+	void recordCommand(const std::string& verb, size_t bytesIn, size_t bytesOut, unsigned long ns);
+	void loopIteration();
+	void recordConnection();
+	// Sizes the talker sketches: `width` counters per row, the `top` heaviest
+	// kept by name, halved every `halfLife` seconds
+	void configureTalkers(size_t width, size_t top, unsigned long halfLife);
+	void recordFanout(const std::string& channel, size_t recipients, size_t bytes);
+	void recordTalker(const std::string& nick, size_t recipients, size_t bytes);
+	// Once a second: rates, and the sketches' decay
+	void sampleTraffic();
+	void noteRecvQueue(size_t bytes);
+	void noteSendQueue(unsigned long bytes);
+	void recordLoopLag(unsigned long ns);
+
+	unsigned long loopsPerSecond() const;
+	unsigned long connectionsAccepted() const;
+	unsigned long fanoutMessages() const;
+	unsigned long fanoutDeliveries() const;
+	unsigned long fanoutBytes() const;
+	unsigned long fanoutBytesIn() const;
+	unsigned long fanoutMessageRate() const;
+	unsigned long fanoutByteRate() const;
+	unsigned long fanoutByteInRate() const;
+	const HeavyHitters& channelTalkers() const;
+	const HeavyHitters& userTalkers() const;
+	size_t talkerMemoryBytes() const;
+	size_t recvqHighWater() const;
+	unsigned long sendqHighWater() const;
+	unsigned long loopLagNs() const;
+	unsigned long loopLagMaxNs() const;
+	time_t uptime() const;
+	const std::map<std::string, CommandStats>& commands() const;
+
+	// One line per entry, without any IRC prefix. `which` is the STATS letter.
+	void report(char which, const StatsGauges& gauges, std::vector<std::string>& lines) const;
+};
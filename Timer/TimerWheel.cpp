@@ -0,0 +1,108 @@
+#include "TimerWheel.hpp"
+#include <ctime>
+
+TimerWheel::TimerWheel(unsigned long tickMs, size_t slots) :
+	_tickMs(tickMs ? tickMs : 1),
+	_slots(slots ? slots : 1),
+	_nextId(1),
+	_currentTick(0),
+	_started(false)
+{
+}
+
+TimerWheel::~TimerWheel() {}
+
+unsigned long TimerWheel::nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000UL + (unsigned long)ts.tv_nsec / 1000000UL;
+}
+
+unsigned long TimerWheel::schedule(unsigned long nowMs, unsigned long delayMs, int kind, int fd) {
+	if (!_started) {
+		_currentTick = nowMs / _tickMs;
+		_started = true;
+	}
+	TimerEvent ev;
+	ev.id = _nextId++;
+	ev.dueMs = nowMs + delayMs;
+	ev.kind = kind;
+	ev.fd = fd;
+	// Round up: by the time the wheel reaches this tick the timer is due
+	unsigned long tick = (ev.dueMs + _tickMs - 1) / _tickMs;
+	// Never land in a slot we already walked past
+	if (tick <= _currentTick)
+		tick = _currentTick + 1;
+	size_t slot = tick % _slots.size();
+	_slots[slot].push_back(ev);
+	_slotOf[ev.id] = slot;
+	return ev.id;
+}
+
+void TimerWheel::cancel(unsigned long id) {
+	std::map<unsigned long, size_t>::iterator it = _slotOf.find(id);
+	if (it == _slotOf.end())
+		return;
+	std::list<TimerEvent>& slot = _slots[it->second];
+	for (std::list<TimerEvent>::iterator ev = slot.begin(); ev != slot.end(); ++ev) {
+		if (ev->id == id) {
+			slot.erase(ev);
+			break;
+		}
+	}
+	_slotOf.erase(it);
+}
+
+void TimerWheel::advance(unsigned long nowMs, std::vector<TimerEvent>& expired) {
+	if (!_started)
+		return;
+	unsigned long nowTick = nowMs / _tickMs;
+	if (nowTick <= _currentTick)
+		return;
+	// After a long stall one lap around the wheel visits every slot
+	unsigned long steps = nowTick - _currentTick;
+	if (steps > _slots.size())
+		steps = _slots.size();
+	for (unsigned long i = 1; i <= steps; ++i) {
+		std::list<TimerEvent>& slot = _slots[(_currentTick + i) % _slots.size()];
+		std::list<TimerEvent>::iterator ev = slot.begin();
+		while (ev != slot.end()) {
+			if (ev->dueMs <= nowMs) {
+				expired.push_back(*ev);
+				_slotOf.erase(ev->id);
+				ev = slot.erase(ev);
+			} else
+				++ev;
+		}
+	}
+	_currentTick = nowTick;
+}
+
+unsigned long TimerWheel::nextTimeoutMs(unsigned long nowMs, unsigned long maxMs) const {
+	if (_slotOf.empty())
+		return maxMs;
+	// Look ahead slot by slot: the first non-empty slot holds the nearest candidates
+	size_t limit = _slots.size();
+	if (maxMs / _tickMs + 1 < limit)
+		limit = maxMs / _tickMs + 1;
+	for (size_t i = 1; i <= limit; ++i) {
+		const std::list<TimerEvent>& slot = _slots[(_currentTick + i) % _slots.size()];
+		// advance() only looks at this slot once its tick has started: waking
+		// up earlier would just spin until then
+		unsigned long slotStart = (_currentTick + i) * _tickMs;
+		unsigned long best = maxMs;
+		for (std::list<TimerEvent>::const_iterator ev = slot.begin(); ev != slot.end(); ++ev) {
+			unsigned long due = ev->dueMs > slotStart ? ev->dueMs : slotStart;
+			unsigned long wait = due > nowMs ? due - nowMs : 0;
+			if (wait < best)
+				best = wait;
+		}
+		if (best < maxMs)
+			return best;
+	}
+	return maxMs;
+}
+
+size_t TimerWheel::size() const {
+	return _slotOf.size();
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <vector>
+#include <list>
+#include <map>
+#include <cstddef>
+
+struct TimerEvent {
+	unsigned long	id;
+	unsigned long	dueMs;
+	int				kind; // what to do, the owner decides what it means
+	int				fd;   // who it is for (-1 if nobody)
+};
+
+// Hashed timer wheel: one slot per tick, a timer lives in the slot of its
+// due tick and is skipped until its round comes. Schedule and cancel are
+// O(1) on average, advancing costs one slot per elapsed tick.
+class TimerWheel {
+	private:
+	unsigned long					_tickMs;
+	std::vector<std::list<TimerEvent> >	_slots;
+	std::map<unsigned long, size_t>	_slotOf; // id -> slot, for cancel()
+	unsigned long					_nextId;
+	unsigned long					_currentTick;
+	bool							_started;
+
+	TimerWheel(const TimerWheel& other);
+	TimerWheel& operator=(const TimerWheel& other);
+
+	public:
+	TimerWheel(unsigned long tickMs, size_t slots);
+	~TimerWheel();
+
+	unsigned long schedule(unsigned long nowMs, unsigned long delayMs, int kind, int fd);
+	void cancel(unsigned long id);
+	// Moves every timer due at or before nowMs into `expired`
+	void advance(unsigned long nowMs, std::vector<TimerEvent>& expired);
+	// Milliseconds poll() may sleep before the next timer is due (capped at maxMs)
+	unsigned long nextTimeoutMs(unsigned long nowMs, unsigned long maxMs) const;
+	size_t size() const;
+
+	static unsigned long nowMs();
+};
@@ -0,0 +1,275 @@
+#include "Trace.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+
+static const char TRACE_MAGIC[8] = { 'I', 'R', 'C', 'T', 'R', 'A', 'C', 'E' };
+static const unsigned char TRACE_VERSION = 1;
+
+static unsigned long monotonicNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static void putVarint(std::string& out, unsigned long value) {
+	while (value >= 0x80) {
+		out.push_back((char)((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+TraceWriter::TraceWriter() : _fd(-1), _running(false), _writing(false), _droppedBytes(0), _nextConnId(1), _lastNs(0), _records(0), _resumed(false) {
+	pthread_mutex_init(&_lock, NULL);
+	pthread_cond_init(&_wake, NULL);
+	pthread_cond_init(&_done, NULL);
+}
+
+TraceWriter::~TraceWriter() {
+	if (_fd != -1) {
+		flush();
+		pthread_mutex_lock(&_lock);
+		bool running = _running;
+		_running = false;
+		pthread_cond_signal(&_wake);
+		pthread_mutex_unlock(&_lock);
+		if (running)
+			pthread_join(_thread, NULL);
+		close(_fd);
+	}
+	pthread_cond_destroy(&_done);
+	pthread_cond_destroy(&_wake);
+	pthread_mutex_destroy(&_lock);
+}
+
+void TraceWriter::open(const std::string& path) {
+	_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (_resumed ? O_APPEND : O_TRUNC) | O_CLOEXEC, 0600);
+	if (_fd < 0)
+		throw std::runtime_error("Failed to open trace file " + path);
+	bool fresh = lseek(_fd, 0, SEEK_END) <= 0;
+	_buffer.reserve(FLUSH_THRESHOLD * 2);
+	if (fresh) {
+		_buffer.append(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+		_buffer.push_back((char)TRACE_VERSION);
+		_buffer.append(7, '\0');
+	}
+	// Resumed, the first delta is counted from the old process' last record
+	if (fresh || !_resumed)
+		_lastNs = monotonicNs();
+	_running = true;
+	if (pthread_create(&_thread, NULL, &TraceWriter::writerMain, this) != 0) {
+		_running = false;
+		::close(_fd);
+		_fd = -1;
+		throw std::runtime_error("Failed to start the trace thread");
+	}
+	if (fresh) {
+		for (std::map<int, unsigned long>::iterator it = _connIds.begin(); it != _connIds.end(); ++it)
+			append(TRACE_CONNECT, it->second, NULL, 0);
+	}
+}
+
+bool TraceWriter::enabled() const {
+	return _fd != -1;
+}
+
+void TraceWriter::append(TraceRecordType type, unsigned long connId, const char* data, size_t len) {
+	unsigned long now = monotonicNs();
+	_buffer.push_back((char)type);
+	putVarint(_buffer, connId);
+	putVarint(_buffer, now - _lastNs);
+	_lastNs = now;
+	if (type == TRACE_LINE) {
+		putVarint(_buffer, len);
+		_buffer.append(data, len);
+	}
+	_records++;
+	if (_buffer.size() >= FLUSH_THRESHOLD)
+		flush();
+}
+
+unsigned long TraceWriter::nextConnId() const {
+	return _nextConnId;
+}
+
+unsigned long TraceWriter::lastNs() const {
+	return _lastNs;
+}
+
+unsigned long TraceWriter::connId(int fd) const {
+	std::map<int, unsigned long>::const_iterator it = _connIds.find(fd);
+	return it != _connIds.end() ? it->second : 0;
+}
+
+void TraceWriter::resume(unsigned long nextConnId, unsigned long lastNs) {
+	if (nextConnId == 0)
+		return; // the old process wasn't tracing
+	_nextConnId = nextConnId;
+	_lastNs = lastNs;
+	_resumed = true;
+}
+
+void TraceWriter::adopt(int fd, unsigned long connId) {
+	if (connId == 0)
+		connId = _nextConnId;
+	if (connId >= _nextConnId)
+		_nextConnId = connId + 1;
+	_connIds[fd] = connId;
+}
+
+void TraceWriter::onConnect(int fd) {
+	if (_fd == -1)
+		return;
+	unsigned long id = _nextConnId++;
+	_connIds[fd] = id;
+	append(TRACE_CONNECT, id, NULL, 0);
+}
+
+void TraceWriter::onLine(int fd, const std::string& line) {
+	if (_fd == -1)
+		return;
+	std::map<int, unsigned long>::iterator it = _connIds.find(fd);
+	if (it == _connIds.end())
+		return;
+	append(TRACE_LINE, it->second, line.data(), line.size());
+}
+
+void TraceWriter::onDisconnect(int fd) {
+	if (_fd == -1)
+		return;
+	std::map<int, unsigned long>::iterator it = _connIds.find(fd);
+	if (it == _connIds.end())
+		return;
+	append(TRACE_DISCONNECT, it->second, NULL, 0);
+	_connIds.erase(it);
+}
+
+void TraceWriter::flush() {
+	if (_fd == -1 || _buffer.empty())
+		return;
+	pthread_mutex_lock(&_lock);
+	if (_pending.size() + _buffer.size() > MAX_PENDING)
+		_droppedBytes += _buffer.size();
+	else if (_pending.empty())
+		_pending.swap(_buffer); // the loop keeps the writer's old (empty) buffer
+	else
+		_pending.append(_buffer);
+	pthread_cond_signal(&_wake);
+	pthread_mutex_unlock(&_lock);
+	_buffer.clear();
+}
+
+void TraceWriter::sync() {
+	flush();
+	pthread_mutex_lock(&_lock);
+	while (_running && (!_pending.empty() || _writing))
+		pthread_cond_wait(&_done, &_lock);
+	pthread_mutex_unlock(&_lock);
+}
+
+void* TraceWriter::writerMain(void* arg) {
+	static_cast<TraceWriter*>(arg)->writerLoop();
+	return NULL;
+}
+
+void TraceWriter::writerLoop() {
+	std::string batch;
+	for (;;) {
+		pthread_mutex_lock(&_lock);
+		while (_running && _pending.empty())
+			pthread_cond_wait(&_wake, &_lock);
+		batch.swap(_pending);
+		bool running = _running;
+		_writing = true;
+		pthread_mutex_unlock(&_lock);
+
+		size_t done = 0;
+		while (done < batch.size()) {
+			ssize_t n = write(_fd, batch.data() + done, batch.size() - done);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				break; // disk full or similar: this chunk is lost
+			}
+			done += n;
+		}
+		batch.clear();
+
+		pthread_mutex_lock(&_lock);
+		_writing = false;
+		pthread_cond_broadcast(&_done);
+		pthread_mutex_unlock(&_lock);
+		if (!running)
+			break;
+	}
+}
+
+unsigned long TraceWriter::droppedBytes() {
+	pthread_mutex_lock(&_lock);
+	unsigned long n = _droppedBytes;
+	pthread_mutex_unlock(&_lock);
+	return n;
+}
+
+unsigned long TraceWriter::records() const {
+	return _records;
+}
+
+TraceReader::TraceReader() : _file(NULL), _offsetNs(0) {}
+
+TraceReader::~TraceReader() {
+	if (_file)
+		fclose(_file);
+}
+
+void TraceReader::open(const std::string& path) {
+	_file = fopen(path.c_str(), "rb");
+	if (!_file)
+		throw std::runtime_error("Failed to open trace file " + path);
+	unsigned char header[16];
+	if (fread(header, 1, sizeof(header), _file) != sizeof(header)
+		|| std::memcmp(header, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+		throw std::runtime_error(path + " is not a trace file");
+	if (header[8] != TRACE_VERSION)
+		throw std::runtime_error(path + ": unsupported trace version");
+}
+
+bool TraceReader::readVarint(unsigned long& value) {
+	value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = fgetc(_file);
+		if (c == EOF)
+			return false;
+		value |= (unsigned long)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool TraceReader::next(TraceRecord& record) {
+	int type = fgetc(_file);
+	if (type == EOF)
+		return false;
+	unsigned long delta;
+	if (type < TRACE_CONNECT || type > TRACE_DISCONNECT
+		|| !readVarint(record.connId) || !readVarint(delta))
+		throw std::runtime_error("Corrupted trace record");
+	record.type = (TraceRecordType)type;
+	_offsetNs += delta;
+	record.offsetNs = _offsetNs;
+	record.line.clear();
+	if (record.type == TRACE_LINE) {
+		unsigned long len;
+		if (!readVarint(len) || len > 1024 * 1024)
+			throw std::runtime_error("Corrupted trace record");
+		record.line.resize(len);
+		if (len && fread(&record.line[0], 1, len, _file) != len)
+			throw std::runtime_error("Truncated trace record");
+	}
+	return true;
+}
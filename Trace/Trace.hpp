@@ -0,0 +1,106 @@
+#pragma once
+#include <string>
+#include <map>
+#include <cstdio>
+#include <pthread.h>
+
+// Binary traffic trace.
+//
+//   header:  "IRCTRACE" | u8 version | 7 bytes reserved
+//   record:  u8 type | varint connId | varint ns since previous record
+//            | (LINE only) varint length | bytes
+//
+// Varints are LEB128 (7 bits per byte, low bits first). Connection ids are
+// handed out in accept order and never reused, unlike file descriptors.
+// Timestamps come from CLOCK_MONOTONIC.
+
+enum TraceRecordType {
+	TRACE_CONNECT = 1,
+	TRACE_LINE = 2,
+	TRACE_DISCONNECT = 3,
+};
+
+struct TraceRecord {
+	TraceRecordType	type;
+	unsigned long	connId;
+	unsigned long	offsetNs;	// since the first record of the trace
+	std::string		line;		// without the trailing CRLF
+};
+
+// Used by the server: buffers records and hands them out in big chunks to a
+// writer thread, like the logger and the archive, so the event loop never
+// waits on the disk. If the disk falls MAX_PENDING behind, chunks are
+// dropped and counted.
+class TraceWriter {
+	private:
+	int								_fd;
+	std::string						_buffer;	// event loop only
+	pthread_t						_thread;
+	pthread_mutex_t					_lock;
+	pthread_cond_t					_wake;		// something to write, or stop
+	pthread_cond_t					_done;		// the writer went idle
+	bool							_running;	// guarded by _lock
+	bool							_writing;	// guarded by _lock
+	std::string						_pending;	// guarded by _lock
+	unsigned long					_droppedBytes;	// guarded by _lock
+	std::map<int, unsigned long>	_connIds; // fd -> connection id
+	unsigned long					_nextConnId;
+	unsigned long					_lastNs;
+	unsigned long					_records;
+	bool							_resumed;	// appending to the old process' trace
+
+	TraceWriter(const TraceWriter& other);
+	TraceWriter& operator=(const TraceWriter& other);
+
+	void append(TraceRecordType type, unsigned long connId, const char* data, size_t len);
+	static void* writerMain(void* arg);
+	void writerLoop();
+
+	public:
+	static const size_t FLUSH_THRESHOLD = 64 * 1024;
+	static const size_t MAX_PENDING = 16 * 1024 * 1024;
+
+	TraceWriter();
+	~TraceWriter();
+
+	void open(const std::string& path); // throws
+	bool enabled() const;
+	// Hot upgrade. The old process passes on its next id, its clock and the
+	// id of every connection; the new one calls resume() and adopt() before
+	// open(), which then appends to the same file instead of starting over.
+	// Connections the old process didn't trace get a new id and, in a
+	// fresh file, a CONNECT record.
+	unsigned long nextConnId() const;
+	unsigned long lastNs() const;
+	unsigned long connId(int fd) const; // 0 if not traced
+	void resume(unsigned long nextConnId, unsigned long lastNs);
+	void adopt(int fd, unsigned long connId);
+	void onConnect(int fd);
+	void onLine(int fd, const std::string& line);
+	void onDisconnect(int fd);
+	// Hands the buffer to the writer thread, never blocks on I/O
+	void flush();
+	// flush() and wait until it is all on disk (before a hot upgrade)
+	void sync();
+	unsigned long records() const;
+	unsigned long droppedBytes();
+};
+
+// Used by the replay tool.
+class TraceReader {
+	private:
+	FILE*			_file;
+	unsigned long	_offsetNs;
+
+	TraceReader(const TraceReader& other);
+	TraceReader& operator=(const TraceReader& other);
+
+	bool readVarint(unsigned long& value);
+
+	public:
+	TraceReader();
+	~TraceReader();
+
+	void open(const std::string& path); // throws
+	bool next(TraceRecord& record);      // false at end of file
+};
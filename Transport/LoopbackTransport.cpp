@@ -0,0 +1,183 @@
+#include "LoopbackTransport.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+LoopbackTransport::LoopbackTransport() :
+	_listenFd(-1),
+	_nextFd(FIRST_HANDLE),
+	_sendLimit(0)
+{
+}
+
+LoopbackTransport::~LoopbackTransport() {}
+
+int LoopbackTransport::listen(int port) {
+	(void)port;
+	if (_listenFd != -1)
+		throw std::runtime_error("Loopback transport is already listening");
+	_listenFd = _nextFd++;
+	return _listenFd;
+}
+
+int LoopbackTransport::accept(int listenFd, std::string& host) {
+	if (listenFd != _listenFd || _pendingAccepts.empty()) {
+		errno = EAGAIN;
+		return -1;
+	}
+	int fd = _pendingAccepts.front();
+	_pendingAccepts.pop_front();
+	host = "127.0.0.1";
+	return fd;
+}
+
+int LoopbackTransport::connectTo(const std::string& host, int port) {
+	(void)host;
+	(void)port;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+ssize_t LoopbackTransport::recv(int fd, char* buffer, size_t len) {
+	std::map<int, Pipe>::iterator it = _pipes.find(fd);
+	if (it == _pipes.end() || it->second.serverClosed) {
+		errno = EBADF;
+		return -1;
+	}
+	Pipe& pipe = it->second;
+	size_t available = pipe.toServer.size() - pipe.toServerPos;
+	if (available == 0) {
+		if (pipe.clientClosed)
+			return 0;
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len > available)
+		len = available;
+	std::memcpy(buffer, pipe.toServer.data() + pipe.toServerPos, len);
+	pipe.toServerPos += len;
+	if (pipe.toServerPos == pipe.toServer.size()) {
+		pipe.toServer.clear();
+		pipe.toServerPos = 0;
+	}
+	return len;
+}
+
+ssize_t LoopbackTransport::send(int fd, const char* data, size_t len) {
+	std::map<int, Pipe>::iterator it = _pipes.find(fd);
+	if (it == _pipes.end() || it->second.serverClosed) {
+		errno = EBADF;
+		return -1;
+	}
+	Pipe& pipe = it->second;
+	if (pipe.clientClosed) {
+		errno = EPIPE;
+		return -1;
+	}
+	if (_sendLimit) {
+		if (pipe.toClient.size() >= _sendLimit) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (len > _sendLimit - pipe.toClient.size())
+			len = _sendLimit - pipe.toClient.size();
+	}
+	pipe.toClient.append(data, len);
+	return len;
+}
+
+void LoopbackTransport::close(int fd) {
+	std::map<int, Pipe>::iterator it = _pipes.find(fd);
+	if (it == _pipes.end())
+		return;
+	it->second.serverClosed = true;
+	// Keep the pipe while the client may still read what we sent
+	if (it->second.clientClosed)
+		_pipes.erase(it);
+}
+
+int LoopbackTransport::poll(std::vector<pollfd>& fds, int timeoutMs) {
+	(void)timeoutMs;
+	int ready = 0;
+	for (size_t i = 0; i < fds.size(); ++i) {
+		fds[i].revents = 0;
+		if (fds[i].fd == _listenFd) {
+			if (!_pendingAccepts.empty())
+				fds[i].revents |= POLLIN;
+		} else {
+			std::map<int, Pipe>::const_iterator it = _pipes.find(fds[i].fd);
+			if (it == _pipes.end() || it->second.serverClosed)
+				continue;
+			const Pipe& pipe = it->second;
+			if (pipe.toServer.size() > pipe.toServerPos || pipe.clientClosed)
+				fds[i].revents |= POLLIN;
+			if (!_sendLimit || pipe.toClient.size() < _sendLimit)
+				fds[i].revents |= POLLOUT;
+		}
+		fds[i].revents &= fds[i].events | POLLHUP | POLLERR;
+		if (fds[i].revents)
+			ready++;
+	}
+	return ready;
+}
+
+int LoopbackTransport::connect() {
+	int fd = _nextFd++;
+	_pipes[fd] = Pipe();
+	_pendingAccepts.push_back(fd);
+	return fd;
+}
+
+void LoopbackTransport::write(int conn, const std::string& data) {
+	std::map<int, Pipe>::iterator it = _pipes.find(conn);
+	if (it == _pipes.end() || it->second.clientClosed || it->second.serverClosed)
+		return;
+	it->second.toServer.append(data);
+}
+
+std::string LoopbackTransport::read(int conn) {
+	std::string out;
+	std::map<int, Pipe>::iterator it = _pipes.find(conn);
+	if (it != _pipes.end())
+		out.swap(it->second.toClient);
+	return out;
+}
+
+size_t LoopbackTransport::discard(int conn) {
+	std::map<int, Pipe>::iterator it = _pipes.find(conn);
+	if (it == _pipes.end())
+		return 0;
+	size_t n = it->second.toClient.size();
+	it->second.toClient.clear();
+	return n;
+}
+
+void LoopbackTransport::hangUp(int conn) {
+	std::map<int, Pipe>::iterator it = _pipes.find(conn);
+	if (it == _pipes.end())
+		return;
+	it->second.clientClosed = true;
+	if (it->second.serverClosed)
+		_pipes.erase(it);
+}
+
+bool LoopbackTransport::closedByServer(int conn) const {
+	std::map<int, Pipe>::const_iterator it = _pipes.find(conn);
+	return it == _pipes.end() || it->second.serverClosed;
+}
+
+bool LoopbackTransport::idle() const {
+	if (!_pendingAccepts.empty())
+		return false;
+	for (std::map<int, Pipe>::const_iterator it = _pipes.begin(); it != _pipes.end(); ++it) {
+		if (it->second.serverClosed)
+			continue;
+		if (it->second.toServer.size() > it->second.toServerPos || it->second.clientClosed)
+			return false;
+	}
+	return true;
+}
+
+void LoopbackTransport::setSendLimit(size_t bytes) {
+	_sendLimit = bytes;
+}
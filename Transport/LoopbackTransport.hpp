@@ -0,0 +1,60 @@
+#pragma once
+#include "Transport.hpp"
+#include <map>
+#include <deque>
+
+// In-process transport for simulations and benchmarks: no kernel, no
+// timing noise. The test side plays the clients with connect(), write(),
+// read() and hangUp(); a connection uses the same handle on both sides.
+// poll() never sleeps, it just reports what is ready right now.
+class LoopbackTransport : public Transport {
+	private:
+	struct Pipe {
+		std::string	toServer;
+		size_t		toServerPos;	// consumed prefix of toServer
+		std::string	toClient;
+		bool		clientClosed;
+		bool		serverClosed;
+
+		Pipe() : toServerPos(0), clientClosed(false), serverClosed(false) {}
+	};
+
+	int					_listenFd;
+	int					_nextFd;
+	std::map<int, Pipe>	_pipes;
+	std::deque<int>		_pendingAccepts;
+	size_t				_sendLimit;
+
+	LoopbackTransport(const LoopbackTransport& other);
+	LoopbackTransport& operator=(const LoopbackTransport& other);
+
+	public:
+	static const int FIRST_HANDLE = 1000;
+
+	LoopbackTransport();
+	~LoopbackTransport();
+
+	// Server side
+	int listen(int port);
+	int accept(int listenFd, std::string& host);
+	int connectTo(const std::string& host, int port); // not supported: -1
+	ssize_t recv(int fd, char* buffer, size_t len);
+	ssize_t send(int fd, const char* data, size_t len);
+	void close(int fd);
+	int poll(std::vector<pollfd>& fds, int timeoutMs);
+
+	// Client side
+	int connect();
+	void write(int conn, const std::string& data);
+	// Takes (and forgets) everything the server sent on this connection
+	std::string read(int conn);
+	// Drops what the server sent without copying it, returns how many bytes that was
+	size_t discard(int conn);
+	void hangUp(int conn);
+	bool closedByServer(int conn) const;
+	// True once the server has consumed everything the clients wrote
+	bool idle() const;
+	// Bytes the server may have waiting for a client before send() says EAGAIN
+	// (0 = unlimited). Lets simulations reproduce slow readers.
+	void setSendLimit(size_t bytes);
+};
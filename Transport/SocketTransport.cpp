@@ -0,0 +1,105 @@
+#include "SocketTransport.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+SocketTransport::SocketTransport() {}
+
+SocketTransport::~SocketTransport() {}
+
+// Also close-on-exec: on a hot upgrade the new binary gets the sockets it
+// needs through SCM_RIGHTS and must not inherit stray copies of the others
+static bool setNonBlocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1 && fcntl(fd, F_SETFD, FD_CLOEXEC) != -1;
+}
+
+//AF_INET: We're telling it we want to use the IPv4 protocol (e.g., 127.0.0.1).
+//SOCK_STREAM: We're telling it we want a reliable TCP connection (the "phone call").
+//0: We're letting the OS pick the specific protocol, which will be TCP.
+int SocketTransport::listen(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		throw std::runtime_error("Failed to create socket");
+	int opt = 1; // This value means "enable the option"
+	// we use this funcion to disable the waiting time after the ctrl+c to use the same port and not wait 30 -60 sec
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+		::close(fd);
+		throw std::runtime_error("Failed to set socket options");
+	}
+	sockaddr_in serverAddress;
+	std::memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddress.sin_family = AF_INET;   //we store the address family
+	serverAddress.sin_port = htons(port);   //we store the port
+	serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) {
+		::close(fd);
+		throw std::runtime_error("Failed to bind socket");
+	}
+	if (::listen(fd, SOMAXCONN) < 0 || !setNonBlocking(fd)) {
+		::close(fd);
+		throw std::runtime_error("Failed to Listen");
+	}
+	return fd;
+}
+
+int SocketTransport::accept(int listenFd, std::string& host) {
+	sockaddr_in client_addr; // A structure to hold the new client's address
+	socklen_t client_len = sizeof(client_addr);
+	int fd = ::accept(listenFd, (sockaddr *)&client_addr, &client_len);
+	if (fd < 0)
+		return -1;
+	if (!setNonBlocking(fd)) {
+		::close(fd);
+		return -1;
+	}
+	char client_ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+	host = client_ip;
+	return fd;
+}
+
+int SocketTransport::connectTo(const std::string& host, int port) {
+	sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	if (!setNonBlocking(fd)
+		|| (::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)) {
+		int saved = errno;
+		::close(fd);
+		errno = saved;
+		return -1;
+	}
+	return fd;
+}
+
+ssize_t SocketTransport::recv(int fd, char* buffer, size_t len) {
+	return ::recv(fd, buffer, len, 0);
+}
+
+ssize_t SocketTransport::send(int fd, const char* data, size_t len) {
+	return ::send(fd, data, len, MSG_NOSIGNAL);
+}
+
+void SocketTransport::close(int fd) {
+	::close(fd);
+}
+
+int SocketTransport::poll(std::vector<pollfd>& fds, int timeoutMs) {
+	if (fds.empty())
+		return 0;
+	return ::poll(&fds[0], fds.size(), timeoutMs);
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "Transport.hpp"
+
+// The real thing: non-blocking TCP sockets and poll(2).
+class SocketTransport : public Transport {
+	private:
+	SocketTransport(const SocketTransport& other);
+	SocketTransport& operator=(const SocketTransport& other);
+
+	public:
+	SocketTransport();
+	~SocketTransport();
+
+	int listen(int port);
+	int accept(int listenFd, std::string& host);
+	int connectTo(const std::string& host, int port);
+	ssize_t recv(int fd, char* buffer, size_t len);
+	ssize_t send(int fd, const char* data, size_t len);
+	void close(int fd);
+	int poll(std::vector<pollfd>& fds, int timeoutMs);
+};
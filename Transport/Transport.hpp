@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <sys/types.h>
+
+// Everything the event loop needs from the outside world. The server only
+// talks to its clients through this interface, so it can run on real
+// sockets (SocketTransport) or entirely in memory (LoopbackTransport).
+//
+// Handles are plain ints, like file descriptors. recv() and send() follow
+// the POSIX conventions: -1 with errno EAGAIN means "not now", recv()
+// returning 0 means the peer hung up.
+class Transport {
+	public:
+	virtual ~Transport() {}
+
+	// Returns the listening handle. Throws std::runtime_error on failure.
+	virtual int listen(int port) = 0;
+	// Returns a new connection handle, or -1 if nobody is waiting.
+	virtual int accept(int listenFd, std::string& host) = 0;
+	// Outgoing connection (server links). Returns at once, the connection may
+	// still be in progress: send() says EAGAIN until it is up. -1 on failure.
+	virtual int connectTo(const std::string& host, int port) = 0;
+	virtual ssize_t recv(int fd, char* buffer, size_t len) = 0;
+	virtual ssize_t send(int fd, const char* data, size_t len) = 0;
+	virtual void close(int fd) = 0;
+	// Fills revents like poll(2). Handles the transport doesn't know are left alone.
+	virtual int poll(std::vector<pollfd>& fds, int timeoutMs) = 0;
+};
@@ -0,0 +1,337 @@
+#include "Upgrade.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+extern char** environ;
+
+const char* const Upgrade::ENV_FD = "FT_IRC_UPGRADE_FD";
+
+namespace {
+
+const char MAGIC[] = "IRCUPG01";
+const size_t MAGIC_SIZE = 8;
+const size_t HEADER_SIZE = MAGIC_SIZE + 4 + 4 + 8;
+
+bool writeAll(int fd, const char* data, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = ::send(fd, data + done, len - done, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+bool readAll(int fd, char* data, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = ::recv(fd, data + done, len - done, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+// One byte of payload carrying up to FDS_PER_MESSAGE descriptors
+bool sendFds(int sock, const int* fds, size_t count) {
+	char byte = 'F';
+	struct iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	std::vector<char> control(CMSG_SPACE(count * sizeof(int)), 0);
+	struct msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &control[0];
+	msg.msg_controllen = control.size();
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	std::memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+	while (true) {
+		ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (n == 1)
+			return true;
+		if (n < 0 && errno == EINTR)
+			continue;
+		return false;
+	}
+}
+
+// Reading a single byte keeps the kernel from handing us two batches at once
+size_t recvFds(int sock, std::vector<int>& out) {
+	char byte;
+	struct iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	std::vector<char> control(CMSG_SPACE(Upgrade::FDS_PER_MESSAGE * sizeof(int)), 0);
+	struct msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &control[0];
+	msg.msg_controllen = control.size();
+	ssize_t n;
+	do {
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n != 1 || (msg.msg_flags & MSG_CTRUNC))
+		return 0;
+	size_t received = 0;
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; ++i) {
+			int fd;
+			std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			out.push_back(fd);
+		}
+		received += count;
+	}
+	return received;
+}
+
+} // namespace
+
+int Upgrade::inheritedSocket() {
+	const char* value = std::getenv(ENV_FD);
+	if (value == NULL)
+		return -1;
+	int fd = std::atoi(value);
+	// Not for our own children, if we ever upgrade again
+	unsetenv(ENV_FD);
+	return fd > 2 ? fd : -1;
+}
+
+std::string Upgrade::programPath(const char* argv0) {
+	std::string name = argv0 != NULL ? argv0 : "";
+	if (name.find('/') != std::string::npos) {
+		if (name[0] == '/')
+			return name;
+		char cwd[4096];
+		if (getcwd(cwd, sizeof(cwd)) != NULL)
+			return std::string(cwd) + "/" + name;
+	} else if (!name.empty()) {
+		const char* path = std::getenv("PATH");
+		std::string dirs = path != NULL ? path : "/usr/bin:/bin";
+		size_t begin = 0;
+		while (begin <= dirs.size()) {
+			size_t end = dirs.find(':', begin);
+			if (end == std::string::npos)
+				end = dirs.size();
+			// An empty entry is the working directory
+			std::string dir = end > begin ? dirs.substr(begin, end - begin) : ".";
+			std::string candidate = dir + "/" + name;
+			if (access(candidate.c_str(), X_OK) == 0)
+				return candidate[0] == '/' ? candidate : programPath(candidate.c_str());
+			begin = end + 1;
+		}
+	}
+	// Nothing better: at least the binary we run from
+	return "/proc/self/exe";
+}
+
+int Upgrade::spawn(const std::string& path, const std::vector<std::string>& argv, pid_t& pid) {
+	if (path.empty() || argv.empty()) {
+		errno = EINVAL;
+		return -1;
+	}
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+		return -1;
+
+	// Everything the child needs is built before fork(): between fork and
+	// exec only async-signal-safe calls are allowed (we have threads)
+	char variable[64];
+	std::snprintf(variable, sizeof(variable), "%s=%d", ENV_FD, pair[1]);
+	std::vector<char*> env;
+	size_t nameLen = std::strlen(ENV_FD);
+	for (char** e = environ; *e != NULL; ++e) {
+		if (std::strncmp(*e, ENV_FD, nameLen) != 0 || (*e)[nameLen] != '=')
+			env.push_back(*e);
+	}
+	env.push_back(variable);
+	env.push_back(NULL);
+	std::vector<char*> args;
+	for (size_t i = 0; i < argv.size(); ++i)
+		args.push_back(const_cast<char*>(argv[i].c_str()));
+	args.push_back(NULL);
+
+	pid = fork();
+	if (pid < 0) {
+		int saved = errno;
+		::close(pair[0]);
+		::close(pair[1]);
+		errno = saved;
+		return -1;
+	}
+	if (pid == 0) {
+		fcntl(pair[1], F_SETFD, 0); // the only descriptor the new binary inherits
+		execve(path.c_str(), &args[0], &env[0]);
+		_exit(127);
+	}
+	::close(pair[1]);
+	return pair[0];
+}
+
+bool Upgrade::sendState(int sock, const std::vector<int>& fds, const std::string& state, int timeoutMs) {
+	struct timeval tv;
+	tv.tv_sec = timeoutMs / 1000;
+	tv.tv_usec = (timeoutMs % 1000) * 1000;
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	char header[HEADER_SIZE];
+	unsigned int version = VERSION;
+	unsigned int count = fds.size();
+	unsigned long length = state.size();
+	std::memcpy(header, MAGIC, MAGIC_SIZE);
+	std::memcpy(header + MAGIC_SIZE, &version, 4);
+	std::memcpy(header + MAGIC_SIZE + 4, &count, 4);
+	std::memcpy(header + MAGIC_SIZE + 8, &length, 8);
+	if (!writeAll(sock, header, HEADER_SIZE))
+		return false;
+	for (size_t i = 0; i < fds.size(); i += FDS_PER_MESSAGE) {
+		size_t n = fds.size() - i < FDS_PER_MESSAGE ? fds.size() - i : FDS_PER_MESSAGE;
+		if (!sendFds(sock, &fds[i], n))
+			return false;
+	}
+	return writeAll(sock, state.data(), state.size());
+}
+
+void Upgrade::receiveState(int sock, std::vector<int>& fds, std::string& state) {
+	char header[HEADER_SIZE];
+	if (!readAll(sock, header, HEADER_SIZE))
+		throw std::runtime_error("Upgrade: the old process hung up before sending its state");
+	unsigned int version;
+	unsigned int count;
+	unsigned long length;
+	std::memcpy(&version, header + MAGIC_SIZE, 4);
+	std::memcpy(&count, header + MAGIC_SIZE + 4, 4);
+	std::memcpy(&length, header + MAGIC_SIZE + 8, 8);
+	if (std::memcmp(header, MAGIC, MAGIC_SIZE) != 0 || version != VERSION)
+		throw std::runtime_error("Upgrade: the old process speaks another handoff version");
+
+	fds.reserve(count);
+	while (fds.size() < count) {
+		if (recvFds(sock, fds) == 0)
+			throw std::runtime_error("Upgrade: could not receive the sockets");
+	}
+	state.resize(length);
+	if (length > 0 && !readAll(sock, &state[0], length))
+		throw std::runtime_error("Upgrade: could not receive the state");
+}
+
+bool Upgrade::waitReady(int sock, int timeoutMs) {
+	struct pollfd pfd;
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	int ready;
+	do {
+		ready = ::poll(&pfd, 1, timeoutMs);
+	} while (ready < 0 && errno == EINTR);
+	if (ready <= 0)
+		return false;
+	char byte;
+	return ::recv(sock, &byte, 1, 0) == 1;
+}
+
+void Upgrade::signalReady(int sock) {
+	char byte = 'R';
+	writeAll(sock, &byte, 1);
+}
+
+void StateEncoder::putU8(unsigned char value) {
+	_data.push_back((char)value);
+}
+
+void StateEncoder::putU32(unsigned int value) {
+	_data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void StateEncoder::putI32(int value) {
+	_data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void StateEncoder::putU64(unsigned long value) {
+	_data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void StateEncoder::putString(const std::string& value) {
+	putU32(value.size());
+	_data.append(value);
+}
+
+std::string& StateEncoder::data() {
+	return _data;
+}
+
+StateDecoder::StateDecoder(const std::string& data) : _data(data), _pos(0), _ok(true) {}
+
+bool StateDecoder::take(void* out, size_t len) {
+	if (!_ok || _data.size() - _pos < len) {
+		_ok = false;
+		std::memset(out, 0, len);
+		return false;
+	}
+	std::memcpy(out, _data.data() + _pos, len);
+	_pos += len;
+	return true;
+}
+
+unsigned char StateDecoder::getU8() {
+	unsigned char value;
+	take(&value, sizeof(value));
+	return value;
+}
+
+unsigned int StateDecoder::getU32() {
+	unsigned int value;
+	take(&value, sizeof(value));
+	return value;
+}
+
+int StateDecoder::getI32() {
+	int value;
+	take(&value, sizeof(value));
+	return value;
+}
+
+unsigned long StateDecoder::getU64() {
+	unsigned long value;
+	take(&value, sizeof(value));
+	return value;
+}
+
+std::string StateDecoder::getString() {
+	unsigned int len = getU32();
+	if (!_ok || _data.size() - _pos < len) {
+		_ok = false;
+		return std::string();
+	}
+	std::string value(_data, _pos, len);
+	_pos += len;
+	return value;
+}
+
+bool StateDecoder::ok() const {
+	return _ok;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <sys/types.h>
+
+// Hot upgrade: the running server hands its listening socket, every client
+// socket and its state to a freshly exec'd copy of the binary, over one end
+// of a socketpair the child finds in FT_IRC_UPGRADE_FD.
+//
+//   old -> new:  "IRCUPG01" | u32 version | u32 fd count | u64 state length
+//                fds, SCM_RIGHTS, at most FDS_PER_MESSAGE per 1-byte message
+//                state bytes (what they mean is the Server's business)
+//   new -> old:  one byte once the new process is ready to serve
+//
+// Until that byte arrives the old process still owns everything: if the
+// child dies or never answers, it simply keeps serving.
+class Upgrade {
+	private:
+	Upgrade();
+
+	public:
+	static const unsigned int VERSION = 5;
+	static const size_t FDS_PER_MESSAGE = 250; // the kernel takes up to 253
+	static const char* const ENV_FD;
+
+	// The socket left by the old process, or -1 on a normal start
+	static int inheritedSocket();
+	// Absolute path of the binary argv[0] names, looked up in $PATH when it
+	// has no slash. Resolved at startup: the working directory and $PATH
+	// may change afterwards, and the point of an upgrade is to start
+	// whatever file is at that path now, not the inode we run from
+	static std::string programPath(const char* argv0);
+	// socketpair + fork + exec `path` with argv. Returns our end, or -1
+	// with errno set.
+	static int spawn(const std::string& path, const std::vector<std::string>& argv, pid_t& pid);
+	// Gives up if the child stops reading for timeoutMs
+	static bool sendState(int sock, const std::vector<int>& fds, const std::string& state, int timeoutMs);
+	// Throws std::runtime_error, the new process can't do anything else anyway
+	static void receiveState(int sock, std::vector<int>& fds, std::string& state);
+	static bool waitReady(int sock, int timeoutMs);
+	static void signalReady(int sock);
+};
+
+// Flat encoding of the state, host byte order: both ends are the same
+// machine and, for all that matters, the same code.
+class StateEncoder {
+	private:
+	std::string	_data;
+
+	public:
+	void putU8(unsigned char value);
+	void putU32(unsigned int value);
+	void putI32(int value);
+	void putU64(unsigned long value);
+	void putString(const std::string& value);
+	std::string& data();
+};
+
+// Every getter checks the bounds; once one fails the rest return zeroes and
+// ok() stays false.
+class StateDecoder {
+	private:
+	const std::string&	_data;
+	size_t				_pos;
+	bool				_ok;
+
+	bool take(void* out, size_t len);
+
+	public:
+	explicit StateDecoder(const std::string& data);
+	unsigned char getU8();
+	unsigned int getU32();
+	int getI32();
+	unsigned long getU64();
+	std::string getString();
+	bool ok() const;
+};
@@ -1,11 +1,12 @@
 #include "channel.hpp"
+#include "../Memory/Footprint.hpp"
 
-Channel::Channel(): _name("")
+Channel::Channel(): _name(""), _epoch(next_epoch())
 {
 	return ; 
 }
 
-Channel::Channel(std::string name, int cl)
+Channel::Channel(std::string name, int cl) : _epoch(next_epoch())
 {
 	_name = name;
 	_operators.push_back(cl); // meto el usuario actual
@@ -18,8 +19,36 @@ Channel::Channel(std::string name, int cl)
 
 }
 
+Channel::Channel(std::string name) : _name(name), _epoch(next_epoch())
+{
+	_mode_flag[0] = 0; // +i
+	_mode_flag[1] = 0; // +k
+	_mode_flag[2] = -1; // +l
+	_mode_flag[3] = 0; // +t
+}
+
 Channel::~Channel() {}
 
+// Topic y modos guardados antes de reiniciar
+void Channel::restore_settings(std::string topic, const int modes[4], std::string password)
+{
+	_topic = topic;
+	for (int i = 0; i < 4; i++)
+		_mode_flag[i] = modes[i];
+	_password = password;
+	touch();
+}
+
+// Miembros, operadores e invitaciones tal y como estaban en el proceso anterior
+void Channel::restore_members(const std::vector<int>& members, const std::vector<int>& operators, const std::vector<int>& invites)
+{
+	_members = members;
+	_operators = operators;
+	_invList = invites;
+	_sendCache.clear();
+	touch();
+}
+
 // NOMBRE DEL CANAL CORRECTO O NO (0 -> OK, 1-> OUT)
 // 403 nick #canal_invalido :No such channel -> 2812 IRC
 
@@ -136,6 +165,13 @@ ChannelError Channel::change_mode(std::string mode, int client, int other_cl, st
 	std::vector<int>::iterator ito = std::find(_operators.begin(), _operators.end(), client);
 	if (ito == _operators.end())
 		return ERR_NOT_OPERATOR;
+	return force_mode(mode, other_cl, other);
+}
+
+// Sin comprobar quien lo pide: el servidor de origen ya lo hizo (server links)
+ChannelError Channel::force_mode(std::string mode, int other_cl, std::string other)
+{
+	touch(); // de sobra si el modo resulta invalido, pero nunca de menos
 	if (mode == "+o" || mode == "-o")
 		return change_mode_o(mode[0], other_cl);
 	else if (mode == "+l" || mode == "-l")
@@ -184,7 +220,7 @@ std::string Channel::get_name()
 	return _name;
 }
 
-std::vector<int> Channel::get_members() const
+const std::vector<int>& Channel::get_members() const
 {
 	return _members;
 }
@@ -194,7 +230,7 @@ int *Channel::get_modes()
 	return _mode_flag;
 }
 
-std::vector<int> Channel::get_invite_list()
+const std::vector<int>& Channel::get_invite_list() const
 {
 	return _invList;
 }
@@ -204,13 +240,37 @@ std::string Channel::get_topic()
 	return _topic;
 }
 
+HistoryRing& Channel::get_history()
+{
+	return _history;
+}
+
+size_t Channel::memoryBytes() const
+{
+	return sizeof(Channel) + stringHeapBytes(_name) + stringHeapBytes(_topic) + stringHeapBytes(_password)
+		+ (_members.capacity() + _operators.capacity() + _invList.capacity()) * sizeof(int)
+		+ _clients.size() * mapNodeBytes(sizeof(std::pair<const int, Client*>))
+		+ _bans.memoryBytes() + _exceptions.memoryBytes()
+		+ _banCache.size() * mapNodeBytes(sizeof(std::pair<const int, std::pair<unsigned long, bool> >))
+		+ _sendCache.size() * mapNodeBytes(sizeof(std::pair<const int, SendVerdict>));
+}
+
+const MaskList& Channel::get_masks(char list) const
+{
+	return list == 'e' ? _exceptions : _bans;
+}
+
 void Channel::add_member(int client, int flag)
 {
+	// Canal restaurado sin nadie dentro: el primero que entra es operador
+	if (_members.empty())
+		flag = 0;
 	std::vector<int>::iterator it = std::find(_members.begin(), _members.end(), client);
 	if (it == _members.end())
 	{
 		_members.push_back(client);
 	}
+	touch();
 	if (flag == 0)
 	{
 		std::vector<int>::iterator it = std::find(_operators.begin(), _operators.end(), client);
@@ -257,6 +317,12 @@ ChannelError Channel::change_topic(int cl, std::string new_topic)
 	return CHANNEL_OK;
 }
 
+// Topic que llega de otro servidor, ya validado alli
+void Channel::set_topic(std::string topic)
+{
+	_topic = topic;
+}
+
 // Meto en la list de invitacion 
 ChannelError Channel::invite(int cl, int to_inv)
 {
@@ -291,6 +357,9 @@ ChannelError  Channel::part(int cl, std::string msg)
 	_members.erase(std::remove(_members.begin(), _members.end(), cl),_members.end());
 	// Si esta en operators le quito de operators tambien, si no esta no hace nada
 	_operators.erase(std::remove(_operators.begin(), _operators.end(), cl), _operators.end());
+	_banCache.erase(cl);
+	_sendCache.erase(cl);
+	touch();
 	return CHANNEL_OK;
 }
 
@@ -310,4 +379,90 @@ ChannelError Channel::kick(int cl, int other, std::string msg)
 bool Channel::isOperator(int clientFd) const
 {
 	return std::find(_operators.begin(), _operators.end(), clientFd) != _operators.end();
-}
\ No newline at end of file
+}
+
+bool Channel::isMember(int clientFd) const
+{
+	return std::find(_members.begin(), _members.end(), clientFd) != _members.end();
+}
+// Cualquier cambio en las listas invalida todos los veredictos
+bool Channel::add_mask(char list, const std::string& mask, const std::string& setBy, unsigned long setAt)
+{
+	if (!(list == 'e' ? _exceptions : _bans).add(mask, setBy, setAt))
+		return false;
+	_banCache.clear();
+	touch();
+	return true;
+}
+
+bool Channel::remove_mask(char list, const std::string& mask)
+{
+	if (!(list == 'e' ? _exceptions : _bans).remove(mask))
+		return false;
+	_banCache.clear();
+	touch();
+	return true;
+}
+
+// Sin bans no cuesta nada; con ellos, una busqueda en el cache salvo tras
+// un NICK o un cambio en las listas. The host is the one every local client
+// is shown with (see Server::maskOf).
+bool Channel::is_banned(int clientFd, const Client& client)
+{
+	if (_bans.empty())
+		return false;
+	std::map<int, std::pair<unsigned long, bool> >::iterator it = _banCache.find(clientFd);
+	if (it != _banCache.end() && it->second.first == client.identity())
+		return it->second.second;
+	std::string identity = client.getNickname() + "!" + client.getUsername() + "@localhost";
+	WildMask::fold(identity);
+	bool banned = _bans.matches(identity) && !_exceptions.matches(identity);
+	_banCache[clientFd] = std::make_pair(client.identity(), banned);
+	return banned;
+}
+
+unsigned long Channel::next_epoch()
+{
+	static unsigned long counter = 0;
+	return ++counter;
+}
+
+void Channel::touch()
+{
+	_epoch = next_epoch();
+}
+
+// En el orden de siempre: ya dentro, +b, +k, +l, +i
+ChannelError Channel::can_join(int clientFd, const Client& client, const std::string& key)
+{
+	if (isMember(clientFd))
+		return ERR_USER_ON_CHANNEL;
+	if (is_banned(clientFd, client))
+		return ERR_BANNED_FROM_CHAN;
+	if (_mode_flag[1] == 1 && key != _password)
+		return ERR_BAD_CHANNEL_KEY;
+	if (_mode_flag[2] != -1 && (int)_members.size() >= _mode_flag[2])
+		return ERR_CHANNEL_IS_FULL;
+	if (_mode_flag[0] != 0 && std::find(_invList.begin(), _invList.end(), clientFd) == _invList.end())
+		return ERR_INVITE_ONLY_CHAN;
+	return CHANNEL_OK;
+}
+
+// Banned members stay, but only operators among them may speak
+ChannelError Channel::can_send(int clientFd, const Client& client)
+{
+	std::map<int, SendVerdict>::iterator it = _sendCache.find(clientFd);
+	if (it != _sendCache.end() && it->second.epoch == _epoch && it->second.identity == client.identity())
+		return it->second.verdict;
+	// Los de fuera no se guardan: no llenan el mapa
+	if (!isMember(clientFd))
+		return ERR_NOT_ON_CHANNEL;
+	ChannelError err = CHANNEL_OK;
+	if (is_banned(clientFd, client) && !isOperator(clientFd))
+		err = ERR_CANNOT_SEND_TO_CHAN;
+	SendVerdict& entry = _sendCache[clientFd];
+	entry.epoch = _epoch;
+	entry.identity = client.identity();
+	entry.verdict = err;
+	return err;
+}
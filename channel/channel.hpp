@@ -6,6 +6,8 @@
 # include <algorithm>
 # include <map>
 #include "../Client/Client.hpp"
+#include "../History/History.hpp"
+#include "../Mask/Mask.hpp"
 
 enum ChannelError {
     CHANNEL_OK = 0,
@@ -24,6 +26,16 @@ enum ChannelError {
 	ERR_NO_RECIPIENT,
 	ERR_NO_TEXT_TO_SEND,
 	ERR_ERRONEUS_NICKNAME,
+	ERR_BANNED_FROM_CHAN,
+	ERR_CANNOT_SEND_TO_CHAN,
+};
+
+// Lo que can_send contesto a un miembro, valido mientras ni el canal
+// (_epoch) ni su nick/user (Client::identity) cambien
+struct SendVerdict {
+    unsigned long epoch;
+    unsigned long identity;
+    ChannelError verdict;
 };
 
 // Si los mensajes se envian desde client o donde sea, o en parseo, no hace falta esto, solo el error
@@ -44,6 +56,21 @@ class Channel
 		int _mode_flag[4]; // MODES (i, k, l, t) i?? 
 		std::string _password; // Mode +k in the channel (NULL)
 		std::vector<int> _invList; // invite list
+		HistoryRing _history; // recent PRIVMSG/NOTICE/TOPIC, for CHATHISTORY
+		MaskList _bans; // +b
+		MaskList _exceptions; // +e, por encima de +b
+		// Veredicto por miembro, valido mientras su Client::identity() no cambie
+		// y nadie toque las listas
+		std::map<int, std::pair<unsigned long, bool> > _banCache;
+		// Cambia con cada modo, mascara o miembro. Sale de un contador global,
+		// asi que dos canales nunca comparten valor.
+		unsigned long _epoch;
+		// "Puede hablar", uno por miembro: quien habla en varios canales tiene
+		// un veredicto en cada uno. Solo miembros; se borra en part().
+		std::map<int, SendVerdict> _sendCache;
+
+		static unsigned long next_epoch();
+		void touch();
 
 		ChannelError change_mode_o(char flag, int other);
 		ChannelError change_mode_l(char flag, std::string limit);
@@ -53,13 +80,16 @@ class Channel
 	public:
 		Channel();
 		Channel(std::string name, int cl);
+		Channel(std::string name); // restored from a snapshot, no members yet
 		~Channel();
 		void send_privmsg(std::string cl); // PRIVMSG
 		void send_notice(std::string cl); // NOTICE
 		ChannelError change_mode(std::string mode, int client, int other_cl, std::string other);
+		ChannelError force_mode(std::string mode, int other_cl, std::string other); // no member/operator check
 		void print_channel_settings(void); // PARA HACER PRUEBAS
 
 		ChannelError change_topic(int cl, std::string new_topic); // TOPIC
+		void set_topic(std::string topic); // TOPIC from a server link
 		ChannelError invite(int cl, int to_inv);
 		ChannelError part(int cl, std::string msg);
 		
@@ -68,15 +98,34 @@ class Channel
 		//GETTERS
 		std::string get_password();
 		std::string get_name();
-		std::vector<int> get_members() const;
+		const std::vector<int>& get_members() const;
 		int *get_modes();
-		std::vector<int> get_invite_list();
+		const std::vector<int>& get_invite_list() const;
 		std::string get_topic();
+		HistoryRing& get_history();
+		const MaskList& get_masks(char list) const; // 'b' o 'e'
+		size_t memoryBytes() const; // the channel and its lists, history apart
+
+		// SNAPSHOT
+		void restore_settings(std::string topic, const int modes[4], std::string password);
+		// HOT UPGRADE (fds already translated to the new process)
+		void restore_members(const std::vector<int>& members, const std::vector<int>& operators, const std::vector<int>& invites);
 
 		// AUX TO JOIN_CHANNEL
 		void add_member(int client, int flag);
 		
 		bool isOperator(int clientFd) const;
+		bool isMember(int clientFd) const;
+
+		// BANS (+b/+e). `mask` normalizada (WildMask::normalize)
+		bool add_mask(char list, const std::string& mask, const std::string& setBy, unsigned long setAt);
+		bool remove_mask(char list, const std::string& mask);
+		// Local clients only: remote ones are checked by their own server
+		bool is_banned(int clientFd, const Client& client);
+
+		// PERMISOS: ERR_* or CHANNEL_OK
+		ChannelError can_join(int clientFd, const Client& client, const std::string& key);
+		ChannelError can_send(int clientFd, const Client& client); // cached per member while nothing changes
 	};
 
 
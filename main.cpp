@@ -1,4 +1,5 @@
 #include "Server/Server.hpp"
+#include "Transport/SocketTransport.hpp"
 
 bool checkPort(const std::string& str) {
     if (str.empty()) 
@@ -13,9 +14,9 @@ bool checkPort(const std::string& str) {
 
 int main(int argc , char **argv) {
 
-    if (argc != 3)
+    if (argc != 3 && argc != 4)
     {
-        std::cerr<< "Usage" << argv[0]<< " <port> <password>"<< std::endl;
+        std::cerr<< "Usage" << argv[0]<< " <port> <password> [config file]"<< std::endl;
         return 1;
     }
     if(checkPort(argv[1]) == false)
@@ -30,7 +31,13 @@ int main(int argc , char **argv) {
         return 1;
     }
     try {
-        Server srv(port, password);
+        Config config;
+        if (argc == 4)
+            config.load(argv[3]);
+        Logger::start(config.getString("log_file", ""), Logger::parseLevel(config.getString("log_level", "info")));
+        SocketTransport transport;
+        Server srv(port, password, config, transport);
+        srv.setUpgradeCommand(argc, argv);
 
         std::cout << "SUCCESS: Server object was created and socket was set up." << std::endl;
         srv.run();
@@ -39,6 +46,7 @@ int main(int argc , char **argv) {
         std::cerr << "Reason: " << e.what() << std::endl;
     }
      
+    Logger::stop();
     std::cout << "--- Test Finished ---" << std::endl;
     return 0;
 }
\ No newline at end of file
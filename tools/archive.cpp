@@ -0,0 +1,47 @@
+// ircarchive: prints what the server archived for a channel (`archive_dir`).
+//
+//   ./ircarchive <dir> <channel> [from] [to] [--limit N]
+//
+// from/to are ISO 8601 UTC times (2024-01-31T12:00:00.000Z) and default to
+// the beginning and the end of time. Every line is printed as
+// "<time> <IRC line>", oldest first.
+#include "../Archive/Archive.hpp"
+#include "../History/History.hpp"
+#include <iostream>
+#include <cstdlib>
+
+static bool parseTime(const std::string& text, unsigned long& ms) {
+	HistoryRef ref;
+	if (!HistoryRing::parseRef("timestamp=" + text, ref))
+		return false;
+	ms = ref.value;
+	return true;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		std::cerr << "Usage: " << argv[0] << " <dir> <channel> [from] [to] [--limit N]" << std::endl;
+		return 1;
+	}
+	unsigned long from = 0;
+	unsigned long to = (unsigned long)-1;
+	size_t limit = (size_t)-1;
+	int positional = 0;
+	for (int i = 3; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--limit" && i + 1 < argc)
+			limit = std::strtoul(argv[++i], NULL, 10);
+		else if (positional < 2 && parseTime(arg, positional == 0 ? from : to))
+			positional++;
+		else {
+			std::cerr << "Bad argument " << arg << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<ArchiveRecord> records;
+	ArchiveReader::read(argv[1], argv[2], from, to, limit, records);
+	for (size_t i = 0; i < records.size(); ++i)
+		std::cout << HistoryRing::formatTime(records[i].timeMs) << " " << records[i].line << "\n";
+	return 0;
+}
@@ -0,0 +1,293 @@
+// ircbench: runs a Server in this process on top of LoopbackTransport and
+// times the command handlers, with no sockets and no kernel in the way.
+//
+//   ./ircbench [--clients N] [--channels C] [--messages M] [--archive DIR] [--scan-mb MB] [--bans B] [--spam S]
+//
+// N clients register and join one of C channels (round robin), then M
+// PRIVMSGs are sent to the channels, also round robin over the clients.
+// Everything the server writes back is counted and thrown away.
+// --archive turns the channel archive on, to see what it costs the loop.
+// Last, the line scanner splits a large pipelined buffer (--scan-mb MB of
+// PRIVMSG lines, some of them UTF-8) with each implementation the CPU has,
+// next to the std::string::find("\r\n") loop it replaced, alone and with
+// the same checks made as a second pass over each line, and a ban list
+// of B masks is matched against many identities, indexed and one by one.
+// The PRIVMSGs all carry the same text: the spam filter flags them
+// (spam_action = flag, the default, set here in case it changes) and they
+// are still delivered; --spam S times S
+// checks of the filter alone on distinct lines.
+#include "../Server/Server.hpp"
+#include "../Transport/LoopbackTransport.hpp"
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+struct Phase {
+	const char*		name;
+	unsigned long	commands;
+	unsigned long	ns;
+	unsigned long	bytesOut;
+	unsigned long	allocations;
+};
+
+// Lets the server run until it has read every line we wrote. Only the heap
+// allocations made inside the server are added to `allocations`.
+static unsigned long settle(Server& srv, LoopbackTransport& transport, const std::vector<int>& conns,
+	unsigned long& allocations) {
+	unsigned long bytes = 0;
+	do {
+		unsigned long before = Stats::heapAllocations;
+		srv.pollOnce(0);
+		allocations += Stats::heapAllocations - before;
+		for (size_t i = 0; i < conns.size(); ++i)
+			bytes += transport.discard(conns[i]);
+	} while (!transport.idle());
+	for (size_t i = 0; i < conns.size(); ++i)
+		bytes += transport.discard(conns[i]);
+	return bytes;
+}
+
+static std::string channelName(size_t index) {
+	std::ostringstream oss;
+	oss << "#bench" << index;
+	return oss.str();
+}
+
+static std::string pipelinedLines(size_t bytes) {
+	static const char* const texts[] = {
+		"hi", "benchmark message", "h\xc3\xa9llo w\xc3\xb6rld \xe2\x9c\x93",
+		"a somewhat longer line, the kind people paste when they explain something to the channel",
+		"\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe3\x83\x86\xe3\x82\xad\xe3\x82\xb9\xe3\x83\x88"
+	};
+	std::string buffer;
+	buffer.reserve(bytes + 256);
+	for (size_t i = 0; buffer.size() < bytes; ++i)
+		buffer.append("PRIVMSG #bench :").append(texts[i % 5]).append("\r\n");
+	return buffer;
+}
+
+static void scanBenchmark(size_t megabytes) {
+	std::string buffer = pipelinedLines(megabytes << 20);
+	double mb = (double)buffer.size() / (1 << 20);
+	// SCAN_IMPLS + 1 stands for the old loop, SCAN_IMPLS for the old loop
+	// plus the checks the scanner makes (NUL, stray CR, UTF-8) as a second
+	// pass over each line
+	for (int impl = SCAN_IMPLS + 1; impl >= 0; --impl) {
+		if (impl < SCAN_IMPLS && !LineScanner::select(static_cast<ScanImpl>(impl)))
+			continue;
+		unsigned long lines = 0, bytes = 0;
+		unsigned long start = Stats::nowNs();
+		if (impl >= SCAN_IMPLS) {
+			bool check = impl == SCAN_IMPLS;
+			size_t from = 0, pos;
+			while ((pos = buffer.find("\r\n", from)) != std::string::npos) {
+				const char* text = buffer.data() + from;
+				size_t len = pos - from;
+				bytes += len;
+				if (check)
+					bytes += (std::memchr(text, '\0', len) != NULL) + (std::memchr(text, '\r', len) != NULL)
+						+ !LineScanner::validUtf8(text, len);
+				from = pos + 2;
+				lines++;
+			}
+		} else {
+			ScannedLine line;
+			size_t from = 0;
+			while (LineScanner::next(buffer.data() + from, buffer.size() - from, true, line)) {
+				bytes += line.length + line.flags;
+				from += line.consumed;
+				lines++;
+			}
+		}
+		double seconds = (double)(Stats::nowNs() - start) / 1e9;
+		const char* name = impl == SCAN_IMPLS + 1 ? "find(\"\\r\\n\")"
+			: impl == SCAN_IMPLS ? "find+checks" : LineScanner::name(impl);
+		std::cout << "scan " << name << ": "
+				  << lines << " lines in " << seconds << "s, " << mb / seconds << " MB/s, "
+				  << (seconds * 1e9) / lines << " ns/line (" << bytes << " bytes of text)" << std::endl;
+	}
+	LineScanner::select(LineScanner::best());
+}
+
+static void maskBenchmark(size_t bans) {
+	MaskList list;
+	std::vector<WildMask> flat;
+	for (size_t i = 0; i < bans; ++i) {
+		std::ostringstream oss;
+		if (i % 3 == 0)
+			oss << "*!*@host" << i << ".example.net";
+		else if (i % 3 == 1)
+			oss << "spam" << i << "*!*@*";
+		else
+			oss << "*!bot" << i << "@*";
+		list.add(oss.str(), "bench", 0);
+		flat.push_back(WildMask(oss.str()));
+	}
+	const size_t lookups = 200000;
+	std::vector<std::string> identities;
+	for (size_t i = 0; i < 1000; ++i) {
+		std::ostringstream oss;
+		oss << "user" << i << "!ident" << i << "@localhost";
+		identities.push_back(oss.str());
+	}
+	for (int indexed = 1; indexed >= 0; --indexed) {
+		size_t hits = 0;
+		unsigned long start = Stats::nowNs();
+		for (size_t i = 0; i < lookups; ++i) {
+			const std::string& id = identities[i % identities.size()];
+			if (indexed)
+				hits += list.matches(id);
+			else {
+				for (size_t j = 0; j < flat.size(); ++j) {
+					if (flat[j].matches(id)) {
+						hits++;
+						break;
+					}
+				}
+			}
+		}
+		unsigned long ns = Stats::nowNs() - start;
+		std::cout << "bans " << (indexed ? "indexed" : "one by one") << ": " << bans << " masks, "
+				  << lookups << " lookups, " << (double)ns / lookups << " ns/lookup (" << hits << " hits)" << std::endl;
+	}
+}
+
+// Chat-like lines, a few dozen to a few hundred bytes, mostly distinct
+static void spamBenchmark(size_t checks) {
+	SpamFilter filter;
+	filter.configure(65536, 20, 12, 10);
+	std::vector<std::string> lines;
+	for (size_t i = 0; i < 4096; ++i) {
+		std::ostringstream oss;
+		oss << "line " << i << " of the benchmark, ";
+		for (size_t j = 0; j < i % 8; ++j)
+			oss << "with some \x02more\x02 Text to hash ";
+		lines.push_back(oss.str());
+	}
+	size_t bytes = 0;
+	unsigned long over = 0;
+	unsigned long start = Stats::nowNs();
+	for (size_t i = 0; i < checks; ++i) {
+		const std::string& line = lines[i % lines.size()];
+		bytes += line.size();
+		if (filter.check(line) > filter.threshold())
+			over++;
+		if (i % 100000 == 99999)
+			filter.tick();
+	}
+	unsigned long ns = Stats::nowNs() - start;
+	std::cout << "spam filter: " << checks << " checks, " << (double)ns / checks << " ns/check, "
+			  << bytes / checks << " bytes/line, " << filter.memoryBytes() << " bytes (" << over << " over threshold)" << std::endl;
+}
+
+static void report(const Phase& p) {
+	double seconds = (double)p.ns / 1e9;
+	std::cout << p.name << ": " << p.commands << " commands in " << seconds << "s, "
+			  << (seconds > 0 ? p.commands / seconds : 0) << " commands/s, "
+			  << (p.commands ? p.ns / p.commands : 0) << " ns/command, "
+			  << p.bytesOut << " bytes out, "
+			  << (p.commands ? (double)p.allocations / p.commands : 0) << " allocations/command" << std::endl;
+}
+
+int main(int argc, char** argv) {
+	size_t clients = 100;
+	size_t channels = 4;
+	size_t messages = 200000;
+	size_t scanMb = 64;
+	size_t bans = 5000;
+	size_t spam = 1000000;
+	Config config;
+	config.set("spam_action", "flag");
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--clients" && i + 1 < argc)
+			clients = std::strtoul(argv[++i], NULL, 10);
+		else if (arg == "--channels" && i + 1 < argc)
+			channels = std::strtoul(argv[++i], NULL, 10);
+		else if (arg == "--messages" && i + 1 < argc)
+			messages = std::strtoul(argv[++i], NULL, 10);
+		else if (arg == "--scan-mb" && i + 1 < argc)
+			scanMb = std::strtoul(argv[++i], NULL, 10);
+		else if (arg == "--bans" && i + 1 < argc)
+			bans = std::strtoul(argv[++i], NULL, 10);
+		else if (arg == "--spam" && i + 1 < argc)
+			spam = std::strtoul(argv[++i], NULL, 10);
+		else if (arg == "--archive" && i + 1 < argc)
+			config.set("archive_dir", argv[++i]);
+		else {
+			std::cerr << "Usage: " << argv[0] << " [--clients N] [--channels C] [--messages M] [--archive DIR] [--scan-mb MB] [--bans B] [--spam S]" << std::endl;
+			return 1;
+		}
+	}
+	if (clients == 0 || channels == 0) {
+		std::cerr << "Need at least one client and one channel" << std::endl;
+		return 1;
+	}
+
+	Logger::start("", LOG_LEVEL_WARN);
+	try {
+		LoopbackTransport transport;
+		Server srv(6667, "bench", config, transport);
+		std::vector<int> conns;
+
+		Phase reg = { "register", 0, 0, 0, 0 };
+		unsigned long start = Stats::nowNs();
+		for (size_t i = 0; i < clients; ++i) {
+			std::ostringstream nick;
+			nick << "u" << i;
+			int conn = transport.connect();
+			transport.write(conn, "PASS bench\r\nNICK " + nick.str() + "\r\nUSER " + nick.str() + " 0 * :bench\r\n");
+			conns.push_back(conn);
+		}
+		reg.bytesOut = settle(srv, transport, conns, reg.allocations);
+		reg.ns = Stats::nowNs() - start;
+		reg.commands = clients * 3;
+
+		Phase join = { "join", 0, 0, 0, 0 };
+		start = Stats::nowNs();
+		for (size_t i = 0; i < clients; ++i)
+			transport.write(conns[i], "JOIN " + channelName(i % channels) + "\r\n");
+		join.bytesOut = settle(srv, transport, conns, join.allocations);
+		join.ns = Stats::nowNs() - start;
+		join.commands = clients;
+
+		// Written in batches so the pipes stay small
+		Phase privmsg = { "privmsg", 0, 0, 0, 0 };
+		const size_t batch = 1024;
+		start = Stats::nowNs();
+		for (size_t sent = 0; sent < messages; ) {
+			for (size_t j = 0; j < batch && sent < messages; ++j, ++sent) {
+				size_t sender = sent % clients;
+				transport.write(conns[sender], "PRIVMSG " + channelName(sender % channels) + " :benchmark message\r\n");
+			}
+			privmsg.bytesOut += settle(srv, transport, conns, privmsg.allocations);
+		}
+		privmsg.ns = Stats::nowNs() - start;
+		privmsg.commands = messages;
+
+		report(reg);
+		report(join);
+		report(privmsg);
+		// Everybody is idle now. The first sweep only clears the activity
+		// marks, the second one takes the buffers back.
+		size_t busyBytes = srv.clientMemory() / clients;
+		srv.trimIdleBuffers();
+		srv.trimIdleBuffers();
+		std::cout << "idle: " << busyBytes << " bytes/connection, " << srv.clientMemory() / clients
+				  << " after trimming buffers" << std::endl;
+		if (scanMb > 0)
+			scanBenchmark(scanMb);
+		if (bans > 0)
+			maskBenchmark(bans);
+		if (spam > 0)
+			spamBenchmark(spam);
+	} catch (const std::exception& e) {
+		std::cerr << "Benchmark failed: " << e.what() << std::endl;
+		Logger::stop();
+		return 1;
+	}
+	Logger::stop();
+	return 0;
+}
@@ -0,0 +1,391 @@
+// irccluster: starts a network of ft_IRC servers on this machine and measures
+// how many channel messages it delivers per second as servers are added.
+//
+//   ./irccluster <ft_IRC binary> [--nodes 1,2,4] [--topology star|chain]
+//                [--clients N] [--channels C] [--messages M] [--port P] [--compress]
+//
+// For every node count the servers are started on ports P, P+1, ... with
+// generated configs (node 0 is the hub of the star, or the head of the
+// chain), N clients are spread over them round robin and join one of C
+// channels, and then every client sends M PRIVMSGs to its channel. One
+// driver process per server does the talking, so the clients are not the
+// bottleneck. The result is every copy delivered, divided by the time the
+// slowest driver needed to receive all of its copies. --compress turns
+// link_compress on in every server.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+struct Options {
+	std::string			binary;
+	std::vector<int>	nodes;
+	bool				chain;
+	bool				compress;
+	size_t				clients;
+	size_t				channels;
+	size_t				messages;
+	int					port;
+
+	Options() : chain(false), compress(false), clients(60), channels(4), messages(2000), port(7600) {}
+};
+
+// What a driver tells the parent once it is done
+struct DriverResult {
+	unsigned long	received;
+	unsigned long	expected;
+	unsigned long	ns;
+};
+
+static unsigned long nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static std::string toString(unsigned long value) {
+	std::ostringstream oss;
+	oss << value;
+	return oss.str();
+}
+
+static int connectTo(int port) {
+	sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static bool writeAll(int fd, const std::string& data) {
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t n = write(fd, data.data() + done, data.size() - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+// Blocking read until `marker` shows up (or timeoutMs passes)
+static bool waitFor(int fd, const std::string& marker, int timeoutMs, std::string* seen = NULL) {
+	std::string buffer;
+	unsigned long deadline = nowNs() + (unsigned long)timeoutMs * 1000000UL;
+	char chunk[4096];
+	while (buffer.find(marker) == std::string::npos) {
+		unsigned long now = nowNs();
+		if (now >= deadline)
+			return false;
+		pollfd p;
+		p.fd = fd;
+		p.events = POLLIN;
+		p.revents = 0;
+		if (poll(&p, 1, (int)((deadline - now) / 1000000UL) + 1) <= 0)
+			continue;
+		ssize_t n = read(fd, chunk, sizeof(chunk));
+		if (n <= 0)
+			return false;
+		buffer.append(chunk, n);
+	}
+	if (seen)
+		*seen = buffer;
+	return true;
+}
+
+static std::string channelName(size_t index) {
+	return "#cluster" + toString(index);
+}
+
+static pid_t startNode(const Options& opt, const std::string& dir, int node) {
+	std::string conf = dir + "/node" + toString(node) + ".conf";
+	std::ofstream out(conf.c_str());
+	out << "server_name = node" << node << ".cluster\n"
+		<< "link_password = cluster\n"
+		<< "link_retry_ms = 200\n"
+		<< "log_level = warn\n"
+		<< "log_file = " << dir << "/node" << node << ".log\n"
+		<< "link_compress = " << (opt.compress ? 1 : 0) << "\n";
+	if (node > 0)
+		out << "link_connect = 127.0.0.1:" << opt.port + (opt.chain ? node - 1 : 0) << "\n";
+	out.close();
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		dup2(null, 2);
+		std::string port = toString(opt.port + node);
+		execl(opt.binary.c_str(), opt.binary.c_str(), port.c_str(), "pw", conf.c_str(), (char*)NULL);
+		_exit(127);
+	}
+	return pid;
+}
+
+// Connects, registers and joins the clients of one node. Client k (over the
+// whole network) is "c<k>" and sits in channel k % channels.
+static bool setUpClients(const Options& opt, int node, int nodes, std::vector<int>& fds, std::vector<size_t>& ids) {
+	for (size_t k = node; k < opt.clients; k += nodes) {
+		int fd = connectTo(opt.port + node);
+		if (fd < 0)
+			return false;
+		std::string nick = "c" + toString(k);
+		if (!writeAll(fd, "PASS pw\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :" + nick + "\r\nJOIN "
+				+ channelName(k % opt.channels) + "\r\n")
+			|| !waitFor(fd, " 366 ", 5000))
+			return false;
+		fds.push_back(fd);
+		ids.push_back(k);
+	}
+	return true;
+}
+
+// The driver of one node: waits for the go byte, sends, and reads until every
+// copy meant for its clients has arrived
+static void runDriver(const Options& opt, int node, int nodes, int readyFd, int goFd) {
+	std::vector<int> fds;
+	std::vector<size_t> ids;
+	DriverResult result;
+	std::memset(&result, 0, sizeof(result));
+	char go = setUpClients(opt, node, nodes, fds, ids) ? 'R' : 'F';
+	writeAll(readyFd, std::string(1, go));
+	if (go != 'R' || read(goFd, &go, 1) != 1)
+		_exit(1);
+
+	// Each client gets every message of the others in its channel
+	std::vector<size_t> members(opt.channels, 0);
+	for (size_t k = 0; k < opt.clients; ++k)
+		members[k % opt.channels]++;
+	for (size_t i = 0; i < ids.size(); ++i)
+		result.expected += (members[ids[i] % opt.channels] - 1) * opt.messages;
+
+	std::vector<size_t> sent(fds.size(), 0);
+	std::vector<std::string> pending(fds.size());
+	std::vector<std::string> partial(fds.size());
+	for (size_t i = 0; i < fds.size(); ++i)
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+
+	unsigned long start = nowNs();
+	unsigned long deadline = start + 60UL * 1000000000UL;
+	char chunk[65536];
+	while (result.received < result.expected && nowNs() < deadline) {
+		std::vector<pollfd> polls(fds.size());
+		for (size_t i = 0; i < fds.size(); ++i) {
+			// A few lines at a time, so every client keeps talking
+			while (pending[i].size() < 4096 && sent[i] < opt.messages) {
+				pending[i] += "PRIVMSG " + channelName(ids[i] % opt.channels) + " :message " + toString(sent[i]) + "\r\n";
+				sent[i]++;
+			}
+			polls[i].fd = fds[i];
+			polls[i].events = POLLIN | (pending[i].empty() ? 0 : POLLOUT);
+			polls[i].revents = 0;
+		}
+		if (poll(&polls[0], polls.size(), 100) <= 0)
+			continue;
+		for (size_t i = 0; i < fds.size(); ++i) {
+			if (polls[i].revents & POLLOUT) {
+				ssize_t n = write(fds[i], pending[i].data(), pending[i].size());
+				if (n > 0)
+					pending[i].erase(0, n);
+			}
+			if (!(polls[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			ssize_t n = read(fds[i], chunk, sizeof(chunk));
+			if (n <= 0) {
+				deadline = 0; // the server dropped us: report what we have
+				break;
+			}
+			partial[i].append(chunk, n);
+			size_t pos = 0, end;
+			while ((end = partial[i].find('\n', pos)) != std::string::npos) {
+				if (partial[i].compare(pos, 1, ":") == 0 && partial[i].find(" PRIVMSG ", pos) < end)
+					result.received++;
+				pos = end + 1;
+			}
+			partial[i].erase(0, pos);
+		}
+	}
+	result.ns = nowNs() - start;
+	write(readyFd, &result, sizeof(result));
+	for (size_t i = 0; i < fds.size(); ++i)
+		close(fds[i]);
+	_exit(0);
+}
+
+// True once a WHO on the last node lists every member of every channel:
+// the JOINs made it across the whole network
+static bool waitForSync(const Options& opt, int nodes) {
+	int fd = connectTo(opt.port + nodes - 1);
+	if (fd < 0 || !writeAll(fd, "PASS pw\r\nNICK probe\r\nUSER probe 0 * :probe\r\n") || !waitFor(fd, " 001 ", 5000))
+		return false;
+	bool synced = false;
+	for (int attempt = 0; attempt < 100 && !synced; ++attempt) {
+		synced = true;
+		for (size_t c = 0; c < opt.channels && synced; ++c) {
+			std::string reply;
+			if (!writeAll(fd, "WHO " + channelName(c) + "\r\n") || !waitFor(fd, " 315 ", 2000, &reply))
+				return false;
+			size_t expected = opt.clients / opt.channels + (c < opt.clients % opt.channels ? 1 : 0);
+			size_t count = 0;
+			for (size_t pos = reply.find(" 352 "); pos != std::string::npos; pos = reply.find(" 352 ", pos + 1))
+				count++;
+			synced = count == expected;
+		}
+		if (!synced)
+			usleep(50000);
+	}
+	close(fd);
+	return synced;
+}
+
+static bool runNetwork(const Options& opt, const std::string& dir, int nodes) {
+	std::vector<pid_t> servers;
+	for (int node = 0; node < nodes; ++node) {
+		servers.push_back(startNode(opt, dir, node));
+		usleep(100000); // listening before the next one calls it
+	}
+	usleep(300000);
+
+	std::vector<pid_t> drivers;
+	std::vector<int> readyFds;
+	int goPipe[2];
+	if (pipe(goPipe) < 0)
+		return false;
+	for (int node = 0; node < nodes; ++node) {
+		int ready[2];
+		if (pipe(ready) < 0)
+			return false;
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(ready[0]);
+			close(goPipe[1]);
+			runDriver(opt, node, nodes, ready[1], goPipe[0]);
+		}
+		close(ready[1]);
+		drivers.push_back(pid);
+		readyFds.push_back(ready[0]);
+	}
+	close(goPipe[0]);
+
+	bool ok = true;
+	for (size_t i = 0; i < readyFds.size(); ++i) {
+		char byte = 0;
+		if (read(readyFds[i], &byte, 1) != 1 || byte != 'R')
+			ok = false;
+	}
+	if (ok && !waitForSync(opt, nodes)) {
+		std::cerr << "the servers never agreed on the channel members" << std::endl;
+		ok = false;
+	}
+	if (ok)
+		writeAll(goPipe[1], std::string(nodes, 'G'));
+	close(goPipe[1]);
+
+	unsigned long received = 0, expected = 0, slowest = 0;
+	for (size_t i = 0; i < readyFds.size(); ++i) {
+		DriverResult result;
+		if (ok && read(readyFds[i], &result, sizeof(result)) == (ssize_t)sizeof(result)) {
+			received += result.received;
+			expected += result.expected;
+			if (result.ns > slowest)
+				slowest = result.ns;
+		}
+		close(readyFds[i]);
+		waitpid(drivers[i], NULL, 0);
+	}
+	for (size_t i = 0; i < servers.size(); ++i) {
+		kill(servers[i], SIGTERM);
+		waitpid(servers[i], NULL, 0);
+	}
+	if (!ok)
+		return false;
+
+	double seconds = (double)slowest / 1e9;
+	std::cout << nodes << " node" << (nodes > 1 ? "s" : " ") << ": " << opt.clients * opt.messages << " sent, "
+			  << received << "/" << expected << " delivered in " << seconds << "s, "
+			  << (seconds > 0 ? received / seconds : 0) << " deliveries/s" << std::endl;
+	return received == expected;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <ft_IRC binary> [--nodes 1,2,4] [--topology star|chain]"
+				  << " [--clients N] [--channels C] [--messages M] [--port P] [--compress]" << std::endl;
+		return 1;
+	}
+	Options opt;
+	opt.binary = argv[1];
+	std::string nodes = "1,2,4";
+	for (int i = 2; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--nodes" && i + 1 < argc)
+			nodes = argv[++i];
+		else if (arg == "--topology" && i + 1 < argc)
+			opt.chain = std::string(argv[++i]) == "chain";
+		else if (arg == "--clients" && i + 1 < argc)
+			opt.clients = std::strtoul(argv[++i], NULL, 10);
+		else if (arg == "--channels" && i + 1 < argc)
+			opt.channels = std::strtoul(argv[++i], NULL, 10);
+		else if (arg == "--messages" && i + 1 < argc)
+			opt.messages = std::strtoul(argv[++i], NULL, 10);
+		else if (arg == "--port" && i + 1 < argc)
+			opt.port = std::atoi(argv[++i]);
+		else if (arg == "--compress")
+			opt.compress = true;
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return 1;
+		}
+	}
+	std::istringstream list(nodes);
+	std::string item;
+	while (std::getline(list, item, ','))
+		opt.nodes.push_back(std::atoi(item.c_str()));
+	if (opt.channels == 0 || opt.clients < opt.channels * 2) {
+		std::cerr << "Need at least two clients per channel" << std::endl;
+		return 1;
+	}
+
+	char dir[] = "/tmp/irccluster.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		std::cerr << "mkdtemp: " << std::strerror(errno) << std::endl;
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	std::cout << opt.clients << " clients, " << opt.channels << " channels, " << opt.messages
+			  << " messages per client, " << (opt.chain ? "chain" : "star") << " topology"
+			  << (opt.compress ? ", compressed links" : "") << " (logs in " << dir << ")" << std::endl;
+	int status = 0;
+	for (size_t i = 0; i < opt.nodes.size(); ++i) {
+		if (opt.nodes[i] < 1 || !runNetwork(opt, dir, opt.nodes[i]))
+			status = 1;
+	}
+	return status;
+}
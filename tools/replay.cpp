@@ -0,0 +1,207 @@
+// ircreplay: feeds a trace recorded with `trace_file` back into a server.
+//
+//   ./ircreplay <trace> <host> <port> [--paced] [--speed N] [--pass PASSWORD]
+//
+// By default lines are sent as fast as possible; --paced keeps the recorded
+// gaps between records (divided by --speed). --pass rewrites PASS lines for
+// servers started with a different password. Everything the server sends
+// back is read and thrown away so it never blocks on us. Before a
+// connection is closed we PING the server and wait for the PONG, so the
+// elapsed time covers the server handling every line, not just us sending it.
+#include "../Trace/Trace.hpp"
+#include <iostream>
+#include <map>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+struct ReplayStats {
+	unsigned long	connections;
+	unsigned long	lines;
+	unsigned long	bytesSent;
+	unsigned long	bytesReceived;
+
+	ReplayStats() : connections(0), lines(0), bytesSent(0), bytesReceived(0) {}
+};
+
+static unsigned long nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static int connectTo(const std::string& host, const std::string& port) {
+	addrinfo hints;
+	addrinfo* res;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+		return -1;
+	int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	}
+	return fd;
+}
+
+// Reads whatever the server sent on every socket, waiting at most timeoutMs.
+// Returns true if anything was read. If `watchFd` is set, what it receives
+// is appended to `watched`.
+static bool drain(const std::map<unsigned long, int>& conns, int timeoutMs, ReplayStats& stats,
+	int watchFd = -1, std::string* watched = NULL) {
+	if (conns.empty())
+		return false;
+	std::vector<pollfd> fds;
+	for (std::map<unsigned long, int>::const_iterator it = conns.begin(); it != conns.end(); ++it) {
+		pollfd p;
+		p.fd = it->second;
+		p.events = POLLIN;
+		p.revents = 0;
+		fds.push_back(p);
+	}
+	if (poll(&fds[0], fds.size(), timeoutMs) <= 0)
+		return false;
+	bool got = false;
+	char buffer[16384];
+	for (size_t i = 0; i < fds.size(); ++i) {
+		if (!(fds[i].revents & POLLIN))
+			continue;
+		ssize_t n;
+		while ((n = recv(fds[i].fd, buffer, sizeof(buffer), 0)) > 0) {
+			stats.bytesReceived += n;
+			got = true;
+			if (fds[i].fd == watchFd && watched)
+				watched->append(buffer, n);
+		}
+	}
+	return got;
+}
+
+static void sendAll(int fd, const std::string& data, const std::map<unsigned long, int>& conns, ReplayStats& stats) {
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+		if (n > 0) {
+			done += n;
+			stats.bytesSent += n;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			drain(conns, 10, stats); // the server is busy writing to us: read so it can go on
+		else
+			return; // the server hung up on this connection
+	}
+}
+
+// Round trip through the server: once our PONG comes back every line sent
+// before it on this connection has been handled.
+static void syncConnection(int fd, const std::map<unsigned long, int>& conns, ReplayStats& stats) {
+	const std::string token = "ircreplay-sync";
+	sendAll(fd, "PING :" + token + "\r\n", conns, stats);
+	std::string received;
+	unsigned long deadline = nowNs() + 5000000000UL;
+	while (received.find(token) == std::string::npos && nowNs() < deadline) {
+		drain(conns, 50, stats, fd, &received);
+		if (received.size() > 4096)
+			received.erase(0, received.size() - 512);
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc < 4) {
+		std::cerr << "Usage: " << argv[0] << " <trace> <host> <port> [--paced] [--speed N] [--pass PASSWORD]" << std::endl;
+		return 1;
+	}
+	bool paced = false;
+	double speed = 1.0;
+	std::string password;
+	for (int i = 4; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--paced")
+			paced = true;
+		else if (arg == "--speed" && i + 1 < argc)
+			speed = std::atof(argv[++i]);
+		else if (arg == "--pass" && i + 1 < argc)
+			password = argv[++i];
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return 1;
+		}
+	}
+	if (speed <= 0)
+		speed = 1.0;
+
+	ReplayStats stats;
+	std::map<unsigned long, int> conns; // trace connection id -> socket
+	unsigned long start = nowNs();
+	try {
+		TraceReader reader;
+		reader.open(argv[1]);
+		TraceRecord rec;
+		while (reader.next(rec)) {
+			if (paced) {
+				unsigned long due = start + (unsigned long)((double)rec.offsetNs / speed);
+				unsigned long now;
+				while ((now = nowNs()) < due)
+					drain(conns, (int)((due - now) / 1000000UL), stats);
+			}
+			if (rec.type == TRACE_CONNECT) {
+				int fd = connectTo(argv[2], argv[3]);
+				if (fd < 0) {
+					std::cerr << "Could not connect to " << argv[2] << ":" << argv[3] << std::endl;
+					return 1;
+				}
+				conns[rec.connId] = fd;
+				stats.connections++;
+			} else if (rec.type == TRACE_LINE) {
+				std::map<unsigned long, int>::iterator it = conns.find(rec.connId);
+				if (it == conns.end())
+					continue; // the connection started before recording did
+				std::string line = rec.line;
+				if (!password.empty() && line.compare(0, 5, "PASS ") == 0)
+					line = "PASS " + password;
+				sendAll(it->second, line + "\r\n", conns, stats);
+				stats.lines++;
+				if (stats.lines % 64 == 0)
+					drain(conns, 0, stats);
+			} else {
+				std::map<unsigned long, int>::iterator it = conns.find(rec.connId);
+				if (it != conns.end()) {
+					syncConnection(it->second, conns, stats);
+					close(it->second);
+					conns.erase(it);
+				}
+			}
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "Replay failed: " << e.what() << std::endl;
+		return 1;
+	}
+	// Connections still open when the recording stopped
+	for (std::map<unsigned long, int>::iterator it = conns.begin(); it != conns.end(); ++it)
+		syncConnection(it->second, conns, stats);
+	unsigned long end = nowNs();
+	for (std::map<unsigned long, int>::iterator it = conns.begin(); it != conns.end(); ++it)
+		close(it->second);
+
+	double elapsed = (double)(end - start) / 1e9;
+	std::cout << "connections=" << stats.connections << " lines=" << stats.lines
+			  << " sent=" << stats.bytesSent << "B received=" << stats.bytesReceived << "B"
+			  << " elapsed=" << elapsed << "s lines/s=" << (elapsed > 0 ? stats.lines / elapsed : 0) << std::endl;
+	return 0;
+}